@@ -0,0 +1,673 @@
+// Benchmarks of the CPU side of the renderer and of the asset pipeline, no window or GL context needed.
+// benchmark [--csv results.csv] [--assets ../snowscape/] [--max-triangles 10000000]
+// Every case is repeated until it has run for a while, --csv writes one line per case
+// with its statistics so the kernels can be tracked from one version to the next.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <chrono>
+
+#include <GL/glew.h>
+
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+#include <glm/gtc/quaternion.hpp>
+#include <glm/gtx/transform.hpp>
+using namespace glm;
+
+#include "objloader.hpp"
+#include "tangentspace.hpp"
+#include "vboindexer.hpp"
+#include "texture.hpp"
+#include "quaternion_utils.hpp"
+
+#include "MatrixBatch.h"
+#include "JobSystem.h"
+#include "EntityStore.h"
+#include "OcclusionCuller.h"
+#include "Obj3D.h"
+
+// Milliseconds since start
+static double elapsed(std::chrono::high_resolution_clock::time_point start) {
+	return std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+}
+
+// Command line
+static FILE *csv;
+static std::string assetDirectory = "../snowscape/";
+static size_t maxTriangles = 10000000;
+
+// Defined by the game, Obj3D.cpp needs them
+std::map<std::string, Model*> Obj3D::modelCache;
+std::map<std::string, GLuint> Obj3D::textureCache;
+
+struct Statistics {
+	int repetitions;
+	double min, median, mean, stddev;
+	double confidence; // Half width of the 95% confidence interval of the mean
+};
+
+static Statistics computeStatistics(std::vector<double> times) {
+	Statistics stats;
+	stats.repetitions = (int)times.size();
+	std::sort(times.begin(), times.end());
+	stats.min = times[0];
+	stats.median = times.size() % 2 ? times[times.size() / 2] : (times[times.size() / 2 - 1] + times[times.size() / 2]) * 0.5;
+
+	stats.mean = 0.0;
+	for (size_t i = 0; i < times.size(); ++i) stats.mean += times[i];
+	stats.mean /= times.size();
+
+	double variance = 0.0;
+	for (size_t i = 0; i < times.size(); ++i) variance += (times[i] - stats.mean) * (times[i] - stats.mean);
+	stats.stddev = times.size() > 1 ? sqrt(variance / (times.size() - 1)) : 0.0;
+	stats.confidence = 1.96 * stats.stddev / sqrt((double)times.size());
+	return stats;
+}
+
+// One line of the CSV file, items is what the time is divided by (triangles, objects, files...)
+static void writeResult(const char *kernel, const char *input, double items, const std::vector<double> &times) {
+	if (!csv) return;
+	if (times.empty()) {
+		fprintf(csv, "%s,%s,%.0f,0,,,,,,\n", kernel, input, items);
+		return;
+	}
+	Statistics stats = computeStatistics(times);
+	fprintf(csv, "%s,%s,%.0f,%d,%.6f,%.6f,%.6f,%.6f,%.6f,%.3f\n", kernel, input, items, stats.repetitions,
+		stats.min, stats.median, stats.mean, stats.stddev, stats.confidence, stats.median * 1e6 / items);
+	fflush(csv);
+}
+
+// Same columns on the console
+static void printResult(const char *kernel, const char *input, double items, const std::vector<double> &times) {
+	if (times.empty()) {
+		printf("%-22s %-28s %6s skipped, the smaller input was over the time budget\n", kernel, input, "-");
+	}
+	else {
+		Statistics stats = computeStatistics(times);
+		printf("%-22s %-28s %6d %12.4f %12.4f %12.4f %10.4f %12.2f\n", kernel, input, stats.repetitions,
+			stats.min, stats.median, stats.mean, stats.confidence, stats.median * 1e6 / items);
+	}
+	writeResult(kernel, input, items, times);
+}
+
+static void printResultHeader(const char *title) {
+	printf("%s\n", title);
+	printf("%-22s %-28s %6s %12s %12s %12s %10s %12s\n", "kernel", "input", "runs", "min ms", "median ms", "mean ms", "+-95% ms", "ns/item");
+}
+
+// Run the function once to warm up, then again until it ran MIN_REPETITIONS times and for
+// REPETITION_TIME ms, at most MAX_REPETITIONS times. A first run longer than SLOW_RUN ms is kept
+// and only repeated MIN_SLOW_REPETITIONS times. Empty if the first run is over CASE_BUDGET ms.
+static const int MIN_REPETITIONS = 5;
+static const int MAX_REPETITIONS = 100;
+static const int MIN_SLOW_REPETITIONS = 3;
+static const double REPETITION_TIME = 500.0;
+static const double SLOW_RUN = 1000.0;
+static const double CASE_BUDGET = 10000.0;
+
+template <typename Function>
+static std::vector<double> measure(Function function, bool &overBudget) {
+	std::vector<double> times;
+	std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+	function();
+	double first = elapsed(start);
+	overBudget = first > CASE_BUDGET;
+	if (overBudget) {
+		times.push_back(first);
+		return times;
+	}
+
+	int minRepetitions = MIN_REPETITIONS;
+	if (first > SLOW_RUN) {
+		times.push_back(first);
+		minRepetitions = MIN_SLOW_REPETITIONS;
+	}
+
+	double total = 0.0;
+	while ((int)times.size() < MAX_REPETITIONS && ((int)times.size() < minRepetitions || total < REPETITION_TIME)) {
+		start = std::chrono::high_resolution_clock::now();
+		function();
+		times.push_back(elapsed(start));
+		total += times.back();
+	}
+	return times;
+}
+
+static float randomFloat(float minValue, float maxValue) {
+	return minValue + (maxValue - minValue) * (rand() / (float)RAND_MAX);
+}
+
+// Object matrices for 10K to 1M objects, every path the CPU supports
+static void benchMatrixBatch() {
+	const int REPETITIONS = 15;
+	const size_t STRIDE = 256; // Usual GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT
+	const size_t counts[] = { 10000, 100000, 1000000 };
+
+	mat4 ViewMatrix = lookAt(vec3(0.0f, 3.0f, 10.0f), vec3(0.0f), vec3(0.0f, 1.0f, 0.0f));
+	mat4 ProjectionMatrix = perspective(radians(45.0f), 4.0f / 3.0f, 0.1f, 1000.0f);
+
+	printf("matrix batch\n");
+	printf("%10s %8s %12s %12s %12s %12s\n", "objects", "path", "min ms", "median ms", "ns/object", "max error");
+
+	for (size_t c = 0; c < sizeof(counts) / sizeof(counts[0]); ++c) {
+		size_t count = counts[c];
+
+		srand(1);
+		std::vector<mat4> world(count);
+		for (size_t i = 0; i < count; ++i) {
+			world[i] = translate(vec3(randomFloat(-500, 500), randomFloat(0, 10), randomFloat(-500, 500)))
+				* rotate(randomFloat(0, 6.28f), vec3(0.0f, 1.0f, 0.0f)) * scale(vec3(randomFloat(0.1f, 2.0f)));
+		}
+
+		// Visible lists come out of the culling in a scattered order
+		std::vector<unsigned int> indices(count);
+		for (size_t i = 0; i < count; ++i) indices[i] = (unsigned int)i;
+		std::random_shuffle(indices.begin(), indices.end());
+
+		std::vector<unsigned char> reference(count * STRIDE), output(count * STRIDE);
+		computeObjectMatrices(MATRIX_BATCH_SCALAR, &world[0], &indices[0], count, ViewMatrix, ProjectionMatrix, &reference[0], STRIDE);
+
+		for (int p = 0; p <= bestMatrixBatchPath(); ++p) {
+			MatrixBatchPath path = MatrixBatchPath(p);
+
+			std::vector<double> times;
+			for (int r = 0; r < REPETITIONS; ++r) {
+				std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+				computeObjectMatrices(path, &world[0], &indices[0], count, ViewMatrix, ProjectionMatrix, &output[0], STRIDE);
+				times.push_back(elapsed(start));
+			}
+			std::sort(times.begin(), times.end());
+
+			float maxError = 0.0f;
+			for (size_t i = 0; i < count; ++i) {
+				const float *a = (const float*)&reference[i * STRIDE];
+				const float *b = (const float*)&output[i * STRIDE];
+				for (size_t f = 0; f < sizeof(ObjectMatrices) / sizeof(float); ++f) {
+					maxError = std::max(maxError, fabsf(a[f] - b[f]));
+				}
+			}
+
+			printf("%10d %8s %12.3f %12.3f %12.2f %12g\n", (int)count, matrixBatchPathName(path), times[0], times[REPETITIONS / 2],
+				times[REPETITIONS / 2] * 1e6 / count, maxError);
+
+			char input[64];
+			snprintf(input, sizeof(input), "%d objects %s", (int)count, matrixBatchPathName(path));
+			writeResult("computeObjectMatrices", input, (double)count, times);
+		}
+	}
+}
+
+// CPU side of one frame of the software culling path : update, transforms, occluders, visibility, object matrices
+static void cpuFrame(JobSystem &jobs, EntityStore &entities, OcclusionCuller &culler, const mat4 &ViewMatrix, const mat4 &ProjectionMatrix,
+	std::vector<unsigned char> &visible, std::vector<unsigned int> &visibleObjects, std::vector<unsigned char> &output) {
+	const size_t STRIDE = 256;
+
+	entities.update(1.0f / 60.0f);
+	entities.updateTransforms(&jobs);
+
+	culler.beginFrame(ProjectionMatrix * ViewMatrix);
+	for (size_t i = 0; i < entities.size(); ++i) {
+		if (entities.occluderScales[i] > 0.0f) {
+			vec3 boxMin, boxMax;
+			if (entities.getOccluderBox(i, boxMin, boxMax)) culler.addOccluder(entities.getModelMatrix(i), boxMin, boxMax);
+		}
+	}
+	culler.rasterize();
+
+	visible.resize(entities.size());
+	jobs.parallelFor(entities.size(), 256, [&](size_t begin, size_t end) {
+		for (size_t i = begin; i < end; ++i) {
+			visible[i] = culler.isVisible(entities.getModelMatrix(i), entities.boundsMin[i], entities.boundsMax[i]);
+		}
+	});
+
+	visibleObjects.clear();
+	for (size_t i = 0; i < entities.size(); ++i) {
+		if (visible[i]) visibleObjects.push_back((unsigned int)i);
+	}
+
+	output.resize(std::max(visibleObjects.size(), (size_t)1) * STRIDE);
+	jobs.parallelFor(visibleObjects.size(), 1024, [&](size_t begin, size_t end) {
+		computeObjectMatrices(bestMatrixBatchPath(), &entities.worldMatrices[0], &visibleObjects[begin], end - begin,
+			ViewMatrix, ProjectionMatrix, &output[begin * STRIDE], STRIDE);
+	});
+}
+
+// 10K objects scene : houses as occluders, small objects, a third of them moving, some attached to a parent.
+// The houses are solid boxes, houseModel only holds their bounds and the occluder box, which fills them
+static void buildScene(EntityStore &entities, Model &houseModel) {
+	srand(2);
+
+	const vec3 houseHalfSize(5.0f, 4.0f, 5.0f);
+	houseModel.boundsMin = houseModel.occluderMin = -houseHalfSize;
+	houseModel.boundsMax = houseModel.occluderMax = houseHalfSize;
+
+	RenderHandles handles = { NULL, 0, 0, true };
+	RenderHandles houseHandles = { &houseModel, 0, 0, true };
+	for (int i = 0; i < 10000; ++i) {
+		bool house = i % 30 == 0;
+		vec3 halfSize = house ? houseHalfSize : vec3(0.5f);
+		EntityID parent = INVALID_ENTITY;
+		if (!house && i % 7 == 0) parent = entities.ids[rand() % entities.size()];
+
+		EntityID id = entities.create(house ? houseHandles : handles, -halfSize, halfSize, parent);
+		if (parent != INVALID_ENTITY) {
+			entities.setPosition(id, vec3(randomFloat(-2, 2), 1.0f, randomFloat(-2, 2)));
+		}
+		else {
+			entities.setPosition(id, vec3(randomFloat(-150, 150), house ? 4.0f : 0.5f, randomFloat(-150, 150)));
+		}
+		entities.setOrientation(id, angleAxis(randomFloat(0, 6.28f), vec3(0.0f, 1.0f, 0.0f)));
+
+		if (house) {
+			entities.occluderScales[entities.indexOf(id)] = 0.7f;
+		}
+		else if (i % 3 == 0) {
+			entities.setSpeed(id, vec3(randomFloat(-1.8f, 1.8f), 0.0f, randomFloat(-1.8f, 1.8f)));
+		}
+	}
+}
+
+// Frame CPU time of the 10K objects scene for 1 to all the cores
+static void benchFrameScaling() {
+	const int WARMUP_FRAMES = 10;
+	const int FRAMES = 100;
+
+	mat4 ViewMatrix = lookAt(vec3(0.0f, 3.0f, 0.0f), vec3(1.0f, 2.5f, 1.0f), vec3(0.0f, 1.0f, 0.0f));
+	mat4 ProjectionMatrix = perspective(radians(45.0f), 4.0f / 3.0f, 0.1f, 1000.0f);
+
+	std::vector<unsigned int> threadCounts;
+	unsigned int maxThreads = std::max(std::thread::hardware_concurrency(), 1u);
+	for (unsigned int t = 1; t < maxThreads; t *= 2) threadCounts.push_back(t);
+	threadCounts.push_back(maxThreads);
+
+	printf("frame scaling, 10000 objects\n");
+	printf("%8s %12s %12s %10s %10s\n", "threads", "min ms", "median ms", "speedup", "visible");
+
+	double singleThread = 0.0;
+	// Outlives the report, its destructor prints
+	static Model houseModel;
+	for (size_t t = 0; t < threadCounts.size(); ++t) {
+		JobSystem jobs(threadCounts[t]);
+		EntityStore entities;
+		buildScene(entities, houseModel);
+		OcclusionCuller culler(&jobs);
+
+		std::vector<unsigned char> visible, output;
+		std::vector<unsigned int> visibleObjects;
+		std::vector<double> times;
+		for (int f = 0; f < WARMUP_FRAMES + FRAMES; ++f) {
+			std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+			cpuFrame(jobs, entities, culler, ViewMatrix, ProjectionMatrix, visible, visibleObjects, output);
+			if (f >= WARMUP_FRAMES) times.push_back(elapsed(start));
+		}
+		std::sort(times.begin(), times.end());
+
+		double median = times[FRAMES / 2];
+		if (t == 0) singleThread = median;
+		printf("%8u %12.3f %12.3f %10.2f %10d\n", threadCounts[t], times[0], median, singleThread / median, (int)visibleObjects.size());
+
+		char input[64];
+		snprintf(input, sizeof(input), "10000 objects %u threads", threadCounts[t]);
+		writeResult("cpuFrame", input, 10000.0, times);
+	}
+}
+
+// Unindexed triangles as loadOBJ returns them : a grid of quads over a rolling height field.
+// Neighbour quads share their corners so the indexers have vertices to merge.
+struct Mesh {
+	std::vector<vec3> vertices;
+	std::vector<vec2> uvs;
+	std::vector<vec3> normals;
+};
+
+static const int GRID_COLUMNS_MAX = 1024;
+
+static float gridHeight(float x, float z) {
+	return sinf(x * 0.3f) * cosf(z * 0.2f);
+}
+
+static vec3 gridNormal(float x, float z) {
+	float dx = 0.3f * cosf(x * 0.3f) * cosf(z * 0.2f);
+	float dz = -0.2f * sinf(x * 0.3f) * sinf(z * 0.2f);
+	return normalize(vec3(-dx, 1.0f, -dz));
+}
+
+// Corner c (0 to 3) of quad q, counter clockwise from the bottom left
+static void gridCorner(size_t q, int c, int columns, vec3 &position, vec2 &uv, vec3 &normal) {
+	int x = (int)(q % columns) + ((c == 1 || c == 2) ? 1 : 0);
+	int z = (int)(q / columns) + ((c == 2 || c == 3) ? 1 : 0);
+	position = vec3((float)x, gridHeight((float)x, (float)z), (float)z);
+	uv = vec2((float)x / columns, (float)z / columns);
+	normal = gridNormal((float)x, (float)z);
+}
+
+static int gridColumns(size_t triangles) {
+	return std::min((int)ceil(sqrt(triangles / 2.0)), GRID_COLUMNS_MAX);
+}
+
+static void buildGridMesh(size_t triangles, Mesh &mesh) {
+	static const int QUAD_CORNERS[6] = { 0, 1, 2, 0, 2, 3 };
+	int columns = gridColumns(triangles);
+
+	mesh.vertices.resize(triangles * 3);
+	mesh.uvs.resize(triangles * 3);
+	mesh.normals.resize(triangles * 3);
+	for (size_t v = 0; v < triangles * 3; ++v) {
+		gridCorner(v / 6, QUAD_CORNERS[v % 6], columns, mesh.vertices[v], mesh.uvs[v], mesh.normals[v]);
+	}
+}
+
+// Same grid as an OBJ file, false if it cannot be written
+static bool writeGridOBJ(const char *path, size_t triangles) {
+	FILE *file = fopen(path, "w");
+	if (!file) return false;
+
+	int columns = gridColumns(triangles);
+	size_t quads = (triangles + 1) / 2;
+	int rows = (int)((quads + columns - 1) / columns);
+	for (int z = 0; z <= rows; ++z) {
+		for (int x = 0; x <= columns; ++x) {
+			vec3 normal = gridNormal((float)x, (float)z);
+			fprintf(file, "v %f %f %f\nvt %f %f\nvn %f %f %f\n", (float)x, gridHeight((float)x, (float)z), (float)z,
+				(float)x / columns, (float)z / columns, normal.x, normal.y, normal.z);
+		}
+	}
+
+	// 1 based, position, uv and normal share their index
+	for (size_t t = 0; t < triangles; ++t) {
+		size_t q = t / 2;
+		int x = (int)(q % columns), z = (int)(q / columns);
+		int corners[4] = { z * (columns + 1) + x + 1, z * (columns + 1) + x + 2, (z + 1) * (columns + 1) + x + 2, (z + 1) * (columns + 1) + x + 1 };
+		int a = corners[0], b = t % 2 ? corners[2] : corners[1], c = t % 2 ? corners[3] : corners[2];
+		fprintf(file, "f %d/%d/%d %d/%d/%d %d/%d/%d\n", a, a, a, b, b, b, c, c, c);
+	}
+	fclose(file);
+	return true;
+}
+
+// The four mesh kernels of Obj3D::init on one input, in the order they run there
+static void benchMeshKernels(const char *input, const Mesh &mesh, bool skip[4]) {
+	double triangles = mesh.vertices.size() / 3.0;
+	std::vector<vec3> tangents, bitangents;
+	bool overBudget;
+
+	std::vector<double> times;
+	if (!skip[0]) {
+		times = measure([&]() {
+			std::vector<vec3> vertices = mesh.vertices, normals = mesh.normals;
+			std::vector<vec2> uvs = mesh.uvs;
+			tangents.clear();
+			bitangents.clear();
+			computeTangentBasis(vertices, uvs, normals, tangents, bitangents);
+		}, overBudget);
+		skip[0] = overBudget;
+	}
+	printResult("computeTangentBasis", input, triangles, times);
+	if (tangents.empty()) {
+		std::vector<vec3> vertices = mesh.vertices, normals = mesh.normals;
+		std::vector<vec2> uvs = mesh.uvs;
+		computeTangentBasis(vertices, uvs, normals, tangents, bitangents);
+	}
+
+	// 16 bits indices, past 65536 distinct vertices the indices wrap but the work is the same
+	times.clear();
+	if (!skip[1]) {
+		times = measure([&]() {
+			std::vector<vec3> vertices = mesh.vertices, normals = mesh.normals;
+			std::vector<vec2> uvs = mesh.uvs;
+			std::vector<unsigned short> indices;
+			std::vector<vec3> indexedVertices, indexedNormals;
+			std::vector<vec2> indexedUVs;
+			indexVBO(vertices, uvs, normals, indices, indexedVertices, indexedUVs, indexedNormals);
+		}, overBudget);
+		skip[1] = overBudget;
+	}
+	printResult("indexVBO", input, triangles, times);
+
+	times.clear();
+	if (!skip[2]) {
+		times = measure([&]() {
+			std::vector<vec3> vertices = mesh.vertices, normals = mesh.normals, tangentsCopy = tangents, bitangentsCopy = bitangents;
+			std::vector<vec2> uvs = mesh.uvs;
+			std::vector<unsigned short> indices;
+			std::vector<vec3> indexedVertices, indexedNormals, indexedTangents, indexedBitangents;
+			std::vector<vec2> indexedUVs;
+			indexVBO_TBN(vertices, uvs, normals, tangentsCopy, bitangentsCopy,
+				indices, indexedVertices, indexedUVs, indexedNormals, indexedTangents, indexedBitangents);
+		}, overBudget);
+		skip[2] = overBudget;
+	}
+	printResult("indexVBO_TBN", input, triangles, times);
+}
+
+static void benchLoadOBJ(const char *input, const char *path, double triangles, bool &skip) {
+	std::vector<double> times;
+	if (!skip) {
+		times = measure([&]() {
+			std::vector<vec3> vertices, normals;
+			std::vector<vec2> uvs;
+			loadOBJ(path, vertices, uvs, normals);
+		}, skip);
+	}
+	printResult("loadOBJ", input, triangles, times);
+}
+
+// The models of the scene, the missing ones are skipped
+static void benchShippedModels() {
+	const char *models[] = { "models/cube/model.obj", "models/skybox/model.obj", "models/rock/model1.obj", "models/deer/model.obj",
+		"models/house2/model.obj", "models/house1/model1.obj" };
+
+	printResultHeader("shipped models");
+	for (size_t m = 0; m < sizeof(models) / sizeof(models[0]); ++m) {
+		std::string path = assetDirectory + models[m];
+		Mesh mesh;
+		FILE *file = fopen(path.c_str(), "r");
+		if (!file) continue;
+		fclose(file);
+		if (!loadOBJ(path.c_str(), mesh.vertices, mesh.uvs, mesh.normals) || mesh.vertices.empty()) continue;
+
+		bool skip = false, skipKernels[4] = { false, false, false, false };
+		benchLoadOBJ(models[m], path.c_str(), mesh.vertices.size() / 3.0, skip);
+		benchMeshKernels(models[m], mesh, skipKernels);
+	}
+}
+
+// Generated grids of 10K to --max-triangles triangles. A kernel over the time budget on a size is not run on the next ones
+static void benchSyntheticMeshes() {
+	// The OBJ text of 10M triangles would be close to a GB on disk
+	const size_t MAX_OBJ_TRIANGLES = 1000000;
+
+	printResultHeader("synthetic meshes");
+	bool skipLoad = false, skipKernels[4] = { false, false, false, false };
+	for (size_t triangles = 10000; triangles <= maxTriangles; triangles *= 10) {
+		char input[64];
+		snprintf(input, sizeof(input), "grid %d triangles", (int)triangles);
+
+		if (triangles <= MAX_OBJ_TRIANGLES) {
+			char path[64];
+			snprintf(path, sizeof(path), "benchmark_grid_%d.obj", (int)triangles);
+			if (writeGridOBJ(path, triangles)) {
+				benchLoadOBJ(input, path, (double)triangles, skipLoad);
+				remove(path);
+			}
+		}
+
+		Mesh mesh;
+		buildGridMesh(triangles, mesh);
+		benchMeshKernels(input, mesh, skipKernels);
+	}
+}
+
+// Header of a DXT1 DDS with its mipmaps, and of a 24 bits BMP
+static void buildDDSHeader(unsigned char header[DDS_HEADER_SIZE], unsigned int width, unsigned int height) {
+	memset(header, 0, DDS_HEADER_SIZE);
+	memcpy(header, "DDS ", 4);
+	unsigned int *desc = (unsigned int*)(header + 4);
+	desc[0] = 124;
+	desc[2] = height;
+	desc[3] = width;
+	desc[4] = ((width + 3) / 4) * ((height + 3) / 4) * 8;
+	desc[6] = 1 + (unsigned int)log2((double)std::max(width, height));
+	memcpy(&desc[20], "DXT1", 4);
+}
+
+static void buildBMPHeader(unsigned char header[BMP_HEADER_SIZE], unsigned int width, unsigned int height) {
+	memset(header, 0, BMP_HEADER_SIZE);
+	header[0] = 'B';
+	header[1] = 'M';
+	*(unsigned int*)&header[0x0A] = BMP_HEADER_SIZE;
+	*(unsigned int*)&header[0x12] = width;
+	*(unsigned int*)&header[0x16] = height;
+	*(unsigned short*)&header[0x1C] = 24;
+	*(unsigned int*)&header[0x22] = width * height * 3;
+}
+
+// Texture files read and parsed without the GL upload
+static void benchTextures() {
+	const char *textures[] = { "models/skybox/texture.dds", "models/skybox/texture2.dds", "models/rock/texture.dds", "models/rock/cloud.dds",
+		"models/house1/texture.dds", "models/house2/texture.dds", "models/house2/texture2.dds", "models/deer/texture.dds",
+		"models/cube/texture.DDS", "models/default_normal.bmp" };
+
+	printResultHeader("textures");
+	for (size_t t = 0; t < sizeof(textures) / sizeof(textures[0]); ++t) {
+		std::string path = assetDirectory + textures[t];
+		FILE *file = fopen(path.c_str(), "rb");
+		if (!file) continue;
+		fclose(file);
+
+		bool bmp = path.compare(path.size() - 4, 4, ".bmp") == 0;
+		TextureData texture;
+		bool overBudget;
+		std::vector<double> times = measure([&]() {
+			if (bmp) readBMP(path.c_str(), texture);
+			else readDDS(path.c_str(), texture);
+		}, overBudget);
+		printResult(bmp ? "readBMP" : "readDDS", textures[t], 1.0, times);
+	}
+
+	// Headers alone, from memory
+	const int HEADERS = 100000;
+	std::vector<unsigned char> ddsHeaders(HEADERS * DDS_HEADER_SIZE), bmpHeaders(HEADERS * BMP_HEADER_SIZE);
+	for (int h = 0; h < HEADERS; ++h) {
+		unsigned int size = 64u << (h % 6);
+		buildDDSHeader(&ddsHeaders[h * DDS_HEADER_SIZE], size, size);
+		buildBMPHeader(&bmpHeaders[h * BMP_HEADER_SIZE], size, size);
+	}
+
+	unsigned int sink = 0;
+	bool overBudget;
+	std::vector<double> times = measure([&]() {
+		TextureData texture;
+		for (int h = 0; h < HEADERS; ++h) {
+			if (parseDDSHeader(&ddsHeaders[h * DDS_HEADER_SIZE], DDS_HEADER_SIZE, texture)) sink += texture.dataSize;
+		}
+	}, overBudget);
+	printResult("parseDDSHeader", "100000 headers", HEADERS, times);
+
+	times = measure([&]() {
+		TextureData texture;
+		for (int h = 0; h < HEADERS; ++h) {
+			if (parseBMPHeader(&bmpHeaders[h * BMP_HEADER_SIZE], BMP_HEADER_SIZE, texture)) sink += texture.dataSize;
+		}
+	}, overBudget);
+	printResult("parseBMPHeader", "100000 headers", HEADERS, times);
+	if (sink == 42) printf("\n");
+}
+
+// Model matrices of the legacy objects and the quaternion helpers
+static void benchTransforms() {
+	const size_t COUNT = 1000000;
+	printResultHeader("transforms");
+
+	srand(3);
+	std::vector<Obj3D> objects;
+	objects.reserve(COUNT);
+	for (size_t i = 0; i < COUNT; ++i) {
+		objects.push_back(Obj3D((char*)"", (char*)""));
+		objects.back().position = vec3(randomFloat(-500, 500), randomFloat(0, 10), randomFloat(-500, 500));
+		objects.back().rotation = vec3(randomFloat(0, 6.28f), randomFloat(0, 6.28f), 0.0f);
+		objects.back().scale = vec3(randomFloat(0.1f, 2.0f));
+	}
+
+	// Summed so the compiler keeps the work
+	float sink = 0.0f;
+	bool overBudget;
+	std::vector<double> times = measure([&]() {
+		for (size_t i = 0; i < COUNT; ++i) {
+			sink += objects[i].getModelMatrix()[3][0];
+		}
+	}, overBudget);
+	printResult("Obj3D::getModelMatrix", "1000000 objects", (double)COUNT, times);
+
+	std::vector<vec3> a(COUNT), b(COUNT);
+	std::vector<quat> q(COUNT);
+	for (size_t i = 0; i < COUNT; ++i) {
+		a[i] = vec3(randomFloat(-1, 1), randomFloat(-1, 1), randomFloat(-1, 1));
+		b[i] = vec3(randomFloat(-1, 1), randomFloat(-1, 1), randomFloat(-1, 1));
+		q[i] = angleAxis(randomFloat(0, 6.28f), normalize(b[i] + vec3(0.0f, 0.01f, 0.0f)));
+	}
+
+	times = measure([&]() {
+		for (size_t i = 0; i < COUNT; ++i) {
+			sink += RotationBetweenVectors(a[i], b[i]).w;
+		}
+	}, overBudget);
+	printResult("RotationBetweenVectors", "1000000 vector pairs", (double)COUNT, times);
+
+	times = measure([&]() {
+		for (size_t i = 0; i < COUNT; ++i) {
+			sink += LookAt(a[i], vec3(0.0f, 1.0f, 0.0f)).w;
+		}
+	}, overBudget);
+	printResult("LookAt", "1000000 directions", (double)COUNT, times);
+
+	times = measure([&]() {
+		for (size_t i = 0; i < COUNT; ++i) {
+			sink += RotateTowards(q[i], q[COUNT - 1 - i], 0.1f).w;
+		}
+	}, overBudget);
+	printResult("RotateTowards", "1000000 quaternion pairs", (double)COUNT, times);
+	if (sink == 42.0f) printf("\n");
+}
+
+int main(int argc, char *argv[])
+{
+	const char *csvPath = NULL;
+	for (int i = 1; i < argc; ++i) {
+		if (!strcmp(argv[i], "--csv") && i + 1 < argc) {
+			csvPath = argv[++i];
+		}
+		else if (!strcmp(argv[i], "--assets") && i + 1 < argc) {
+			assetDirectory = argv[++i];
+			if (!assetDirectory.empty() && assetDirectory.back() != '/' && assetDirectory.back() != '\\') assetDirectory += '/';
+		}
+		else if (!strcmp(argv[i], "--max-triangles") && i + 1 < argc) {
+			maxTriangles = (size_t)strtoull(argv[++i], NULL, 10);
+		}
+	}
+
+	if (csvPath) {
+		csv = fopen(csvPath, "w");
+		if (!csv) {
+			fprintf(stderr, "%s could not be opened for writing\n", csvPath);
+			return 1;
+		}
+		fprintf(csv, "kernel,input,items,repetitions,min_ms,median_ms,mean_ms,stddev_ms,ci95_ms,ns_per_item\n");
+	}
+
+	benchMatrixBatch();
+	benchFrameScaling();
+	benchShippedModels();
+	benchSyntheticMeshes();
+	benchTextures();
+	benchTransforms();
+
+	if (csv) fclose(csv);
+	return 0;
+}
@@ -32,6 +32,17 @@ float initialFoV = 45.0f;
 float speed = 20.0f; // units / second
 float mouseSpeed = 0.005f;
 
+// Height of the ground under a point, flat at 0 until one is set
+static float (*groundHeight)(float x, float z) = NULL;
+
+void setGroundHeightFunction(float (*function)(float x, float z)){
+	groundHeight = function;
+}
+
+glm::vec3 getCameraPosition(){
+	return position;
+}
+
 void computeMatricesFromInputs(){
 
 	// glfwGetTime is called only once, the first time this function is called
@@ -98,9 +109,10 @@ void computeMatricesFromInputs(){
 	// Projection matrix : 45 Field of View, 4:3 ratio, display range : 0.1 unit <-> 100 units
 	ProjectionMatrix = glm::perspective(FoV, 4.0f / 3.0f, 0.1f, 1000.0f);
 	
-	// Limit camera vertical movement
-	if (position.y > 3.5f) position.y = 3.5f;
-	if (position.y < 2) position.y = 2;
+	// Limit camera vertical movement, above the ground
+	float ground = groundHeight ? groundHeight(position.x, position.z) : 0.0f;
+	if (position.y > ground + 3.5f) position.y = ground + 3.5f;
+	if (position.y < ground + 2) position.y = ground + 2;
 
 
 	// Camera matrix
@@ -4,5 +4,9 @@
 void computeMatricesFromInputs();
 glm::mat4 getViewMatrix();
 glm::mat4 getProjectionMatrix();
+// Eye position of the last computeMatricesFromInputs() call
+glm::vec3 getCameraPosition();
+// The camera is kept at eye height over it, NULL for a flat ground at 0
+void setGroundHeightFunction(float (*function)(float x, float z));
 
 #endif
\ No newline at end of file
@@ -0,0 +1,47 @@
+#include "cpufeatures.hpp"
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+
+struct CpuFeatures {
+	bool sse2, avx;
+
+	CpuFeatures() {
+		unsigned int regs[4] = { 0, 0, 0, 0 }; // eax, ebx, ecx, edx
+#ifdef _MSC_VER
+		__cpuid((int*)regs, 1);
+#else
+		__get_cpuid(1, &regs[0], &regs[1], &regs[2], &regs[3]);
+#endif
+		sse2 = (regs[3] & (1u << 26)) != 0;
+
+		// AVX also needs the OS to save the YMM registers : OSXSAVE set and XCR0 bits 1 and 2
+		avx = false;
+		if ((regs[2] & (1u << 28)) && (regs[2] & (1u << 27))) {
+#ifdef _MSC_VER
+			unsigned long long xcr0 = _xgetbv(0);
+#else
+			unsigned int low, high;
+			__asm__ volatile ("xgetbv" : "=a"(low), "=d"(high) : "c"(0));
+			unsigned long long xcr0 = ((unsigned long long)high << 32) | low;
+#endif
+			avx = (xcr0 & 6) == 6;
+		}
+	}
+};
+
+static const CpuFeatures &features() {
+	static CpuFeatures detected;
+	return detected;
+}
+
+bool cpuHasSSE2() {
+	return features().sse2;
+}
+
+bool cpuHasAVX() {
+	return features().avx;
+}
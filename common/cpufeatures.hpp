@@ -0,0 +1,8 @@
+#ifndef CPUFEATURES_HPP
+#define CPUFEATURES_HPP
+
+// Instruction sets usable on this CPU and operating system, detected once
+bool cpuHasSSE2();
+bool cpuHasAVX();
+
+#endif
@@ -0,0 +1,21 @@
+#include <stdio.h>
+
+#ifdef _WIN32
+#include <io.h>
+#define isatty _isatty
+#define fileno _fileno
+#else
+#include <unistd.h>
+#endif
+
+#include "errorpause.hpp"
+
+static bool pauseEnabled = true;
+
+void setPauseOnError(bool enabled) {
+	pauseEnabled = enabled;
+}
+
+void pauseOnError() {
+	if (pauseEnabled && isatty(fileno(stdin))) getchar();
+}
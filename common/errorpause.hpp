@@ -0,0 +1,9 @@
+#ifndef ERRORPAUSE_HPP
+#define ERRORPAUSE_HPP
+
+// Wait for a key after an error message so it stays readable in a console window.
+// Never waits once disabled (headless runs) or when stdin is not a terminal.
+void pauseOnError();
+void setPauseOnError(bool enabled);
+
+#endif
@@ -0,0 +1,220 @@
+#include "memorytracker.hpp"
+
+#include <stdio.h>
+#include <algorithm>
+
+static const char *poolNames[MEMORY_POOL_COUNT] = { "GPU", "CPU" };
+static const char *categoryNames[MEMORY_CATEGORY_COUNT] = { "meshes", "textures", "render targets", "dynamic" };
+
+static const double MB = 1024.0 * 1024.0;
+
+const char *memoryPoolName(MemoryPool pool) {
+	return poolNames[pool];
+}
+
+const char *memoryCategoryName(MemoryCategory category) {
+	return categoryNames[category];
+}
+
+std::mutex MemoryTracker::lock;
+std::map<MemoryTracker::Key, MemoryTracker::Allocation> MemoryTracker::allocations;
+size_t MemoryTracker::totals[MEMORY_POOL_COUNT][MEMORY_CATEGORY_COUNT];
+size_t MemoryTracker::poolTotals[MEMORY_POOL_COUNT];
+size_t MemoryTracker::peaks[MEMORY_POOL_COUNT];
+size_t MemoryTracker::budgets[MEMORY_POOL_COUNT];
+bool MemoryTracker::warned[MEMORY_POOL_COUNT];
+
+void MemoryTracker::trackBuffer(GLuint buffer, size_t bytes, MemoryCategory category, const char *asset) {
+	track(Key(KEY_BUFFER, buffer), MEMORY_GPU, bytes, category, asset);
+}
+
+void MemoryTracker::trackTexture(GLuint texture, size_t bytes, MemoryCategory category, const char *asset) {
+	track(Key(KEY_TEXTURE, texture), MEMORY_GPU, bytes, category, asset);
+}
+
+void MemoryTracker::trackRenderbuffer(GLuint renderbuffer, size_t bytes, MemoryCategory category, const char *asset) {
+	track(Key(KEY_RENDERBUFFER, renderbuffer), MEMORY_GPU, bytes, category, asset);
+}
+
+void MemoryTracker::trackCpu(const void *owner, size_t bytes, MemoryCategory category, const char *asset) {
+	track(Key(KEY_CPU, (size_t)owner), MEMORY_CPU, bytes, category, asset);
+}
+
+void MemoryTracker::releaseBuffer(GLuint buffer) {
+	release(Key(KEY_BUFFER, buffer));
+}
+
+void MemoryTracker::releaseTexture(GLuint texture) {
+	release(Key(KEY_TEXTURE, texture));
+}
+
+void MemoryTracker::releaseRenderbuffer(GLuint renderbuffer) {
+	release(Key(KEY_RENDERBUFFER, renderbuffer));
+}
+
+void MemoryTracker::releaseCpu(const void *owner) {
+	release(Key(KEY_CPU, (size_t)owner));
+}
+
+void MemoryTracker::track(Key key, MemoryPool pool, size_t bytes, MemoryCategory category, const char *asset) {
+	if (key.second == 0) return;
+	std::lock_guard<std::mutex> guard(lock);
+
+	std::map<Key, Allocation>::iterator it = allocations.find(key);
+	if (it == allocations.end()) {
+		Allocation allocation;
+		allocation.bytes = 0;
+		allocation.pool = pool;
+		allocation.category = category;
+		allocation.asset = asset;
+		it = allocations.insert(std::make_pair(key, allocation)).first;
+	}
+	else if (it->second.category != category || it->second.asset != asset) {
+		// GL names are reused once deleted, the key may belong to something else now
+		totals[pool][it->second.category] -= it->second.bytes;
+		poolTotals[pool] -= it->second.bytes;
+		it->second.bytes = 0;
+		it->second.category = category;
+		it->second.asset = asset;
+	}
+
+	Allocation &allocation = it->second;
+	totals[pool][category] += bytes - allocation.bytes;
+	poolTotals[pool] += bytes - allocation.bytes;
+	allocation.bytes = bytes;
+	peaks[pool] = std::max(peaks[pool], poolTotals[pool]);
+	checkBudget(pool, allocation.asset);
+}
+
+void MemoryTracker::release(Key key) {
+	if (key.second == 0) return;
+	std::lock_guard<std::mutex> guard(lock);
+
+	std::map<Key, Allocation>::iterator it = allocations.find(key);
+	if (it == allocations.end()) return;
+	totals[it->second.pool][it->second.category] -= it->second.bytes;
+	poolTotals[it->second.pool] -= it->second.bytes;
+	checkBudget(it->second.pool, it->second.asset);
+	allocations.erase(it);
+}
+
+// Called with the lock held
+void MemoryTracker::checkBudget(MemoryPool pool, const std::string &asset) {
+	bool over = budgets[pool] && poolTotals[pool] > budgets[pool];
+	if (over && !warned[pool]) {
+		printf("Warning : %s memory over its budget, %.1f MB for %.1f MB, with %s\n", poolNames[pool], poolTotals[pool] / MB, budgets[pool] / MB, asset.c_str());
+	}
+	warned[pool] = over;
+}
+
+size_t MemoryTracker::textureSize(GLuint texture) {
+	GLint previous;
+	glGetIntegerv(GL_TEXTURE_BINDING_2D, &previous);
+	glBindTexture(GL_TEXTURE_2D, texture);
+
+	size_t bytes = 0;
+	for (GLint level = 0; level < 16; ++level) {
+		GLint width = 0, height = 0, compressed = GL_FALSE;
+		glGetTexLevelParameteriv(GL_TEXTURE_2D, level, GL_TEXTURE_WIDTH, &width);
+		glGetTexLevelParameteriv(GL_TEXTURE_2D, level, GL_TEXTURE_HEIGHT, &height);
+		if (width == 0 || height == 0) break;
+
+		glGetTexLevelParameteriv(GL_TEXTURE_2D, level, GL_TEXTURE_COMPRESSED, &compressed);
+		if (compressed) {
+			GLint size = 0;
+			glGetTexLevelParameteriv(GL_TEXTURE_2D, level, GL_TEXTURE_COMPRESSED_IMAGE_SIZE, &size);
+			bytes += size;
+		}
+		else {
+			// Bits of every component the internal format kept
+			static const GLenum components[] = { GL_TEXTURE_RED_SIZE, GL_TEXTURE_GREEN_SIZE, GL_TEXTURE_BLUE_SIZE, GL_TEXTURE_ALPHA_SIZE, GL_TEXTURE_DEPTH_SIZE, GL_TEXTURE_STENCIL_SIZE };
+			GLint bits = 0;
+			for (int c = 0; c < 6; ++c) {
+				GLint size = 0;
+				glGetTexLevelParameteriv(GL_TEXTURE_2D, level, components[c], &size);
+				bits += size;
+			}
+			bytes += (size_t)width * height * ((bits + 7) / 8);
+		}
+	}
+
+	glBindTexture(GL_TEXTURE_2D, previous);
+	return bytes;
+}
+
+size_t MemoryTracker::total(MemoryPool pool) {
+	std::lock_guard<std::mutex> guard(lock);
+	return poolTotals[pool];
+}
+
+size_t MemoryTracker::peak(MemoryPool pool) {
+	std::lock_guard<std::mutex> guard(lock);
+	return peaks[pool];
+}
+
+size_t MemoryTracker::categoryTotal(MemoryPool pool, MemoryCategory category) {
+	std::lock_guard<std::mutex> guard(lock);
+	return totals[pool][category];
+}
+
+std::vector<MemoryTracker::Asset> MemoryTracker::assets() {
+	std::lock_guard<std::mutex> guard(lock);
+
+	std::map<std::string, Asset> byName;
+	for (std::map<Key, Allocation>::const_iterator it = allocations.begin(); it != allocations.end(); ++it) {
+		const Allocation &allocation = it->second;
+		std::map<std::string, Asset>::iterator asset = byName.find(allocation.asset);
+		if (asset == byName.end()) {
+			Asset newAsset;
+			newAsset.name = allocation.asset;
+			newAsset.category = allocation.category;
+			std::fill(newAsset.bytes, newAsset.bytes + MEMORY_POOL_COUNT, (size_t)0);
+			asset = byName.insert(std::make_pair(allocation.asset, newAsset)).first;
+		}
+		asset->second.bytes[allocation.pool] += allocation.bytes;
+	}
+
+	std::vector<Asset> result;
+	for (std::map<std::string, Asset>::const_iterator it = byName.begin(); it != byName.end(); ++it) {
+		result.push_back(it->second);
+	}
+	std::sort(result.begin(), result.end(), [](const Asset &a, const Asset &b) {
+		return a.bytes[MEMORY_GPU] + a.bytes[MEMORY_CPU] > b.bytes[MEMORY_GPU] + b.bytes[MEMORY_CPU];
+	});
+	return result;
+}
+
+void MemoryTracker::setBudget(MemoryPool pool, size_t bytes) {
+	std::lock_guard<std::mutex> guard(lock);
+	budgets[pool] = bytes;
+	checkBudget(pool, "the budget change");
+}
+
+size_t MemoryTracker::budget(MemoryPool pool) {
+	std::lock_guard<std::mutex> guard(lock);
+	return budgets[pool];
+}
+
+bool MemoryTracker::overBudget(MemoryPool pool) {
+	std::lock_guard<std::mutex> guard(lock);
+	return budgets[pool] && poolTotals[pool] > budgets[pool];
+}
+
+void MemoryTracker::print() {
+	std::vector<Asset> list = assets();
+
+	std::lock_guard<std::mutex> guard(lock);
+	for (int pool = 0; pool < MEMORY_POOL_COUNT; ++pool) {
+		printf("%s memory : %.2f MB, %.2f MB peak", poolNames[pool], poolTotals[pool] / MB, peaks[pool] / MB);
+		if (budgets[pool]) printf(", %.2f MB budget", budgets[pool] / MB);
+		for (int category = 0; category < MEMORY_CATEGORY_COUNT; ++category) {
+			if (totals[pool][category]) printf(", %.2f MB %s", totals[pool][category] / MB, categoryNames[category]);
+		}
+		printf("\n");
+	}
+
+	for (size_t a = 0; a < list.size(); ++a) {
+		printf("  %10.3f MB GPU %10.3f MB CPU  %-14s %s\n", list[a].bytes[MEMORY_GPU] / MB, list[a].bytes[MEMORY_CPU] / MB,
+			categoryNames[list[a].category], list[a].name.c_str());
+	}
+}
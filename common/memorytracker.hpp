@@ -0,0 +1,91 @@
+#ifndef MEMORYTRACKER_HPP
+#define MEMORYTRACKER_HPP
+
+#include <GL/glew.h>
+
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+
+enum MemoryPool {
+	MEMORY_GPU, // Buffers, textures and renderbuffers
+	MEMORY_CPU, // Copies kept in RAM by the assets
+	MEMORY_POOL_COUNT
+};
+
+enum MemoryCategory {
+	MEMORY_MESH,          // Vertices and indices of the models
+	MEMORY_TEXTURE,       // Images of the models and the font
+	MEMORY_RENDER_TARGET, // Framebuffers, depth copies and pyramids
+	MEMORY_DYNAMIC,       // Buffers rewritten while running : matrices, lights, culling, text
+	MEMORY_CATEGORY_COUNT
+};
+
+const char *memoryPoolName(MemoryPool pool);
+const char *memoryCategoryName(MemoryCategory category);
+
+// Bytes held by the GL objects and the CPU copies, by asset and category.
+// The GL sizes are the ones asked for, drivers add padding and shadow copies on top.
+// Buffers, textures and renderbuffers are keyed by their GL name, CPU memory by the address
+// of its owner. Tracking a key again replaces its size, as glBufferData does.
+// A pool over its budget prints a warning, once until it goes back under.
+// Every call takes a lock, fine for allocations but not for every draw.
+class MemoryTracker {
+	public:
+		struct Asset {
+			std::string name;
+			MemoryCategory category;
+			size_t bytes[MEMORY_POOL_COUNT];
+		};
+
+		static void trackBuffer(GLuint buffer, size_t bytes, MemoryCategory category, const char *asset);
+		static void trackTexture(GLuint texture, size_t bytes, MemoryCategory category, const char *asset);
+		static void trackRenderbuffer(GLuint renderbuffer, size_t bytes, MemoryCategory category, const char *asset);
+		static void trackCpu(const void *owner, size_t bytes, MemoryCategory category, const char *asset);
+
+		static void releaseBuffer(GLuint buffer);
+		static void releaseTexture(GLuint texture);
+		static void releaseRenderbuffer(GLuint renderbuffer);
+		static void releaseCpu(const void *owner);
+
+		// Size of all the levels of a 2D texture, as the driver reports them
+		static size_t textureSize(GLuint texture);
+
+		static size_t total(MemoryPool pool);
+		static size_t peak(MemoryPool pool);
+		static size_t categoryTotal(MemoryPool pool, MemoryCategory category);
+		// Largest first
+		static std::vector<Asset> assets();
+
+		// 0 for no budget
+		static void setBudget(MemoryPool pool, size_t bytes);
+		static size_t budget(MemoryPool pool);
+		static bool overBudget(MemoryPool pool);
+
+		// Totals, peaks and assets
+		static void print();
+
+	private:
+		enum KeyType { KEY_BUFFER, KEY_TEXTURE, KEY_RENDERBUFFER, KEY_CPU };
+		typedef std::pair<int, size_t> Key;
+
+		struct Allocation {
+			size_t bytes;
+			MemoryPool pool;
+			MemoryCategory category;
+			std::string asset;
+		};
+
+		static void track(Key key, MemoryPool pool, size_t bytes, MemoryCategory category, const char *asset);
+		static void release(Key key);
+		static void checkBudget(MemoryPool pool, const std::string &asset);
+
+		static std::mutex lock;
+		static std::map<Key, Allocation> allocations;
+		static size_t totals[MEMORY_POOL_COUNT][MEMORY_CATEGORY_COUNT];
+		static size_t poolTotals[MEMORY_POOL_COUNT], peaks[MEMORY_POOL_COUNT], budgets[MEMORY_POOL_COUNT];
+		static bool warned[MEMORY_POOL_COUNT];
+};
+
+#endif
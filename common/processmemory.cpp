@@ -0,0 +1,26 @@
+#include "processmemory.hpp"
+
+#ifdef _WIN32
+#include <windows.h>
+#include <psapi.h>
+#pragma comment(lib, "psapi.lib")
+#else
+#include <stdio.h>
+#include <unistd.h>
+#endif
+
+size_t processMemoryUsage() {
+#ifdef _WIN32
+	PROCESS_MEMORY_COUNTERS counters;
+	if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) return 0;
+	return counters.WorkingSetSize;
+#else
+	// Second field of statm, in pages
+	FILE *file = fopen("/proc/self/statm", "r");
+	if (!file) return 0;
+	unsigned long size = 0, resident = 0;
+	int read = fscanf(file, "%lu %lu", &size, &resident);
+	fclose(file);
+	return read == 2 ? (size_t)resident * (size_t)sysconf(_SC_PAGESIZE) : 0;
+#endif
+}
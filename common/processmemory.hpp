@@ -0,0 +1,9 @@
+#ifndef PROCESSMEMORY_HPP
+#define PROCESSMEMORY_HPP
+
+#include <stddef.h>
+
+// Physical memory used by the process in bytes (working set, resident set), 0 if unknown
+size_t processMemoryUsage();
+
+#endif
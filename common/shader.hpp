@@ -3,4 +3,7 @@
 
 GLuint LoadShaders(const char * vertex_file_path,const char * fragment_file_path);
 
+// Needs a GL 4.3 context
+GLuint LoadComputeShader(const char * compute_file_path);
+
 #endif
@@ -1,4 +1,3 @@
-#include <vector>
 #include <cstring>
 
 #include <GL/glew.h>
@@ -9,77 +8,221 @@ using namespace glm;
 
 #include "shader.hpp"
 #include "texture.hpp"
+#include "memorytracker.hpp"
 
 #include "text2D.hpp"
 
+// The glyphs of a frame are appended to one buffer and drawn with a single
+// instanced call, 8 bytes per character : x, y in pixels, then the character,
+// its size and its color. With GL 4.4 the buffer stays mapped and printText2D
+// writes straight into it, a third of it per frame in flight.
+#define TEXT2D_MAX_GLYPHS 4096
+#define TEXT2D_SEGMENTS 3
+
+// 5x7 pixels font for the characters 32 to 95, one byte per row, used when no font texture is given.
+// Lower case letters are drawn with the upper case ones.
+static const unsigned char builtinFont[64][7] = {
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, // space
+	0x04, 0x04, 0x04, 0x04, 0x04, 0x00, 0x04, // !
+	0x0a, 0x0a, 0x0a, 0x00, 0x00, 0x00, 0x00, // "
+	0x0a, 0x0a, 0x1f, 0x0a, 0x1f, 0x0a, 0x0a, // #
+	0x04, 0x0f, 0x14, 0x0e, 0x05, 0x1e, 0x04, // $
+	0x18, 0x19, 0x02, 0x04, 0x08, 0x13, 0x03, // %
+	0x0c, 0x12, 0x14, 0x08, 0x15, 0x12, 0x0d, // &
+	0x04, 0x04, 0x08, 0x00, 0x00, 0x00, 0x00, // '
+	0x02, 0x04, 0x08, 0x08, 0x08, 0x04, 0x02, // (
+	0x08, 0x04, 0x02, 0x02, 0x02, 0x04, 0x08, // )
+	0x00, 0x04, 0x15, 0x0e, 0x15, 0x04, 0x00, // *
+	0x00, 0x04, 0x04, 0x1f, 0x04, 0x04, 0x00, // +
+	0x00, 0x00, 0x00, 0x00, 0x0c, 0x04, 0x08, // ,
+	0x00, 0x00, 0x00, 0x1f, 0x00, 0x00, 0x00, // -
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x0c, 0x0c, // .
+	0x00, 0x01, 0x02, 0x04, 0x08, 0x10, 0x00, // /
+	0x0e, 0x11, 0x13, 0x15, 0x19, 0x11, 0x0e, // 0
+	0x04, 0x0c, 0x04, 0x04, 0x04, 0x04, 0x0e, // 1
+	0x0e, 0x11, 0x01, 0x02, 0x04, 0x08, 0x1f, // 2
+	0x1f, 0x02, 0x04, 0x02, 0x01, 0x11, 0x0e, // 3
+	0x02, 0x06, 0x0a, 0x12, 0x1f, 0x02, 0x02, // 4
+	0x1f, 0x10, 0x1e, 0x01, 0x01, 0x11, 0x0e, // 5
+	0x06, 0x08, 0x10, 0x1e, 0x11, 0x11, 0x0e, // 6
+	0x1f, 0x01, 0x02, 0x04, 0x08, 0x08, 0x08, // 7
+	0x0e, 0x11, 0x11, 0x0e, 0x11, 0x11, 0x0e, // 8
+	0x0e, 0x11, 0x11, 0x0f, 0x01, 0x02, 0x0c, // 9
+	0x00, 0x0c, 0x0c, 0x00, 0x0c, 0x0c, 0x00, // :
+	0x00, 0x0c, 0x0c, 0x00, 0x0c, 0x04, 0x08, // ;
+	0x02, 0x04, 0x08, 0x10, 0x08, 0x04, 0x02, // <
+	0x00, 0x00, 0x1f, 0x00, 0x1f, 0x00, 0x00, // =
+	0x08, 0x04, 0x02, 0x01, 0x02, 0x04, 0x08, // >
+	0x0e, 0x11, 0x01, 0x02, 0x04, 0x00, 0x04, // ?
+	0x0e, 0x11, 0x01, 0x0d, 0x15, 0x15, 0x0e, // @
+	0x0e, 0x11, 0x11, 0x1f, 0x11, 0x11, 0x11, // A
+	0x1e, 0x11, 0x11, 0x1e, 0x11, 0x11, 0x1e, // B
+	0x0e, 0x11, 0x10, 0x10, 0x10, 0x11, 0x0e, // C
+	0x1c, 0x12, 0x11, 0x11, 0x11, 0x12, 0x1c, // D
+	0x1f, 0x10, 0x10, 0x1e, 0x10, 0x10, 0x1f, // E
+	0x1f, 0x10, 0x10, 0x1e, 0x10, 0x10, 0x10, // F
+	0x0e, 0x11, 0x10, 0x17, 0x11, 0x11, 0x0f, // G
+	0x11, 0x11, 0x11, 0x1f, 0x11, 0x11, 0x11, // H
+	0x0e, 0x04, 0x04, 0x04, 0x04, 0x04, 0x0e, // I
+	0x07, 0x02, 0x02, 0x02, 0x02, 0x12, 0x0c, // J
+	0x11, 0x12, 0x14, 0x18, 0x14, 0x12, 0x11, // K
+	0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x1f, // L
+	0x11, 0x1b, 0x15, 0x15, 0x11, 0x11, 0x11, // M
+	0x11, 0x11, 0x19, 0x15, 0x13, 0x11, 0x11, // N
+	0x0e, 0x11, 0x11, 0x11, 0x11, 0x11, 0x0e, // O
+	0x1e, 0x11, 0x11, 0x1e, 0x10, 0x10, 0x10, // P
+	0x0e, 0x11, 0x11, 0x11, 0x15, 0x12, 0x0d, // Q
+	0x1e, 0x11, 0x11, 0x1e, 0x14, 0x12, 0x11, // R
+	0x0f, 0x10, 0x10, 0x0e, 0x01, 0x01, 0x1e, // S
+	0x1f, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, // T
+	0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x0e, // U
+	0x11, 0x11, 0x11, 0x11, 0x11, 0x0a, 0x04, // V
+	0x11, 0x11, 0x11, 0x15, 0x15, 0x15, 0x0a, // W
+	0x11, 0x11, 0x0a, 0x04, 0x0a, 0x11, 0x11, // X
+	0x11, 0x11, 0x0a, 0x04, 0x04, 0x04, 0x04, // Y
+	0x1f, 0x01, 0x02, 0x04, 0x08, 0x10, 0x1f, // Z
+	0x0e, 0x08, 0x08, 0x08, 0x08, 0x08, 0x0e, // [
+	0x00, 0x10, 0x08, 0x04, 0x02, 0x01, 0x00, // backslash
+	0x0e, 0x02, 0x02, 0x02, 0x02, 0x02, 0x0e, // ]
+	0x04, 0x0a, 0x11, 0x00, 0x00, 0x00, 0x00, // ^
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x1f, // _
+};
+
 unsigned int Text2DTextureID;
 unsigned int Text2DVertexBufferID;
-unsigned int Text2DUVBufferID;
+unsigned int Text2DVertexArrayID;
 unsigned int Text2DShaderID;
 unsigned int Text2DUniformID;
+unsigned int Text2DScreenSizeID;
+
+static bool persistent;
+static GLuint *glyphs;      // Mapped buffer, or the copy uploaded by drawText2D
+static GLuint glyphCopy[TEXT2D_MAX_GLYPHS * 2];
+static unsigned int glyphCount;
+static int segment;
+static GLsync fences[TEXT2D_SEGMENTS];
+
+// Character cells of 8x8 texels in a 16x16 grid, coverage in the red channel
+static GLuint createBuiltinFont() {
+	static unsigned char texels[128 * 128];
+	memset(texels, 0, sizeof(texels));
+	for (int c = 32; c < 128; ++c) {
+		int glyph = (c >= 'a' && c <= 'z') ? c - 'a' + 'A' : c;
+		if (glyph >= 96) continue;
+		for (int row = 0; row < 7; ++row) {
+			for (int column = 0; column < 5; ++column) {
+				if (builtinFont[glyph - 32][row] & (0x10 >> column)) {
+					texels[((c / 16) * 8 + row) * 128 + (c % 16) * 8 + column + 1] = 255;
+				}
+			}
+		}
+	}
+
+	GLuint textureID;
+	glGenTextures(1, &textureID);
+	glBindTexture(GL_TEXTURE_2D, textureID);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_R8, 128, 128, 0, GL_RED, GL_UNSIGNED_BYTE, texels);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+	// White glyphs, the coverage is the alpha
+	GLint swizzle[4] = { GL_ONE, GL_ONE, GL_ONE, GL_RED };
+	glTexParameteriv(GL_TEXTURE_2D, GL_TEXTURE_SWIZZLE_RGBA, swizzle);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
+	return textureID;
+}
 
 void initText2D(const char * texturePath){
 
 	// Initialize texture
-	Text2DTextureID = loadDDS(texturePath);
+	Text2DTextureID = texturePath ? loadDDS(texturePath) : createBuiltinFont();
+	MemoryTracker::trackTexture(Text2DTextureID, MemoryTracker::textureSize(Text2DTextureID), MEMORY_TEXTURE, texturePath ? texturePath : "built-in font");
+
+	// Initialize VBO, in its own VAO for the instanced attribute
+	GLint previousVertexArray;
+	glGetIntegerv(GL_VERTEX_ARRAY_BINDING, &previousVertexArray);
+	glGenVertexArrays(1, &Text2DVertexArrayID);
+	glBindVertexArray(Text2DVertexArrayID);
 
-	// Initialize VBO
 	glGenBuffers(1, &Text2DVertexBufferID);
-	glGenBuffers(1, &Text2DUVBufferID);
+	glBindBuffer(GL_ARRAY_BUFFER, Text2DVertexBufferID);
+	GLsizeiptr size = TEXT2D_MAX_GLYPHS * 2 * sizeof(GLuint) * TEXT2D_SEGMENTS;
+	persistent = GLEW_VERSION_4_4 || GLEW_ARB_buffer_storage;
+	if (persistent) {
+		GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+		glBufferStorage(GL_ARRAY_BUFFER, size, NULL, flags);
+		glyphs = (GLuint*)glMapBufferRange(GL_ARRAY_BUFFER, 0, size, flags);
+	}
+	else {
+		glBufferData(GL_ARRAY_BUFFER, size, NULL, GL_STREAM_DRAW);
+		glyphs = glyphCopy;
+	}
+	MemoryTracker::trackBuffer(Text2DVertexBufferID, size, MEMORY_DYNAMIC, "text");
+	glEnableVertexAttribArray(0);
+	glVertexAttribDivisor(0, 1);
+	glBindVertexArray(previousVertexArray);
+
+	glyphCount = 0;
+	segment = 0;
+	memset(fences, 0, sizeof(fences));
 
 	// Initialize Shader
 	Text2DShaderID = LoadShaders( "TextVertexShader.vertexshader", "TextVertexShader.fragmentshader" );
 
 	// Initialize uniforms' IDs
 	Text2DUniformID = glGetUniformLocation( Text2DShaderID, "myTextureSampler" );
+	Text2DScreenSizeID = glGetUniformLocation( Text2DShaderID, "screenSize" );
 
 }
 
-void printText2D(const char * text, int x, int y, int size){
-
-	unsigned int length = strlen(text);
-
-	// Fill buffers
-	std::vector<glm::vec2> vertices;
-	std::vector<glm::vec2> UVs;
-	for ( unsigned int i=0 ; i<length ; i++ ){
-		
-		glm::vec2 vertex_up_left    = glm::vec2( x+i*size     , y+size );
-		glm::vec2 vertex_up_right   = glm::vec2( x+i*size+size, y+size );
-		glm::vec2 vertex_down_right = glm::vec2( x+i*size+size, y      );
-		glm::vec2 vertex_down_left  = glm::vec2( x+i*size     , y      );
-
-		vertices.push_back(vertex_up_left   );
-		vertices.push_back(vertex_down_left );
-		vertices.push_back(vertex_up_right  );
-
-		vertices.push_back(vertex_down_right);
-		vertices.push_back(vertex_up_right);
-		vertices.push_back(vertex_down_left);
-
-		char character = text[i];
-		float uv_x = (character%16)/16.0f;
-		float uv_y = (character/16)/16.0f;
-
-		glm::vec2 uv_up_left    = glm::vec2( uv_x           , uv_y );
-		glm::vec2 uv_up_right   = glm::vec2( uv_x+1.0f/16.0f, uv_y );
-		glm::vec2 uv_down_right = glm::vec2( uv_x+1.0f/16.0f, (uv_y + 1.0f/16.0f) );
-		glm::vec2 uv_down_left  = glm::vec2( uv_x           , (uv_y + 1.0f/16.0f) );
-		UVs.push_back(uv_up_left   );
-		UVs.push_back(uv_down_left );
-		UVs.push_back(uv_up_right  );
-
-		UVs.push_back(uv_down_right);
-		UVs.push_back(uv_up_right);
-		UVs.push_back(uv_down_left);
+void printText2D(const char * text, int x, int y, int size, unsigned int color){
+
+	// The GPU may still read this segment, from TEXT2D_SEGMENTS frames ago
+	if (glyphCount == 0 && persistent && fences[segment]) {
+		// Only flush the commands of this frame if the fence is not signaled yet, it almost always is
+		if (glClientWaitSync(fences[segment], 0, 0) == GL_TIMEOUT_EXPIRED) {
+			glClientWaitSync(fences[segment], GL_SYNC_FLUSH_COMMANDS_BIT, GL_TIMEOUT_IGNORED);
+		}
+		glDeleteSync(fences[segment]);
+		fences[segment] = 0;
 	}
+
+	// RGB 565
+	unsigned int packedColor = ((color >> 8) & 0xf800) | ((color >> 5) & 0x07e0) | ((color >> 3) & 0x001f);
+	GLuint *output = glyphs + (persistent ? segment * TEXT2D_MAX_GLYPHS * 2 : 0);
+
+	for (const char *character = text; *character && glyphCount < TEXT2D_MAX_GLYPHS; ++character, x += size) {
+		if (*character == ' ' || x < 0 || y < 0 || x > 0xffff || y > 0xffff) continue;
+		output[glyphCount * 2] = (GLuint)x | ((GLuint)y << 16);
+		output[glyphCount * 2 + 1] = (GLuint)(unsigned char)*character | ((GLuint)(size & 0xff) << 8) | (packedColor << 16);
+		glyphCount++;
+	}
+}
+
+void drawText2D(int width, int height){
+
+	if (glyphCount == 0) return;
+
+	GLint previousVertexArray;
+	glGetIntegerv(GL_VERTEX_ARRAY_BINDING, &previousVertexArray);
+	glBindVertexArray(Text2DVertexArrayID);
+
+	// Glyphs of this frame
 	glBindBuffer(GL_ARRAY_BUFFER, Text2DVertexBufferID);
-	glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(glm::vec2), &vertices[0], GL_STATIC_DRAW);
-	glBindBuffer(GL_ARRAY_BUFFER, Text2DUVBufferID);
-	glBufferData(GL_ARRAY_BUFFER, UVs.size() * sizeof(glm::vec2), &UVs[0], GL_STATIC_DRAW);
+	GLsizeiptr offset = 0;
+	if (persistent) {
+		offset = segment * TEXT2D_MAX_GLYPHS * 2 * sizeof(GLuint);
+	}
+	else {
+		glBufferData(GL_ARRAY_BUFFER, TEXT2D_MAX_GLYPHS * 2 * sizeof(GLuint) * TEXT2D_SEGMENTS, NULL, GL_STREAM_DRAW);
+		glBufferSubData(GL_ARRAY_BUFFER, 0, glyphCount * 2 * sizeof(GLuint), glyphCopy);
+	}
+	glVertexAttribIPointer(0, 2, GL_UNSIGNED_INT, 0, (void*)offset);
 
 	// Bind shader
 	glUseProgram(Text2DShaderID);
+	glUniform2f(Text2DScreenSizeID, (float)width, (float)height);
 
 	// Bind texture
 	glActiveTexture(GL_TEXTURE0);
@@ -87,36 +230,45 @@ void printText2D(const char * text, int x, int y, int size){
 	// Set our "myTextureSampler" sampler to user Texture Unit 0
 	glUniform1i(Text2DUniformID, 0);
 
-	// 1rst attribute buffer : vertices
-	glEnableVertexAttribArray(0);
-	glBindBuffer(GL_ARRAY_BUFFER, Text2DVertexBufferID);
-	glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, (void*)0 );
-
-	// 2nd attribute buffer : UVs
-	glEnableVertexAttribArray(1);
-	glBindBuffer(GL_ARRAY_BUFFER, Text2DUVBufferID);
-	glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 0, (void*)0 );
-
+	// Over everything
+	GLboolean depthTest = glIsEnabled(GL_DEPTH_TEST);
+	glDisable(GL_DEPTH_TEST);
 	glEnable(GL_BLEND);
 	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 
-	// Draw call
-	glDrawArrays(GL_TRIANGLES, 0, vertices.size() );
+	// Draw call, one quad per glyph
+	glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, glyphCount);
 
 	glDisable(GL_BLEND);
+	if (depthTest) glEnable(GL_DEPTH_TEST);
+
+	if (persistent) {
+		fences[segment] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+		segment = (segment + 1) % TEXT2D_SEGMENTS;
+	}
+	glyphCount = 0;
 
-	glDisableVertexAttribArray(0);
-	glDisableVertexAttribArray(1);
+	glBindVertexArray(previousVertexArray);
 
 }
 
 void cleanupText2D(){
 
+	for (int i = 0; i < TEXT2D_SEGMENTS; ++i) {
+		if (fences[i]) glDeleteSync(fences[i]);
+	}
+
 	// Delete buffers
+	if (persistent) {
+		glBindBuffer(GL_ARRAY_BUFFER, Text2DVertexBufferID);
+		glUnmapBuffer(GL_ARRAY_BUFFER);
+	}
+	MemoryTracker::releaseBuffer(Text2DVertexBufferID);
 	glDeleteBuffers(1, &Text2DVertexBufferID);
-	glDeleteBuffers(1, &Text2DUVBufferID);
+	glDeleteVertexArrays(1, &Text2DVertexArrayID);
 
 	// Delete texture
+	MemoryTracker::releaseTexture(Text2DTextureID);
 	glDeleteTextures(1, &Text2DTextureID);
 
 	// Delete shader
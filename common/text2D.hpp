@@ -1,8 +1,12 @@
 #ifndef TEXT2D_HPP
 #define TEXT2D_HPP
 
+// NULL for the built-in font, or a DDS of 16x16 characters
 void initText2D(const char * texturePath);
-void printText2D(const char * text, int x, int y, int size);
+// Queue a string, x and y are the bottom left corner in pixels and color is 0xRRGGBB
+void printText2D(const char * text, int x, int y, int size, unsigned int color = 0xffffff);
+// Draw the strings queued since the last call in one draw call
+void drawText2D(int width, int height);
 void cleanupText2D();
 
 #endif
\ No newline at end of file
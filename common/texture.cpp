@@ -6,84 +6,66 @@
 
 #include <GLFW/glfw3.h>
 
+#include "errorpause.hpp"
+#include "texture.hpp"
 
-GLuint loadBMP_custom(const char * imagepath){
-
-	printf("Reading image %s\n", imagepath);
-
-	// Data read from the header of the BMP file
-	unsigned char header[54];
-	unsigned int dataPos;
-	unsigned int imageSize;
-	unsigned int width, height;
-	// Actual RGB data
-	unsigned char * data;
-
-	// Open the file
-	FILE * file = fopen(imagepath,"rb");
-	if (!file)							    {printf("%s could not be opened. Are you in the right directory ? Don't forget to read the FAQ !\n", imagepath); getchar(); return 0;}
-
-	// Read the header, i.e. the 54 first bytes
+bool parseBMPHeader(const unsigned char * header, size_t size, TextureData & texture){
 
 	// If less than 54 bytes are read, problem
-	if ( fread(header, 1, 54, file)!=54 ){ 
-		printf("Not a correct BMP file\n");
-		return 0;
-	}
+	if ( size < BMP_HEADER_SIZE ) return false;
 	// A BMP files always begins with "BM"
-	if ( header[0]!='B' || header[1]!='M' ){
-		printf("Not a correct BMP file\n");
-		return 0;
-	}
+	if ( header[0]!='B' || header[1]!='M' ) return false;
 	// Make sure this is a 24bpp file
-	if ( *(int*)&(header[0x1E])!=0  )         {printf("Not a correct BMP file\n");    return 0;}
-	if ( *(int*)&(header[0x1C])!=24 )         {printf("Not a correct BMP file\n");    return 0;}
+	if ( *(int*)&(header[0x1E])!=0  ) return false;
+	if ( *(int*)&(header[0x1C])!=24 ) return false;
 
 	// Read the information about the image
-	dataPos    = *(int*)&(header[0x0A]);
-	imageSize  = *(int*)&(header[0x22]);
-	width      = *(int*)&(header[0x12]);
-	height     = *(int*)&(header[0x16]);
+	texture.dataOffset = *(int*)&(header[0x0A]);
+	texture.dataSize   = *(int*)&(header[0x22]);
+	texture.width      = *(int*)&(header[0x12]);
+	texture.height     = *(int*)&(header[0x16]);
+	texture.mipMapCount = 1;
+	texture.format     = GL_BGR;
+	texture.compressed = false;
 
 	// Some BMP files are misformatted, guess missing information
-	if (imageSize==0)    imageSize=width*height*3; // 3 : one byte for each Red, Green and Blue component
-	if (dataPos==0)      dataPos=54; // The BMP header is done that way
+	if (texture.dataSize==0)    texture.dataSize=texture.width*texture.height*3; // 3 : one byte for each Red, Green and Blue component
+	if (texture.dataOffset==0)  texture.dataOffset=BMP_HEADER_SIZE; // The BMP header is done that way
+	return true;
+}
+
+bool readBMP(const char * imagepath, TextureData & texture){
 
-	// Create a buffer
-	data = new unsigned char [imageSize];
+	// Open the file
+	FILE * file = fopen(imagepath,"rb");
+	if (!file)							    {printf("%s could not be opened. Are you in the right directory ? Don't forget to read the FAQ !\n", imagepath); pauseOnError(); return false;}
+
+	// Read the header, i.e. the 54 first bytes
+	unsigned char header[BMP_HEADER_SIZE];
+	size_t headerSize = fread(header, 1, BMP_HEADER_SIZE, file);
+	if ( !parseBMPHeader(header, headerSize, texture) ){
+		printf("Not a correct BMP file\n");
+		fclose(file);
+		return false;
+	}
 
 	// Read the actual data from the file into the buffer
-	fread(data,1,imageSize,file);
+	texture.pixels.resize(texture.dataSize);
+	fseek(file, texture.dataOffset, SEEK_SET);
+	if (!texture.pixels.empty()) texture.pixels.resize(fread(&texture.pixels[0], 1, texture.dataSize, file));
 
 	// Everything is in memory now, the file wan be closed
 	fclose (file);
+	return true;
+}
 
-	// Create one OpenGL texture
-	GLuint textureID;
-	glGenTextures(1, &textureID);
-	
-	// "Bind" the newly created texture : all future texture functions will modify this texture
-	glBindTexture(GL_TEXTURE_2D, textureID);
-
-	// Give the image to OpenGL
-	glTexImage2D(GL_TEXTURE_2D, 0,GL_RGB, width, height, 0, GL_BGR, GL_UNSIGNED_BYTE, data);
-
-	// OpenGL has now copied the data. Free our own version
-	delete [] data;
-
-	// Poor filtering, or ...
-	//glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-	//glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST); 
+GLuint loadBMP_custom(const char * imagepath){
 
-	// ... nice trilinear filtering.
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR); 
-	glGenerateMipmap(GL_TEXTURE_2D);
+	printf("Reading image %s\n", imagepath);
 
-	// Return the ID of the texture we just created
-	return textureID;
+	TextureData texture;
+	if (!readBMP(imagepath, texture)) return 0;
+	return createTexture(texture);
 }
 
 // Since GLFW 3, glfwLoadTexture2D() has been removed. You have to use another texture loading library, 
@@ -117,63 +99,76 @@ GLuint loadBMP_custom(const char * imagepath){
 #define FOURCC_DXT3 0x33545844 // Equivalent to "DXT3" in ASCII
 #define FOURCC_DXT5 0x35545844 // Equivalent to "DXT5" in ASCII
 
-GLuint loadDDS(const char * imagepath){
+bool parseDDSHeader(const unsigned char * header, size_t size, TextureData & texture){
 
-	unsigned char header[124];
-
-	FILE *fp; 
- 
-	/* try to open the file */ 
-	fp = fopen(imagepath, "rb"); 
-	if (fp == NULL){
-		printf("%s could not be opened. Are you in the right directory ? Don't forget to read the FAQ !\n", imagepath); getchar(); 
-		return 0;
-	}
-   
 	/* verify the type of file */ 
-	char filecode[4]; 
-	fread(filecode, 1, 4, fp); 
-	if (strncmp(filecode, "DDS ", 4) != 0) { 
-		fclose(fp); 
-		return 0; 
-	}
-	
-	/* get the surface desc */ 
-	fread(&header, 124, 1, fp); 
-
-	unsigned int height      = *(unsigned int*)&(header[8 ]);
-	unsigned int width	     = *(unsigned int*)&(header[12]);
-	unsigned int linearSize	 = *(unsigned int*)&(header[16]);
-	unsigned int mipMapCount = *(unsigned int*)&(header[24]);
-	unsigned int fourCC      = *(unsigned int*)&(header[80]);
-
- 
-	unsigned char * buffer;
-	unsigned int bufsize;
-	/* how big is it going to be including all mipmaps? */ 
-	bufsize = mipMapCount > 1 ? linearSize * 2 : linearSize; 
-	buffer = (unsigned char*)malloc(bufsize * sizeof(unsigned char)); 
-	fread(buffer, 1, bufsize, fp); 
-	/* close the file pointer */ 
-	fclose(fp);
+	if (size < DDS_HEADER_SIZE || strncmp((const char*)header, "DDS ", 4) != 0) return false;
+
+	/* get the surface desc, after the file code */ 
+	const unsigned char * desc = header + 4;
+	texture.height      = *(unsigned int*)&(desc[8 ]);
+	texture.width       = *(unsigned int*)&(desc[12]);
+	unsigned int linearSize  = *(unsigned int*)&(desc[16]);
+	texture.mipMapCount = *(unsigned int*)&(desc[24]);
+	unsigned int fourCC      = *(unsigned int*)&(desc[80]);
 
-	unsigned int components  = (fourCC == FOURCC_DXT1) ? 3 : 4; 
-	unsigned int format;
 	switch(fourCC) 
 	{ 
 	case FOURCC_DXT1: 
-		format = GL_COMPRESSED_RGBA_S3TC_DXT1_EXT; 
+		texture.format = GL_COMPRESSED_RGBA_S3TC_DXT1_EXT; 
 		break; 
 	case FOURCC_DXT3: 
-		format = GL_COMPRESSED_RGBA_S3TC_DXT3_EXT; 
+		texture.format = GL_COMPRESSED_RGBA_S3TC_DXT3_EXT; 
 		break; 
 	case FOURCC_DXT5: 
-		format = GL_COMPRESSED_RGBA_S3TC_DXT5_EXT; 
+		texture.format = GL_COMPRESSED_RGBA_S3TC_DXT5_EXT; 
 		break; 
 	default: 
-		free(buffer); 
-		return 0; 
+		return false; 
 	}
+	texture.compressed = true;
+
+	/* how big is it going to be including all mipmaps? */ 
+	texture.dataOffset = DDS_HEADER_SIZE;
+	texture.dataSize = texture.mipMapCount > 1 ? linearSize * 2 : linearSize; 
+	return true;
+}
+
+bool readDDS(const char * imagepath, TextureData & texture){
+
+	/* try to open the file */ 
+	FILE *fp = fopen(imagepath, "rb"); 
+	if (fp == NULL){
+		printf("%s could not be opened. Are you in the right directory ? Don't forget to read the FAQ !\n", imagepath); pauseOnError(); 
+		return false;
+	}
+
+	unsigned char header[DDS_HEADER_SIZE];
+	size_t headerSize = fread(header, 1, DDS_HEADER_SIZE, fp);
+	if (!parseDDSHeader(header, headerSize, texture)) {
+		fclose(fp);
+		return false;
+	}
+
+	texture.pixels.resize(texture.dataSize);
+	if (!texture.pixels.empty()) texture.pixels.resize(fread(&texture.pixels[0], 1, texture.dataSize, fp));
+	/* close the file pointer */ 
+	fclose(fp);
+	return true;
+}
+
+GLuint loadDDS(const char * imagepath){
+
+	TextureData texture;
+	if (!readDDS(imagepath, texture)) return 0;
+	GLuint textureID = createTexture(texture);
+
+	printf("Texture loaded!");
+
+	return textureID;
+}
+
+GLuint createTexture(const TextureData & texture){
 
 	// Create one OpenGL texture
 	GLuint textureID;
@@ -181,17 +176,40 @@ GLuint loadDDS(const char * imagepath){
 
 	// "Bind" the newly created texture : all future texture functions will modify this texture
 	glBindTexture(GL_TEXTURE_2D, textureID);
+
+	if (!texture.compressed) {
+		// Give the image to OpenGL
+		glTexImage2D(GL_TEXTURE_2D, 0,GL_RGB, texture.width, texture.height, 0, texture.format, GL_UNSIGNED_BYTE, texture.pixels.empty() ? NULL : &texture.pixels[0]);
+
+		// Poor filtering, or ...
+		//glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		//glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST); 
+
+		// ... nice trilinear filtering.
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR); 
+		glGenerateMipmap(GL_TEXTURE_2D);
+
+		// Return the ID of the texture we just created
+		return textureID;
+	}
+
 	glPixelStorei(GL_UNPACK_ALIGNMENT,1);	
 	
-	unsigned int blockSize = (format == GL_COMPRESSED_RGBA_S3TC_DXT1_EXT) ? 8 : 16; 
+	unsigned int blockSize = (texture.format == GL_COMPRESSED_RGBA_S3TC_DXT1_EXT) ? 8 : 16; 
 	unsigned int offset = 0;
+	unsigned int width = texture.width, height = texture.height;
 
 	/* load the mipmaps */ 
-	for (unsigned int level = 0; level < mipMapCount && (width || height); ++level) 
+	for (unsigned int level = 0; level < texture.mipMapCount && (width || height); ++level) 
 	{ 
 		unsigned int size = ((width+3)/4)*((height+3)/4)*blockSize; 
-		glCompressedTexImage2D(GL_TEXTURE_2D, level, format, width, height,  
-			0, size, buffer + offset); 
+		// A truncated file, the last levels are missing
+		if (offset + size > texture.pixels.size()) break;
+		glCompressedTexImage2D(GL_TEXTURE_2D, level, texture.format, width, height,  
+			0, size, &texture.pixels[offset]); 
 	 
 		offset += size; 
 		width  /= 2; 
@@ -203,9 +221,5 @@ GLuint loadDDS(const char * imagepath){
 
 	} 
 
-	free(buffer); 
-
-	printf("Texture loaded!");
-
 	return textureID;
 }
\ No newline at end of file
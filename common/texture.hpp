@@ -1,6 +1,33 @@
 #ifndef TEXTURE_HPP
 #define TEXTURE_HPP
 
+#include <vector>
+
+#define BMP_HEADER_SIZE 54
+#define DDS_HEADER_SIZE 128 // File code and surface description
+
+// CPU side of the loaders, no GL call so any thread can read and parse a file.
+// The pixels of every mipmap follow each other.
+struct TextureData {
+	unsigned int width, height, mipMapCount;
+	unsigned int format;     // GL_BGR, or the S3TC format of a DDS
+	bool compressed;
+	unsigned int dataOffset; // Where the pixels start in the file
+	unsigned int dataSize;   // Bytes of pixels announced by the header
+	std::vector<unsigned char> pixels;
+};
+
+// Check the first bytes of a file and fill the fields of texture, the pixels are left alone
+bool parseBMPHeader(const unsigned char * header, size_t size, TextureData & texture);
+bool parseDDSHeader(const unsigned char * header, size_t size, TextureData & texture);
+
+// Read a whole file, false if it cannot be opened or is not supported
+bool readBMP(const char * imagepath, TextureData & texture);
+bool readDDS(const char * imagepath, TextureData & texture);
+
+// GL texture of the data, on the thread that owns the context
+GLuint createTexture(const TextureData & texture);
+
 // Load a .BMP file using our custom loader
 GLuint loadBMP_custom(const char * imagepath);
 
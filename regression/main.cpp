@@ -0,0 +1,292 @@
+// Performance regression gate : the headless flythrough of the game on generated scenes of growing
+// size, the frame time distribution of each one compared to a stored baseline.
+// regression [--directory ../snowscape/] [--snowscape ../Release/snowscape.exe] [--baseline ../regression/baseline/]
+//            [--output ../regression/results/] [--scenes 1000,10000,100000,1000000] [--scene-models 64]
+//            [--frames 600] [--warmup 60] [--threshold 5] [--confidence 0.99] [--update-baseline]
+// The game runs from --directory, where its models and shaders are, and every other path is relative to it.
+// A scene fails when its p95 frame time is more than --threshold percent over the baseline with the given
+// confidence. Exit code 0 when every scene passed, 1 when one regressed, 2 when one could not be measured.
+// The baseline belongs to the machine it was recorded on, --update-baseline records a new one.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <random>
+
+#ifdef _WIN32
+#include <direct.h>
+#define chdir _chdir
+#define makeDirectory(path) _mkdir(path)
+#else
+#include <unistd.h>
+#include <sys/stat.h>
+#define makeDirectory(path) mkdir(path, 0755)
+#endif
+
+// Command line
+static std::string directory = "../snowscape/";
+#ifdef _WIN32
+static std::string snowscape = "..\\Release\\snowscape.exe";
+#else
+static std::string snowscape = "./snowscape";
+#endif
+static std::string baselineDirectory = "../regression/baseline/";
+static std::string outputDirectory = "../regression/results/";
+static std::vector<unsigned int> scenes;
+static unsigned int sceneModels = 64;
+static int frames = 600;
+static int warmup = 60;
+static double threshold = 5.0;  // Percent
+static double confidence = 0.99;
+static bool updateBaseline = false;
+
+// Resamples of the bootstrap, with a fixed seed the verdict does not change from one run of the gate to the next
+static const int BOOTSTRAP_SAMPLES = 2000;
+static const unsigned int BOOTSTRAP_SEED = 1;
+
+static std::string withSlash(std::string path) {
+	if (!path.empty() && path.back() != '/' && path.back() != '\\') path += '/';
+	return path;
+}
+
+// mkdir does not take the trailing slash everywhere
+static void createDirectory(std::string path) {
+	while (!path.empty() && (path.back() == '/' || path.back() == '\\')) path.pop_back();
+	makeDirectory(path.c_str());
+}
+
+static std::string sceneFile(const std::string &dir, unsigned int scene, const char *extension) {
+	char name[64];
+	sprintf(name, "scene_%u.%s", scene, extension);
+	return dir + name;
+}
+
+// Column frame_ms of a CSV written by the headless run, without the warm up frames. Empty if unreadable
+static std::vector<double> readFrameTimes(const std::string &path) {
+	std::vector<double> times;
+	FILE *file = fopen(path.c_str(), "r");
+	if (!file) return times;
+
+	char line[1024];
+	int column = -1;
+	if (fgets(line, sizeof(line), file)) {
+		int index = 0;
+		for (char *field = strtok(line, ",\r\n"); field; field = strtok(NULL, ",\r\n"), ++index) {
+			if (!strcmp(field, "frame_ms")) column = index;
+		}
+	}
+	int row = 0;
+	while (column >= 0 && fgets(line, sizeof(line), file)) {
+		int index = 0;
+		for (char *field = strtok(line, ",\r\n"); field; field = strtok(NULL, ",\r\n"), ++index) {
+			if (index == column) {
+				if (row >= warmup) times.push_back(atof(field));
+				break;
+			}
+		}
+		row++;
+	}
+	fclose(file);
+	return times;
+}
+
+static bool copyFile(const std::string &from, const std::string &to) {
+	FILE *in = fopen(from.c_str(), "rb");
+	if (!in) return false;
+	FILE *out = fopen(to.c_str(), "wb");
+	if (!out) {
+		fclose(in);
+		return false;
+	}
+	char buffer[65536];
+	size_t read;
+	while ((read = fread(buffer, 1, sizeof(buffer), in)) > 0) fwrite(buffer, 1, read, out);
+	fclose(in);
+	fclose(out);
+	return true;
+}
+
+// Value of rank p, p in [0, 1], same rank as FrameStats. Reorders times
+static double percentile(std::vector<double> &times, double p) {
+	size_t rank = std::min((size_t)(p * (times.size() - 1) + 0.5), times.size() - 1);
+	std::nth_element(times.begin(), times.begin() + rank, times.end());
+	return times[rank];
+}
+
+// Moving block bootstrap of the p95. The camera path makes consecutive frames alike, blocks of
+// about sqrt(n) frames keep that correlation where resampling single frames would hide it and
+// give a confidence interval much too narrow.
+static void resample(const std::vector<double> &times, std::mt19937 &random, std::vector<double> &out) {
+	size_t n = times.size();
+	size_t block = std::max((size_t)sqrt((double)n), (size_t)1);
+	out.clear();
+	while (out.size() < n) {
+		size_t start = random() % (n - block + 1);
+		for (size_t i = start; i < start + block && out.size() < n; ++i) out.push_back(times[i]);
+	}
+}
+
+struct Comparison {
+	double baseP50, p50, baseP95, p95;
+	double change;           // Percent of the baseline p95
+	double lowBound, highBound; // Percent, the change is inside with the requested confidence
+};
+
+static Comparison compare(std::vector<double> baseline, std::vector<double> current) {
+	Comparison result;
+	result.baseP50 = percentile(baseline, 0.5);
+	result.p50 = percentile(current, 0.5);
+	result.baseP95 = percentile(baseline, 0.95);
+	result.p95 = percentile(current, 0.95);
+	result.change = (result.p95 / result.baseP95 - 1.0) * 100.0;
+
+	std::mt19937 random(BOOTSTRAP_SEED);
+	std::vector<double> changes(BOOTSTRAP_SAMPLES), baseSample, sample;
+	for (int b = 0; b < BOOTSTRAP_SAMPLES; ++b) {
+		resample(baseline, random, baseSample);
+		resample(current, random, sample);
+		changes[b] = (percentile(sample, 0.95) / percentile(baseSample, 0.95) - 1.0) * 100.0;
+	}
+	// One sided bounds, each of them is wrong with probability 1 - confidence
+	result.lowBound = percentile(changes, 1.0 - confidence);
+	result.highBound = percentile(changes, confidence);
+	return result;
+}
+
+// Headless run of one scene, its frame times written to the output directory. False if the game failed.
+// Only the generated objects, the terrain and the snow stay off whatever their defaults
+static bool runScene(unsigned int scene) {
+	char arguments[256];
+	sprintf(arguments, " --headless --no-hud --no-terrain --snow 0 --seed 1 --frames %d --scene %u --scene-models %u --csv ", frames, scene, sceneModels);
+	std::string command = snowscape + arguments + sceneFile(outputDirectory, scene, "csv") + " > " + sceneFile(outputDirectory, scene, "log");
+	printf("%s\n", command.c_str());
+	fflush(stdout);
+	return system(command.c_str()) == 0;
+}
+
+static void parseScenes(const char *list) {
+	scenes.clear();
+	std::string copy = list;
+	for (char *item = strtok(&copy[0], ","); item; item = strtok(NULL, ",")) {
+		unsigned int scene = (unsigned int)strtoul(item, NULL, 10);
+		if (scene > 0) scenes.push_back(scene);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	parseScenes("1000,10000,100000,1000000");
+	for (int i = 1; i < argc; ++i) {
+		if (!strcmp(argv[i], "--directory") && i + 1 < argc) {
+			directory = withSlash(argv[++i]);
+		}
+		else if (!strcmp(argv[i], "--snowscape") && i + 1 < argc) {
+			snowscape = argv[++i];
+		}
+		else if (!strcmp(argv[i], "--baseline") && i + 1 < argc) {
+			baselineDirectory = withSlash(argv[++i]);
+		}
+		else if (!strcmp(argv[i], "--output") && i + 1 < argc) {
+			outputDirectory = withSlash(argv[++i]);
+		}
+		else if (!strcmp(argv[i], "--scenes") && i + 1 < argc) {
+			parseScenes(argv[++i]);
+		}
+		else if (!strcmp(argv[i], "--scene-models") && i + 1 < argc) {
+			sceneModels = (unsigned int)strtoul(argv[++i], NULL, 10);
+		}
+		else if (!strcmp(argv[i], "--frames") && i + 1 < argc) {
+			frames = std::max(atoi(argv[++i]), 1);
+		}
+		else if (!strcmp(argv[i], "--warmup") && i + 1 < argc) {
+			warmup = std::max(atoi(argv[++i]), 0);
+		}
+		else if (!strcmp(argv[i], "--threshold") && i + 1 < argc) {
+			threshold = atof(argv[++i]);
+		}
+		else if (!strcmp(argv[i], "--confidence") && i + 1 < argc) {
+			confidence = std::min(std::max(atof(argv[++i]), 0.5), 0.9999);
+		}
+		else if (!strcmp(argv[i], "--update-baseline")) {
+			updateBaseline = true;
+		}
+	}
+
+	if (chdir(directory.c_str()) != 0) {
+		fprintf(stderr, "%s could not be entered\n", directory.c_str());
+		return 2;
+	}
+	createDirectory(outputDirectory);
+	if (updateBaseline) createDirectory(baselineDirectory);
+
+	FILE *summary = fopen((outputDirectory + "summary.csv").c_str(), "w");
+	if (summary) fprintf(summary, "scene,frames,base_p50_ms,p50_ms,base_p95_ms,p95_ms,p95_change_percent,low_bound_percent,high_bound_percent,result\n");
+
+	struct Row {
+		unsigned int scene;
+		int frames;
+		Comparison comparison;
+		const char *result;
+	};
+	std::vector<Row> rows;
+	int exitCode = 0;
+	for (size_t s = 0; s < scenes.size(); ++s) {
+		Row row;
+		row.scene = scenes[s];
+		row.frames = 0;
+		memset(&row.comparison, 0, sizeof(row.comparison));
+
+		std::vector<double> current;
+		if (runScene(row.scene)) current = readFrameTimes(sceneFile(outputDirectory, row.scene, "csv"));
+		std::vector<double> baseline = readFrameTimes(sceneFile(baselineDirectory, row.scene, "csv"));
+		row.frames = (int)current.size();
+
+		if (current.empty()) {
+			row.result = "failed";
+			exitCode = std::max(exitCode, 2);
+		}
+		else if (updateBaseline) {
+			copyFile(sceneFile(outputDirectory, row.scene, "csv"), sceneFile(baselineDirectory, row.scene, "csv"));
+			if (!baseline.empty()) row.comparison = compare(baseline, current);
+			row.result = "recorded";
+		}
+		else if (baseline.empty()) {
+			row.result = "no baseline";
+			exitCode = std::max(exitCode, 2);
+		}
+		else {
+			row.comparison = compare(baseline, current);
+			// Only a change the noise cannot explain, both ways
+			if (row.comparison.lowBound > threshold) {
+				row.result = "REGRESSED";
+				exitCode = std::max(exitCode, 1);
+			}
+			else if (row.comparison.highBound < -threshold) {
+				row.result = "improved";
+			}
+			else {
+				row.result = "ok";
+			}
+		}
+		rows.push_back(row);
+
+		const Comparison &c = row.comparison;
+		if (summary) fprintf(summary, "%u,%d,%f,%f,%f,%f,%f,%f,%f,%s\n", row.scene, row.frames, c.baseP50, c.p50, c.baseP95, c.p95,
+			c.change, c.lowBound, c.highBound, row.result);
+	}
+	if (summary) fclose(summary);
+
+	printf("\np95 threshold %.1f%%, %.1f%% confidence, %d frames after %d of warm up\n", threshold, confidence * 100.0, frames - warmup, warmup);
+	printf("%10s %7s %12s %12s %12s %12s %9s %22s  %s\n", "scene", "frames", "base p50 ms", "p50 ms", "base p95 ms", "p95 ms", "p95", "interval", "result");
+	for (size_t r = 0; r < rows.size(); ++r) {
+		const Comparison &c = rows[r].comparison;
+		printf("%10u %7d %12.3f %12.3f %12.3f %12.3f %+8.1f%% [%+8.1f%%, %+8.1f%%]  %s\n", rows[r].scene, rows[r].frames, c.baseP50, c.p50, c.baseP95, c.p95,
+			c.change, c.lowBound, c.highBound, rows[r].result);
+	}
+	if (updateBaseline) printf("Baseline written to %s\n", baselineDirectory.c_str());
+
+	return exitCode;
+}
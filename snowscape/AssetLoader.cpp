@@ -0,0 +1,126 @@
+#include "AssetLoader.h"
+#include "Profiler.h"
+#include "memorytracker.hpp"
+
+#include <stdio.h>
+#include <algorithm>
+#include <chrono>
+
+bool AssetLoader::contains(const std::string &path) const {
+	for (size_t i = 0; i < assets.size(); ++i) {
+		if (assets[i].path == path) return true;
+	}
+	return false;
+}
+
+void AssetLoader::addModel(const char *path) {
+	if (Obj3D::modelCache.count(path) || contains(path)) return;
+
+	Asset asset;
+	asset.path = path;
+	asset.isTexture = asset.streamed = false;
+	asset.model = NULL;
+	asset.textureRead = false;
+	asset.parseTime = asset.uploadTime = 0.0;
+	asset.thread = 0;
+	assets.push_back(asset);
+}
+
+void AssetLoader::addTexture(const char *path, bool streamed) {
+	if (Obj3D::textureCache.count(path) || contains(path)) return;
+
+	Asset asset;
+	asset.path = path;
+	asset.isTexture = true;
+	asset.streamed = streamed && streamer;
+	asset.model = NULL;
+	asset.textureRead = false;
+	asset.parseTime = asset.uploadTime = 0.0;
+	asset.thread = 0;
+	assets.push_back(asset);
+}
+
+void AssetLoader::parse(Asset &asset) {
+	std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+	asset.thread = JobSystem::threadIndex();
+
+	if (!asset.isTexture) {
+		asset.model = Obj3D::loadModel(asset.path.c_str());
+	}
+	else {
+		PROFILE_SCOPE("Read texture");
+		size_t length = asset.path.size();
+		bool bmp = length >= 4 && (asset.path.compare(length - 4, 4, ".bmp") == 0 || asset.path.compare(length - 4, 4, ".BMP") == 0);
+		if (asset.streamed) asset.textureRead = TextureStreamer::readTail(asset.path.c_str(), asset.texture);
+		else asset.textureRead = bmp ? readBMP(asset.path.c_str(), asset.texture) : readDDS(asset.path.c_str(), asset.texture);
+	}
+
+	asset.parseTime = millisecondsSince(start);
+}
+
+void AssetLoader::upload(Asset &asset) {
+	std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+
+	if (!asset.isTexture) {
+		Obj3D::uploadModel(asset.model, asset.path.c_str());
+		Obj3D::modelCache[asset.path] = asset.model;
+	}
+	else {
+		PROFILE_SCOPE("Upload texture");
+		// A file that could not be read gets texture 0, as with loadDDS(). The streamer accounts for its own textures
+		GLuint texture = 0;
+		if (asset.textureRead && asset.streamed) {
+			texture = streamer->create(asset.path.c_str(), asset.texture);
+		}
+		else if (asset.textureRead) {
+			texture = createTexture(asset.texture);
+			MemoryTracker::trackTexture(texture, MemoryTracker::textureSize(texture), MEMORY_TEXTURE, asset.path.c_str());
+		}
+		Obj3D::textureCache[asset.path] = texture;
+		std::vector<unsigned char>().swap(asset.texture.pixels);
+	}
+
+	asset.uploadTime = millisecondsSince(start);
+}
+
+void AssetLoader::load() {
+	PROFILE_SCOPE("Load assets");
+	std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+
+	// The vector does not change until every job is done
+	JobCounter counter;
+	for (size_t i = 0; i < assets.size(); ++i) {
+		Asset *asset = &assets[i];
+		jobSystem->run([asset]() { parse(*asset); }, &counter);
+	}
+	jobSystem->wait(counter);
+	parseTime = millisecondsSince(start);
+
+	workTime = 0.0;
+	for (size_t i = 0; i < assets.size(); ++i) {
+		workTime += assets[i].parseTime;
+	}
+
+	// Every GL call of the load in one go, the driver is not interleaved with file reads
+	start = std::chrono::high_resolution_clock::now();
+	for (size_t i = 0; i < assets.size(); ++i) {
+		upload(assets[i]);
+	}
+	uploadTime = millisecondsSince(start);
+}
+
+void AssetLoader::print() const {
+	if (assets.empty()) return;
+
+	std::vector<const Asset*> sorted;
+	for (size_t i = 0; i < assets.size(); ++i) {
+		sorted.push_back(&assets[i]);
+	}
+	std::sort(sorted.begin(), sorted.end(), [](const Asset *a, const Asset *b) { return a->parseTime > b->parseTime; });
+
+	printf("Assets : %d files on %u threads, %f ms reading (%f ms of work, slowest %s %f ms), %f ms uploading\n", (int)assets.size(),
+		jobSystem->threadCount(), parseTime, workTime, sorted[0]->path.c_str(), sorted[0]->parseTime, uploadTime);
+	for (size_t i = 0; i < sorted.size(); ++i) {
+		printf("  %10.3f ms read %10.3f ms upload  thread %2u  %s\n", sorted[i]->parseTime, sorted[i]->uploadTime, sorted[i]->thread, sorted[i]->path.c_str());
+	}
+}
@@ -0,0 +1,52 @@
+#ifndef ASSETLOADER_H
+#define ASSETLOADER_H
+
+#include <string>
+#include <vector>
+
+#include "Obj3D.h"
+#include "JobSystem.h"
+#include "TextureStreamer.h"
+
+// Cold start loading of a known set of files.
+// Every distinct file is read and parsed by its own job, so the wait is the slowest
+// file rather than the sum of them. The GL objects are then created in one batch on
+// the calling thread, which must own the context, and put in the caches of Obj3D :
+// the Obj3D::init() calls that follow find everything there.
+class AssetLoader {
+	public:
+		// Without a streamer the streamed textures are loaded in full
+		AssetLoader(JobSystem *jobSystem, TextureStreamer *streamer = NULL) : jobSystem(jobSystem), streamer(streamer), parseTime(0.0), workTime(0.0), uploadTime(0.0) {}
+
+		// Files already in the caches or already added are ignored
+		void addModel(const char *path);
+		// .bmp files are read as BMP, anything else as DDS. Only the tail of a streamed DDS is read
+		void addTexture(const char *path, bool streamed = false);
+
+		// Returns once everything is uploaded
+		void load();
+		// Wall time of both steps and the cost of every file
+		void print() const;
+
+	private:
+		struct Asset {
+			std::string path;
+			bool isTexture, streamed;
+			Model *model;
+			TextureData texture;
+			bool textureRead;
+			double parseTime, uploadTime; // Milliseconds
+			unsigned int thread;          // Job thread that parsed it
+		};
+
+		bool contains(const std::string &path) const;
+		static void parse(Asset &asset);
+		void upload(Asset &asset);
+
+		JobSystem *jobSystem;
+		TextureStreamer *streamer;
+		std::vector<Asset> assets;
+		double parseTime, workTime, uploadTime; // Milliseconds, workTime is the sum over the files
+};
+
+#endif
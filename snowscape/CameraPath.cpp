@@ -0,0 +1,90 @@
+#include "CameraPath.h"
+
+#include <stdio.h>
+#include <cmath>
+#include <algorithm>
+
+#include <glm/gtc/matrix_transform.hpp>
+#include <glm/gtc/constants.hpp>
+
+bool CameraPath::load(const char *path) {
+	FILE *file = fopen(path, "r");
+	if (!file) {
+		printf("Camera path %s could not be opened\n", path);
+		return false;
+	}
+
+	keys.clear();
+	char line[256];
+	while (fgets(line, sizeof(line), file)) {
+		if (line[0] == '#') continue;
+
+		Key key;
+		if (sscanf(line, "%f %f %f %f %f %f %f", &key.time, &key.position.x, &key.position.y, &key.position.z, &key.target.x, &key.target.y, &key.target.z) == 7) {
+			keys.push_back(key);
+		}
+	}
+	fclose(file);
+
+	std::sort(keys.begin(), keys.end(), [](const Key &a, const Key &b) { return a.time < b.time; });
+	if (keys.empty()) printf("Camera path %s has no key\n", path);
+	return !keys.empty();
+}
+
+void CameraPath::createDefault() {
+	// Around the houses, in and out of the lantern paths, 60 seconds per loop
+	const int KEY_COUNT = 12;
+	const float LOOP_TIME = 60.0f;
+
+	keys.clear();
+	for (int i = 0; i <= KEY_COUNT; ++i) {
+		float angle = two_pi<float>() * i / KEY_COUNT;
+		float radius = (i % 2) ? 25.0f : 60.0f;
+
+		Key key;
+		key.time = LOOP_TIME * i / KEY_COUNT;
+		key.position = vec3(radius * cos(angle), 2.5f, radius * sin(angle));
+		// Look a bit ahead along the loop
+		float nextAngle = angle + two_pi<float>() / KEY_COUNT;
+		key.target = vec3(40.0f * cos(nextAngle), 2.0f, 40.0f * sin(nextAngle));
+		keys.push_back(key);
+	}
+}
+
+static vec3 catmullRom(const vec3 &p0, const vec3 &p1, const vec3 &p2, const vec3 &p3, float t) {
+	float t2 = t * t, t3 = t2 * t;
+	return 0.5f * ((2.0f * p1) + (p2 - p0) * t + (2.0f * p0 - 5.0f * p1 + 4.0f * p2 - p3) * t2 + (3.0f * p1 - p0 - 3.0f * p2 + p3) * t3);
+}
+
+mat4 CameraPath::getViewMatrix(float time) const {
+	if (keys.empty()) return mat4(1.0f);
+
+	vec3 position = keys[0].position, target = keys[0].target;
+	if (keys.size() > 1 && duration() > 0.0f) {
+		time = fmod(time, duration());
+		size_t i = 0;
+		while (i + 2 < keys.size() && keys[i + 1].time <= time) ++i;
+
+		const Key &k0 = keys[i > 0 ? i - 1 : 0];
+		const Key &k1 = keys[i];
+		const Key &k2 = keys[i + 1];
+		const Key &k3 = keys[std::min(i + 2, keys.size() - 1)];
+
+		float span = k2.time - k1.time;
+		float t = span > 0.0f ? clamp((time - k1.time) / span, 0.0f, 1.0f) : 0.0f;
+
+		position = catmullRom(k0.position, k1.position, k2.position, k3.position, t);
+		target = catmullRom(k0.target, k1.target, k2.target, k3.target, t);
+	}
+
+	if (groundHeight) {
+		vec3 ground(0.0f, groundHeight(position.x, position.z), 0.0f);
+		position += ground;
+		target += ground;
+	}
+	return lookAt(position, target, vec3(0.0f, 1.0f, 0.0f));
+}
+
+mat4 CameraPath::getProjectionMatrix() const {
+	return perspective(45.0f, 4.0f / 3.0f, 0.1f, 1000.0f);
+}
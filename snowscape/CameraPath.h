@@ -0,0 +1,38 @@
+#ifndef CAMERAPATH_H
+#define CAMERAPATH_H
+
+#include <vector>
+
+#include <glm/glm.hpp>
+using namespace glm;
+
+// Scripted camera for the benchmark runs, replaces the keyboard and mouse.
+// Keys are an eye position and a point to look at, reached at a given time.
+// They are played back with Catmull-Rom splines and the path loops once the
+// last key is reached.
+// With a ground height function the heights of the keys are over the ground under
+// the eye, the target is raised by as much.
+class CameraPath {
+	public:
+		struct Key {
+			float time; // Seconds from the start of the path
+			vec3 position, target;
+		};
+
+		std::vector<Key> keys;
+		float (*groundHeight)(float x, float z); // NULL for a flat ground at 0
+
+		CameraPath() : groundHeight(NULL) {}
+
+		// One "time x y z targetX targetY targetZ" key per line, # starts a comment. False if nothing was read
+		bool load(const char *path);
+		// A loop through the village at eye height
+		void createDefault();
+
+		mat4 getViewMatrix(float time) const;
+		// Same projection as the interactive camera
+		mat4 getProjectionMatrix() const;
+		float duration() const { return keys.empty() ? 0.0f : keys.back().time; }
+};
+
+#endif
@@ -0,0 +1,215 @@
+#include "ClusteredLights.h"
+#include "Profiler.h"
+#include "memorytracker.hpp"
+
+#include <cmath>
+#include <algorithm>
+#include <chrono>
+#include <xmmintrin.h>
+
+ClusteredLights::ClusteredLights() {
+	buildTime = 0.0;
+	lightReferences = 0;
+	lightBuffer = gridBuffer = indexBuffer = 0;
+	lightCapacity = gridCapacity = indexCapacity = 0;
+	lightTexture = gridTexture = indexTexture = 0;
+
+	// Exponential slices between 1 and 300 units, anything closer or farther goes in the first or last slice
+	clusterNear = 1.0f;
+	clusterFar = 300.0f;
+}
+
+// Orphan the storage of the last frame and fill the new one. The buffer is reallocated, and tracked again, only when it grows
+static void uploadBuffer(GLuint buffer, size_t &capacity, const void *data, size_t size) {
+	glBindBuffer(GL_TEXTURE_BUFFER, buffer);
+	if (size > capacity) {
+		capacity = size * 2;
+		MemoryTracker::trackBuffer(buffer, capacity, MEMORY_DYNAMIC, "clustered lights");
+	}
+	glBufferData(GL_TEXTURE_BUFFER, capacity, NULL, GL_STREAM_DRAW);
+	glBufferSubData(GL_TEXTURE_BUFFER, 0, size, data);
+}
+
+ClusteredLights::~ClusteredLights() {
+	MemoryTracker::releaseBuffer(lightBuffer);
+	MemoryTracker::releaseBuffer(gridBuffer);
+	MemoryTracker::releaseBuffer(indexBuffer);
+	glDeleteTextures(1, &lightTexture);
+	glDeleteTextures(1, &gridTexture);
+	glDeleteTextures(1, &indexTexture);
+	glDeleteBuffers(1, &lightBuffer);
+	glDeleteBuffers(1, &gridBuffer);
+	glDeleteBuffers(1, &indexBuffer);
+}
+
+void ClusteredLights::init() {
+	glGenBuffers(1, &lightBuffer);
+	glGenBuffers(1, &gridBuffer);
+	glGenBuffers(1, &indexBuffer);
+	glGenTextures(1, &lightTexture);
+	glGenTextures(1, &gridTexture);
+	glGenTextures(1, &indexTexture);
+
+	grid.resize(CLUSTERS_X * CLUSTERS_Y * CLUSTERS_Z * 2);
+}
+
+bool ClusteredLights::addLight(vec3 position, float radius, vec3 color, float intensity) {
+	if (positionX.size() >= MAX_LIGHTS) return false;
+
+	positionX.push_back(position.x);
+	positionY.push_back(position.y);
+	positionZ.push_back(position.z);
+	this->radius.push_back(radius);
+	colors.push_back(vec4(color, intensity));
+	return true;
+}
+
+void ClusteredLights::update(const mat4 &ViewMatrix, const mat4 &ProjectionMatrix, int width, int height) {
+	PROFILE_SCOPE("Light binning");
+	std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+
+	tileSize = vec2((float)width / CLUSTERS_X, (float)height / CLUSTERS_Y);
+
+	// View space positions, 4 lights at a time
+	size_t count = positionX.size();
+	viewX.resize(count);
+	viewY.resize(count);
+	viewZ.resize(count);
+
+	size_t i = 0;
+	for (; i + 4 <= count; i += 4) {
+		__m128 x = _mm_loadu_ps(&positionX[i]);
+		__m128 y = _mm_loadu_ps(&positionY[i]);
+		__m128 z = _mm_loadu_ps(&positionZ[i]);
+
+		for (int row = 0; row < 3; ++row) {
+			__m128 result = _mm_add_ps(
+				_mm_add_ps(_mm_mul_ps(_mm_set1_ps(ViewMatrix[0][row]), x), _mm_mul_ps(_mm_set1_ps(ViewMatrix[1][row]), y)),
+				_mm_add_ps(_mm_mul_ps(_mm_set1_ps(ViewMatrix[2][row]), z), _mm_set1_ps(ViewMatrix[3][row]))
+			);
+			float *destination = row == 0 ? &viewX[i] : (row == 1 ? &viewY[i] : &viewZ[i]);
+			_mm_storeu_ps(destination, result);
+		}
+	}
+	for (; i < count; ++i) {
+		vec4 view = ViewMatrix * vec4(positionX[i], positionY[i], positionZ[i], 1.0f);
+		viewX[i] = view.x;
+		viewY[i] = view.y;
+		viewZ[i] = view.z;
+	}
+
+	// Near plane of the projection, the screen bounds of a light are computed no closer than that
+	const float projectionNear = ProjectionMatrix[3][2] / (ProjectionMatrix[2][2] - 1.0f);
+	const float scaleX = ProjectionMatrix[0][0];
+	const float scaleY = ProjectionMatrix[1][1];
+	const float logScale = CLUSTERS_Z / log(clusterFar / clusterNear);
+
+	lightData.clear();
+	lightRanges.clear();
+	std::fill(grid.begin(), grid.end(), 0);
+
+	// Count the lights of each cluster
+	for (size_t l = 0; l < count; ++l) {
+		float depth = -viewZ[l];
+		float r = radius[l];
+		if (depth + r < projectionNear) continue;
+
+		float zMin = std::max(depth - r, projectionNear);
+		float zMax = depth + r;
+		int sliceMin = clamp((int)floor(log(std::max(zMin, clusterNear) / clusterNear) * logScale), 0, CLUSTERS_Z - 1);
+		int sliceMax = clamp((int)floor(log(std::max(zMax, clusterNear) / clusterNear) * logScale), 0, CLUSTERS_Z - 1);
+
+		// Screen bounds of the view space box around the light, extreme at its corners
+		float xs[2] = { viewX[l] - r, viewX[l] + r };
+		float ys[2] = { viewY[l] - r, viewY[l] + r };
+		float zs[2] = { zMin, zMax };
+		vec2 ndcMin(1e30f), ndcMax(-1e30f);
+		for (int c = 0; c < 4; ++c) {
+			for (int z = 0; z < 2; ++z) {
+				vec2 ndc(scaleX * xs[c & 1] / zs[z], scaleY * ys[c >> 1] / zs[z]);
+				ndcMin = min(ndcMin, ndc);
+				ndcMax = max(ndcMax, ndc);
+			}
+		}
+		if (ndcMax.x < -1.0f || ndcMin.x > 1.0f || ndcMax.y < -1.0f || ndcMin.y > 1.0f) continue;
+
+		int range[6] = {
+			clamp((int)floor((ndcMin.x * 0.5f + 0.5f) * CLUSTERS_X), 0, CLUSTERS_X - 1),
+			clamp((int)floor((ndcMax.x * 0.5f + 0.5f) * CLUSTERS_X), 0, CLUSTERS_X - 1),
+			clamp((int)floor((ndcMin.y * 0.5f + 0.5f) * CLUSTERS_Y), 0, CLUSTERS_Y - 1),
+			clamp((int)floor((ndcMax.y * 0.5f + 0.5f) * CLUSTERS_Y), 0, CLUSTERS_Y - 1),
+			sliceMin,
+			sliceMax
+		};
+
+		for (int z = range[4]; z <= range[5]; ++z) {
+			for (int y = range[2]; y <= range[3]; ++y) {
+				for (int x = range[0]; x <= range[1]; ++x) {
+					grid[((z * CLUSTERS_Y + y) * CLUSTERS_X + x) * 2 + 1]++;
+				}
+			}
+		}
+
+		lightRanges.insert(lightRanges.end(), range, range + 6);
+		lightData.push_back(vec4(viewX[l], viewY[l], viewZ[l], r));
+		lightData.push_back(colors[l]);
+	}
+
+	// Offsets of the lists, counts are rebuilt while filling them
+	GLuint offset = 0;
+	for (size_t c = 0; c < grid.size(); c += 2) {
+		grid[c] = offset;
+		offset += grid[c + 1];
+		grid[c + 1] = 0;
+	}
+	lightReferences = (int)offset;
+	indices.resize(std::max(offset, 1u));
+
+	for (size_t l = 0; l < lightRanges.size() / 6; ++l) {
+		const int *range = &lightRanges[l * 6];
+		for (int z = range[4]; z <= range[5]; ++z) {
+			for (int y = range[2]; y <= range[3]; ++y) {
+				for (int x = range[0]; x <= range[1]; ++x) {
+					GLuint *cluster = &grid[((z * CLUSTERS_Y + y) * CLUSTERS_X + x) * 2];
+					indices[cluster[0] + cluster[1]++] = (GLuint)l;
+				}
+			}
+		}
+	}
+
+	if (lightData.empty()) lightData.push_back(vec4(0.0f));
+
+	uploadBuffer(lightBuffer, lightCapacity, &lightData[0], lightData.size() * sizeof(vec4));
+	uploadBuffer(gridBuffer, gridCapacity, &grid[0], grid.size() * sizeof(GLuint));
+	uploadBuffer(indexBuffer, indexCapacity, &indices[0], indices.size() * sizeof(GLuint));
+	glBindBuffer(GL_TEXTURE_BUFFER, 0);
+
+	buildTime = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+}
+
+void ClusteredLights::bind(GLuint program) {
+	glUseProgram(program);
+
+	// Texture units 0 and 1 are used by the material
+	glActiveTexture(GL_TEXTURE2);
+	glBindTexture(GL_TEXTURE_BUFFER, lightTexture);
+	glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, lightBuffer);
+	glUniform1i(glGetUniformLocation(program, "lightData"), 2);
+
+	glActiveTexture(GL_TEXTURE3);
+	glBindTexture(GL_TEXTURE_BUFFER, gridTexture);
+	glTexBuffer(GL_TEXTURE_BUFFER, GL_RG32UI, gridBuffer);
+	glUniform1i(glGetUniformLocation(program, "lightGrid"), 3);
+
+	glActiveTexture(GL_TEXTURE4);
+	glBindTexture(GL_TEXTURE_BUFFER, indexTexture);
+	glTexBuffer(GL_TEXTURE_BUFFER, GL_R32UI, indexBuffer);
+	glUniform1i(glGetUniformLocation(program, "lightIndices"), 4);
+
+	glUniform2f(glGetUniformLocation(program, "clusterTileSize"), tileSize.x, tileSize.y);
+	glUniform3i(glGetUniformLocation(program, "clusterCount"), CLUSTERS_X, CLUSTERS_Y, CLUSTERS_Z);
+	glUniform1f(glGetUniformLocation(program, "clusterNear"), clusterNear);
+	glUniform1f(glGetUniformLocation(program, "clusterLogScale"), CLUSTERS_Z / log(clusterFar / clusterNear));
+
+	glActiveTexture(GL_TEXTURE0);
+}
@@ -0,0 +1,62 @@
+#ifndef CLUSTEREDLIGHTS_H
+#define CLUSTEREDLIGHTS_H
+
+#include <vector>
+#include <GL/glew.h>
+
+#include <glm/glm.hpp>
+using namespace glm;
+
+// Clustered forward lighting.
+// The view frustum is split in a grid of froxels (screen tiles times exponential
+// depth slices). Every frame the point lights are binned into the froxels they
+// touch on the CPU, and the grid, the light index lists and the lights are
+// uploaded as texture buffers. light.fragmentshader then only loops over the
+// lights of its own cluster.
+class ClusteredLights {
+	public:
+		static const int CLUSTERS_X = 16;
+		static const int CLUSTERS_Y = 12;
+		static const int CLUSTERS_Z = 24;
+		static const int MAX_LIGHTS = 1024;
+
+		ClusteredLights();
+		~ClusteredLights();
+
+		void init();
+		// Returns false once MAX_LIGHTS is reached
+		bool addLight(vec3 position, float radius, vec3 color, float intensity);
+		// Bin the lights for this view and upload the result
+		void update(const mat4 &ViewMatrix, const mat4 &ProjectionMatrix, int width, int height);
+		// Use the program and point its cluster uniforms to the buffers of this frame
+		void bind(GLuint program);
+
+		int lightCount() const { return (int)positionX.size(); }
+
+		// Time spent in the last update() call, in milliseconds
+		double buildTime;
+		// Number of light references stored in the clusters
+		int lightReferences;
+
+	private:
+		// World space lights, SoA for the SSE view transform
+		std::vector<float> positionX, positionY, positionZ, radius;
+		std::vector<vec4> colors; // rgb : color, a : intensity
+		std::vector<float> viewX, viewY, viewZ;
+
+		// View space position and radius, then color and intensity, per light
+		std::vector<vec4> lightData;
+		// Offset and count in the index list, per cluster
+		std::vector<GLuint> grid;
+		std::vector<GLuint> indices;
+		std::vector<int> lightRanges; // Cluster range of each visible light : minX, maxX, minY, maxY, minZ, maxZ
+
+		GLuint lightBuffer, gridBuffer, indexBuffer;
+		size_t lightCapacity, gridCapacity, indexCapacity; // Bytes allocated, they only grow
+		GLuint lightTexture, gridTexture, indexTexture;
+
+		float clusterNear, clusterFar;
+		vec2 tileSize;
+};
+
+#endif
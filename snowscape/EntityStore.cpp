@@ -0,0 +1,358 @@
+#include "EntityStore.h"
+#include "Profiler.h"
+
+#include <algorithm>
+#include <emmintrin.h>
+
+// Translation, rotation and scale composed without the matrix products
+static mat4 composeMatrix(const vec3 &position, const quat &orientation, const vec3 &scale) {
+	mat4 m = mat4_cast(orientation);
+	m[0] *= scale.x;
+	m[1] *= scale.y;
+	m[2] *= scale.z;
+	m[3] = vec4(position, 1.0f);
+	return m;
+}
+
+EntityStore::EntityStore() {
+	layoutVersion = 0;
+	anyDirty = false;
+	movingCount = 0;
+	levelsValid = false;
+}
+
+EntityID EntityStore::create(const Obj3D &obj, EntityID parent) {
+	RenderHandles handles;
+	handles.model = obj.model;
+	handles.Texture = obj.Texture;
+	handles.NormalTexture = obj.NormalTexture;
+	handles.depthTest = obj.depthTest;
+
+	EntityID id = create(handles, obj.model->boundsMin, obj.model->boundsMax, parent);
+	size_t i = indexOf(id);
+
+	// Same rotations as Obj3D::getModelMatrix, around Y then -X
+	positions[i] = obj.position;
+	orientations[i] = angleAxis(obj.rotation.x, vec3(0.0f, 1.0f, 0.0f)) * angleAxis(obj.rotation.y, vec3(-1.0f, 0.0f, 0.0f));
+	scales[i] = obj.scale;
+	occluderScales[i] = obj.occluderScale;
+	setSpeed(id, obj.speed);
+
+	return id;
+}
+
+EntityID EntityStore::create(const RenderHandles &handles, const vec3 &boundsMin, const vec3 &boundsMax, EntityID parent) {
+	unsigned int slot;
+	if (!freeSlots.empty()) {
+		slot = freeSlots.back();
+		freeSlots.pop_back();
+	}
+	else {
+		slot = (unsigned int)slots.size();
+		Slot newSlot = { 0, 0 };
+		slots.push_back(newSlot);
+	}
+
+	EntityID id = (slots[slot].generation << SLOT_BITS) | slot;
+	slots[slot].index = (unsigned int)ids.size();
+
+	positions.push_back(vec3(0.0f));
+	speeds.push_back(vec3(0.0f));
+	scales.push_back(vec3(1.0f));
+	orientations.push_back(quat());
+	this->boundsMin.push_back(boundsMin);
+	this->boundsMax.push_back(boundsMax);
+	render.push_back(handles);
+	occluderScales.push_back(0.0f);
+	parents.push_back(alive(parent) ? parent : INVALID_ENTITY);
+	worldMatrices.push_back(mat4(1.0f));
+	dirty.push_back(1);
+	ids.push_back(id);
+
+	anyDirty = true;
+	levelsValid = false;
+	layoutVersion++;
+
+	return id;
+}
+
+void EntityStore::destroy(EntityID id) {
+	if (!alive(id)) return;
+
+	unsigned int slot = id & SLOT_MASK;
+	size_t i = slots[slot].index;
+	size_t last = ids.size() - 1;
+
+	if (speeds[i] != vec3(0.0f)) movingCount--;
+
+	// Move the last entity in the hole
+	if (i != last) {
+		positions[i] = positions[last];
+		speeds[i] = speeds[last];
+		scales[i] = scales[last];
+		orientations[i] = orientations[last];
+		boundsMin[i] = boundsMin[last];
+		boundsMax[i] = boundsMax[last];
+		render[i] = render[last];
+		occluderScales[i] = occluderScales[last];
+		parents[i] = parents[last];
+		worldMatrices[i] = worldMatrices[last];
+		dirty[i] = dirty[last];
+		ids[i] = ids[last];
+		slots[ids[i] & SLOT_MASK].index = (unsigned int)i;
+	}
+
+	positions.pop_back();
+	speeds.pop_back();
+	scales.pop_back();
+	orientations.pop_back();
+	boundsMin.pop_back();
+	boundsMax.pop_back();
+	render.pop_back();
+	occluderScales.pop_back();
+	parents.pop_back();
+	worldMatrices.pop_back();
+	dirty.pop_back();
+	ids.pop_back();
+
+	// Old handles of this slot are now stale
+	slots[slot].generation = (slots[slot].generation + 1) & (0xffffffffu >> SLOT_BITS);
+	freeSlots.push_back(slot);
+
+	// The orphans are detached when the levels are rebuilt
+	levelsValid = false;
+	layoutVersion++;
+}
+
+bool EntityStore::alive(EntityID id) const {
+	unsigned int slot = id & SLOT_MASK;
+	if (id == INVALID_ENTITY || slot >= slots.size()) return false;
+	return slots[slot].generation == (id >> SLOT_BITS) && slots[slot].index < ids.size() && ids[slots[slot].index] == id;
+}
+
+void EntityStore::clear() {
+	positions.clear();
+	speeds.clear();
+	scales.clear();
+	orientations.clear();
+	boundsMin.clear();
+	boundsMax.clear();
+	render.clear();
+	occluderScales.clear();
+	parents.clear();
+	worldMatrices.clear();
+	dirty.clear();
+	ids.clear();
+	slots.clear();
+	freeSlots.clear();
+	anyDirty = false;
+	movingCount = 0;
+	levelsValid = false;
+	layoutVersion++;
+}
+
+void EntityStore::markDirty(size_t i) {
+	dirty[i] = 1;
+	anyDirty = true;
+}
+
+void EntityStore::setPosition(EntityID id, const vec3 &position) {
+	if (!alive(id)) return;
+	size_t i = indexOf(id);
+	positions[i] = position;
+	markDirty(i);
+}
+
+void EntityStore::setOrientation(EntityID id, const quat &orientation) {
+	if (!alive(id)) return;
+	size_t i = indexOf(id);
+	orientations[i] = orientation;
+	markDirty(i);
+}
+
+void EntityStore::setScale(EntityID id, const vec3 &scale) {
+	if (!alive(id)) return;
+	size_t i = indexOf(id);
+	scales[i] = scale;
+	markDirty(i);
+}
+
+void EntityStore::setSpeed(EntityID id, const vec3 &speed) {
+	if (!alive(id)) return;
+	size_t i = indexOf(id);
+	if (speeds[i] != vec3(0.0f)) movingCount--;
+	if (speed != vec3(0.0f)) movingCount++;
+	speeds[i] = speed;
+}
+
+bool EntityStore::setParent(EntityID id, EntityID parent) {
+	if (!alive(id)) return false;
+	if (!alive(parent)) parent = INVALID_ENTITY;
+
+	// The new parent must not be a descendant
+	for (EntityID ancestor = parent; ancestor != INVALID_ENTITY; ancestor = parents[indexOf(ancestor)]) {
+		if (ancestor == id) return false;
+		if (!alive(parents[indexOf(ancestor)])) break;
+	}
+
+	size_t i = indexOf(id);
+	parents[i] = parent;
+	markDirty(i);
+	levelsValid = false;
+	return true;
+}
+
+void EntityStore::update(float dt) {
+	// Static scenes stop here
+	if (movingCount == 0) return;
+	PROFILE_SCOPE("Move entities");
+
+	// vec3 are packed, both arrays are one long run of floats
+	float *position = &positions[0].x;
+	const float *speed = &speeds[0].x;
+	size_t count = positions.size() * 3;
+
+	__m128 step = _mm_set1_ps(dt);
+	size_t i = 0;
+	for (; i + 4 <= count; i += 4) {
+		_mm_storeu_ps(position + i, _mm_add_ps(_mm_loadu_ps(position + i), _mm_mul_ps(_mm_loadu_ps(speed + i), step)));
+	}
+	for (; i < count; ++i) {
+		position[i] += speed[i] * dt;
+	}
+
+	for (size_t e = 0; e < speeds.size(); ++e) {
+		if (speeds[e] != vec3(0.0f)) dirty[e] = 1;
+	}
+	anyDirty = true;
+}
+
+void EntityStore::rebuildLevels() {
+	size_t count = ids.size();
+	parentIndices.assign(count, INVALID_ENTITY);
+	std::vector<int> levels(count, -1);
+
+	for (size_t i = 0; i < count; ++i) {
+		// Links to destroyed entities turn their children into roots
+		if (parents[i] != INVALID_ENTITY && !alive(parents[i])) {
+			parents[i] = INVALID_ENTITY;
+			dirty[i] = 1;
+		}
+		if (parents[i] != INVALID_ENTITY) parentIndices[i] = (unsigned int)indexOf(parents[i]);
+	}
+
+	// Depth of each entity, walking up to the first ancestor already known
+	std::vector<unsigned int> chain;
+	int maxLevel = 0;
+	for (size_t i = 0; i < count; ++i) {
+		unsigned int e = (unsigned int)i;
+		while (levels[e] < 0 && parentIndices[e] != INVALID_ENTITY) {
+			chain.push_back(e);
+			e = parentIndices[e];
+		}
+		int level = levels[e] < 0 ? 0 : levels[e];
+		levels[e] = level;
+		while (!chain.empty()) {
+			levels[chain.back()] = ++level;
+			chain.pop_back();
+		}
+		maxLevel = std::max(maxLevel, levels[i]);
+	}
+
+	// Counting sort by level
+	levelStarts.assign(maxLevel + 2, 0);
+	for (size_t i = 0; i < count; ++i) levelStarts[levels[i] + 1]++;
+	for (int l = 0; l <= maxLevel; ++l) levelStarts[l + 1] += levelStarts[l];
+
+	std::vector<size_t> cursor(levelStarts.begin(), levelStarts.end() - 1);
+	levelOrder.resize(count);
+	for (size_t i = 0; i < count; ++i) levelOrder[cursor[levels[i]]++] = (unsigned int)i;
+
+	levelsValid = true;
+}
+
+void EntityStore::updateTransformRange(const unsigned int *entries, size_t count) {
+	for (size_t n = 0; n < count; ++n) {
+		unsigned int i = entries[n];
+		unsigned int parent = parentIndices[i];
+
+		// The parents are one level up and already final for this pass
+		mat4 local = composeMatrix(positions[i], orientations[i], scales[i]);
+		worldMatrices[i] = parent == INVALID_ENTITY ? local : worldMatrices[parent] * local;
+	}
+}
+
+void EntityStore::updateTransforms(JobSystem *jobs) {
+	updatedEntities.clear();
+	previousMatrices.clear();
+	if (!anyDirty && levelsValid) return;
+	PROFILE_SCOPE("Update transforms");
+	if (!levelsValid) rebuildLevels();
+
+	// The dirty flags go down the levels first, the entities to recompute are known before any matrix changes
+	updatedStarts.assign(1, 0);
+	for (size_t l = 0; l + 1 < levelStarts.size(); ++l) {
+		for (size_t n = levelStarts[l]; n < levelStarts[l + 1]; ++n) {
+			unsigned int i = levelOrder[n];
+			unsigned int parent = parentIndices[i];
+			if (!dirty[i] && parent != INVALID_ENTITY && dirty[parent]) dirty[i] = 1;
+			if (dirty[i]) updatedEntities.push_back(i);
+		}
+		updatedStarts.push_back(updatedEntities.size());
+	}
+
+	previousMatrices.resize(updatedEntities.size());
+	for (size_t n = 0; n < updatedEntities.size(); ++n) {
+		previousMatrices[n] = worldMatrices[updatedEntities[n]];
+	}
+
+	for (size_t l = 0; l + 1 < updatedStarts.size(); ++l) {
+		size_t count = updatedStarts[l + 1] - updatedStarts[l];
+		if (count == 0) continue;
+		const unsigned int *entries = &updatedEntities[0] + updatedStarts[l];
+
+		// Entities of one level never depend on each other
+		if (jobs == NULL) {
+			updateTransformRange(entries, count);
+			continue;
+		}
+
+		jobs->parallelFor(count, TRANSFORM_GRAIN, [this, entries](size_t begin, size_t end) {
+			updateTransformRange(entries + begin, end - begin);
+		});
+	}
+
+	for (size_t n = 0; n < updatedEntities.size(); ++n) {
+		dirty[updatedEntities[n]] = 0;
+	}
+	anyDirty = false;
+}
+
+void EntityStore::copyRenderState(const EntityStore &source) {
+	positions = source.positions;
+	speeds = source.speeds;
+	boundsMin = source.boundsMin;
+	boundsMax = source.boundsMax;
+	render = source.render;
+	occluderScales = source.occluderScales;
+	worldMatrices = source.worldMatrices;
+	ids = source.ids;
+	slots = source.slots;
+	layoutVersion = source.layoutVersion;
+}
+
+void EntityStore::copyWorldMatrices(const EntityStore &source, const unsigned int *indices, size_t count) {
+	for (size_t n = 0; n < count; ++n) {
+		worldMatrices[indices[n]] = source.worldMatrices[indices[n]];
+	}
+}
+
+bool EntityStore::getOccluderBox(size_t i, vec3 &boxMin, vec3 &boxMax) const {
+	const Model *model = render[i].model;
+	if (model == NULL || model->occluderMin.x > model->occluderMax.x) return false;
+	vec3 center = (model->occluderMin + model->occluderMax) * 0.5f;
+	vec3 halfSize = (model->occluderMax - model->occluderMin) * 0.5f * occluderScales[i];
+	boxMin = center - halfSize;
+	boxMax = center + halfSize;
+	return true;
+}
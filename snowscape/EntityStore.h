@@ -0,0 +1,119 @@
+#ifndef ENTITYSTORE_H
+#define ENTITYSTORE_H
+
+#include <vector>
+#include <GL/glew.h>
+
+#include <glm/glm.hpp>
+#include <glm/gtc/quaternion.hpp>
+using namespace glm;
+
+#include "Obj3D.h"
+#include "JobSystem.h"
+
+// Stable handle of an entity : slot in the low bits, generation of the slot in the high bits
+typedef unsigned int EntityID;
+#define INVALID_ENTITY 0xffffffffu
+
+// What the draw code needs besides the model matrix
+struct RenderHandles {
+	Model *model;
+	GLuint Texture, NormalTexture;
+	bool depthTest;
+};
+
+// The lit objects of the scene, stored as structure of arrays.
+// Index i of every array is the same entity, the arrays stay dense : deleting an
+// entity moves the last one in its place. The update pass and the render passes
+// only walk the arrays they need. Obj3D is only used to load the assets and
+// describe an entity before it is created here.
+//
+// Position, orientation and scale are relative to the parent entity. The world
+// matrices are cached and only recomputed for the entities marked dirty and their
+// descendants, one hierarchy level after the other.
+class EntityStore {
+	public:
+		static const int SLOT_BITS = 20;
+		static const unsigned int SLOT_MASK = (1u << SLOT_BITS) - 1;
+		// Entities of one hierarchy level per job
+		static const size_t TRANSFORM_GRAIN = 4096;
+
+		std::vector<vec3> positions, speeds, scales;
+		std::vector<quat> orientations;
+		std::vector<vec3> boundsMin, boundsMax; // Model space
+		std::vector<RenderHandles> render;
+		std::vector<float> occluderScales;      // 0 when not an occluder
+		std::vector<EntityID> parents;          // INVALID_ENTITY for the roots
+		std::vector<mat4> worldMatrices;        // Valid after updateTransforms()
+		std::vector<EntityID> ids;              // Handle of the entity at each index
+		unsigned int layoutVersion;             // Changes whenever entities are created or destroyed
+
+		EntityStore();
+
+		// Copy the state of an initialized object
+		EntityID create(const Obj3D &obj, EntityID parent = INVALID_ENTITY);
+		// Entity at the origin of its parent, placed with the setters
+		EntityID create(const RenderHandles &handles, const vec3 &boundsMin, const vec3 &boundsMax, EntityID parent = INVALID_ENTITY);
+		// Swap with the last entity and pop, the handle becomes invalid and the children become roots
+		void destroy(EntityID id);
+		bool alive(EntityID id) const;
+		// Current index of a live entity in the arrays
+		size_t indexOf(EntityID id) const { return slots[id & SLOT_MASK].index; }
+		size_t size() const { return ids.size(); }
+		void clear();
+
+		// Local transform setters, they mark the entity dirty. Destroyed entities are ignored, like destroy() does
+		void setPosition(EntityID id, const vec3 &position);
+		void setOrientation(EntityID id, const quat &orientation);
+		void setScale(EntityID id, const vec3 &scale);
+		void setSpeed(EntityID id, const vec3 &speed);
+		// Attach to a new parent, INVALID_ENTITY detaches. Returns false if it would create a cycle
+		bool setParent(EntityID id, EntityID parent);
+
+		// position += speed * dt for every moving entity, speeds are in units per second
+		void update(float dt);
+		// Recompute the world matrices of the dirty entities and their descendants, in parallel when jobs is set
+		void updateTransforms(JobSystem *jobs = NULL);
+
+		const mat4 &getModelMatrix(size_t i) const { return worldMatrices[i]; }
+		// Conservative box for the occlusion culler, model space. False without a model or a box inside it
+		bool getOccluderBox(size_t i, vec3 &boxMin, vec3 &boxMax) const;
+
+		// Copy what the render thread reads into a store that is only read : the handles, bounds, occluder scales,
+		// world matrices and the handle table, plus the positions and speeds the occlusion queries group by.
+		// The local transforms and the hierarchy are left out
+		void copyRenderState(const EntityStore &source);
+		// Only the world matrices of these entities, both stores must have the same layoutVersion
+		void copyWorldMatrices(const EntityStore &source, const unsigned int *indices, size_t count);
+
+		// Indices the last updateTransforms() call recomputed, parents first, and their world matrix before it
+		std::vector<unsigned int> updatedEntities;
+		std::vector<mat4> previousMatrices;
+
+	private:
+		struct Slot {
+			unsigned int index;
+			unsigned int generation;
+		};
+
+		void markDirty(size_t i);
+		void rebuildLevels();
+		void updateTransformRange(const unsigned int *entries, size_t count);
+
+		std::vector<Slot> slots;
+		std::vector<unsigned int> freeSlots;
+
+		std::vector<unsigned char> dirty;
+		bool anyDirty;
+		size_t movingCount; // Entities with a non zero speed
+
+		// Entity indices sorted by depth in the hierarchy, rebuilt when the layout or the links change
+		std::vector<unsigned int> levelOrder;
+		std::vector<size_t> levelStarts;
+		std::vector<unsigned int> parentIndices;
+		bool levelsValid;
+		// Start of each level in updatedEntities
+		std::vector<size_t> updatedStarts;
+};
+
+#endif
@@ -0,0 +1,141 @@
+#include "FrameStats.h"
+
+#include <stdio.h>
+#include <algorithm>
+
+static const char *phaseNames[FRAME_PHASE_COUNT] = { "update", "cull", "submit", "swap", "asset upload" };
+
+const char *framePhaseName(FramePhase phase) {
+	return phaseNames[phase];
+}
+
+FrameStats::FrameStats() {
+	frames = 0;
+	totalTime = 0.0;
+	maxTime = 0.0f;
+	stutterTotal = 0;
+	simulationTime = 0.0;
+	maxSimulationTime = 0.0f;
+	simulationSnapshots = 0;
+	std::fill(current, current + FRAME_PHASE_COUNT, 0.0f);
+	std::fill(bins, bins + HISTOGRAM_BINS, 0u);
+	std::fill(phaseStutters, phaseStutters + FRAME_PHASE_COUNT, 0u);
+	scratch.reserve(WINDOW);
+}
+
+void FrameStats::addPhase(FramePhase phase, double time) {
+	current[phase] += (float)time;
+}
+
+float FrameStats::percentileOf(const float *ring, unsigned int n, float p, std::vector<float> &scratch) {
+	if (n == 0) return 0.0f;
+	// The ring is full or filled from 0, either way its first n entries are the last n frames
+	scratch.assign(ring, ring + n);
+	size_t rank = std::min((size_t)(p * (n - 1) + 0.5f), (size_t)n - 1);
+	std::nth_element(scratch.begin(), scratch.begin() + rank, scratch.end());
+	return scratch[rank];
+}
+
+void FrameStats::endFrame(double time) {
+	unsigned int count = std::min(frames, (unsigned int)WINDOW);
+
+	// Compared to the frames before this one
+	if (frames >= WARMUP_FRAMES) {
+		float median = percentileOf(times, count, 0.5f, scratch);
+		if (time > 2.0 * median) {
+			Stutter stutter;
+			stutter.frame = frames;
+			stutter.time = (float)time;
+			stutter.median = median;
+			stutter.phase = PHASE_UPDATE;
+			stutter.phaseTime = stutter.phaseMedian = 0.0f;
+
+			float worstExcess = -1e30f;
+			for (int p = 0; p < FRAME_PHASE_COUNT; ++p) {
+				float phaseMedian = percentileOf(phaseTimes[p], count, 0.5f, scratch);
+				if (current[p] - phaseMedian > worstExcess) {
+					worstExcess = current[p] - phaseMedian;
+					stutter.phase = FramePhase(p);
+					stutter.phaseTime = current[p];
+					stutter.phaseMedian = phaseMedian;
+				}
+			}
+
+			if (stutterList.size() < MAX_STUTTERS) stutterList.push_back(stutter);
+			stutterTotal++;
+			phaseStutters[stutter.phase]++;
+		}
+	}
+
+	int slot = frames % WINDOW;
+	times[slot] = (float)time;
+	for (int p = 0; p < FRAME_PHASE_COUNT; ++p) {
+		phaseTimes[p][slot] = current[p];
+		current[p] = 0.0f;
+	}
+	frames++;
+
+	bins[std::min((int)time, HISTOGRAM_BINS - 1)]++;
+	totalTime += time;
+	maxTime = std::max(maxTime, (float)time);
+}
+
+void FrameStats::addSimulation(double time) {
+	simulationTime += time;
+	maxSimulationTime = std::max(maxSimulationTime, (float)time);
+	simulationSnapshots++;
+}
+
+float FrameStats::percentile(float p) const {
+	return percentileOf(times, std::min(frames, (unsigned int)WINDOW), p, scratch);
+}
+
+FrameStats::Summary FrameStats::summary() const {
+	Summary result;
+	unsigned int count = std::min(frames, (unsigned int)WINDOW);
+	result.frames = count;
+	result.average = result.max = 0.0f;
+	for (unsigned int i = 0; i < count; ++i) {
+		result.average += times[i];
+		result.max = std::max(result.max, times[i]);
+	}
+	if (count) result.average /= count;
+	result.p50 = percentile(0.5f);
+	result.p95 = percentile(0.95f);
+	result.p99 = percentile(0.99f);
+	return result;
+}
+
+void FrameStats::print() const {
+	if (frames == 0) return;
+
+	Summary last = summary();
+	printf("Frame times : %u frames, %f ms average, %f ms max\n", frames, totalTime / frames, maxTime);
+	printf("Last %u frames : p50 %f ms, p95 %f ms, p99 %f ms, max %f ms\n", last.frames, last.p50, last.p95, last.p99, last.max);
+	if (simulationSnapshots) {
+		printf("Simulation beside the frames : %u snapshots, %f ms of ticks average, %f ms max\n", simulationSnapshots, simulationTime / simulationSnapshots, maxSimulationTime);
+	}
+
+	// Non empty bins only, with a bar scaled to the largest one
+	unsigned int largest = *std::max_element(bins, bins + HISTOGRAM_BINS);
+	for (int b = 0; b < HISTOGRAM_BINS; ++b) {
+		if (!bins[b]) continue;
+		int width = (int)((bins[b] * 50ull + largest - 1) / largest);
+		if (b == HISTOGRAM_BINS - 1) printf("   %3d+ ms %8u ", b, bins[b]);
+		else printf("%3d-%3d ms %8u ", b, b + 1, bins[b]);
+		for (int i = 0; i < width; ++i) putchar('#');
+		putchar('\n');
+	}
+
+	printf("%u stutters (frames over twice the median)", stutterTotal);
+	for (int p = 0; p < FRAME_PHASE_COUNT; ++p) {
+		if (phaseStutters[p]) printf(", %u %s", phaseStutters[p], phaseNames[p]);
+	}
+	printf("\n");
+	for (size_t s = 0; s < stutterList.size(); ++s) {
+		const Stutter &stutter = stutterList[s];
+		printf("  frame %u : %f ms for a %f ms median, %s %f ms for a %f ms median\n", stutter.frame, stutter.time, stutter.median,
+			phaseNames[stutter.phase], stutter.phaseTime, stutter.phaseMedian);
+	}
+	if (stutterTotal > stutterList.size()) printf("  %u more\n", stutterTotal - (unsigned int)stutterList.size());
+}
@@ -0,0 +1,89 @@
+#ifndef FRAMESTATS_H
+#define FRAMESTATS_H
+
+#include <vector>
+
+// Parts of a frame the stutters are attributed to
+enum FramePhase {
+	PHASE_UPDATE,  // Interpolation and snow of the frame, and the ticks when they ran on the thread that draws
+	PHASE_CULL,    // Light binning, occluders and visibility
+	PHASE_SUBMIT,  // Draw calls
+	PHASE_SWAP,    // Present, waits for the GPU and the vsync
+	PHASE_UPLOAD,  // GL work queued by the jobs, textures and buffers
+	FRAME_PHASE_COUNT
+};
+
+const char *framePhaseName(FramePhase phase);
+
+// Frame time distribution and stutter detection.
+// The percentiles are computed over the last WINDOW frames, the histogram and the
+// maximum cover the whole run. A frame slower than twice the median of the window
+// is a stutter, it is blamed on the phase that exceeds its own median the most.
+// Written and read by the thread that draws.
+class FrameStats {
+	public:
+		static const int WINDOW = 1024;
+		static const int HISTOGRAM_BINS = 100; // Bins of 1 ms, the last one holds everything slower
+		static const int WARMUP_FRAMES = 32;   // No stutter is flagged before the median means something
+		static const int MAX_STUTTERS = 1024;  // Stutters kept for the report, the later ones are only counted
+
+		struct Stutter {
+			unsigned int frame;
+			float time, median; // Milliseconds
+			FramePhase phase;
+			float phaseTime, phaseMedian;
+		};
+
+		struct Summary {
+			unsigned int frames;
+			float average, p50, p95, p99, max; // Milliseconds, over the window
+		};
+
+		FrameStats();
+
+		// Time spent in a phase of the current frame, in milliseconds. Several calls add up
+		void addPhase(FramePhase phase, double time);
+		// Close the current frame, time is its total in milliseconds
+		void endFrame(double time);
+		// Ticks of a snapshot that ran on another thread while the frames were drawn, in milliseconds.
+		// Kept out of the phases : they did not delay any frame
+		void addSimulation(double time);
+
+		// p in [0, 1], over the window
+		float percentile(float p) const;
+		Summary summary() const;
+
+		unsigned int frameCount() const { return frames; }
+		const unsigned int *histogram() const { return bins; }
+		const std::vector<Stutter> &stutters() const { return stutterList; }
+		unsigned int stutterCount() const { return stutterTotal; }
+		unsigned int phaseStutterCount(FramePhase phase) const { return phaseStutters[phase]; }
+
+		// Whole run report, at exit
+		void print() const;
+
+	private:
+		// Value of rank p of the last n entries of a ring
+		static float percentileOf(const float *ring, unsigned int n, float p, std::vector<float> &scratch);
+
+		float times[WINDOW];
+		float phaseTimes[FRAME_PHASE_COUNT][WINDOW];
+		float current[FRAME_PHASE_COUNT];
+		unsigned int frames;
+
+		unsigned int bins[HISTOGRAM_BINS];
+		double totalTime;
+		float maxTime;
+
+		std::vector<Stutter> stutterList;
+		unsigned int stutterTotal;
+		unsigned int phaseStutters[FRAME_PHASE_COUNT];
+
+		double simulationTime;
+		float maxSimulationTime;
+		unsigned int simulationSnapshots;
+
+		mutable std::vector<float> scratch;
+};
+
+#endif
@@ -0,0 +1,375 @@
+#include "GpuCulling.h"
+#include "shader.hpp"
+#include "memorytracker.hpp"
+
+#include <map>
+#include <algorithm>
+
+GpuCulling::GpuCulling() {
+	supported = false;
+	hizSupported = hizValid = false;
+	depthSamples = 0;
+	instanceBuffer = commandBuffer = commandTemplateBuffer = visibleBuffer = 0;
+	cullProgramID = hizProgramID = drawProgramID = 0;
+	depthTexture = depthFramebuffer = hizTexture = 0;
+	width = height = hizLevels = 0;
+	layoutVersion = 0xffffffffu;
+}
+
+GpuCulling::~GpuCulling() {
+	if (!supported) return;
+
+	releaseBuffers();
+	glDeleteBuffers(1, &instanceBuffer);
+	glDeleteBuffers(1, &commandBuffer);
+	glDeleteBuffers(1, &commandTemplateBuffer);
+	glDeleteBuffers(1, &visibleBuffer);
+	glDeleteProgram(cullProgramID);
+	glDeleteProgram(hizProgramID);
+	glDeleteProgram(drawProgramID);
+	glDeleteFramebuffers(1, &depthFramebuffer);
+	MemoryTracker::releaseTexture(depthTexture);
+	MemoryTracker::releaseTexture(hizTexture);
+	glDeleteTextures(1, &depthTexture);
+	glDeleteTextures(1, &hizTexture);
+}
+
+void GpuCulling::releaseBuffers() {
+	MemoryTracker::releaseBuffer(instanceBuffer);
+	MemoryTracker::releaseBuffer(commandBuffer);
+	MemoryTracker::releaseBuffer(commandTemplateBuffer);
+	MemoryTracker::releaseBuffer(visibleBuffer);
+}
+
+void GpuCulling::init(int width, int height) {
+	// Compute shaders, SSBOs and indirect draws
+	supported = GLEW_VERSION_4_3 != 0;
+	if (!supported) {
+		printf("GPU culling needs OpenGL 4.3, disabled\n");
+		return;
+	}
+
+	this->width = width;
+	this->height = height;
+
+	// Programs
+	cullProgramID = LoadComputeShader("cull.computeshader");
+	InstanceCountID = glGetUniformLocation(cullProgramID, "instanceCount");
+	FrustumPlanesID = glGetUniformLocation(cullProgramID, "frustumPlanes");
+	HiZTextureID = glGetUniformLocation(cullProgramID, "hizTexture");
+	UseHiZID = glGetUniformLocation(cullProgramID, "useHiZ");
+	LastViewProjectionID = glGetUniformLocation(cullProgramID, "lastViewProjection");
+
+	hizProgramID = LoadComputeShader("hiz.computeshader");
+	HiZDepthTextureID = glGetUniformLocation(hizProgramID, "depthTexture");
+	HiZDepthMultisampleID = glGetUniformLocation(hizProgramID, "depthTextureMultisample");
+	HiZDepthSamplesID = glGetUniformLocation(hizProgramID, "depthSamples");
+	HiZSourceID = glGetUniformLocation(hizProgramID, "hizTexture");
+	HiZLevelID = glGetUniformLocation(hizProgramID, "level");
+
+	drawProgramID = LoadShaders("lightInstanced.vertexshader", "light.fragmentshader");
+	ViewMatrixID = glGetUniformLocation(drawProgramID, "V");
+	ProjectionMatrixID = glGetUniformLocation(drawProgramID, "P");
+	LightID = glGetUniformLocation(drawProgramID, "LightPosition_worldspace");
+	TextureID = glGetUniformLocation(drawProgramID, "myTextureSampler");
+	NormalTextureID = glGetUniformLocation(drawProgramID, "normalTextureSampler");
+
+	// Depth copy. A blit needs the same format and, between multisampled framebuffers, the same sample
+	// count : the samples are kept and the pyramid takes the farthest of them instead of a driver resolve
+	GLint sceneFramebuffer;
+	glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &sceneFramebuffer);
+	glGetIntegerv(GL_SAMPLES, &depthSamples);
+	int bytesPerSample = 0;
+	GLenum depthFormat = matchingDepthFormat(sceneFramebuffer, bytesPerSample);
+	if (depthFormat) {
+		GLenum target = depthSamples > 0 ? GL_TEXTURE_2D_MULTISAMPLE : GL_TEXTURE_2D;
+		glGenTextures(1, &depthTexture);
+		glBindTexture(target, depthTexture);
+		if (depthSamples > 0) {
+			glTexStorage2DMultisample(target, depthSamples, depthFormat, width, height, GL_TRUE);
+		}
+		else {
+			glTexStorage2D(target, 1, depthFormat, width, height);
+			glTexParameteri(target, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+			glTexParameteri(target, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		}
+		MemoryTracker::trackTexture(depthTexture, (size_t)width * height * bytesPerSample * std::max(depthSamples, 1), MEMORY_RENDER_TARGET, "GPU culling depth copy");
+
+		glGenFramebuffers(1, &depthFramebuffer);
+		glBindFramebuffer(GL_FRAMEBUFFER, depthFramebuffer);
+		bool stencil = depthFormat == GL_DEPTH24_STENCIL8 || depthFormat == GL_DEPTH32F_STENCIL8;
+		glFramebufferTexture(GL_FRAMEBUFFER, stencil ? GL_DEPTH_STENCIL_ATTACHMENT : GL_DEPTH_ATTACHMENT, depthTexture, 0);
+		hizSupported = glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+		glBindFramebuffer(GL_FRAMEBUFFER, sceneFramebuffer);
+	}
+	if (!hizSupported) printf("The depth of the framebuffer cannot be copied, GPU culling without the Hi-Z pyramid\n");
+
+	// Max depth pyramid
+	int hizWidth = std::max(width / 2, 1), hizHeight = std::max(height / 2, 1);
+	hizLevels = 1;
+	while ((hizWidth >> hizLevels) > 0 || (hizHeight >> hizLevels) > 0) hizLevels++;
+
+	glGenTextures(1, &hizTexture);
+	glBindTexture(GL_TEXTURE_2D, hizTexture);
+	glTexStorage2D(GL_TEXTURE_2D, hizLevels, GL_R32F, hizWidth, hizHeight);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	MemoryTracker::trackTexture(hizTexture, MemoryTracker::textureSize(hizTexture), MEMORY_RENDER_TARGET, "Hi-Z pyramid");
+}
+
+GLenum GpuCulling::matchingDepthFormat(GLuint framebuffer, int &bytesPerSample) const {
+	// The default framebuffer names its buffers differently
+	GLenum depthAttachment = framebuffer ? GL_DEPTH_ATTACHMENT : GL_DEPTH;
+	GLenum stencilAttachment = framebuffer ? GL_STENCIL_ATTACHMENT : GL_STENCIL;
+	GLint type = GL_NONE, depthBits = 0, stencilBits = 0, componentType = GL_NONE;
+	glGetFramebufferAttachmentParameteriv(GL_DRAW_FRAMEBUFFER, depthAttachment, GL_FRAMEBUFFER_ATTACHMENT_OBJECT_TYPE, &type);
+	if (type == GL_NONE) return 0;
+	glGetFramebufferAttachmentParameteriv(GL_DRAW_FRAMEBUFFER, depthAttachment, GL_FRAMEBUFFER_ATTACHMENT_DEPTH_SIZE, &depthBits);
+	glGetFramebufferAttachmentParameteriv(GL_DRAW_FRAMEBUFFER, depthAttachment, GL_FRAMEBUFFER_ATTACHMENT_COMPONENT_TYPE, &componentType);
+	glGetFramebufferAttachmentParameteriv(GL_DRAW_FRAMEBUFFER, stencilAttachment, GL_FRAMEBUFFER_ATTACHMENT_OBJECT_TYPE, &type);
+	if (type != GL_NONE) glGetFramebufferAttachmentParameteriv(GL_DRAW_FRAMEBUFFER, stencilAttachment, GL_FRAMEBUFFER_ATTACHMENT_STENCIL_SIZE, &stencilBits);
+
+	bool floating = componentType == GL_FLOAT;
+	if (!floating && depthBits == 24 && stencilBits == 8) return bytesPerSample = 4, GL_DEPTH24_STENCIL8;
+	if (!floating && depthBits == 24 && stencilBits == 0) return bytesPerSample = 4, GL_DEPTH_COMPONENT24;
+	if (!floating && depthBits == 16 && stencilBits == 0) return bytesPerSample = 2, GL_DEPTH_COMPONENT16;
+	if (floating && depthBits == 32 && stencilBits == 8) return bytesPerSample = 8, GL_DEPTH32F_STENCIL8;
+	if (floating && depthBits == 32 && stencilBits == 0) return bytesPerSample = 4, GL_DEPTH_COMPONENT32F;
+	return 0;
+}
+
+void GpuCulling::buildInstances(const EntityStore &entities) {
+	releaseBuffers();
+	glDeleteBuffers(1, &instanceBuffer);
+	glDeleteBuffers(1, &commandBuffer);
+	glDeleteBuffers(1, &commandTemplateBuffer);
+	glDeleteBuffers(1, &visibleBuffer);
+	instanceBuffer = commandBuffer = commandTemplateBuffer = visibleBuffer = 0;
+	groups.clear();
+	instances.clear();
+	layoutVersion = entities.layoutVersion;
+	if (entities.size() == 0) return;
+
+	// One draw group per model and textures, the instances of a group are contiguous in the visible list
+	std::map<std::pair<Model*, std::pair<GLuint, GLuint> >, int> groupIndices;
+	std::vector<int> groupSizes;
+	for (size_t i = 0; i < entities.size(); ++i) {
+		const RenderHandles &handles = entities.render[i];
+		std::pair<Model*, std::pair<GLuint, GLuint> > key(handles.model, std::make_pair(handles.Texture, handles.NormalTexture));
+		if (groupIndices.count(key) == 0) {
+			DrawGroup group;
+			group.model = handles.model;
+			group.Texture = handles.Texture;
+			group.NormalTexture = handles.NormalTexture;
+			groupIndices[key] = (int)groups.size();
+			groups.push_back(group);
+			groupSizes.push_back(0);
+		}
+
+		int group = groupIndices[key];
+		groupSizes[group]++;
+
+		Instance instance;
+		instance.boundsMin = vec4(entities.boundsMin[i], (float)group);
+		instance.boundsMax = vec4(entities.boundsMax[i], 0.0f);
+		instances.push_back(instance);
+	}
+
+	std::vector<DrawElementsIndirectCommand> commands(groups.size());
+	GLuint baseInstance = 0;
+	for (size_t g = 0; g < groups.size(); ++g) {
+		commands[g].count = (GLuint)groups[g].model->indices.size();
+		commands[g].instanceCount = 0;
+		commands[g].firstIndex = 0;
+		commands[g].baseVertex = 0;
+		commands[g].baseInstance = baseInstance;
+		baseInstance += groupSizes[g];
+	}
+
+	// Filled by cull()
+	glGenBuffers(1, &instanceBuffer);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, instanceBuffer);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, instances.size() * sizeof(Instance), NULL, GL_DYNAMIC_DRAW);
+
+	// The template resets the instance counts every frame, copied on the GPU
+	glGenBuffers(1, &commandTemplateBuffer);
+	glBindBuffer(GL_COPY_READ_BUFFER, commandTemplateBuffer);
+	glBufferData(GL_COPY_READ_BUFFER, commands.size() * sizeof(DrawElementsIndirectCommand), &commands[0], GL_STATIC_DRAW);
+
+	glGenBuffers(1, &commandBuffer);
+	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, commandBuffer);
+	glBufferData(GL_DRAW_INDIRECT_BUFFER, commands.size() * sizeof(DrawElementsIndirectCommand), NULL, GL_DYNAMIC_DRAW);
+
+	glGenBuffers(1, &visibleBuffer);
+	glBindBuffer(GL_ARRAY_BUFFER, visibleBuffer);
+	glBufferData(GL_ARRAY_BUFFER, instances.size() * sizeof(GLuint), NULL, GL_DYNAMIC_DRAW);
+
+	MemoryTracker::trackBuffer(instanceBuffer, instances.size() * sizeof(Instance), MEMORY_DYNAMIC, "GPU culling instances");
+	MemoryTracker::trackBuffer(commandTemplateBuffer, commands.size() * sizeof(DrawElementsIndirectCommand), MEMORY_DYNAMIC, "GPU culling commands");
+	MemoryTracker::trackBuffer(commandBuffer, commands.size() * sizeof(DrawElementsIndirectCommand), MEMORY_DYNAMIC, "GPU culling commands");
+	MemoryTracker::trackBuffer(visibleBuffer, instances.size() * sizeof(GLuint), MEMORY_DYNAMIC, "GPU culling instances");
+}
+
+void GpuCulling::cull(const EntityStore &entities, const mat4 *worldMatrices, const mat4 &viewProjection) {
+	if (entities.layoutVersion != layoutVersion) buildInstances(entities);
+	if (instances.empty()) return;
+
+	// Model matrices of this frame
+	for (size_t i = 0; i < instances.size(); ++i) {
+		instances[i].M = worldMatrices[i];
+	}
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, instanceBuffer);
+	glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, instances.size() * sizeof(Instance), &instances[0]);
+
+	// Reset the instance counts
+	glBindBuffer(GL_COPY_READ_BUFFER, commandTemplateBuffer);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, commandBuffer);
+	glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, groups.size() * sizeof(DrawElementsIndirectCommand));
+
+	// Frustum planes, rows of the view projection matrix combined
+	vec4 planes[6];
+	for (int i = 0; i < 3; ++i) {
+		vec4 row(viewProjection[0][i], viewProjection[1][i], viewProjection[2][i], viewProjection[3][i]);
+		vec4 w(viewProjection[0][3], viewProjection[1][3], viewProjection[2][3], viewProjection[3][3]);
+		planes[i * 2] = w + row;
+		planes[i * 2 + 1] = w - row;
+	}
+	for (int i = 0; i < 6; ++i) {
+		planes[i] /= length(vec3(planes[i]));
+	}
+
+	glUseProgram(cullProgramID);
+	glUniform1ui(InstanceCountID, (GLuint)instances.size());
+	glUniform4fv(FrustumPlanesID, 6, &planes[0][0]);
+	glUniform1i(UseHiZID, hizValid);
+	glUniformMatrix4fv(LastViewProjectionID, 1, GL_FALSE, &lastViewProjection[0][0]);
+
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_2D, hizTexture);
+	glUniform1i(HiZTextureID, 0);
+
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, instanceBuffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, commandBuffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, visibleBuffer);
+
+	glDispatchCompute(((GLuint)instances.size() + 63) / 64, 1, 1);
+
+	// The commands and the visible list are consumed by the draws
+	glMemoryBarrier(GL_COMMAND_BARRIER_BIT | GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT | GL_SHADER_STORAGE_BARRIER_BIT);
+}
+
+void GpuCulling::draw(const mat4 &ViewMatrix, const mat4 &ProjectionMatrix, vec3 lightPos) {
+	if (instances.empty()) return;
+
+	glUseProgram(drawProgramID);
+
+	glUniformMatrix4fv(ViewMatrixID, 1, GL_FALSE, &ViewMatrix[0][0]);
+	glUniformMatrix4fv(ProjectionMatrixID, 1, GL_FALSE, &ProjectionMatrix[0][0]);
+	glUniform3f(LightID, lightPos.x, lightPos.y, lightPos.z);
+	glUniform1i(TextureID, 0);
+	glUniform1i(NormalTextureID, 1);
+	glDepthMask(GL_TRUE);
+
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, instanceBuffer);
+	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, commandBuffer);
+
+	// Instance index, offset by the baseInstance of each command
+	glEnableVertexAttribArray(5);
+	glBindBuffer(GL_ARRAY_BUFFER, visibleBuffer);
+	glVertexAttribIPointer(5, 1, GL_UNSIGNED_INT, 0, (GLvoid*)0);
+	glVertexAttribDivisor(5, 1);
+
+	for (size_t g = 0; g < groups.size(); ++g) {
+		DrawGroup &group = groups[g];
+
+		glActiveTexture(GL_TEXTURE0);
+		glBindTexture(GL_TEXTURE_2D, group.Texture);
+		glActiveTexture(GL_TEXTURE1);
+		glBindTexture(GL_TEXTURE_2D, group.NormalTexture);
+
+		// Vertices
+		glEnableVertexAttribArray(0);
+		glBindBuffer(GL_ARRAY_BUFFER, group.model->VBO);
+		glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, (GLvoid*)0);
+
+		// UVs
+		glEnableVertexAttribArray(1);
+		glBindBuffer(GL_ARRAY_BUFFER, group.model->UVBO);
+		glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 0, (GLvoid*)0);
+
+		// Normals
+		glEnableVertexAttribArray(2);
+		glBindBuffer(GL_ARRAY_BUFFER, group.model->NBO);
+		glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, 0, (GLvoid*)0);
+
+		// Tangents
+		glEnableVertexAttribArray(3);
+		glBindBuffer(GL_ARRAY_BUFFER, group.model->tangentbuffer);
+		glVertexAttribPointer(3, 3, GL_FLOAT, GL_FALSE, 0, (GLvoid*)0);
+
+		// Bitangents
+		glEnableVertexAttribArray(4);
+		glBindBuffer(GL_ARRAY_BUFFER, group.model->bitangentbuffer);
+		glVertexAttribPointer(4, 3, GL_FLOAT, GL_FALSE, 0, (GLvoid*)0);
+
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, group.model->elementbuffer);
+
+		glDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_SHORT, (GLvoid*)(g * sizeof(DrawElementsIndirectCommand)));
+	}
+
+	// The vertex array is shared with the other passes
+	glVertexAttribDivisor(5, 0);
+	glDisableVertexAttribArray(5);
+	glDisableVertexAttribArray(0);
+	glDisableVertexAttribArray(1);
+	glDisableVertexAttribArray(3);
+}
+
+void GpuCulling::buildHiZ(const mat4 &viewProjection) {
+	hizValid = false;
+	if (!hizSupported) return;
+
+	// Copy the depth of the framebuffer drawn, the window or the headless one. The formats were matched
+	// by init(), an error here means the framebuffer changed : no culling against a copy that failed
+	GLint sceneFramebuffer;
+	glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &sceneFramebuffer);
+	glBindFramebuffer(GL_READ_FRAMEBUFFER, sceneFramebuffer);
+	glBindFramebuffer(GL_DRAW_FRAMEBUFFER, depthFramebuffer);
+	while (glGetError() != GL_NO_ERROR) {} // Not the blit's
+	glBlitFramebuffer(0, 0, width, height, 0, 0, width, height, GL_DEPTH_BUFFER_BIT, GL_NEAREST);
+	GLenum error = glGetError();
+	glBindFramebuffer(GL_FRAMEBUFFER, sceneFramebuffer);
+	if (error != GL_NO_ERROR) {
+		printf("Depth copy for the Hi-Z pyramid failed (0x%x), GPU culling without it\n", error);
+		hizSupported = false;
+		return;
+	}
+
+	glUseProgram(hizProgramID);
+
+	// Each sampler type on its own unit, even the one not read
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(depthSamples > 0 ? GL_TEXTURE_2D_MULTISAMPLE : GL_TEXTURE_2D, depthTexture);
+	glUniform1i(depthSamples > 0 ? HiZDepthMultisampleID : HiZDepthTextureID, 0);
+	glUniform1i(depthSamples > 0 ? HiZDepthTextureID : HiZDepthMultisampleID, 2);
+	glUniform1i(HiZDepthSamplesID, depthSamples);
+	glActiveTexture(GL_TEXTURE1);
+	glBindTexture(GL_TEXTURE_2D, hizTexture);
+	glUniform1i(HiZSourceID, 1);
+
+	int levelWidth = std::max(width / 2, 1), levelHeight = std::max(height / 2, 1);
+	for (int level = 0; level < hizLevels; ++level) {
+		glUniform1i(HiZLevelID, level);
+		glBindImageTexture(0, hizTexture, level, GL_FALSE, 0, GL_WRITE_ONLY, GL_R32F);
+		glDispatchCompute((levelWidth + 7) / 8, (levelHeight + 7) / 8, 1);
+
+		// The next level reads this one
+		glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT | GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+
+		levelWidth = std::max(levelWidth / 2, 1);
+		levelHeight = std::max(levelHeight / 2, 1);
+	}
+
+	lastViewProjection = viewProjection;
+	hizValid = true;
+}
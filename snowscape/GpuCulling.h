@@ -0,0 +1,88 @@
+#ifndef GPUCULLING_H
+#define GPUCULLING_H
+
+#include <vector>
+#include <GL/glew.h>
+
+#include <glm/glm.hpp>
+using namespace glm;
+
+#include "EntityStore.h"
+
+// GPU driven culling, needs a GL 4.3 context.
+// The instances of the scene live in a SSBO, a compute shader tests them against
+// the frustum and the max depth pyramid of the last frame, appends the survivors
+// to the instance list of their draw group and writes the indirect draw commands.
+// The CPU never reads anything back.
+class GpuCulling {
+	public:
+		bool supported;
+
+		GpuCulling();
+		~GpuCulling();
+
+		// Programs and depth pyramid
+		void init(int width, int height);
+		// Upload the instances and run the culling pass, the draw groups are rebuilt when entities were created or destroyed.
+		// worldMatrices are those of this frame, one per entity
+		void cull(const EntityStore &entities, const mat4 *worldMatrices, const mat4 &viewProjection);
+		// Draw the surviving instances, one indirect draw per group
+		void draw(const mat4 &ViewMatrix, const mat4 &ProjectionMatrix, vec3 lightPos);
+		// Build the depth pyramid used to cull the next frame, once the opaque objects are drawn
+		void buildHiZ(const mat4 &viewProjection);
+		// Forget the pyramid, called while another culling mode draws : it would be stale when this one comes back
+		void invalidateHiZ() { hizValid = false; }
+
+		GLuint getDrawProgram() const { return drawProgramID; }
+		// Indirect draws issued by draw(), their triangle count stays on the GPU
+		int drawCount() const { return (int)groups.size(); }
+
+	private:
+		// Draw groups (same model and textures) and the buffers sized for them
+		void buildInstances(const EntityStore &entities);
+		// Drop the instance buffers from the memory accounting, before they are deleted
+		void releaseBuffers();
+
+		struct Instance {
+			mat4 M;
+			vec4 boundsMin; // Model space bounds, w : draw group
+			vec4 boundsMax;
+		};
+
+		struct DrawElementsIndirectCommand {
+			GLuint count;
+			GLuint instanceCount;
+			GLuint firstIndex;
+			GLuint baseVertex;
+			GLuint baseInstance;
+		};
+
+		struct DrawGroup {
+			Model *model;
+			GLuint Texture, NormalTexture;
+		};
+
+		std::vector<DrawGroup> groups;
+		std::vector<Instance> instances;
+		unsigned int layoutVersion;
+
+		GLuint instanceBuffer, commandBuffer, commandTemplateBuffer, visibleBuffer;
+
+		GLuint cullProgramID, hizProgramID, drawProgramID;
+		GLuint InstanceCountID, FrustumPlanesID, HiZTextureID, UseHiZID, LastViewProjectionID;
+		GLuint HiZDepthTextureID, HiZDepthMultisampleID, HiZDepthSamplesID, HiZSourceID, HiZLevelID;
+		GLuint ViewMatrixID, ProjectionMatrixID, LightID, TextureID, NormalTextureID;
+
+		// Same depth format and sample count as the framebuffer drawn, so it can be blitted. 0 if there is none
+		GLenum matchingDepthFormat(GLuint framebuffer, int &bytesPerSample) const;
+
+		// Depth copied from the framebuffer drawn, multisampled like it, and its max pyramid, half resolution at level 0
+		GLuint depthTexture, depthFramebuffer, hizTexture;
+		GLint depthSamples; // 0 when the copy is not multisampled
+		int width, height, hizLevels;
+		mat4 lastViewProjection;
+		bool hizSupported; // False when the depth of the framebuffer drawn cannot be copied, only the frustum culls then
+		bool hizValid;
+};
+
+#endif
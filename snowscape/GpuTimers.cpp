@@ -0,0 +1,84 @@
+#include "GpuTimers.h"
+
+GpuTimers::GpuTimers() {
+	current = 0;
+	initialized = false;
+	openCount = 0;
+	clockOffset = 0;
+	passCount = 0;
+	for (int f = 0; f < LATENCY; ++f) {
+		frames[f].count = 0;
+	}
+}
+
+GpuTimers::~GpuTimers() {
+	if (!initialized) return;
+	for (int f = 0; f < LATENCY; ++f) {
+		glDeleteQueries(MAX_PASSES * 2, frames[f].queries);
+	}
+}
+
+void GpuTimers::init() {
+	for (int f = 0; f < LATENCY; ++f) {
+		glGenQueries(MAX_PASSES * 2, frames[f].queries);
+	}
+
+	// Place the GPU timestamps on the timeline of the CPU events
+	GLint64 gpuTime = 0;
+	glGetInteger64v(GL_TIMESTAMP, &gpuTime);
+	clockOffset = (long long)Profiler::now() - (long long)gpuTime;
+	initialized = true;
+}
+
+void GpuTimers::beginFrame() {
+	if (!initialized) return;
+
+	current = (current + 1) % LATENCY;
+	Frame &frame = frames[current];
+
+	if (frame.count > 0) {
+		// Should be long done, the frame is dropped rather than waited for if it is not
+		GLuint available = 0;
+		glGetQueryObjectuiv(frame.queries[frame.lastQuery], GL_QUERY_RESULT_AVAILABLE, &available);
+		if (available) {
+			passCount = frame.count;
+			for (int p = 0; p < frame.count; ++p) {
+				GLuint64 start = 0, end = 0;
+				glGetQueryObjectui64v(frame.queries[p * 2], GL_QUERY_RESULT, &start);
+				glGetQueryObjectui64v(frame.queries[p * 2 + 1], GL_QUERY_RESULT, &end);
+				passNames[p] = frame.names[p];
+				passTimes[p] = (end - start) / 1000000.0;
+
+				if (Profiler::enabled()) Profiler::recordGpu(frame.names[p], start + clockOffset, end + clockOffset);
+			}
+		}
+	}
+
+	frame.count = 0;
+	openCount = 0;
+}
+
+void GpuTimers::begin(const char *name) {
+	if (!initialized || openCount == MAX_PASSES) return;
+
+	// Past MAX_PASSES the pass is not timed, end() still has to match it
+	Frame &frame = frames[current];
+	int pass = frame.count < MAX_PASSES ? frame.count++ : -1;
+	openPasses[openCount++] = pass;
+	if (pass < 0) return;
+
+	frame.names[pass] = name;
+	glQueryCounter(frame.queries[pass * 2], GL_TIMESTAMP);
+	frame.lastQuery = pass * 2;
+}
+
+void GpuTimers::end() {
+	if (!initialized || openCount == 0) return;
+
+	int pass = openPasses[--openCount];
+	if (pass < 0) return;
+
+	Frame &frame = frames[current];
+	glQueryCounter(frame.queries[pass * 2 + 1], GL_TIMESTAMP);
+	frame.lastQuery = pass * 2 + 1;
+}
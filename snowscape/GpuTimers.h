@@ -0,0 +1,63 @@
+#ifndef GPUTIMERS_H
+#define GPUTIMERS_H
+
+#include <GL/glew.h>
+
+#include "Profiler.h"
+
+// GPU time of the render passes, with glQueryCounter timestamps around each pass.
+// The queries of a frame are read back LATENCY frames later, by then the GPU is
+// done with them and reading never stalls. Render thread only.
+class GpuTimers {
+	public:
+		static const int LATENCY = 4;
+		static const int MAX_PASSES = 16;
+
+		GpuTimers();
+		~GpuTimers();
+
+		void init();
+		// Collect the frame issued LATENCY frames ago and reuse its queries
+		void beginFrame();
+		void begin(const char *name);
+		void end();
+
+		// Passes of the last collected frame, in milliseconds
+		int passCount;
+		const char *passNames[MAX_PASSES];
+		double passTimes[MAX_PASSES];
+
+	private:
+		struct Frame {
+			GLuint queries[MAX_PASSES * 2]; // Begin and end timestamp of each pass
+			const char *names[MAX_PASSES];
+			int count;
+			int lastQuery; // Written last, once it is available all the others are
+		};
+
+		Frame frames[LATENCY];
+		int current;
+		bool initialized;
+		// Passes begun and not ended yet, they may nest
+		int openPasses[MAX_PASSES];
+		int openCount;
+		// Offset from the GPU clock to the profiler clock
+		long long clockOffset;
+};
+
+class GpuScope {
+	public:
+		GpuScope(GpuTimers *timers, const char *name) : timers(timers) { timers->begin(name); }
+		~GpuScope() { timers->end(); }
+
+	private:
+		GpuTimers *timers;
+};
+
+#ifdef SNOWSCAPE_NO_PROFILER
+#define GPU_PROFILE_SCOPE(timers, name)
+#else
+#define GPU_PROFILE_SCOPE(timers, name) GpuScope PROFILE_CONCAT(gpuScope, __LINE__)(timers, name)
+#endif
+
+#endif
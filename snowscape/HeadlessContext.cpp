@@ -0,0 +1,158 @@
+#include "HeadlessContext.h"
+#include "memorytracker.hpp"
+
+#include <stdio.h>
+
+#ifndef _WIN32
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#endif
+
+HeadlessContext::HeadlessContext() {
+	framebuffer = colorBuffer = depthBuffer = 0;
+	width = height = 0;
+	api = "none";
+	eglDisplay = eglContext = NULL;
+	window = NULL;
+}
+
+HeadlessContext::~HeadlessContext() {
+	if (framebuffer) {
+		glDeleteFramebuffers(1, &framebuffer);
+		MemoryTracker::releaseRenderbuffer(colorBuffer);
+		MemoryTracker::releaseRenderbuffer(depthBuffer);
+		glDeleteRenderbuffers(1, &colorBuffer);
+		glDeleteRenderbuffers(1, &depthBuffer);
+	}
+
+#ifndef _WIN32
+	if (eglContext) {
+		eglMakeCurrent((EGLDisplay)eglDisplay, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+		eglDestroyContext((EGLDisplay)eglDisplay, (EGLContext)eglContext);
+		eglTerminate((EGLDisplay)eglDisplay);
+	}
+#endif
+
+	if (window) {
+		glfwDestroyWindow(window);
+		glfwTerminate();
+	}
+}
+
+bool HeadlessContext::create(int width, int height) {
+	this->width = width;
+	this->height = height;
+
+	if (createEGL()) {
+		api = "EGL surfaceless";
+		return true;
+	}
+	if (createHiddenWindow()) {
+		api = "hidden GLFW window";
+		return true;
+	}
+
+	fprintf(stderr, "Failed to create a headless GL context\n");
+	return false;
+}
+
+bool HeadlessContext::createEGL() {
+#ifndef _WIN32
+	// The surfaceless platform needs no X or Wayland server, the default display is tried otherwise
+	EGLDisplay display = EGL_NO_DISPLAY;
+	PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay = (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+	if (getPlatformDisplay) display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+	if (display == EGL_NO_DISPLAY) display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+	if (display == EGL_NO_DISPLAY || !eglInitialize(display, NULL, NULL)) return false;
+
+	if (!eglBindAPI(EGL_OPENGL_API)) {
+		eglTerminate(display);
+		return false;
+	}
+
+	// The surfaceless platform may have no config at all, a context without one only draws to framebuffer objects anyway
+	EGLint configAttributes[] = { EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT, EGL_NONE };
+	EGLConfig config = EGL_NO_CONFIG_KHR;
+	EGLint configCount = 0;
+	if (!eglChooseConfig(display, configAttributes, &config, 1, &configCount) || configCount == 0) config = EGL_NO_CONFIG_KHR;
+
+	// 4.5 for the GPU culling, everything else runs on 3.3
+	EGLContext context = EGL_NO_CONTEXT;
+	const EGLint versions[2][2] = { { 4, 5 }, { 3, 3 } };
+	for (int v = 0; v < 2 && context == EGL_NO_CONTEXT; ++v) {
+		EGLint contextAttributes[] = {
+			EGL_CONTEXT_MAJOR_VERSION, versions[v][0],
+			EGL_CONTEXT_MINOR_VERSION, versions[v][1],
+			EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+			EGL_NONE
+		};
+		context = eglCreateContext(display, config, EGL_NO_CONTEXT, contextAttributes);
+	}
+
+	// No surface at all, everything goes to the framebuffer object
+	if (context == EGL_NO_CONTEXT || !eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, context)) {
+		if (context != EGL_NO_CONTEXT) eglDestroyContext(display, context);
+		eglTerminate(display);
+		return false;
+	}
+
+	eglDisplay = display;
+	eglContext = context;
+	return true;
+#else
+	return false;
+#endif
+}
+
+bool HeadlessContext::createHiddenWindow() {
+	if (!glfwInit()) return false;
+
+	glfwWindowHint(GLFW_VISIBLE, GL_FALSE);
+	glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
+	glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 5);
+	glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
+	glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+	window = glfwCreateWindow(width, height, "Snowscape", NULL, NULL);
+	if (window == NULL) {
+		glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
+		glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
+		window = glfwCreateWindow(width, height, "Snowscape", NULL, NULL);
+	}
+	if (window == NULL) {
+		glfwTerminate();
+		return false;
+	}
+
+	glfwMakeContextCurrent(window);
+	// Nothing is ever presented, but the swap interval would not matter anyway
+	glfwSwapInterval(0);
+	return true;
+}
+
+bool HeadlessContext::createFramebuffer() {
+	glGenRenderbuffers(1, &colorBuffer);
+	glBindRenderbuffer(GL_RENDERBUFFER, colorBuffer);
+	glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+
+	// Same format as the default framebuffer, the GPU culling blits its depth
+	glGenRenderbuffers(1, &depthBuffer);
+	glBindRenderbuffer(GL_RENDERBUFFER, depthBuffer);
+	glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH24_STENCIL8, width, height);
+
+	glGenFramebuffers(1, &framebuffer);
+	glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, colorBuffer);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_RENDERBUFFER, depthBuffer);
+
+	if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+		fprintf(stderr, "Offscreen framebuffer incomplete\n");
+		return false;
+	}
+
+	// Both are 4 bytes a pixel
+	MemoryTracker::trackRenderbuffer(colorBuffer, (size_t)width * height * 4, MEMORY_RENDER_TARGET, "offscreen framebuffer");
+	MemoryTracker::trackRenderbuffer(depthBuffer, (size_t)width * height * 4, MEMORY_RENDER_TARGET, "offscreen framebuffer");
+
+	glViewport(0, 0, width, height);
+	return true;
+}
@@ -0,0 +1,41 @@
+#ifndef HEADLESSCONTEXT_H
+#define HEADLESSCONTEXT_H
+
+#include <GL/glew.h>
+#include <GLFW/glfw3.h>
+
+// Not in the GLEW built for Windows, where glewInit never returns it
+#ifndef GLEW_ERROR_NO_GLX_DISPLAY
+#define GLEW_ERROR_NO_GLX_DISPLAY 4
+#endif
+
+// GL context without a visible window, for the benchmark runs on machines without a display.
+// Outside Windows it is an EGL context without any surface (Mesa llvmpipe works, no X
+// server needed), on Windows or if EGL fails it falls back to a hidden GLFW window. Either way the frames are drawn
+// in an offscreen framebuffer of the requested size.
+class HeadlessContext {
+	public:
+		HeadlessContext();
+		~HeadlessContext();
+
+		// Create the context and make it current on the calling thread
+		bool create(int width, int height);
+		// Offscreen color and depth, call once GLEW is initialized. Leaves it bound
+		bool createFramebuffer();
+
+		GLuint framebuffer;
+		int width, height;
+		const char *api; // What create() ended up using
+		// GLEW looks for a GLX display next to the context, there is none then
+		bool usesEGL() const { return eglContext != NULL; }
+
+	private:
+		bool createEGL();
+		bool createHiddenWindow();
+
+		void *eglDisplay, *eglContext;
+		GLFWwindow *window;
+		GLuint colorBuffer, depthBuffer;
+};
+
+#endif
@@ -0,0 +1,269 @@
+#include "JobSystem.h"
+#include "Profiler.h"
+
+#include <stdio.h>
+#include <algorithm>
+
+static thread_local unsigned int currentThreadIndex = 0;
+
+JobSystem::JobSystem(unsigned int threadCount, unsigned int externalThreads) {
+	if (threadCount == 0) threadCount = std::max(std::thread::hardware_concurrency(), 1u);
+
+	queuedJobs = 0;
+	backgroundJobs = 0;
+	quit = false;
+	attachedThreads = threadCount;
+
+	for (unsigned int i = 0; i < threadCount + externalThreads; ++i) {
+		queues.push_back(new WorkQueue());
+	}
+	for (unsigned int i = 1; i < threadCount; ++i) {
+		workers.push_back(std::thread(&JobSystem::workerLoop, this, i));
+	}
+	if (workers.empty()) backgroundWorker = std::thread(&JobSystem::backgroundLoop, this);
+}
+
+JobSystem::~JobSystem() {
+	{
+		std::lock_guard<std::mutex> lock(sleepLock);
+		quit = true;
+	}
+	wakeUp.notify_all();
+	for (size_t i = 0; i < workers.size(); ++i) {
+		workers[i].join();
+	}
+	if (backgroundWorker.joinable()) backgroundWorker.join();
+	for (size_t i = 0; i < queues.size(); ++i) {
+		delete queues[i];
+	}
+}
+
+unsigned int JobSystem::threadIndex() {
+	return currentThreadIndex;
+}
+
+void JobSystem::attachThread() {
+	unsigned int index = attachedThreads++;
+	if (index >= queues.size()) {
+		printf("No job queue left for another thread, sharing the main thread one\n");
+		index = 0;
+	}
+	currentThreadIndex = index;
+}
+
+void JobSystem::push(const Job &job) {
+	// Threads unknown to the job system share the queue of the main thread
+	WorkQueue *queue = queues[currentThreadIndex < queues.size() ? currentThreadIndex : 0];
+	{
+		std::lock_guard<std::mutex> lock(queue->lock);
+		queue->jobs.push_back(job);
+	}
+	queuedJobs++;
+	wake();
+}
+
+void JobSystem::wake() {
+	// Taking the lock makes sure a thread about to sleep sees the new job
+	{
+		std::lock_guard<std::mutex> lock(sleepLock);
+	}
+	wakeUp.notify_one();
+	counterWakeUp.notify_all();
+}
+
+bool JobSystem::pop(Job &job) {
+	unsigned int count = (unsigned int)queues.size();
+	unsigned int self = currentThreadIndex < count ? currentThreadIndex : 0;
+
+	// Own jobs first, newest first while they are still in cache
+	{
+		WorkQueue *queue = queues[self];
+		std::lock_guard<std::mutex> lock(queue->lock);
+		if (!queue->jobs.empty()) {
+			job = queue->jobs.back();
+			queue->jobs.pop_back();
+			queuedJobs--;
+			return true;
+		}
+	}
+
+	// Then steal the oldest job of another thread
+	for (unsigned int i = 1; i < count; ++i) {
+		WorkQueue *queue = queues[(self + i) % count];
+		std::lock_guard<std::mutex> lock(queue->lock);
+		if (!queue->jobs.empty()) {
+			job = queue->jobs.front();
+			queue->jobs.pop_front();
+			queuedJobs--;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+bool JobSystem::popBackground(Job &job, const JobCounter *counter) {
+	std::lock_guard<std::mutex> lock(backgroundQueue.lock);
+	for (std::deque<Job>::iterator it = backgroundQueue.jobs.begin(); it != backgroundQueue.jobs.end(); ++it) {
+		if (counter && it->counter != counter) continue;
+		job = *it;
+		backgroundQueue.jobs.erase(it);
+		backgroundJobs--;
+		return true;
+	}
+	return false;
+}
+
+bool JobSystem::hasBackground(const JobCounter *counter) {
+	std::lock_guard<std::mutex> lock(backgroundQueue.lock);
+	for (std::deque<Job>::const_iterator it = backgroundQueue.jobs.begin(); it != backgroundQueue.jobs.end(); ++it) {
+		if (it->counter == counter) return true;
+	}
+	return false;
+}
+
+void JobSystem::execute(Job &job) {
+	job.function();
+	if (job.counter) finish(job.counter);
+}
+
+void JobSystem::finish(JobCounter *counter) {
+	// Release the jobs waiting for this counter. The counter is not touched once the lock is
+	// released, wait() takes it before returning so the counter can live on the stack.
+	std::vector<JobCounter::Continuation> continuations;
+	{
+		std::lock_guard<std::mutex> lock(counter->lock);
+		if (--counter->pending > 0) return;
+		continuations.swap(counter->continuations);
+	}
+	for (size_t i = 0; i < continuations.size(); ++i) {
+		Job job = { continuations[i].function, continuations[i].counter };
+		push(job);
+	}
+
+	// The threads in wait() sleep until their counter is done
+	{
+		std::lock_guard<std::mutex> lock(sleepLock);
+	}
+	counterWakeUp.notify_all();
+}
+
+void JobSystem::run(const Function &job, JobCounter *counter) {
+	if (counter) counter->pending++;
+	Job newJob = { job, counter };
+	push(newJob);
+}
+
+void JobSystem::runAfter(JobCounter &dependency, const Function &job, JobCounter *counter) {
+	if (counter) counter->pending++;
+
+	{
+		std::lock_guard<std::mutex> lock(dependency.lock);
+		if (dependency.pending > 0) {
+			JobCounter::Continuation continuation = { job, counter };
+			dependency.continuations.push_back(continuation);
+			return;
+		}
+	}
+
+	Job newJob = { job, counter };
+	push(newJob);
+}
+
+void JobSystem::runBackground(const Function &job, JobCounter *counter) {
+	if (counter) counter->pending++;
+	Job newJob = { job, counter };
+	{
+		std::lock_guard<std::mutex> lock(backgroundQueue.lock);
+		backgroundQueue.jobs.push_back(newJob);
+	}
+	backgroundJobs++;
+	wake();
+}
+
+void JobSystem::wait(JobCounter &counter) {
+	while (counter.pending > 0) {
+		Job job;
+		if (pop(job) || popBackground(job, &counter)) {
+			execute(job);
+			continue;
+		}
+
+		// The jobs left run elsewhere, another background job would hold this thread for too long
+		std::unique_lock<std::mutex> lock(sleepLock);
+		counterWakeUp.wait(lock, [this, &counter] { return counter.pending == 0 || queuedJobs > 0 || hasBackground(&counter); });
+	}
+
+	// The thread that finished the last job may still hold the lock
+	std::lock_guard<std::mutex> lock(counter.lock);
+}
+
+void JobSystem::parallelFor(size_t count, size_t grainSize, const RangeFunction &body) {
+	if (count == 0) return;
+	grainSize = std::max(grainSize, (size_t)1);
+
+	// Not worth a job
+	if (count <= grainSize || queues.size() == 1) {
+		body(0, count);
+		return;
+	}
+
+	JobCounter counter;
+	for (size_t begin = grainSize; begin < count; begin += grainSize) {
+		size_t end = std::min(begin + grainSize, count);
+		run([&body, begin, end] { body(begin, end); }, &counter);
+	}
+	// The first chunk on this thread
+	body(0, grainSize);
+	wait(counter);
+}
+
+void JobSystem::runOnGLThread(const Function &job) {
+	std::lock_guard<std::mutex> lock(glThreadLock);
+	glThreadJobs.push_back(job);
+}
+
+void JobSystem::flushGLThread() {
+	std::vector<Function> jobs;
+	{
+		std::lock_guard<std::mutex> lock(glThreadLock);
+		jobs.swap(glThreadJobs);
+	}
+	for (size_t i = 0; i < jobs.size(); ++i) {
+		jobs[i]();
+	}
+}
+
+void JobSystem::workerLoop(unsigned int index) {
+	currentThreadIndex = index;
+	Profiler::setThreadName("Job worker");
+
+	for (;;) {
+		Job job;
+		if (pop(job) || popBackground(job, NULL)) {
+			execute(job);
+			continue;
+		}
+
+		std::unique_lock<std::mutex> lock(sleepLock);
+		wakeUp.wait(lock, [this] { return quit || queuedJobs > 0 || backgroundJobs > 0; });
+		if (quit) return;
+	}
+}
+
+void JobSystem::backgroundLoop() {
+	// Its jobs share the queue of the main thread
+	Profiler::setThreadName("Background jobs");
+
+	for (;;) {
+		Job job;
+		if (popBackground(job, NULL)) {
+			execute(job);
+			continue;
+		}
+
+		std::unique_lock<std::mutex> lock(sleepLock);
+		wakeUp.wait(lock, [this] { return quit || backgroundJobs > 0; });
+		if (quit) return;
+	}
+}
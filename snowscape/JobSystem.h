@@ -0,0 +1,117 @@
+#ifndef JOBSYSTEM_H
+#define JOBSYSTEM_H
+
+#include <vector>
+#include <deque>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
+class JobSystem;
+
+// Number of unfinished jobs of a group. Jobs queued with runAfter() start once it reaches zero.
+class JobCounter {
+	public:
+		JobCounter() : pending(0) {}
+		bool done() const { return pending == 0; }
+
+	private:
+		friend class JobSystem;
+		struct Continuation {
+			std::function<void()> function;
+			JobCounter *counter;
+		};
+
+		std::atomic<int> pending;
+		std::mutex lock;
+		std::vector<Continuation> continuations;
+};
+
+// Work stealing job system.
+// Every thread owns a deque of jobs : it pushes and pops at the back, idle
+// threads steal from the front of the others. The main thread is thread 0 and
+// runs jobs while it waits, other threads created outside the job system (the
+// render thread) attach themselves to get their own queue. GL calls must stay on
+// the thread that owns the context, jobs queue them with runOnGLThread() and
+// that thread runs them in flushGLThread().
+// Long or blocking jobs (tile generation, file reads) go to one shared background
+// queue instead. Idle workers take them, a waiting thread only takes those of the
+// counter it waits for, so a frame waiting for short jobs never runs one of them.
+class JobSystem {
+	public:
+		typedef std::function<void()> Function;
+		typedef std::function<void(size_t begin, size_t end)> RangeFunction;
+
+		// threadCount includes the main thread, 0 uses every core. externalThreads more queues are
+		// reserved for the threads that will call attachThread()
+		JobSystem(unsigned int threadCount = 0, unsigned int externalThreads = 0);
+		~JobSystem();
+
+		// Threads running jobs, the main thread and the workers
+		unsigned int threadCount() const { return (unsigned int)workers.size() + 1; }
+		// Bound of threadIndex(), the reserved queues of the attached threads included
+		unsigned int queueCount() const { return (unsigned int)queues.size(); }
+		// Index of the calling thread, 0 for the main thread
+		static unsigned int threadIndex();
+		// Give the calling thread one of the reserved queues, before it runs or waits for any job
+		void attachThread();
+
+		// Queue a job, counter (optional) is incremented now and decremented once the job is done
+		void run(const Function &job, JobCounter *counter = NULL);
+		// Queue a job once dependency reaches zero
+		void runAfter(JobCounter &dependency, const Function &job, JobCounter *counter = NULL);
+		// Queue a long or blocking job on the background queue
+		void runBackground(const Function &job, JobCounter *counter = NULL);
+		// Run jobs until the counter reaches zero : any short job, the background ones of this counter only.
+		// Sleeps while there is none
+		void wait(JobCounter &counter);
+		// body(begin, end) over [0, count) in chunks of grainSize items, returns once every chunk is done
+		void parallelFor(size_t count, size_t grainSize, const RangeFunction &body);
+
+		// Queue a job for the thread that owns the GL context
+		void runOnGLThread(const Function &job);
+		// GL thread only, run the queued GL jobs
+		void flushGLThread();
+
+	private:
+		struct Job {
+			Function function;
+			JobCounter *counter;
+		};
+
+		struct WorkQueue {
+			std::mutex lock;
+			std::deque<Job> jobs;
+		};
+
+		void push(const Job &job);
+		void wake();
+		bool pop(Job &job);
+		// Oldest background job of counter, of any counter when NULL
+		bool popBackground(Job &job, const JobCounter *counter);
+		bool hasBackground(const JobCounter *counter);
+		void execute(Job &job);
+		void finish(JobCounter *counter);
+		void workerLoop(unsigned int index);
+		void backgroundLoop();
+
+		std::vector<WorkQueue*> queues;
+		std::vector<std::thread> workers;
+		// Without workers, a thread of its own runs the background jobs
+		std::thread backgroundWorker;
+
+		WorkQueue backgroundQueue;
+		std::atomic<int> queuedJobs, backgroundJobs;
+		std::mutex sleepLock;
+		std::condition_variable wakeUp, counterWakeUp; // Idle workers, threads in wait()
+		bool quit;
+
+		std::atomic<unsigned int> attachedThreads;
+
+		std::mutex glThreadLock;
+		std::vector<Function> glThreadJobs;
+};
+
+#endif
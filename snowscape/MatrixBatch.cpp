@@ -0,0 +1,76 @@
+#include "MatrixBatch.h"
+#include "cpufeatures.hpp"
+
+#include <emmintrin.h>
+
+MatrixBatchPath bestMatrixBatchPath() {
+	static MatrixBatchPath path = cpuHasAVX() ? MATRIX_BATCH_AVX : cpuHasSSE2() ? MATRIX_BATCH_SSE : MATRIX_BATCH_SCALAR;
+	return path;
+}
+
+const char *matrixBatchPathName(MatrixBatchPath path) {
+	static const char *names[] = { "scalar", "SSE", "AVX" };
+	return names[path];
+}
+
+static void computeScalar(const mat4 *world, const unsigned int *indices, size_t count,
+	const mat4 &ViewMatrix, const mat4 &ProjectionMatrix, unsigned char *output, size_t stride) {
+	for (size_t i = 0; i < count; ++i) {
+		const mat4 &ModelMatrix = world[indices[i]];
+		mat4 ModelViewMatrix = ViewMatrix * ModelMatrix;
+
+		ObjectMatrices *out = (ObjectMatrices*)(output + i * stride);
+		out->MVP = ProjectionMatrix * ModelViewMatrix;
+		out->M = ModelMatrix;
+		out->MV3x3[0] = ModelViewMatrix[0];
+		out->MV3x3[1] = ModelViewMatrix[1];
+		out->MV3x3[2] = ModelViewMatrix[2];
+	}
+}
+
+// Column of A * column b, column major
+static inline __m128 transformColumn(const __m128 a[4], __m128 b) {
+	__m128 r = _mm_mul_ps(a[0], _mm_shuffle_ps(b, b, _MM_SHUFFLE(0, 0, 0, 0)));
+	r = _mm_add_ps(r, _mm_mul_ps(a[1], _mm_shuffle_ps(b, b, _MM_SHUFFLE(1, 1, 1, 1))));
+	r = _mm_add_ps(r, _mm_mul_ps(a[2], _mm_shuffle_ps(b, b, _MM_SHUFFLE(2, 2, 2, 2))));
+	r = _mm_add_ps(r, _mm_mul_ps(a[3], _mm_shuffle_ps(b, b, _MM_SHUFFLE(3, 3, 3, 3))));
+	return r;
+}
+
+static void computeSSE(const mat4 *world, const unsigned int *indices, size_t count,
+	const mat4 &ViewMatrix, const mat4 &ProjectionMatrix, unsigned char *output, size_t stride) {
+	__m128 V[4], P[4];
+	for (int c = 0; c < 4; ++c) {
+		V[c] = _mm_loadu_ps(&ViewMatrix[c][0]);
+		P[c] = _mm_loadu_ps(&ProjectionMatrix[c][0]);
+	}
+
+	for (size_t i = 0; i < count; ++i) {
+		const float *M = &world[indices[i]][0][0];
+		float *out = (float*)(output + i * stride);
+
+		for (int c = 0; c < 4; ++c) {
+			__m128 column = _mm_loadu_ps(M + c * 4);
+			__m128 modelView = transformColumn(V, column);
+
+			_mm_storeu_ps(out + c * 4, transformColumn(P, modelView)); // MVP
+			_mm_storeu_ps(out + 16 + c * 4, column);                   // M
+			if (c < 3) _mm_storeu_ps(out + 32 + c * 4, modelView);     // MV3x3
+		}
+	}
+}
+
+void computeObjectMatrices(MatrixBatchPath path, const mat4 *world, const unsigned int *indices, size_t count,
+	const mat4 &ViewMatrix, const mat4 &ProjectionMatrix, unsigned char *output, size_t stride) {
+	switch (path) {
+	case MATRIX_BATCH_AVX:
+		computeObjectMatricesAVX(world, indices, count, ViewMatrix, ProjectionMatrix, output, stride);
+		break;
+	case MATRIX_BATCH_SSE:
+		computeSSE(world, indices, count, ViewMatrix, ProjectionMatrix, output, stride);
+		break;
+	default:
+		computeScalar(world, indices, count, ViewMatrix, ProjectionMatrix, output, stride);
+		break;
+	}
+}
@@ -0,0 +1,31 @@
+#ifndef MATRIXBATCH_H
+#define MATRIXBATCH_H
+
+#include <cstddef>
+
+#include <glm/glm.hpp>
+using namespace glm;
+
+// Per object uniform block of light.vertexshader and depth.vertexshader, std140 layout
+struct ObjectMatrices {
+	mat4 MVP;
+	mat4 M;
+	vec4 MV3x3[3]; // mat3 columns are padded to vec4
+};
+
+enum MatrixBatchPath { MATRIX_BATCH_SCALAR, MATRIX_BATCH_SSE, MATRIX_BATCH_AVX, MATRIX_BATCH_PATH_COUNT };
+
+// Fastest path supported by this CPU, detected once
+MatrixBatchPath bestMatrixBatchPath();
+const char *matrixBatchPathName(MatrixBatchPath path);
+
+// Write the ObjectMatrices of world[indices[i]] for the view and projection to
+// output + i * stride. The output is usually a mapped uniform buffer, it is only written.
+void computeObjectMatrices(MatrixBatchPath path, const mat4 *world, const unsigned int *indices, size_t count,
+	const mat4 &ViewMatrix, const mat4 &ProjectionMatrix, unsigned char *output, size_t stride);
+
+// AVX version, in its own file compiled for AVX, only call it when the CPU supports it
+void computeObjectMatricesAVX(const mat4 *world, const unsigned int *indices, size_t count,
+	const mat4 &ViewMatrix, const mat4 &ProjectionMatrix, unsigned char *output, size_t stride);
+
+#endif
@@ -0,0 +1,51 @@
+// Compiled with /arch:AVX, see snowscape.vcxproj. Only reached when cpuHasAVX().
+#include "MatrixBatch.h"
+
+#include <immintrin.h>
+
+#if defined(__GNUC__) && !defined(__AVX__)
+#define AVX_FUNCTION __attribute__((target("avx")))
+#else
+#define AVX_FUNCTION
+#endif
+
+// Two columns of A * B at once, b holds columns j and j + 1 of B
+AVX_FUNCTION static inline __m256 transformColumns(const __m256 a[4], __m256 b) {
+	__m256 r = _mm256_mul_ps(a[0], _mm256_permute_ps(b, _MM_SHUFFLE(0, 0, 0, 0)));
+	r = _mm256_add_ps(r, _mm256_mul_ps(a[1], _mm256_permute_ps(b, _MM_SHUFFLE(1, 1, 1, 1))));
+	r = _mm256_add_ps(r, _mm256_mul_ps(a[2], _mm256_permute_ps(b, _MM_SHUFFLE(2, 2, 2, 2))));
+	r = _mm256_add_ps(r, _mm256_mul_ps(a[3], _mm256_permute_ps(b, _MM_SHUFFLE(3, 3, 3, 3))));
+	return r;
+}
+
+AVX_FUNCTION void computeObjectMatricesAVX(const mat4 *world, const unsigned int *indices, size_t count,
+	const mat4 &ViewMatrix, const mat4 &ProjectionMatrix, unsigned char *output, size_t stride) {
+	// Every column of V and P in both halves
+	__m256 V[4], P[4];
+	for (int c = 0; c < 4; ++c) {
+		V[c] = _mm256_broadcast_ps((const __m128*)&ViewMatrix[c][0]);
+		P[c] = _mm256_broadcast_ps((const __m128*)&ProjectionMatrix[c][0]);
+	}
+
+	for (size_t i = 0; i < count; ++i) {
+		const float *M = &world[indices[i]][0][0];
+		float *out = (float*)(output + i * stride);
+
+		__m256 columns01 = _mm256_loadu_ps(M);
+		__m256 columns23 = _mm256_loadu_ps(M + 8);
+		__m256 modelView01 = transformColumns(V, columns01);
+		__m256 modelView23 = transformColumns(V, columns23);
+
+		// MVP
+		_mm256_storeu_ps(out, transformColumns(P, modelView01));
+		_mm256_storeu_ps(out + 8, transformColumns(P, modelView23));
+		// M
+		_mm256_storeu_ps(out + 16, columns01);
+		_mm256_storeu_ps(out + 24, columns23);
+		// MV3x3, the fourth column is not part of the block
+		_mm256_storeu_ps(out + 32, modelView01);
+		_mm_storeu_ps(out + 40, _mm256_castps256_ps128(modelView23));
+	}
+
+	_mm256_zeroupper();
+}
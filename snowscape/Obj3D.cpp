@@ -1,13 +1,17 @@
 #include "Obj3d.h"
 #include "vboindexer.hpp"
 #include "tangentspace.hpp"
+#include "Profiler.h"
+
+#include <algorithm>
+#include <cmath>
 
 #include <glm/glm.hpp>
 #include<glm/mat4x4.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 #include <glm/gtx/transform.hpp>
 
-Obj3D::Obj3D(char * modelPath,char * texturePath, char * normalTexturePath) {
+Obj3D::Obj3D(const char * modelPath,const char * texturePath, const char * normalTexturePath) {
 	this->modelPath = modelPath;
 	this->texturePath = texturePath;
 	this->normalTexturePath = normalTexturePath;
@@ -17,66 +21,212 @@ Obj3D::Obj3D(char * modelPath,char * texturePath, char * normalTexturePath) {
 	//rotation = vec3(0.0f);
 	scale = vec3(1.0f);
 	depthTest = true;
+	occluderScale = 0.0f;
+}
+
+// What the vectors of a model hold, the unindexed ones are kept after the upload
+static size_t modelCpuSize(const Model *model) {
+	return (model->vertices.capacity() + model->normals.capacity() + model->tangents.capacity() + model->bitangents.capacity()
+		+ model->indexed_vertices.capacity() + model->indexed_normals.capacity() + model->indexed_tangents.capacity() + model->indexed_bitangents.capacity()) * sizeof(vec3)
+		+ (model->UVs.capacity() + model->indexed_UVs.capacity()) * sizeof(vec2)
+		+ model->indices.capacity() * sizeof(unsigned short);
+}
+
+// Basic update function, speed is in units per second
+void Obj3D::update(float dt) {
+	position += speed * dt;
+}
+
+// Separating axis test of a triangle against the box of the given center and half size, touching counts as overlapping
+static bool triangleOverlapsBox(vec3 a, vec3 b, vec3 c, const vec3 &center, const vec3 &halfSize) {
+	a -= center;
+	b -= center;
+	c -= center;
+
+	// Axes of the box
+	if (min(min(a, b), c).x > halfSize.x || max(max(a, b), c).x < -halfSize.x) return false;
+	if (min(min(a, b), c).y > halfSize.y || max(max(a, b), c).y < -halfSize.y) return false;
+	if (min(min(a, b), c).z > halfSize.z || max(max(a, b), c).z < -halfSize.z) return false;
+
+	// Normal of the triangle
+	vec3 normal = cross(b - a, c - a);
+	if (fabsf(dot(normal, a)) > dot(halfSize, abs(normal))) return false;
+
+	// Edges of the triangle crossed with the axes of the box
+	const vec3 edges[3] = { b - a, c - b, a - c };
+	for (int e = 0; e < 3; ++e) {
+		for (int axis = 0; axis < 3; ++axis) {
+			vec3 unit(0.0f);
+			unit[axis] = 1.0f;
+			vec3 separating = cross(edges[e], unit);
+			float pa = dot(a, separating), pb = dot(b, separating), pc = dot(c, separating);
+			float radius = dot(halfSize, abs(separating));
+			if (std::min(pa, std::min(pb, pc)) > radius || std::max(pa, std::max(pb, pc)) < -radius) return false;
+		}
+	}
+	return true;
+}
+
+static bool boxCrossesMesh(const Model *model, const vec3 &boxMin, const vec3 &boxMax) {
+	vec3 center = (boxMin + boxMax) * 0.5f, halfSize = (boxMax - boxMin) * 0.5f;
+	const std::vector<vec3> &vertices = model->indexed_vertices;
+	for (size_t i = 0; i + 2 < model->indices.size(); i += 3) {
+		if (triangleOverlapsBox(vertices[model->indices[i]], vertices[model->indices[i + 1]], vertices[model->indices[i + 2]], center, halfSize)) return true;
+	}
+	return false;
+}
+
+// Box for the occlusion culler that no triangle crosses, grown one step at a time from a seed on the vertical
+// axis of the bounds : each face moves out until the next step would cross the mesh. Walls and roof must stop
+// the sides and the top, a face that reaches the bounds there would stick out of the mesh. The bottom may
+// reach them, houses usually have no floor and stand on the ground. The largest box of a few seeds is kept.
+void Obj3D::fitOccluderBox(Model *model) {
+	const int STEPS = 64, SEEDS = 8;
+	vec3 size = model->boundsMax - model->boundsMin;
+	vec3 step = size / (float)STEPS;
+	vec3 center = (model->boundsMin + model->boundsMax) * 0.5f;
+	model->occluderMin = model->boundsMax;
+	model->occluderMax = model->boundsMin;
+	float bestVolume = 0.0f;
+
+	for (int seed = 0; seed < SEEDS; ++seed) {
+		vec3 boxMin(center.x - step.x * 0.5f, model->boundsMin.y + size.y * (seed + 0.5f) / SEEDS - step.y * 0.5f, center.z - step.z * 0.5f);
+		vec3 boxMax = boxMin + step;
+		if (boxCrossesMesh(model, boxMin, boxMax)) continue;
+
+		// Faces : -x, +x, -y, +y, -z, +z
+		bool blocked[6] = { false, false, false, false, false, false };
+		bool grown = true;
+		while (grown) {
+			grown = false;
+			for (int face = 0; face < 6; ++face) {
+				if (blocked[face]) continue;
+				int axis = face / 2;
+				bool positive = (face & 1) != 0;
+
+				// Only the slab added by the step is tested, the box itself is already clear
+				vec3 slabMin = boxMin, slabMax = boxMax;
+				if (positive) {
+					slabMin[axis] = boxMax[axis];
+					slabMax[axis] = std::min(boxMax[axis] + step[axis], model->boundsMax[axis]);
+				}
+				else {
+					slabMax[axis] = boxMin[axis];
+					slabMin[axis] = std::max(boxMin[axis] - step[axis], model->boundsMin[axis]);
+				}
+				if (slabMin[axis] == slabMax[axis] || boxCrossesMesh(model, slabMin, slabMax)) {
+					blocked[face] = true;
+					continue;
+				}
+				if (positive) boxMax[axis] = slabMax[axis];
+				else boxMin[axis] = slabMin[axis];
+				grown = true;
+			}
+		}
+
+		// Stopped by the bounds instead of the mesh on a side or the top : outside the mesh
+		bool enclosed = true;
+		for (int face = 0; face < 6; ++face) {
+			int axis = face / 2;
+			bool positive = (face & 1) != 0;
+			if (face == 2) continue;
+			if (positive ? boxMax[axis] >= model->boundsMax[axis] : boxMin[axis] <= model->boundsMin[axis]) enclosed = false;
+		}
+		vec3 extent = boxMax - boxMin;
+		float volume = extent.x * extent.y * extent.z;
+		if (enclosed && volume > bestVolume) {
+			bestVolume = volume;
+			model->occluderMin = boxMin;
+			model->occluderMax = boxMax;
+		}
+	}
 }
 
-// Basic update function, no dt for now, time step is fixed
-void Obj3D::update() {
-	position += speed;
+Model *Obj3D::loadModel(const char *path) {
+	Model *newModel = new Model();
+	PROFILE_SCOPE("Load model");
+
+	// Read object from file
+	printf("Loading OBJ file %s...\n", path);
+	loadOBJ(path, newModel->vertices, newModel->UVs, newModel->normals);
+	computeTangentBasis(
+		newModel->vertices, newModel->UVs, newModel->normals, // input
+		newModel->tangents, newModel->bitangents    // output
+	);
+
+	// VBO indexing
+	indexVBO_TBN(newModel->vertices, newModel->UVs, newModel->normals, newModel->tangents, newModel->bitangents,
+		// Output
+		newModel->indices, newModel->indexed_vertices, newModel->indexed_UVs, 
+		newModel->indexed_normals, newModel->indexed_tangents, newModel->indexed_bitangents);
+
+	// Bounding box
+	newModel->boundsMin = newModel->boundsMax = newModel->indexed_vertices[0];
+	for (size_t i = 1; i < newModel->indexed_vertices.size(); ++i) {
+		newModel->boundsMin = min(newModel->boundsMin, newModel->indexed_vertices[i]);
+		newModel->boundsMax = max(newModel->boundsMax, newModel->indexed_vertices[i]);
+	}
+	fitOccluderBox(newModel);
+
+	MemoryTracker::trackCpu(newModel, modelCpuSize(newModel), MEMORY_MESH, path);
+	return newModel;
+}
+
+void Obj3D::uploadModel(Model *newModel, const char *path) {
+	PROFILE_SCOPE("Upload model");
+
+	glGenVertexArrays(1, &newModel->VertexArrayID);
+	glBindVertexArray(newModel->VertexArrayID);
+
+	glGenBuffers(1, &newModel->VBO);
+	glBindBuffer(GL_ARRAY_BUFFER, newModel->VBO);
+	glBufferData(GL_ARRAY_BUFFER, sizeof(vec3) * newModel->indexed_vertices.size(), &newModel->indexed_vertices[0], GL_STATIC_DRAW);
+
+	glGenBuffers(1, &newModel->UVBO);
+	glBindBuffer(GL_ARRAY_BUFFER, newModel->UVBO);
+	glBufferData(GL_ARRAY_BUFFER, sizeof(vec2) * newModel->indexed_UVs.size(), &newModel->indexed_UVs[0], GL_STATIC_DRAW);
+
+	glGenBuffers(1, &newModel->NBO);
+	glBindBuffer(GL_ARRAY_BUFFER, newModel->NBO);
+	glBufferData(GL_ARRAY_BUFFER, sizeof(vec3) * newModel->indexed_normals.size(), &newModel->indexed_normals[0], GL_STATIC_DRAW);
+
+	glGenBuffers(1, &newModel->tangentbuffer);
+	glBindBuffer(GL_ARRAY_BUFFER, newModel->tangentbuffer);
+	glBufferData(GL_ARRAY_BUFFER, newModel->indexed_tangents.size() * sizeof(glm::vec3), &newModel->indexed_tangents[0], GL_STATIC_DRAW);
+
+	glGenBuffers(1, &newModel->bitangentbuffer);
+	glBindBuffer(GL_ARRAY_BUFFER, newModel->bitangentbuffer);
+	glBufferData(GL_ARRAY_BUFFER, newModel->indexed_bitangents.size() * sizeof(glm::vec3), &newModel->indexed_bitangents[0], GL_STATIC_DRAW);
+
+	glGenBuffers(1, &newModel->elementbuffer);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, newModel->elementbuffer);
+	glBufferData(GL_ELEMENT_ARRAY_BUFFER, newModel->indices.size() * sizeof(unsigned short), &newModel->indices[0], GL_STATIC_DRAW);
+
+	size_t vertexCount = newModel->indexed_vertices.size();
+	MemoryTracker::trackBuffer(newModel->VBO, vertexCount * sizeof(vec3), MEMORY_MESH, path);
+	MemoryTracker::trackBuffer(newModel->UVBO, vertexCount * sizeof(vec2), MEMORY_MESH, path);
+	MemoryTracker::trackBuffer(newModel->NBO, vertexCount * sizeof(vec3), MEMORY_MESH, path);
+	MemoryTracker::trackBuffer(newModel->tangentbuffer, vertexCount * sizeof(vec3), MEMORY_MESH, path);
+	MemoryTracker::trackBuffer(newModel->bitangentbuffer, vertexCount * sizeof(vec3), MEMORY_MESH, path);
+	MemoryTracker::trackBuffer(newModel->elementbuffer, newModel->indices.size() * sizeof(unsigned short), MEMORY_MESH, path);
 }
 
 void Obj3D::init() {
 	// Load model if not in cache
 	if (Obj3D::modelCache.count(modelPath) == 0) {
-		Obj3D::modelCache.insert(std::make_pair(modelPath, new Model()));
-		Model *newModel = modelCache[modelPath];
-
-		// Read object from file
-		loadOBJ(modelPath, newModel->vertices, newModel->UVs, newModel->normals);
-		computeTangentBasis(
-			newModel->vertices, newModel->UVs, newModel->normals, // input
-			newModel->tangents, newModel->bitangents    // output
-		);
-
-		// VBO indexing
-		indexVBO_TBN(newModel->vertices, newModel->UVs, newModel->normals, newModel->tangents, newModel->bitangents,
-			// Output
-			newModel->indices, newModel->indexed_vertices, newModel->indexed_UVs, 
-			newModel->indexed_normals, newModel->indexed_tangents, newModel->indexed_bitangents);
-
-		glGenVertexArrays(1, &newModel->VertexArrayID);
-		glBindVertexArray(newModel->VertexArrayID);
-
-		glGenBuffers(1, &newModel->VBO);
-		glBindBuffer(GL_ARRAY_BUFFER, newModel->VBO);
-		glBufferData(GL_ARRAY_BUFFER, sizeof(vec3) * newModel->indexed_vertices.size(), &newModel->indexed_vertices[0], GL_STATIC_DRAW);
-
-		glGenBuffers(1, &newModel->UVBO);
-		glBindBuffer(GL_ARRAY_BUFFER, newModel->UVBO);
-		glBufferData(GL_ARRAY_BUFFER, sizeof(vec2) * newModel->indexed_UVs.size(), &newModel->indexed_UVs[0], GL_STATIC_DRAW);
-
-		glGenBuffers(1, &newModel->NBO);
-		glBindBuffer(GL_ARRAY_BUFFER, newModel->NBO);
-		glBufferData(GL_ARRAY_BUFFER, sizeof(vec3) * newModel->indexed_normals.size(), &newModel->indexed_normals[0], GL_STATIC_DRAW);
-
-		glGenBuffers(1, &newModel->tangentbuffer);
-		glBindBuffer(GL_ARRAY_BUFFER, newModel->tangentbuffer);
-		glBufferData(GL_ARRAY_BUFFER, newModel->indexed_tangents.size() * sizeof(glm::vec3), &newModel->indexed_tangents[0], GL_STATIC_DRAW);
-
-		glGenBuffers(1, &newModel->bitangentbuffer);
-		glBindBuffer(GL_ARRAY_BUFFER, newModel->bitangentbuffer);
-		glBufferData(GL_ARRAY_BUFFER, newModel->indexed_bitangents.size() * sizeof(glm::vec3), &newModel->indexed_bitangents[0], GL_STATIC_DRAW);
-
-		glGenBuffers(1, &newModel->elementbuffer);
-		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, newModel->elementbuffer);
-		glBufferData(GL_ELEMENT_ARRAY_BUFFER, newModel->indices.size() * sizeof(unsigned short), &newModel->indices[0], GL_STATIC_DRAW);
+		Model *newModel = loadModel(modelPath);
+		uploadModel(newModel, modelPath);
+		Obj3D::modelCache.insert(std::make_pair(modelPath, newModel));
 	}
 
 	model = Obj3D::modelCache[modelPath];
 
 	// Load texture
 	if (Obj3D::textureCache.count(texturePath) == 0) {
+		PROFILE_SCOPE("Load texture");
 		const char *path = texturePath;
 		Texture = loadDDS(texturePath);
+		MemoryTracker::trackTexture(Texture, MemoryTracker::textureSize(Texture), MEMORY_TEXTURE, texturePath);
 		Obj3D::textureCache[texturePath] = Texture;
 	}
 	Texture = Obj3D::textureCache[texturePath];
@@ -84,8 +234,10 @@ void Obj3D::init() {
 	// Load normal texture
 	if (normalTexturePath != NULL) {
 		if (Obj3D::textureCache.count(normalTexturePath) == 0) {
+			PROFILE_SCOPE("Load normal map");
 			const char *path = normalTexturePath;
 			NormalTexture = loadBMP_custom(path);
+			MemoryTracker::trackTexture(NormalTexture, MemoryTracker::textureSize(NormalTexture), MEMORY_TEXTURE, normalTexturePath);
 			Obj3D::textureCache[normalTexturePath] = NormalTexture;
 		}
 		NormalTexture = Obj3D::textureCache[normalTexturePath];
@@ -101,6 +253,16 @@ mat4 Obj3D::getModelMatrix() {
 	return ModelMatrix;
 }
 
+// Conservative box for the occlusion culler, the box fitted inside the mesh scaled around its center
+bool Obj3D::getOccluderBox(vec3 &boxMin, vec3 &boxMax) {
+	if (model->occluderMin.x > model->occluderMax.x) return false;
+	vec3 center = (model->occluderMin + model->occluderMax) * 0.5f;
+	vec3 halfSize = (model->occluderMax - model->occluderMin) * 0.5f * occluderScale;
+	boxMin = center - halfSize;
+	boxMax = center + halfSize;
+	return true;
+}
+
 Obj3D::~Obj3D() {
 	
 }
@@ -10,6 +10,7 @@ using namespace glm;
 
 #include "objloader.hpp"
 #include "texture.hpp"
+#include "memorytracker.hpp"
 
 struct Model {
 	std::vector<glm::vec3> vertices;
@@ -25,10 +26,16 @@ struct Model {
 	std::vector<glm::vec3> indexed_tangents;
 	std::vector<glm::vec3> indexed_bitangents;
 
+	// Axis aligned bounding box, model space
+	glm::vec3 boundsMin, boundsMax;
+	// Box inside the mesh for the occlusion culler, model space. occluderMin > occluderMax when none was found
+	glm::vec3 occluderMin, occluderMax;
+
 	GLuint VertexArrayID, VBO, UVBO, NBO, elementbuffer, tangentbuffer, bitangentbuffer;
 
 	~Model() {
 		printf("Model destructor called \n");
+		MemoryTracker::releaseCpu(this);
 	}
 };
 
@@ -39,15 +46,26 @@ class Obj3D {
 
 		Model *model;
 		GLuint Texture, NormalTexture;
-		char *modelPath, *texturePath, *normalTexturePath;
+		const char *modelPath, *texturePath, *normalTexturePath;
 		vec3 position, speed, rotation, scale;
 		bool depthTest;
+		// Size of the occluder box relative to the box fitted inside the mesh (Model::occluderMin and max), 0 when not an occluder
+		float occluderScale;
+
+		// CPU side of a model : file, tangents, indexing and bounds. Any thread can call it
+		static Model *loadModel(const char *path);
+		// Occluder box of a model whose vertices, indices and bounds are set, loadModel() calls it. Any thread
+		static void fitOccluderBox(Model *model);
+		// GL buffers of a loaded model, on the thread that owns the context
+		static void uploadModel(Model *model, const char *path);
 
-		Obj3D(char * modelPath, char * texturePath, char * normalTexturePath = "models/default_normal.bmp");
+		Obj3D(const char * modelPath, const char * texturePath, const char * normalTexturePath = "models/default_normal.bmp");
 		~Obj3D();
 		void init();
-		void update();
+		void update(float dt);
 		mat4 getModelMatrix();
+		// False when the model has no box inside it
+		bool getOccluderBox(vec3 &boxMin, vec3 &boxMax);
 };
 
 #endif
\ No newline at end of file
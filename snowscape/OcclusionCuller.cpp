@@ -0,0 +1,220 @@
+#include "OcclusionCuller.h"
+#include "Profiler.h"
+
+#include <cmath>
+#include <algorithm>
+#include <chrono>
+#include <emmintrin.h>
+
+// Box corner i is (i & 1, (i >> 1) & 1, (i >> 2) & 1), faces wound CCW seen from outside
+static const int boxIndices[36] = {
+	4, 6, 2, 4, 2, 0,
+	1, 3, 7, 1, 7, 5,
+	0, 1, 5, 0, 5, 4,
+	6, 7, 3, 6, 3, 2,
+	2, 3, 1, 2, 1, 0,
+	4, 5, 7, 4, 7, 6
+};
+
+static const int TILES_X = OcclusionCuller::WIDTH / OcclusionCuller::TILE_WIDTH;
+static const int TILES_Y = OcclusionCuller::HEIGHT / OcclusionCuller::TILE_HEIGHT;
+static const int HIZ_WIDTH = OcclusionCuller::WIDTH / OcclusionCuller::BLOCK_SIZE;
+static const int HIZ_HEIGHT = OcclusionCuller::HEIGHT / OcclusionCuller::BLOCK_SIZE;
+
+// Anything closer than this in clip space is considered crossing the near plane
+static const float NEAR_W = 0.001f;
+
+OcclusionCuller::OcclusionCuller(JobSystem *jobs) {
+	this->jobs = jobs;
+	depth.resize(WIDTH * HEIGHT, 1.0f);
+	hiz.resize(HIZ_WIDTH * HIZ_HEIGHT, 1.0f);
+	rasterTime = 0.0;
+}
+
+OcclusionCuller::~OcclusionCuller() {
+}
+
+void OcclusionCuller::beginFrame(const mat4 &viewProjection) {
+	this->viewProjection = viewProjection;
+	triangles.clear();
+}
+
+void OcclusionCuller::addOccluder(const mat4 &modelMatrix, vec3 boxMin, vec3 boxMax) {
+	mat4 MVP = viewProjection * modelMatrix;
+
+	// Project the corners, an occluder crossing the near plane is simply dropped
+	vec3 screen[8];
+	for (int i = 0; i < 8; ++i) {
+		vec4 corner = MVP * vec4((i & 1) ? boxMax.x : boxMin.x, (i & 2) ? boxMax.y : boxMin.y, (i & 4) ? boxMax.z : boxMin.z, 1.0f);
+		if (corner.w < NEAR_W) return;
+
+		screen[i] = vec3(
+			(corner.x / corner.w * 0.5f + 0.5f) * WIDTH,
+			(corner.y / corner.w * 0.5f + 0.5f) * HEIGHT,
+			corner.z / corner.w
+		);
+	}
+
+	for (int i = 0; i < 36; i += 3) {
+		const vec3 &v0 = screen[boxIndices[i]];
+		const vec3 &v1 = screen[boxIndices[i + 1]];
+		const vec3 &v2 = screen[boxIndices[i + 2]];
+
+		// Back faces are hidden by the front ones
+		float area = (v1.x - v0.x) * (v2.y - v0.y) - (v2.x - v0.x) * (v1.y - v0.y);
+		if (area <= 0.0f) continue;
+
+		Triangle tri;
+		tri.minX = std::max(0, (int)floor(std::min(v0.x, std::min(v1.x, v2.x))));
+		tri.minY = std::max(0, (int)floor(std::min(v0.y, std::min(v1.y, v2.y))));
+		tri.maxX = std::min(WIDTH - 1, (int)ceil(std::max(v0.x, std::max(v1.x, v2.x))));
+		tri.maxY = std::min(HEIGHT - 1, (int)ceil(std::max(v0.y, std::max(v1.y, v2.y))));
+		if (tri.minX > tri.maxX || tri.minY > tri.maxY) continue;
+
+		const vec3 *v[3] = { &v0, &v1, &v2 };
+		for (int e = 0; e < 3; ++e) {
+			const vec3 &a = *v[e];
+			const vec3 &b = *v[(e + 1) % 3];
+			tri.edgeA[e] = a.y - b.y;
+			tri.edgeB[e] = b.x - a.x;
+			tri.edgeC[e] = a.x * b.y - a.y * b.x;
+		}
+
+		float dzdx = ((v1.z - v0.z) * (v2.y - v0.y) - (v2.z - v0.z) * (v1.y - v0.y)) / area;
+		float dzdy = ((v2.z - v0.z) * (v1.x - v0.x) - (v1.z - v0.z) * (v2.x - v0.x)) / area;
+		tri.zA = dzdx;
+		tri.zB = dzdy;
+		tri.zC = v0.z - dzdx * v0.x - dzdy * v0.y;
+
+		triangles.push_back(tri);
+	}
+}
+
+void OcclusionCuller::rasterize() {
+	std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+
+	// One job per tile, the tiles do not share any pixel
+	jobs->parallelFor(TILES_X * TILES_Y, 1, [this](size_t begin, size_t end) {
+		PROFILE_SCOPE("Rasterize tile");
+		for (size_t tile = begin; tile < end; ++tile) {
+			rasterizeTile((int)tile);
+		}
+	});
+
+	rasterTime = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+}
+
+void OcclusionCuller::rasterizeTile(int tile) {
+	const int tileX0 = (tile % TILES_X) * TILE_WIDTH;
+	const int tileY0 = (tile / TILES_X) * TILE_HEIGHT;
+	const int tileX1 = tileX0 + TILE_WIDTH - 1;
+	const int tileY1 = tileY0 + TILE_HEIGHT - 1;
+
+	// Clear to the far plane
+	const __m128 farPlane = _mm_set1_ps(1.0f);
+	for (int y = tileY0; y <= tileY1; ++y) {
+		float *row = &depth[y * WIDTH];
+		for (int x = tileX0; x <= tileX1; x += 4) {
+			_mm_storeu_ps(row + x, farPlane);
+		}
+	}
+
+	const __m128 pixelOffsets = _mm_setr_ps(0.5f, 1.5f, 2.5f, 3.5f);
+	const __m128 zero = _mm_setzero_ps();
+
+	for (size_t t = 0; t < triangles.size(); ++t) {
+		const Triangle &tri = triangles[t];
+		if (tri.maxX < tileX0 || tri.minX > tileX1 || tri.maxY < tileY0 || tri.minY > tileY1) continue;
+
+		// Tiles are 4 pixels aligned so the SSE span never leaves the tile
+		const int minX = std::max(tri.minX, tileX0) & ~3;
+		const int maxX = std::min(tri.maxX, tileX1);
+		const int minY = std::max(tri.minY, tileY0);
+		const int maxY = std::min(tri.maxY, tileY1);
+
+		const __m128 A0 = _mm_set1_ps(tri.edgeA[0]), B0 = _mm_set1_ps(tri.edgeB[0]), C0 = _mm_set1_ps(tri.edgeC[0]);
+		const __m128 A1 = _mm_set1_ps(tri.edgeA[1]), B1 = _mm_set1_ps(tri.edgeB[1]), C1 = _mm_set1_ps(tri.edgeC[1]);
+		const __m128 A2 = _mm_set1_ps(tri.edgeA[2]), B2 = _mm_set1_ps(tri.edgeB[2]), C2 = _mm_set1_ps(tri.edgeC[2]);
+		const __m128 ZA = _mm_set1_ps(tri.zA), ZB = _mm_set1_ps(tri.zB), ZC = _mm_set1_ps(tri.zC);
+
+		for (int y = minY; y <= maxY; ++y) {
+			const __m128 py = _mm_set1_ps(y + 0.5f);
+			// Row constant part of each edge function and of the depth plane
+			const __m128 row0 = _mm_add_ps(_mm_mul_ps(B0, py), C0);
+			const __m128 row1 = _mm_add_ps(_mm_mul_ps(B1, py), C1);
+			const __m128 row2 = _mm_add_ps(_mm_mul_ps(B2, py), C2);
+			const __m128 rowZ = _mm_add_ps(_mm_mul_ps(ZB, py), ZC);
+			float *row = &depth[y * WIDTH];
+
+			for (int x = minX; x <= maxX; x += 4) {
+				const __m128 px = _mm_add_ps(_mm_set1_ps((float)x), pixelOffsets);
+
+				__m128 mask = _mm_cmpge_ps(_mm_add_ps(_mm_mul_ps(A0, px), row0), zero);
+				mask = _mm_and_ps(mask, _mm_cmpge_ps(_mm_add_ps(_mm_mul_ps(A1, px), row1), zero));
+				mask = _mm_and_ps(mask, _mm_cmpge_ps(_mm_add_ps(_mm_mul_ps(A2, px), row2), zero));
+				if (_mm_movemask_ps(mask) == 0) continue;
+
+				const __m128 z = _mm_add_ps(_mm_mul_ps(ZA, px), rowZ);
+				const __m128 old = _mm_loadu_ps(row + x);
+				const __m128 closest = _mm_min_ps(old, z);
+				_mm_storeu_ps(row + x, _mm_or_ps(_mm_and_ps(mask, closest), _mm_andnot_ps(mask, old)));
+			}
+		}
+	}
+
+	// Build the HiZ texels covered by this tile : farthest depth of each block
+	for (int by = tileY0 / BLOCK_SIZE; by <= tileY1 / BLOCK_SIZE; ++by) {
+		for (int bx = tileX0 / BLOCK_SIZE; bx <= tileX1 / BLOCK_SIZE; ++bx) {
+			__m128 farthest = _mm_set1_ps(-1.0e30f);
+			for (int y = by * BLOCK_SIZE; y < (by + 1) * BLOCK_SIZE; ++y) {
+				const float *row = &depth[y * WIDTH + bx * BLOCK_SIZE];
+				farthest = _mm_max_ps(farthest, _mm_max_ps(_mm_loadu_ps(row), _mm_loadu_ps(row + 4)));
+			}
+			farthest = _mm_max_ps(farthest, _mm_shuffle_ps(farthest, farthest, _MM_SHUFFLE(1, 0, 3, 2)));
+			farthest = _mm_max_ps(farthest, _mm_shuffle_ps(farthest, farthest, _MM_SHUFFLE(2, 3, 0, 1)));
+			_mm_store_ss(&hiz[by * HIZ_WIDTH + bx], farthest);
+		}
+	}
+}
+
+bool OcclusionCuller::isVisible(const mat4 &modelMatrix, vec3 boxMin, vec3 boxMax) const {
+	mat4 MVP = viewProjection * modelMatrix;
+
+	vec2 screenMin(1e30f), screenMax(-1e30f);
+	float nearest = 1e30f;
+	int behind = 0;
+	for (int i = 0; i < 8; ++i) {
+		vec4 corner = MVP * vec4((i & 1) ? boxMax.x : boxMin.x, (i & 2) ? boxMax.y : boxMin.y, (i & 4) ? boxMax.z : boxMin.z, 1.0f);
+		if (corner.w < NEAR_W) {
+			behind++;
+			continue;
+		}
+
+		vec2 ndc = vec2(corner) / corner.w;
+		screenMin = min(screenMin, ndc);
+		screenMax = max(screenMax, ndc);
+		nearest = std::min(nearest, corner.z / corner.w);
+	}
+
+	// Entirely behind the camera, or crossing the near plane where we can't say anything
+	if (behind == 8) return false;
+	if (behind > 0) return true;
+
+	// Completely off screen or beyond the far plane
+	if (screenMax.x < -1.0f || screenMin.x > 1.0f || screenMax.y < -1.0f || screenMin.y > 1.0f || nearest > 1.0f) {
+		return false;
+	}
+
+	int minX = std::max(0, (int)((screenMin.x * 0.5f + 0.5f) * WIDTH) / BLOCK_SIZE);
+	int minY = std::max(0, (int)((screenMin.y * 0.5f + 0.5f) * HEIGHT) / BLOCK_SIZE);
+	int maxX = std::min(HIZ_WIDTH - 1, (int)((screenMax.x * 0.5f + 0.5f) * WIDTH) / BLOCK_SIZE);
+	int maxY = std::min(HIZ_HEIGHT - 1, (int)((screenMax.y * 0.5f + 0.5f) * HEIGHT) / BLOCK_SIZE);
+
+	for (int y = minY; y <= maxY; ++y) {
+		for (int x = minX; x <= maxX; ++x) {
+			if (nearest <= hiz[y * HIZ_WIDTH + x]) return true;
+		}
+	}
+
+	return false;
+}
@@ -0,0 +1,58 @@
+#ifndef OCCLUSIONCULLER_H
+#define OCCLUSIONCULLER_H
+
+#include <vector>
+
+#include <glm/glm.hpp>
+using namespace glm;
+
+#include "JobSystem.h"
+
+// Low resolution software depth buffer.
+// Simplified occluders (boxes fitted inside the houses) are rasterized with SSE
+// across screen tiles, then the screen bounds of every other object are tested
+// against a max-depth pyramid before it is submitted to the lit shader.
+class OcclusionCuller {
+	public:
+		static const int WIDTH = 256;
+		static const int HEIGHT = 192;
+		static const int TILE_WIDTH = 64;
+		static const int TILE_HEIGHT = 48;
+		static const int BLOCK_SIZE = 8; // One HiZ texel covers 8x8 depth pixels
+
+		// The tiles are rasterized in parallel on the job system
+		OcclusionCuller(JobSystem *jobs);
+		~OcclusionCuller();
+
+		// Start a new frame, drops all the occluders of the previous one
+		void beginFrame(const mat4 &viewProjection);
+		// Queue the box [boxMin, boxMax] (model space) as an occluder
+		void addOccluder(const mat4 &modelMatrix, vec3 boxMin, vec3 boxMax);
+		// Rasterize the queued occluders and build the HiZ buffer
+		void rasterize();
+		// False if the box [boxMin, boxMax] (model space) is hidden or off screen
+		bool isVisible(const mat4 &modelMatrix, vec3 boxMin, vec3 boxMax) const;
+
+		// Time spent in the last rasterize() call, in milliseconds
+		double rasterTime;
+
+	private:
+		struct Triangle {
+			// Edge functions : inside when A*x + B*y + C >= 0
+			float edgeA[3], edgeB[3], edgeC[3];
+			// Depth plane : z = zA*x + zB*y + zC
+			float zA, zB, zC;
+			int minX, minY, maxX, maxY;
+		};
+
+		mat4 viewProjection;
+		std::vector<Triangle> triangles;
+		std::vector<float> depth;
+		std::vector<float> hiz;
+
+		JobSystem *jobs;
+
+		void rasterizeTile(int tile);
+};
+
+#endif
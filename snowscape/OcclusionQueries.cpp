@@ -0,0 +1,222 @@
+#include "OcclusionQueries.h"
+#include "shader.hpp"
+#include "memorytracker.hpp"
+
+#include <map>
+#include <cmath>
+
+#include <glm/gtc/matrix_transform.hpp>
+#include <glm/gtx/transform.hpp>
+
+// Unit cube in [-1, 1], drawn scaled to the bounds of a node
+static const GLfloat cubeVertices[] = {
+	-1.0f, -1.0f, -1.0f,
+	 1.0f, -1.0f, -1.0f,
+	-1.0f,  1.0f, -1.0f,
+	 1.0f,  1.0f, -1.0f,
+	-1.0f, -1.0f,  1.0f,
+	 1.0f, -1.0f,  1.0f,
+	-1.0f,  1.0f,  1.0f,
+	 1.0f,  1.0f,  1.0f
+};
+
+static const GLushort cubeIndices[] = {
+	4, 6, 2, 4, 2, 0,
+	1, 3, 7, 1, 7, 5,
+	0, 1, 5, 0, 5, 4,
+	6, 7, 3, 6, 3, 2,
+	2, 3, 1, 2, 1, 0,
+	4, 5, 7, 4, 7, 6
+};
+
+OcclusionQueries::OcclusionQueries() {
+	programID = 0;
+	cubeVBO = cubeIBO = 0;
+	queriesIssued = 0;
+	frame = 0;
+	layoutVersion = 0;
+}
+
+OcclusionQueries::~OcclusionQueries() {
+	for (size_t i = 0; i < nodes.size(); ++i) {
+		glDeleteQueries(1, &nodes[i].query);
+	}
+	MemoryTracker::releaseBuffer(cubeVBO);
+	MemoryTracker::releaseBuffer(cubeIBO);
+	glDeleteBuffers(1, &cubeVBO);
+	glDeleteBuffers(1, &cubeIBO);
+	glDeleteProgram(programID);
+}
+
+void OcclusionQueries::init(const EntityStore &entities) {
+	// Conservative queries may skip some of the rasterization work, not available before GL 4.3
+	target = (GLEW_VERSION_4_3 || GLEW_ARB_ES3_compatibility) ? GL_ANY_SAMPLES_PASSED_CONSERVATIVE : GL_ANY_SAMPLES_PASSED;
+
+	programID = LoadShaders("bounds.vertexshader", "default.fragmentshader");
+	MatrixID = glGetUniformLocation(programID, "MVP");
+
+	glGenBuffers(1, &cubeVBO);
+	glBindBuffer(GL_ARRAY_BUFFER, cubeVBO);
+	glBufferData(GL_ARRAY_BUFFER, sizeof(cubeVertices), cubeVertices, GL_STATIC_DRAW);
+
+	glGenBuffers(1, &cubeIBO);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, cubeIBO);
+	glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(cubeIndices), cubeIndices, GL_STATIC_DRAW);
+	MemoryTracker::trackBuffer(cubeVBO, sizeof(cubeVertices), MEMORY_MESH, "occlusion query cube");
+	MemoryTracker::trackBuffer(cubeIBO, sizeof(cubeIndices), MEMORY_MESH, "occlusion query cube");
+
+	assignNodes(entities);
+}
+
+void OcclusionQueries::assignNodes(const EntityStore &entities) {
+	std::map<unsigned long long, size_t> previousKeys;
+	for (size_t n = 0; n < nodes.size(); ++n) {
+		previousKeys[nodes[n].key] = n;
+	}
+	std::vector<Node> previous;
+	previous.swap(nodes);
+
+	// Houses and moving objects get their own node, small static objects share one per grid cell
+	std::map<unsigned long long, int> keys;
+	for (size_t i = 0; i < entities.size(); ++i) {
+		bool alone = entities.occluderScales[i] > 0.0f || entities.speeds[i] != vec3(0.0f);
+		unsigned long long key;
+		if (alone) {
+			key = (1ull << 63) | entities.ids[i];
+		}
+		else {
+			int cellX = (int)floor(entities.positions[i].x / CLUSTER_SIZE), cellZ = (int)floor(entities.positions[i].z / CLUSTER_SIZE);
+			key = ((unsigned long long)(unsigned int)cellX << 32) | (unsigned int)cellZ;
+		}
+
+		int nodeIndex;
+		std::map<unsigned long long, int>::iterator it = keys.find(key);
+		if (it != keys.end()) {
+			nodeIndex = it->second;
+		}
+		else {
+			Node node;
+			std::map<unsigned long long, size_t>::iterator old = previousKeys.find(key);
+			if (old != previousKeys.end()) {
+				node = previous[old->second];
+				node.entities.clear();
+				previous[old->second].query = 0;
+			}
+			else {
+				node.key = key;
+				glGenQueries(1, &node.query);
+				node.visible = true;
+				node.pending = false;
+			}
+			nodeIndex = (int)nodes.size();
+			nodes.push_back(node);
+			keys[key] = nodeIndex;
+		}
+		nodes[nodeIndex].entities.push_back(entities.ids[i]);
+	}
+
+	// Nodes left empty
+	for (size_t n = 0; n < previous.size(); ++n) {
+		if (previous[n].query) glDeleteQueries(1, &previous[n].query);
+	}
+	layoutVersion = entities.layoutVersion;
+}
+
+void OcclusionQueries::beginFrame(const EntityStore &entities, const mat4 *worldMatrices) {
+	frame++;
+	queriesIssued = 0;
+	if (entities.layoutVersion != layoutVersion) assignNodes(entities);
+
+	for (size_t n = 0; n < nodes.size(); ++n) {
+		Node &node = nodes[n];
+
+		// Results of the previous frames, never wait for them
+		if (node.pending) {
+			GLuint available = 0;
+			glGetQueryObjectuiv(node.query, GL_QUERY_RESULT_AVAILABLE, &available);
+			if (available) {
+				GLuint samples = 0;
+				glGetQueryObjectuiv(node.query, GL_QUERY_RESULT, &samples);
+				node.visible = samples != 0;
+				node.pending = false;
+			}
+		}
+
+		// World space bounds of the members
+		node.boundsMin = vec3(1e30f);
+		node.boundsMax = vec3(-1e30f);
+		for (size_t i = 0; i < node.entities.size(); ++i) {
+			if (!entities.alive(node.entities[i])) {
+				node.entities[i--] = node.entities.back();
+				node.entities.pop_back();
+				continue;
+			}
+
+			size_t e = entities.indexOf(node.entities[i]);
+			const mat4 &ModelMatrix = worldMatrices[e];
+			vec3 boxMin = entities.boundsMin[e], boxMax = entities.boundsMax[e];
+			for (int c = 0; c < 8; ++c) {
+				vec3 corner = vec3(ModelMatrix * vec4((c & 1) ? boxMax.x : boxMin.x, (c & 2) ? boxMax.y : boxMin.y, (c & 4) ? boxMax.z : boxMin.z, 1.0f));
+				node.boundsMin = min(node.boundsMin, corner);
+				node.boundsMax = max(node.boundsMax, corner);
+			}
+		}
+	}
+}
+
+bool OcclusionQueries::wantsQuery(int node) const {
+	// Stagger the checks so only a fraction of the visible nodes is queried each frame
+	return !nodes[node].pending && (frame + node) % VISIBLE_QUERY_INTERVAL == 0;
+}
+
+void OcclusionQueries::beginQuery(int node) {
+	glBeginQuery(target, nodes[node].query);
+	nodes[node].pending = true;
+	queriesIssued++;
+}
+
+void OcclusionQueries::endQuery() {
+	glEndQuery(target);
+}
+
+void OcclusionQueries::queryHiddenBounds(const mat4 &viewProjection, vec3 cameraPosition) {
+	glUseProgram(programID);
+
+	// Test against the depth buffer without touching it
+	glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+	glDepthMask(GL_FALSE);
+	// The camera may be inside a box of a neighbour cluster
+	glDisable(GL_CULL_FACE);
+
+	glEnableVertexAttribArray(0);
+	glBindBuffer(GL_ARRAY_BUFFER, cubeVBO);
+	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, (GLvoid*)0);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, cubeIBO);
+
+	for (size_t n = 0; n < nodes.size(); ++n) {
+		Node &node = nodes[n];
+		if (node.visible || node.pending || node.entities.empty()) continue;
+
+		// The near plane would clip the box, consider the node visible
+		vec3 margin(1.0f);
+		if (all(greaterThan(cameraPosition, node.boundsMin - margin)) && all(lessThan(cameraPosition, node.boundsMax + margin))) {
+			node.visible = true;
+			continue;
+		}
+
+		vec3 center = (node.boundsMin + node.boundsMax) * 0.5f;
+		vec3 halfSize = (node.boundsMax - node.boundsMin) * 0.5f;
+		mat4 MVP = viewProjection * glm::translate(center) * glm::scale(halfSize);
+		glUniformMatrix4fv(MatrixID, 1, GL_FALSE, &MVP[0][0]);
+
+		beginQuery((int)n);
+		glDrawElements(GL_TRIANGLES, 36, GL_UNSIGNED_SHORT, (void*)0);
+		endQuery();
+	}
+
+	glDisableVertexAttribArray(0);
+
+	glEnable(GL_CULL_FACE);
+	glDepthMask(GL_TRUE);
+	glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+}
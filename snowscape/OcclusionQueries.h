@@ -0,0 +1,63 @@
+#ifndef OCCLUSIONQUERIES_H
+#define OCCLUSIONQUERIES_H
+
+#include <vector>
+#include <GL/glew.h>
+
+#include <glm/glm.hpp>
+using namespace glm;
+
+#include "EntityStore.h"
+
+// GPU occlusion culling with hardware queries.
+// Houses get one query each, small static objects are grouped in clusters on a
+// grid and moving objects get their own. Nodes visible last frame are drawn
+// first and only re-checked every few frames, hidden nodes get their bounding
+// box tested every frame and their draw wrapped in a conditional render.
+// Results are read back a frame late so the CPU never waits for the GPU.
+// The nodes are rebuilt when entities are created or destroyed, a node whose house,
+// moving object or grid cell is still there keeps its query and its last result.
+class OcclusionQueries {
+	public:
+		static const int VISIBLE_QUERY_INTERVAL = 8; // Frames between two checks of a visible node
+		static const int CLUSTER_SIZE = 16;          // World units covered by a cluster of small objects
+
+		struct Node {
+			unsigned long long key;    // Grid cell, or entity of a node of its own
+			GLuint query;
+			vec3 boundsMin, boundsMax; // World space, updated every frame
+			std::vector<EntityID> entities;
+			bool visible;              // Last result read back
+			bool pending;              // A query was issued and its result is not read yet
+		};
+
+		std::vector<Node> nodes;
+		int queriesIssued;
+
+		OcclusionQueries();
+		~OcclusionQueries();
+
+		// Build the query nodes of the scene
+		void init(const EntityStore &entities);
+		// Read back the available results and refresh the bounds of the nodes, the nodes follow the entities created or destroyed.
+		// worldMatrices are those of this frame, one per entity
+		void beginFrame(const EntityStore &entities, const mat4 *worldMatrices);
+		// True if the visible node should wrap its draw in a query this frame
+		bool wantsQuery(int node) const;
+		void beginQuery(int node);
+		void endQuery();
+		// Issue a bounding box query for every hidden node that has no pending query
+		void queryHiddenBounds(const mat4 &viewProjection, vec3 cameraPosition);
+
+	private:
+		// Group the entities in nodes, reusing the nodes of the same key
+		void assignNodes(const EntityStore &entities);
+
+		GLuint programID, MatrixID;
+		GLuint cubeVBO, cubeIBO;
+		GLenum target;
+		unsigned int frame;
+		unsigned int layoutVersion; // Of the entities the nodes were built from
+};
+
+#endif
@@ -0,0 +1,113 @@
+#include "Profiler.h"
+
+#include <stdio.h>
+#include <mutex>
+#include <chrono>
+#include <algorithm>
+
+bool Profiler::active = false;
+std::mutex Profiler::buffersLock;
+std::vector<Profiler::ThreadBuffer*> Profiler::buffers;
+
+// Track of the GPU events in the trace, after the threads
+static const unsigned int GPU_TRACK = 1000;
+
+unsigned long long Profiler::now() {
+	static std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	// Never 0, a scope started while disabled has start == 0
+	return (unsigned long long)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count() + 1;
+}
+
+Profiler::ThreadBuffer *Profiler::createBuffer(const char *name, unsigned int id) {
+	ThreadBuffer *buffer = new ThreadBuffer();
+	buffer->name = name;
+	buffer->events.resize(THREAD_CAPACITY);
+	buffer->count = 0;
+	buffer->dropped = 0;
+
+	std::lock_guard<std::mutex> lock(buffersLock);
+	buffer->id = id ? id : (unsigned int)buffers.size() + 1;
+	buffers.push_back(buffer);
+	return buffer;
+}
+
+// Name given before the thread recorded anything, its buffer takes it when created
+static thread_local const char *threadName = NULL;
+
+Profiler::ThreadBuffer *Profiler::threadBuffer(bool create) {
+	static thread_local ThreadBuffer *buffer = NULL;
+	if (!buffer && create) buffer = createBuffer(threadName, 0);
+	return buffer;
+}
+
+void Profiler::append(ThreadBuffer *buffer, const char *name, unsigned long long start, unsigned long long end) {
+	size_t index = buffer->count.load(std::memory_order_relaxed);
+	if (index >= buffer->events.size()) {
+		buffer->dropped++;
+		return;
+	}
+
+	Event &event = buffer->events[index];
+	event.name = name;
+	event.start = start;
+	event.end = end;
+	// The exporter only reads the events below count
+	buffer->count.store(index + 1, std::memory_order_release);
+}
+
+void Profiler::record(const char *name, unsigned long long start, unsigned long long end) {
+	append(threadBuffer(true), name, start, end);
+}
+
+void Profiler::recordGpu(const char *name, unsigned long long start, unsigned long long end) {
+	// Only the render thread reads the GPU timers back, no other thread writes this buffer
+	static ThreadBuffer *gpuBuffer = NULL;
+	if (!gpuBuffer) gpuBuffer = createBuffer("GPU", GPU_TRACK);
+	append(gpuBuffer, name, start, end);
+}
+
+void Profiler::setThreadName(const char *name) {
+	threadName = name;
+	ThreadBuffer *buffer = threadBuffer(false);
+	if (buffer) buffer->name = name;
+}
+
+bool Profiler::writeChromeTrace(const char *path) {
+	FILE *file = fopen(path, "w");
+	if (!file) {
+		printf("%s could not be opened for writing\n", path);
+		return false;
+	}
+
+	std::lock_guard<std::mutex> lock(buffersLock);
+	size_t eventCount = 0, dropped = 0;
+	bool first = true;
+
+	fprintf(file, "{\"traceEvents\":[\n");
+	for (size_t b = 0; b < buffers.size(); ++b) {
+		ThreadBuffer *buffer = buffers[b];
+
+		if (buffer->name) {
+			fprintf(file, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":%u,\"args\":{\"name\":\"%s\"}}", first ? "" : ",\n", buffer->id, buffer->name);
+			first = false;
+		}
+
+		// Complete events, microseconds
+		size_t count = buffer->count.load(std::memory_order_acquire);
+		for (size_t i = 0; i < count; ++i) {
+			const Event &event = buffer->events[i];
+			fprintf(file, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":0,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f}", first ? "" : ",\n",
+				event.name, buffer->id, event.start / 1000.0, (event.end - event.start) / 1000.0);
+			first = false;
+		}
+		eventCount += count;
+		dropped += buffer->dropped;
+	}
+	fprintf(file, "\n]}\n");
+	fclose(file);
+
+	printf("%u events written to %s", (unsigned int)eventCount, path);
+	if (dropped) printf(", %u dropped once the buffers were full", (unsigned int)dropped);
+	printf("\n");
+	return true;
+}
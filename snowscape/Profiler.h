@@ -0,0 +1,86 @@
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include <vector>
+#include <atomic>
+#include <mutex>
+#include <chrono>
+
+// Scoped CPU markers, exported as a Chrome trace (chrome://tracing, Perfetto) with the GPU timers.
+//
+// PROFILE_SCOPE("name") times the enclosing block. Every thread appends its events to
+// its own fixed size buffer, no lock and no allocation once the buffer exists. The
+// buffer is allocated by the first event the thread records, so nothing is allocated
+// while the profiler is disabled. The markers cost one branch then, and nothing at all
+// when the program is built with SNOWSCAPE_NO_PROFILER. Names must be string literals, only
+// the pointer is stored.
+class Profiler {
+	public:
+		// Events kept per thread, the later ones are dropped
+		static const size_t THREAD_CAPACITY = 1 << 18;
+
+		struct Event {
+			const char *name;
+			unsigned long long start, end; // Nanoseconds since the program started
+		};
+
+		static void setEnabled(bool enabled) { active = enabled; }
+		static bool enabled() { return active; }
+
+		static unsigned long long now();
+		// Append a finished event to the buffer of the calling thread
+		static void record(const char *name, unsigned long long start, unsigned long long end);
+		// Events measured on the GPU, shown on their own track
+		static void recordGpu(const char *name, unsigned long long start, unsigned long long end);
+		// Track name of the calling thread in the trace
+		static void setThreadName(const char *name);
+
+		// Call once the recording threads are idle. False if the file could not be written
+		static bool writeChromeTrace(const char *path);
+
+	private:
+		struct ThreadBuffer {
+			const char *name;
+			unsigned int id;
+			std::vector<Event> events;
+			std::atomic<size_t> count;
+			size_t dropped;
+		};
+
+		static ThreadBuffer *createBuffer(const char *name, unsigned int id);
+		// Buffer of the calling thread, created on first use unless create is false
+		static ThreadBuffer *threadBuffer(bool create);
+		static void append(ThreadBuffer *buffer, const char *name, unsigned long long start, unsigned long long end);
+
+		static bool active;
+		// Every buffer ever created, they live until the program exits
+		static std::mutex buffersLock;
+		static std::vector<ThreadBuffer*> buffers;
+};
+
+// Times its own lifetime
+class ProfileScope {
+	public:
+		ProfileScope(const char *name) : name(name), start(Profiler::enabled() ? Profiler::now() : 0) {}
+		~ProfileScope() { if (start) Profiler::record(name, start, Profiler::now()); }
+
+	private:
+		const char *name;
+		unsigned long long start;
+};
+
+// Wall clock time for the summaries printed, whether the profiler is enabled or not
+inline double millisecondsSince(std::chrono::high_resolution_clock::time_point start) {
+	return std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+}
+
+#define PROFILE_CONCAT_INNER(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_INNER(a, b)
+
+#ifdef SNOWSCAPE_NO_PROFILER
+#define PROFILE_SCOPE(name)
+#else
+#define PROFILE_SCOPE(name) ProfileScope PROFILE_CONCAT(profileScope, __LINE__)(name)
+#endif
+
+#endif
@@ -0,0 +1,129 @@
+#include "RenderQueue.h"
+#include "Profiler.h"
+
+#include <algorithm>
+#include <chrono>
+
+static bool compareKeys(const DrawPacket &a, const DrawPacket &b) {
+	return a.sortKey < b.sortKey;
+}
+
+RenderQueue::RenderQueue(JobSystem *jobs) {
+	// The render thread submits from one of the reserved queues
+	threadBuffers.resize(jobs->queueCount());
+	stateChanges = 0;
+	drawCalls = 0;
+	triangles = 0;
+	sortTime = 0.0;
+}
+
+void RenderQueue::reset() {
+	for (size_t i = 0; i < threadBuffers.size(); ++i) {
+		threadBuffers[i].clear();
+	}
+	packets.clear();
+	stateChanges = 0;
+	drawCalls = 0;
+	triangles = 0;
+}
+
+std::vector<DrawPacket> &RenderQueue::threadBuffer() {
+	unsigned int thread = JobSystem::threadIndex();
+	return threadBuffers[thread < threadBuffers.size() ? thread : 0];
+}
+
+void RenderQueue::sort() {
+	PROFILE_SCOPE("Sort draws");
+	std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+
+	size_t count = 0;
+	for (size_t i = 0; i < threadBuffers.size(); ++i) {
+		count += threadBuffers[i].size();
+	}
+	packets.reserve(count);
+	for (size_t i = 0; i < threadBuffers.size(); ++i) {
+		packets.insert(packets.end(), threadBuffers[i].begin(), threadBuffers[i].end());
+	}
+
+	std::sort(packets.begin(), packets.end(), compareKeys);
+
+	sortTime = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+}
+
+unsigned long long RenderQueue::makeKey(RenderPass pass, unsigned int depthBucket, GLuint vertexBuffer, GLuint texture, GLuint normalTexture) {
+	if (depthBucket > MAX_DEPTH_BUCKET) depthBucket = MAX_DEPTH_BUCKET;
+	return ((unsigned long long)pass << PASS_SHIFT)
+		| ((unsigned long long)depthBucket << DEPTH_SHIFT)
+		| ((unsigned long long)(vertexBuffer & 0xffff) << 32)
+		| ((unsigned long long)(texture & 0xffff) << 16)
+		| (unsigned long long)(normalTexture & 0xffff);
+}
+
+void RenderQueue::replay(RenderPass pass, GLuint objectBuffer, GLuint blockBinding, GLsizeiptr blockSize) {
+	PROFILE_SCOPE("Replay draws");
+	// Packets of this pass
+	DrawPacket bounds;
+	bounds.sortKey = (unsigned long long)pass << PASS_SHIFT;
+	std::vector<DrawPacket>::iterator first = std::lower_bound(packets.begin(), packets.end(), bounds, compareKeys);
+	bounds.sortKey = (unsigned long long)(pass + 1) << PASS_SHIFT;
+	std::vector<DrawPacket>::iterator last = std::lower_bound(first, packets.end(), bounds, compareKeys);
+	if (first == last) return;
+
+	// The depth and overdraw passes only need the positions
+	bool lit = pass == PASS_LIT;
+	int attributes = lit ? 5 : 1;
+	for (int a = 0; a < attributes; ++a) {
+		glEnableVertexAttribArray(a);
+	}
+
+	GLuint vertexBuffer = 0, elementBuffer = 0, texture = 0, normalTexture = 0;
+	int depthWrite = -1;
+	for (std::vector<DrawPacket>::iterator packet = first; packet != last; ++packet) {
+		if (packet->vertexBuffer != vertexBuffer) {
+			vertexBuffer = packet->vertexBuffer;
+			glBindBuffer(GL_ARRAY_BUFFER, packet->vertexBuffer);
+			glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, (GLvoid*)0);
+			if (lit) {
+				glBindBuffer(GL_ARRAY_BUFFER, packet->uvBuffer);
+				glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 0, (GLvoid*)0);
+				glBindBuffer(GL_ARRAY_BUFFER, packet->normalBuffer);
+				glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, 0, (GLvoid*)0);
+				glBindBuffer(GL_ARRAY_BUFFER, packet->tangentBuffer);
+				glVertexAttribPointer(3, 3, GL_FLOAT, GL_FALSE, 0, (GLvoid*)0);
+				glBindBuffer(GL_ARRAY_BUFFER, packet->bitangentBuffer);
+				glVertexAttribPointer(4, 3, GL_FLOAT, GL_FALSE, 0, (GLvoid*)0);
+			}
+			stateChanges++;
+		}
+		if (packet->elementBuffer != elementBuffer) {
+			elementBuffer = packet->elementBuffer;
+			glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, elementBuffer);
+			stateChanges++;
+		}
+		if (lit && packet->texture != texture) {
+			texture = packet->texture;
+			glActiveTexture(GL_TEXTURE0);
+			glBindTexture(GL_TEXTURE_2D, texture);
+			stateChanges++;
+		}
+		if (lit && packet->normalTexture != normalTexture) {
+			normalTexture = packet->normalTexture;
+			glActiveTexture(GL_TEXTURE1);
+			glBindTexture(GL_TEXTURE_2D, normalTexture);
+			stateChanges++;
+		}
+		if (packet->depthWrite != depthWrite) {
+			depthWrite = packet->depthWrite;
+			glDepthMask(depthWrite ? GL_TRUE : GL_FALSE);
+		}
+
+		glBindBufferRange(GL_UNIFORM_BUFFER, blockBinding, objectBuffer, packet->uniformOffset, blockSize);
+		glDrawElements(GL_TRIANGLES, packet->indexCount, GL_UNSIGNED_SHORT, (void*)0);
+		drawCalls++;
+		triangles += packet->indexCount / 3;
+	}
+
+	for (int a = 0; a < attributes; ++a) {
+		glDisableVertexAttribArray(a);
+	}
+}
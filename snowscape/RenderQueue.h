@@ -0,0 +1,62 @@
+#ifndef RENDERQUEUE_H
+#define RENDERQUEUE_H
+
+#include <vector>
+#include <GL/glew.h>
+
+#include "JobSystem.h"
+
+enum RenderPass { PASS_DEPTH, PASS_LIT, PASS_OVERDRAW };
+
+// One draw, plain data so any thread can record it
+struct DrawPacket {
+	// Pass in the top bits, then whatever order the pass wants : depth bucket, buffers, textures
+	unsigned long long sortKey;
+	GLuint vertexBuffer, uvBuffer, normalBuffer, tangentBuffer, bitangentBuffer, elementBuffer;
+	GLuint texture, normalTexture;
+	GLuint uniformOffset; // Bytes into the object buffer
+	GLsizei indexCount;
+	unsigned char pass;
+	unsigned char depthWrite;
+};
+
+// Draws recorded in parallel and replayed by the GL thread.
+// Each job thread appends its packets to its own command buffer, no locking.
+// The GL thread then merges the buffers, sorts the packets by key and replays
+// them, only touching the GL state that changes from one packet to the next.
+class RenderQueue {
+	public:
+		static const int PASS_SHIFT = 62;
+		static const int DEPTH_SHIFT = 48;
+		static const unsigned int MAX_DEPTH_BUCKET = 0x3fff;
+
+		// One command buffer per thread of the job system, which is not kept
+		RenderQueue(JobSystem *jobs);
+
+		// Drop the packets of the last frame
+		void reset();
+		// Command buffer of the calling job thread
+		std::vector<DrawPacket> &threadBuffer();
+		// Merge the command buffers and sort them
+		void sort();
+		// Draw the packets of one pass, its program and state must be set
+		void replay(RenderPass pass, GLuint objectBuffer, GLuint blockBinding, GLsizeiptr blockSize);
+
+		// Pass, depth bucket (14 bits) and draw state (48 bits of GL names)
+		static unsigned long long makeKey(RenderPass pass, unsigned int depthBucket, GLuint vertexBuffer, GLuint texture, GLuint normalTexture);
+
+		size_t packetCount() const { return packets.size(); }
+		// Buffer and texture binds issued by the last replays, reset by reset()
+		int stateChanges;
+		// Draws and triangles of the last replays, reset by reset()
+		int drawCalls;
+		long long triangles;
+		// Time spent in the last sort() call, in milliseconds
+		double sortTime;
+
+	private:
+		std::vector<std::vector<DrawPacket> > threadBuffers;
+		std::vector<DrawPacket> packets;
+};
+
+#endif
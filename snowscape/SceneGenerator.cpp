@@ -0,0 +1,189 @@
+#include "SceneGenerator.h"
+#include "Profiler.h"
+#include "SeededRandom.h"
+#include "memorytracker.hpp"
+
+#include <stdio.h>
+#include <math.h>
+#include <random>
+#include <algorithm>
+#include <chrono>
+
+#include <glm/gtc/constants.hpp>
+#include <glm/gtx/rotate_vector.hpp>
+
+const float SceneGenerator::DEFAULT_DENSITY = 0.01f;
+
+// Counts of createObjects() : 26 clouds, 51 rocks, 31 deer and 31 houses
+const SceneGenerator::Kind SceneGenerator::kinds[KIND_COUNT] = {
+	{ "models/rock/model1.obj", { "models/rock/cloud.dds", NULL }, "models/default_normal.bmp", 26.0f / 139 },
+	{ "models/rock/model1.obj", { "models/rock/texture.dds", NULL }, "models/rock/texture_normals.bmp", 51.0f / 139 },
+	{ "models/deer/model.obj", { "models/deer/texture.dds", NULL }, "models/deer/texture_normals.bmp", 31.0f / 139 },
+	{ "models/house2/model.obj", { "models/house2/texture.dds", "models/house2/texture2.dds" }, "models/house2/texture_normals.bmp", 31.0f / 139 },
+};
+
+static const char *kindNames[] = { "clouds", "rocks", "deer", "houses" };
+
+Model *SceneGenerator::createVariant(const Model *base, unsigned int seed, const char *name) {
+	PROFILE_SCOPE("Create model variant");
+	std::mt19937 random(seed);
+	vec3 stretch(randomFloat(random, 0.8f, 1.25f), randomFloat(random, 0.8f, 1.25f), randomFloat(random, 0.8f, 1.25f));
+	float twist = randomFloat(random, -0.6f, 0.6f);
+	float height = std::max(base->boundsMax.y - base->boundsMin.y, 0.0001f);
+
+	// Only what the upload and the draw code read, the unindexed arrays stay empty
+	Model *model = new Model();
+	model->indices = base->indices;
+	model->indexed_UVs = base->indexed_UVs;
+	size_t count = base->indexed_vertices.size();
+	model->indexed_vertices.resize(count);
+	model->indexed_normals.resize(count);
+	model->indexed_tangents.resize(count);
+	model->indexed_bitangents.resize(count);
+	for (size_t i = 0; i < count; ++i) {
+		// Turned around Y by an angle growing with the height, normals through the inverse transpose of the stretch
+		float angle = twist * (base->indexed_vertices[i].y - base->boundsMin.y) / height;
+		model->indexed_vertices[i] = rotateY(base->indexed_vertices[i] * stretch, angle);
+		model->indexed_normals[i] = rotateY(normalize(base->indexed_normals[i] / stretch), angle);
+		model->indexed_tangents[i] = rotateY(normalize(base->indexed_tangents[i] * stretch), angle);
+		model->indexed_bitangents[i] = rotateY(normalize(base->indexed_bitangents[i] * stretch), angle);
+	}
+
+	model->boundsMin = model->boundsMax = model->indexed_vertices[0];
+	for (size_t i = 1; i < count; ++i) {
+		model->boundsMin = min(model->boundsMin, model->indexed_vertices[i]);
+		model->boundsMax = max(model->boundsMax, model->indexed_vertices[i]);
+	}
+	// Stretched and twisted, the box of the base model may stick out
+	Obj3D::fitOccluderBox(model);
+
+	MemoryTracker::trackCpu(model, count * (4 * sizeof(vec3) + sizeof(vec2)) + model->indices.size() * sizeof(unsigned short), MEMORY_MESH, name);
+	return model;
+}
+
+void SceneGenerator::generate(const SceneParameters &parameters, EntityStore &entities) {
+	PROFILE_SCOPE("Generate scene");
+	this->parameters = parameters;
+	this->parameters.instances = std::min(parameters.instances, EntityStore::SLOT_MASK + 1 - (unsigned int)entities.size());
+	this->parameters.uniqueModels = std::max(parameters.uniqueModels, (unsigned int)KIND_COUNT);
+	if (this->parameters.extent <= 0.0f) this->parameters.extent = sqrtf(this->parameters.instances / DEFAULT_DENSITY);
+	unsigned int instances = this->parameters.instances;
+
+	// Meshes first, kind after kind. The first one of a kind is the shipped model unless an other kind took it
+	std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+	variants.clear();
+	for (unsigned int v = 0; v < this->parameters.uniqueModels; ++v) {
+		Variant variant;
+		variant.kind = v % KIND_COUNT;
+		variant.name = kinds[variant.kind].model;
+		variant.model = NULL;
+		variant.copy = false;
+		for (size_t i = 0; i < variants.size(); ++i) {
+			if (variants[i].name == variant.name) variant.copy = true;
+		}
+		if (variant.copy) {
+			char suffix[16];
+			sprintf(suffix, "#%u", v);
+			variant.name += suffix;
+		}
+		variants.push_back(variant);
+	}
+
+	JobCounter counter;
+	for (size_t v = 0; v < variants.size(); ++v) {
+		Variant *variant = &variants[v];
+		const Model *base = Obj3D::modelCache[kinds[variant->kind].model];
+		if (!variant->copy) {
+			variant->model = (Model*)base;
+			continue;
+		}
+		unsigned int variantSeed = parameters.seed * 7919u + (unsigned int)v;
+		jobSystem->run([variant, base, variantSeed]() { variant->model = createVariant(base, variantSeed, variant->name.c_str()); }, &counter);
+	}
+	jobSystem->wait(counter);
+	for (size_t v = 0; v < variants.size(); ++v) {
+		if (!variants[v].copy) continue;
+		Obj3D::uploadModel(variants[v].model, variants[v].name.c_str());
+		Obj3D::modelCache[variants[v].name] = variants[v].model;
+	}
+	meshTime = millisecondsSince(start);
+
+	// Shares rounded down, the rocks take what is left
+	start = std::chrono::high_resolution_clock::now();
+	unsigned int assigned = 0;
+	for (int k = 0; k < KIND_COUNT; ++k) {
+		kindCounts[k] = (unsigned int)(kinds[k].share * instances);
+		assigned += kindCounts[k];
+	}
+	kindCounts[1] += instances - assigned;
+
+	// Variants of each kind, so an instance only draws among its own
+	std::vector<unsigned int> kindVariants[KIND_COUNT];
+	for (size_t v = 0; v < variants.size(); ++v) {
+		kindVariants[variants[v].kind].push_back((unsigned int)v);
+	}
+
+	const float pi_over_2 = half_pi<float>();
+	const float pi_over_4 = quarter_pi<float>();
+	float half = this->parameters.extent * 0.5f;
+	std::mt19937 random(parameters.seed);
+	for (int k = 0; k < KIND_COUNT; ++k) {
+		const Kind &kind = kinds[k];
+		RenderHandles handles;
+		handles.NormalTexture = Obj3D::textureCache[kind.normalTexture];
+		handles.depthTest = true;
+		GLuint textures[2] = { Obj3D::textureCache[kind.textures[0]], kind.textures[1] ? Obj3D::textureCache[kind.textures[1]] : 0 };
+
+		for (unsigned int i = 0; i < kindCounts[k]; ++i) {
+			const Variant &variant = variants[kindVariants[k][randomInt(random, (unsigned int)kindVariants[k].size())]];
+			handles.model = variant.model;
+			handles.Texture = textures[textures[1] ? randomInt(random, 2) : 0];
+			EntityID id = entities.create(handles, variant.model->boundsMin, variant.model->boundsMax);
+
+			// Sizes, heights and headings of createObjects()
+			vec3 position(randomFloat(random, -half, half), 0.0f, randomFloat(random, -half, half));
+			vec3 rotation(0.0f);
+			vec3 scale, speed(0.0f);
+			float size;
+			switch (k) {
+				case 0:
+					size = 7.0f / (randomInt(random, 10) + 1);
+					scale = vec3(size / (1 + randomInt(random, 2)), 3.0f / (randomInt(random, 10) + 1), size / (1 + randomInt(random, 2)));
+					position.y = 75.0f - randomInt(random, 10);
+					speed = vec3(-4.0f + randomInt(random, 8), 0.0f, -4.0f + randomInt(random, 8)) * (60.0f / 126);
+					break;
+				case 1:
+					scale = vec3(1.0f / (randomInt(random, 10) + 1));
+					position.y = -1.0f / (0.001f + randomInt(random, 5));
+					rotation.x = randomInt(random, 8) * pi_over_4;
+					break;
+				case 2:
+					scale = vec3(0.1f);
+					rotation.x = randomInt(random, 8) * pi_over_4;
+					break;
+				default:
+					scale = vec3(0.2f);
+					position.y = -1.0f;
+					rotation = vec3(randomInt(random, 4) * pi_over_2, pi_over_2, 0.0f);
+					entities.occluderScales[entities.indexOf(id)] = 1.0f;
+					break;
+			}
+
+			if (terrain) position.y += terrain->height(position.x, position.z);
+			// Same rotations as Obj3D::getModelMatrix
+			entities.setPosition(id, position);
+			entities.setOrientation(id, angleAxis(rotation.x, vec3(0.0f, 1.0f, 0.0f)) * angleAxis(rotation.y, vec3(-1.0f, 0.0f, 0.0f)));
+			entities.setScale(id, scale);
+			if (k == 0) entities.setSpeed(id, speed);
+		}
+	}
+	entityTime = millisecondsSince(start);
+}
+
+void SceneGenerator::print() const {
+	printf("Scene : %u objects on %.0f x %.0f units, %u meshes, %f ms meshes, %f ms entities\n", parameters.instances, parameters.extent, parameters.extent,
+		(unsigned int)variants.size(), meshTime, entityTime);
+	for (int k = 0; k < KIND_COUNT; ++k) {
+		printf("  %8u %s\n", kindCounts[k], kindNames[k]);
+	}
+}
@@ -0,0 +1,67 @@
+#ifndef SCENEGENERATOR_H
+#define SCENEGENERATOR_H
+
+#include <string>
+#include <vector>
+
+#include "Obj3D.h"
+#include "EntityStore.h"
+#include "JobSystem.h"
+#include "Terrain.h"
+
+// Size of a synthetic scene
+struct SceneParameters {
+	unsigned int instances;    // Lit objects, up to the 2^20 slots of the entity store
+	unsigned int uniqueModels; // Distinct meshes they use, at least one per kind of object
+	float extent;              // Side of the square they are spread on, 0 keeps the density of the village
+	unsigned int seed;
+};
+
+// Scenes of any size for the scaling tests, in place of createObjects().
+// The objects are the clouds, rocks, deer and houses of the village, in the same
+// proportions and with the same random sizes. Above one mesh per kind, the extra
+// meshes are copies of the shipped ones stretched and twisted by their own amount,
+// so every one of them is a separate model for the draw code.
+// The meshes are built by the job threads and uploaded on the calling thread, which
+// must own the context. The same parameters always give the same scene. Heights are
+// over the terrain when there is one.
+class SceneGenerator {
+	public:
+		// Objects per square unit when no extent is given, about what the village has
+		static const float DEFAULT_DENSITY;
+
+		SceneGenerator(JobSystem *jobSystem, const Terrain *terrain) : jobSystem(jobSystem), terrain(terrain), meshTime(0.0), entityTime(0.0) {}
+
+		// The shipped models must be in Obj3D::modelCache already, see loadSceneAssets()
+		void generate(const SceneParameters &parameters, EntityStore &entities);
+		// What was created and how long it took
+		void print() const;
+
+	private:
+		// One line of the village
+		struct Kind {
+			const char *model, *textures[2], *normalTexture;
+			float share; // Of the instances
+		};
+		struct Variant {
+			std::string name; // Key in the model cache
+			int kind;
+			Model *model;
+			bool copy;        // False for the shipped model itself
+		};
+
+		static const int KIND_COUNT = 4;
+		static const Kind kinds[KIND_COUNT];
+
+		// Stretched and twisted copy of a loaded model, any thread
+		static Model *createVariant(const Model *base, unsigned int seed, const char *name);
+
+		JobSystem *jobSystem;
+		const Terrain *terrain;
+		SceneParameters parameters;
+		std::vector<Variant> variants;
+		unsigned int kindCounts[KIND_COUNT];
+		double meshTime, entityTime; // Milliseconds
+};
+
+#endif
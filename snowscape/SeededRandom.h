@@ -0,0 +1,30 @@
+#ifndef SEEDEDRANDOM_H
+#define SEEDEDRANDOM_H
+
+#include <random>
+
+// The distributions of <random> differ between standard libraries, the engine does not :
+// these only use its raw output, so the same seed gives the same world with every compiler.
+
+// In [0, n)
+inline unsigned int randomInt(std::mt19937 &random, unsigned int n) {
+	return random() % n;
+}
+
+// In [low, high), 24 bits of precision
+inline float randomFloat(std::mt19937 &random, float low, float high) {
+	return low + (high - low) * (random() >> 8) * (1.0f / 16777216.0f);
+}
+
+// Seed of a grid point, neighbour points get unrelated values
+inline unsigned int hashCoordinates(unsigned int seed, int x, int z) {
+	unsigned int h = seed * 0x9e3779b1u ^ (unsigned int)x * 0x85ebca6bu ^ (unsigned int)z * 0xc2b2ae35u;
+	h ^= h >> 16;
+	h *= 0x7feb352du;
+	h ^= h >> 15;
+	h *= 0x846ca68bu;
+	h ^= h >> 16;
+	return h;
+}
+
+#endif
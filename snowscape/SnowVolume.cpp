@@ -0,0 +1,85 @@
+#include "SnowVolume.h"
+#include "shader.hpp"
+#include "memorytracker.hpp"
+#include "SeededRandom.h"
+
+#include <stdio.h>
+#include <vector>
+
+// Same look as Snowfall
+static const float FLAKE_SIZE = 0.03f;
+static const float FADE_DISTANCE = 60.0f;
+
+SnowVolume::SnowVolume(size_t count, unsigned int seed) : flakes(count), seed(seed) {
+	buffer = vertexArray = 0;
+	programID = 0;
+}
+
+SnowVolume::~SnowVolume() {
+	if (!programID) return;
+	MemoryTracker::releaseBuffer(buffer);
+	glDeleteBuffers(1, &buffer);
+	glDeleteVertexArrays(1, &vertexArray);
+	glDeleteProgram(programID);
+}
+
+void SnowVolume::init(GLuint objectBlockBinding) {
+	// Position in the box in [0, 1), then what sets the speed and the sway of the flake
+	std::vector<vec4> seeds(flakes);
+	std::mt19937 random(seed);
+	for (size_t i = 0; i < flakes; ++i) {
+		seeds[i] = vec4(randomFloat(random, 0.0f, 1.0f), randomFloat(random, 0.0f, 1.0f), randomFloat(random, 0.0f, 1.0f), randomFloat(random, 0.0f, 1.0f));
+	}
+
+	GLint previousVertexArray;
+	glGetIntegerv(GL_VERTEX_ARRAY_BINDING, &previousVertexArray);
+	glGenVertexArrays(1, &vertexArray);
+	glBindVertexArray(vertexArray);
+	glGenBuffers(1, &buffer);
+	glBindBuffer(GL_ARRAY_BUFFER, buffer);
+	glBufferData(GL_ARRAY_BUFFER, seeds.size() * sizeof(vec4), &seeds[0], GL_STATIC_DRAW);
+	MemoryTracker::trackBuffer(buffer, seeds.size() * sizeof(vec4), MEMORY_MESH, "snow volume seeds");
+	glEnableVertexAttribArray(0);
+	glVertexAttribPointer(0, 4, GL_FLOAT, GL_FALSE, 0, (GLvoid*)0);
+	glBindVertexArray(previousVertexArray);
+
+	// The flakes of Snowfall and these look the same
+	programID = LoadShaders("snowvolume.vertexshader", "snowfall.fragmentshader");
+	glUniformBlockBinding(programID, glGetUniformBlockIndex(programID, "ObjectMatrices"), objectBlockBinding);
+	TimeID = glGetUniformLocation(programID, "time");
+	PeriodID = glGetUniformLocation(programID, "period");
+	EyeID = glGetUniformLocation(programID, "eye");
+	PointScaleID = glGetUniformLocation(programID, "pointScale");
+	FadeDistanceID = glGetUniformLocation(programID, "fadeDistance");
+}
+
+void SnowVolume::draw(float time, const vec3 &eye, const mat4 &ProjectionMatrix, int framebufferHeight) {
+	if (!programID || !flakes) return;
+
+	GLint previousVertexArray;
+	glGetIntegerv(GL_VERTEX_ARRAY_BINDING, &previousVertexArray);
+	glBindVertexArray(vertexArray);
+
+	glUseProgram(programID);
+	glUniform1f(TimeID, time);
+	glUniform1f(PeriodID, (float)PERIOD);
+	glUniform3f(EyeID, eye.x, eye.y, eye.z);
+	// Pixels across a flake at a distance of one
+	glUniform1f(PointScaleID, FLAKE_SIZE * ProjectionMatrix[1][1] * framebufferHeight * 0.5f);
+	glUniform1f(FadeDistanceID, FADE_DISTANCE);
+
+	// Blended over the scene like Snowfall
+	glEnable(GL_PROGRAM_POINT_SIZE);
+	glEnable(GL_BLEND);
+	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+	glDepthMask(GL_FALSE);
+	glDrawArrays(GL_POINTS, 0, (GLsizei)flakes);
+	glDepthMask(GL_TRUE);
+	glDisable(GL_BLEND);
+	glDisable(GL_PROGRAM_POINT_SIZE);
+	glBindVertexArray(previousVertexArray);
+}
+
+void SnowVolume::print() const {
+	printf("Snow volume : %u flakes animated on the GPU, %f MB of seeds\n", (unsigned int)flakes, flakes * sizeof(vec4) / (1024.0 * 1024.0));
+}
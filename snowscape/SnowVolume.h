@@ -0,0 +1,44 @@
+#ifndef SNOWVOLUME_H
+#define SNOWVOLUME_H
+
+#include <GL/glew.h>
+
+#include <glm/glm.hpp>
+using namespace glm;
+
+// Falling snow with no work on the CPU, the alternative to Snowfall.
+// A static buffer holds one seed per flake : where it starts in the box, how fast it
+// falls and how it sways. The vertex shader moves it from the time alone and wraps it
+// modulo a box around the camera, every point of the world is covered by one copy of
+// the box so the flakes stay in place when the camera moves. Nothing is uploaded per
+// frame, the view and projection come from the scene block of the object buffer the
+// lit pass uses, and the flakes fade out with the distance.
+// Every flake comes back to its start after PERIOD seconds, the time is wrapped to it
+// so it keeps its precision however long the program runs.
+class SnowVolume {
+	public:
+		// Seconds, the wind and the box size of the shader are set for it
+		static const int PERIOD = 1200;
+
+		SnowVolume(size_t count, unsigned int seed);
+		~SnowVolume();
+
+		// Seed buffer and program, thread that owns the context.
+		// objectBlockBinding is where the ObjectMatrices block of the lit pass is bound
+		void init(GLuint objectBlockBinding);
+		// One draw of every flake at time seconds, in [0, PERIOD). The block of an identity world matrix is bound beforehand
+		void draw(float time, const vec3 &eye, const mat4 &ProjectionMatrix, int framebufferHeight);
+
+		size_t count() const { return flakes; }
+		void print() const;
+
+	private:
+		size_t flakes;
+		unsigned int seed;
+
+		GLuint buffer, vertexArray;
+		GLuint programID;
+		GLuint TimeID, PeriodID, EyeID, PointScaleID, FadeDistanceID;
+};
+
+#endif
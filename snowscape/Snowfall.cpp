@@ -0,0 +1,264 @@
+#include "Snowfall.h"
+#include "shader.hpp"
+#include "cpufeatures.hpp"
+#include "memorytracker.hpp"
+#include "Profiler.h"
+#include "SeededRandom.h"
+
+#include <stdio.h>
+#include <math.h>
+#include <algorithm>
+#include <chrono>
+
+// Box of flakes around the camera, it reaches a little below the eye
+static const vec3 VOLUME_SIZE(120.0f, 40.0f, 120.0f);
+static const float VOLUME_BELOW_EYE = 5.0f;
+// Falling at gravity / drag once the drag balances it, between 0.7 and 1.6 units per second
+static const float GRAVITY = 9.81f;
+static const float DRAG_MIN = 6.0f, DRAG_MAX = 14.0f;
+static const vec3 WIND(1.5f, 0.0f, 0.8f);
+static const float TURBULENCE = 0.8f;
+// Flake size in units, and where they are faded out
+static const float FLAKE_SIZE = 0.03f;
+static const float FADE_DISTANCE = 60.0f;
+
+// Same as the AVX version
+static inline float wave(float u) {
+	float g = (u - floorf(u)) * 2.0f - 1.0f;
+	return 4.0f * g * (1.0f - fabsf(g));
+}
+
+Snowfall::Snowfall(JobSystem *jobSystem, size_t count, unsigned int seed) : jobSystem(jobSystem) {
+	avx = cpuHasAVX();
+	count = (count + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+	x.resize(count);
+	y.resize(count);
+	z.resize(count);
+	vx.resize(count);
+	vy.resize(count);
+	vz.resize(count);
+	drag.resize(count);
+
+	// Anywhere in a box at the origin, the first update moves them around the camera
+	std::mt19937 random(seed);
+	for (size_t i = 0; i < count; ++i) {
+		x[i] = randomFloat(random, 0.0f, VOLUME_SIZE.x);
+		y[i] = randomFloat(random, 0.0f, VOLUME_SIZE.y);
+		z[i] = randomFloat(random, 0.0f, VOLUME_SIZE.z);
+		drag[i] = randomFloat(random, DRAG_MIN, DRAG_MAX);
+		vx[i] = vz[i] = 0.0f;
+		vy[i] = -GRAVITY / drag[i];
+	}
+	MemoryTracker::trackCpu(this, count * 7 * sizeof(float), MEMORY_DYNAMIC, "snowfall");
+
+	time = 0.0f;
+	blockTimes.resize(count / BLOCK_SIZE * 3);
+	cpuTime = wallTime = waitTime = 0.0;
+	totalCpuTime = maxCpuTime = 0.0;
+	updates = 0;
+
+	persistent = false;
+	buffer = vertexArray = 0;
+	mapped = NULL;
+	segment = 0;
+	segmentCount = 1;
+	pending = false;
+	programID = 0;
+	for (int s = 0; s < SEGMENTS; ++s) fences[s] = 0;
+}
+
+Snowfall::~Snowfall() {
+	jobSystem->wait(jobs);
+	MemoryTracker::releaseCpu(this);
+	if (!programID) return;
+
+	for (int s = 0; s < SEGMENTS; ++s) {
+		if (fences[s]) glDeleteSync(fences[s]);
+	}
+	if (persistent) {
+		glBindBuffer(GL_ARRAY_BUFFER, buffer);
+		glUnmapBuffer(GL_ARRAY_BUFFER);
+	}
+	MemoryTracker::releaseBuffer(buffer);
+	glDeleteBuffers(1, &buffer);
+	glDeleteVertexArrays(1, &vertexArray);
+	glDeleteProgram(programID);
+}
+
+void Snowfall::init() {
+	size_t flakes = count();
+	GLint previousVertexArray;
+	glGetIntegerv(GL_VERTEX_ARRAY_BINDING, &previousVertexArray);
+	glGenVertexArrays(1, &vertexArray);
+	glBindVertexArray(vertexArray);
+
+	// x of every segment, then y, then z : the attributes do not move, the draw starts at the segment
+	persistent = GLEW_VERSION_4_4 || GLEW_ARB_buffer_storage;
+	segmentCount = persistent ? SEGMENTS : 1;
+	GLsizeiptr size = 3 * segmentCount * flakes * sizeof(float);
+	glGenBuffers(1, &buffer);
+	glBindBuffer(GL_ARRAY_BUFFER, buffer);
+	if (persistent) {
+		GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+		glBufferStorage(GL_ARRAY_BUFFER, size, NULL, flags);
+		mapped = (float*)glMapBufferRange(GL_ARRAY_BUFFER, 0, size, flags);
+	}
+	else {
+		glBufferData(GL_ARRAY_BUFFER, size, NULL, GL_STREAM_DRAW);
+		staging.resize(3 * flakes);
+		mapped = &staging[0];
+	}
+	MemoryTracker::trackBuffer(buffer, size, MEMORY_DYNAMIC, "snowfall");
+	for (int c = 0; c < 3; ++c) {
+		glEnableVertexAttribArray(c);
+		glVertexAttribPointer(c, 1, GL_FLOAT, GL_FALSE, 0, (GLvoid*)(c * segmentCount * flakes * sizeof(float)));
+	}
+	glBindVertexArray(previousVertexArray);
+
+	programID = LoadShaders("snowfall.vertexshader", "snowfall.fragmentshader");
+	ViewProjectionID = glGetUniformLocation(programID, "VP");
+	PointScaleID = glGetUniformLocation(programID, "pointScale");
+	FadeDistanceID = glGetUniformLocation(programID, "fadeDistance");
+}
+
+void Snowfall::integrate(size_t begin, size_t end, const SnowfallStep &step, float *output) {
+	size_t stride = segmentCount * count();
+	float *outX = output + begin, *outY = output + stride + begin, *outZ = output + 2 * stride + begin;
+	if (avx) {
+		integrateSnowfallAVX(&x[begin], &y[begin], &z[begin], &vx[begin], &vy[begin], &vz[begin], &drag[begin], end - begin, step, outX, outY, outZ);
+		return;
+	}
+
+	for (size_t i = begin; i < end; ++i) {
+		// Turbulence
+		float turbulenceX = step.turbulence * wave(step.waveX.x * x[i] + step.waveX.y * y[i] + (step.waveX.z * z[i] + step.waveX.w));
+		float turbulenceZ = step.turbulence * wave(step.waveZ.x * x[i] + step.waveZ.y * y[i] + (step.waveZ.z * z[i] + step.waveZ.w));
+
+		// Drag towards the wind, gravity
+		vx[i] += drag[i] * (step.wind.x + turbulenceX - vx[i]) * step.dt;
+		vy[i] += (drag[i] * (step.wind.y - vy[i]) - step.gravity) * step.dt;
+		vz[i] += drag[i] * (step.wind.z + turbulenceZ - vz[i]) * step.dt;
+		x[i] += vx[i] * step.dt;
+		y[i] += vy[i] * step.dt;
+		z[i] += vz[i] * step.dt;
+
+		// Out through the bottom or the top : back on the other side, over an other spot
+		float wraps = floorf((y[i] - step.volumeMin.y) * (1.0f / step.volumeSize.y));
+		y[i] -= wraps * step.volumeSize.y;
+		if (wraps != 0.0f) {
+			float h = x[i] * 0.7548777f + z[i] * 0.5698403f;
+			x[i] += (h - floorf(h)) * step.volumeSize.x;
+			z[i] += (2.0f * h - floorf(2.0f * h)) * step.volumeSize.z;
+		}
+
+		// Around the camera
+		x[i] -= floorf((x[i] - step.volumeMin.x) * (1.0f / step.volumeSize.x)) * step.volumeSize.x;
+		z[i] -= floorf((z[i] - step.volumeMin.z) * (1.0f / step.volumeSize.z)) * step.volumeSize.z;
+
+		outX[i - begin] = x[i];
+		outY[i - begin] = y[i];
+		outZ[i - begin] = z[i];
+	}
+}
+
+void Snowfall::update(float dt, const vec3 &camera) {
+	PROFILE_SCOPE("Snowfall update");
+	if (!programID) return;
+
+	// The GPU may still read this segment, from SEGMENTS frames ago
+	if (persistent && fences[segment]) {
+		if (glClientWaitSync(fences[segment], 0, 0) == GL_TIMEOUT_EXPIRED) {
+			glClientWaitSync(fences[segment], GL_SYNC_FLUSH_COMMANDS_BIT, GL_TIMEOUT_IGNORED);
+		}
+		glDeleteSync(fences[segment]);
+		fences[segment] = 0;
+	}
+
+	// A long hitch does not throw the flakes through the volume
+	dt = std::min(dt, 0.1f);
+	time += dt;
+	step.dt = dt;
+	step.gravity = GRAVITY;
+	step.wind = WIND * (0.7f + 0.3f * sinf(time * 0.2f));
+	step.turbulence = TURBULENCE;
+	step.waveX = vec4(0.0f, 0.21f, 0.13f, time * 0.5f);
+	step.waveZ = vec4(0.11f, 0.17f, 0.0f, time * 0.37f + 0.5f);
+	step.volumeMin = camera - vec3(VOLUME_SIZE.x * 0.5f, VOLUME_BELOW_EYE, VOLUME_SIZE.z * 0.5f);
+	step.volumeSize = VOLUME_SIZE;
+
+	float *output = mapped + segment * count();
+	std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+	for (size_t block = 0; block < count() / BLOCK_SIZE; ++block) {
+		jobSystem->run([this, block, output, start]() {
+			PROFILE_SCOPE("Snowfall block");
+			double blockStart = millisecondsSince(start);
+			integrate(block * BLOCK_SIZE, (block + 1) * BLOCK_SIZE, step, output);
+			double blockEnd = millisecondsSince(start);
+			blockTimes[block * 3] = blockStart;
+			blockTimes[block * 3 + 1] = blockEnd;
+			blockTimes[block * 3 + 2] = blockEnd - blockStart;
+		}, &jobs);
+	}
+	pending = true;
+}
+
+void Snowfall::draw(const mat4 &ViewMatrix, const mat4 &ProjectionMatrix, int framebufferHeight) {
+	if (!pending) return;
+	{
+		PROFILE_SCOPE("Snowfall wait");
+		std::chrono::high_resolution_clock::time_point waitStart = std::chrono::high_resolution_clock::now();
+		jobSystem->wait(jobs);
+		waitTime = millisecondsSince(waitStart);
+	}
+	pending = false;
+
+	// Time of the jobs, and from the first one started to the last one done
+	double first = blockTimes[0], last = 0.0;
+	cpuTime = 0.0;
+	for (size_t block = 0; block < blockTimes.size(); block += 3) {
+		first = std::min(first, blockTimes[block]);
+		last = std::max(last, blockTimes[block + 1]);
+		cpuTime += blockTimes[block + 2];
+	}
+	wallTime = last - first;
+	totalCpuTime += cpuTime;
+	maxCpuTime = std::max(maxCpuTime, cpuTime);
+	updates++;
+
+	GLint previousVertexArray;
+	glGetIntegerv(GL_VERTEX_ARRAY_BINDING, &previousVertexArray);
+	glBindVertexArray(vertexArray);
+	if (!persistent) {
+		glBindBuffer(GL_ARRAY_BUFFER, buffer);
+		glBufferData(GL_ARRAY_BUFFER, staging.size() * sizeof(float), NULL, GL_STREAM_DRAW);
+		glBufferSubData(GL_ARRAY_BUFFER, 0, staging.size() * sizeof(float), &staging[0]);
+	}
+
+	glUseProgram(programID);
+	mat4 viewProjection = ProjectionMatrix * ViewMatrix;
+	glUniformMatrix4fv(ViewProjectionID, 1, GL_FALSE, &viewProjection[0][0]);
+	// Pixels across a flake at a distance of one
+	glUniform1f(PointScaleID, FLAKE_SIZE * ProjectionMatrix[1][1] * framebufferHeight * 0.5f);
+	glUniform1f(FadeDistanceID, FADE_DISTANCE);
+
+	// Blended over the scene, in any order : every flake is the same white
+	glEnable(GL_PROGRAM_POINT_SIZE);
+	glEnable(GL_BLEND);
+	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+	glDepthMask(GL_FALSE);
+	glDrawArrays(GL_POINTS, (GLint)(segment * count()), (GLsizei)count());
+	glDepthMask(GL_TRUE);
+	glDisable(GL_BLEND);
+	glDisable(GL_PROGRAM_POINT_SIZE);
+	glBindVertexArray(previousVertexArray);
+
+	if (persistent) {
+		fences[segment] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+		segment = (segment + 1) % segmentCount;
+	}
+}
+
+void Snowfall::print() const {
+	printf("Snowfall : %u flakes in blocks of %d, %s integrator, %s buffer, %f ms CPU per update average, %f ms max\n", (unsigned int)count(), BLOCK_SIZE,
+		avx ? "AVX" : "scalar", persistent ? "persistently mapped" : "orphaned", updates ? totalCpuTime / updates : 0.0, maxCpuTime);
+}
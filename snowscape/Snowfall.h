@@ -0,0 +1,90 @@
+#ifndef SNOWFALL_H
+#define SNOWFALL_H
+
+#include <vector>
+#include <GL/glew.h>
+
+#include <glm/glm.hpp>
+using namespace glm;
+
+#include "JobSystem.h"
+
+// Values of one step of the integrator, the same for every flake
+struct SnowfallStep {
+	float dt;
+	float gravity;      // Units per second squared
+	vec3 wind;          // Units per second
+	float turbulence;   // Amplitude of the waves, units per second
+	vec4 waveX, waveZ;  // Turbulence along x and z : frequencies along x, y and z, then phase
+	vec3 volumeMin;     // Corner of the box around the camera
+	vec3 volumeSize;
+};
+
+// Falling snow, up to millions of flakes simulated on the CPU.
+// The state is kept as separate arrays of x, y, z and velocities so eight flakes
+// are integrated at once with AVX, a block of BLOCK_SIZE flakes per job : gravity
+// against a drag of their own, wind and waves of turbulence they cross as they fall.
+// The flakes live in a box around the camera. Those that leave it through the bottom
+// come back at the top over an other spot, those left behind by the camera come back
+// on the side it moves to : the density around the eye never changes.
+// The jobs write the positions straight into a persistently mapped buffer, one segment
+// per frame in flight, and all the flakes are one draw of points.
+class Snowfall {
+	public:
+		static const int BLOCK_SIZE = 4096;
+		static const int SEGMENTS = 3; // Frames the GPU may still be reading
+
+		// count is rounded up to whole blocks
+		Snowfall(JobSystem *jobSystem, size_t count, unsigned int seed);
+		~Snowfall();
+
+		// Buffer and program, thread that owns the context
+		void init();
+		// Queue the jobs that move the flakes by dt around the camera, they run while the frame is culled and drawn
+		void update(float dt, const vec3 &camera);
+		// Wait for the jobs, then one draw of every flake. After the opaque objects, blended over them
+		void draw(const mat4 &ViewMatrix, const mat4 &ProjectionMatrix, int framebufferHeight);
+
+		size_t count() const { return x.size(); }
+		// Of the last update, milliseconds : sum over the jobs, and from the first job to the last
+		double cpuTime, wallTime;
+		// Milliseconds the last draw() waited for the jobs on the calling thread
+		double waitTime;
+		void print() const;
+
+	private:
+		// Integrate [begin, end) and write the positions to the segment at output, its x, y and z arrays segmentCount * count() floats apart
+		void integrate(size_t begin, size_t end, const SnowfallStep &step, float *output);
+
+		JobSystem *jobSystem;
+		bool avx;
+
+		// Flake state, one array per component
+		std::vector<float> x, y, z, vx, vy, vz, drag;
+
+		SnowfallStep step;
+		float time; // Seconds simulated
+		JobCounter jobs;
+		std::vector<double> blockTimes; // Milliseconds, start, end and length of each block of the last update
+		double totalCpuTime, maxCpuTime;
+		unsigned int updates;
+
+		// Persistently mapped when the driver can, else written to staging and uploaded by draw()
+		bool persistent;
+		GLuint buffer, vertexArray;
+		float *mapped;
+		std::vector<float> staging;
+		GLsync fences[SEGMENTS];
+		int segment, segmentCount;
+		bool pending;
+
+		GLuint programID;
+		GLuint ViewProjectionID, PointScaleID, FadeDistanceID;
+};
+
+// AVX version of the integrator, in its own file compiled for AVX, only call it when the CPU supports it.
+// count is a multiple of 8
+void integrateSnowfallAVX(float *x, float *y, float *z, float *vx, float *vy, float *vz, const float *drag, size_t count,
+	const SnowfallStep &step, float *outX, float *outY, float *outZ);
+
+#endif
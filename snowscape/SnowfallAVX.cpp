@@ -0,0 +1,83 @@
+// Compiled with /arch:AVX, see snowscape.vcxproj. Only reached when cpuHasAVX().
+#include "Snowfall.h"
+
+#include <immintrin.h>
+
+#if defined(__GNUC__) && !defined(__AVX__)
+#define AVX_FUNCTION __attribute__((target("avx")))
+#else
+#define AVX_FUNCTION
+#endif
+
+// Periodic and smooth, close to a sine of period 1 : 4g(1 - |g|) with g in [-1, 1)
+AVX_FUNCTION static inline __m256 wave(__m256 u) {
+	const __m256 one = _mm256_set1_ps(1.0f);
+	const __m256 signMask = _mm256_set1_ps(-0.0f);
+	__m256 g = _mm256_sub_ps(_mm256_mul_ps(_mm256_sub_ps(u, _mm256_floor_ps(u)), _mm256_set1_ps(2.0f)), one);
+	__m256 absG = _mm256_andnot_ps(signMask, g);
+	return _mm256_mul_ps(_mm256_mul_ps(_mm256_set1_ps(4.0f), g), _mm256_sub_ps(one, absG));
+}
+
+AVX_FUNCTION static inline __m256 fract(__m256 u) {
+	return _mm256_sub_ps(u, _mm256_floor_ps(u));
+}
+
+AVX_FUNCTION void integrateSnowfallAVX(float *x, float *y, float *z, float *vx, float *vy, float *vz, const float *drag, size_t count,
+	const SnowfallStep &step, float *outX, float *outY, float *outZ) {
+	const __m256 dt = _mm256_set1_ps(step.dt);
+	const __m256 gravity = _mm256_set1_ps(step.gravity);
+	const __m256 turbulence = _mm256_set1_ps(step.turbulence);
+	const __m256 windX = _mm256_set1_ps(step.wind.x), windY = _mm256_set1_ps(step.wind.y), windZ = _mm256_set1_ps(step.wind.z);
+	const __m256 waveX[4] = { _mm256_set1_ps(step.waveX.x), _mm256_set1_ps(step.waveX.y), _mm256_set1_ps(step.waveX.z), _mm256_set1_ps(step.waveX.w) };
+	const __m256 waveZ[4] = { _mm256_set1_ps(step.waveZ.x), _mm256_set1_ps(step.waveZ.y), _mm256_set1_ps(step.waveZ.z), _mm256_set1_ps(step.waveZ.w) };
+	const __m256 minX = _mm256_set1_ps(step.volumeMin.x), minY = _mm256_set1_ps(step.volumeMin.y), minZ = _mm256_set1_ps(step.volumeMin.z);
+	const __m256 sizeX = _mm256_set1_ps(step.volumeSize.x), sizeY = _mm256_set1_ps(step.volumeSize.y), sizeZ = _mm256_set1_ps(step.volumeSize.z);
+	const __m256 inverseX = _mm256_set1_ps(1.0f / step.volumeSize.x), inverseY = _mm256_set1_ps(1.0f / step.volumeSize.y), inverseZ = _mm256_set1_ps(1.0f / step.volumeSize.z);
+	const __m256 hashX = _mm256_set1_ps(0.7548777f), hashZ = _mm256_set1_ps(0.5698403f);
+	const __m256 zero = _mm256_setzero_ps();
+
+	for (size_t i = 0; i < count; i += 8) {
+		__m256 px = _mm256_loadu_ps(x + i), py = _mm256_loadu_ps(y + i), pz = _mm256_loadu_ps(z + i);
+		__m256 velocityX = _mm256_loadu_ps(vx + i), velocityY = _mm256_loadu_ps(vy + i), velocityZ = _mm256_loadu_ps(vz + i);
+		__m256 k = _mm256_loadu_ps(drag + i);
+
+		// Turbulence
+		__m256 u = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(waveX[0], px), _mm256_mul_ps(waveX[1], py)), _mm256_add_ps(_mm256_mul_ps(waveX[2], pz), waveX[3]));
+		__m256 turbulenceX = _mm256_mul_ps(turbulence, wave(u));
+		u = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(waveZ[0], px), _mm256_mul_ps(waveZ[1], py)), _mm256_add_ps(_mm256_mul_ps(waveZ[2], pz), waveZ[3]));
+		__m256 turbulenceZ = _mm256_mul_ps(turbulence, wave(u));
+
+		// Drag towards the wind, gravity
+		velocityX = _mm256_add_ps(velocityX, _mm256_mul_ps(_mm256_mul_ps(k, _mm256_sub_ps(_mm256_add_ps(windX, turbulenceX), velocityX)), dt));
+		velocityY = _mm256_add_ps(velocityY, _mm256_mul_ps(_mm256_sub_ps(_mm256_mul_ps(k, _mm256_sub_ps(windY, velocityY)), gravity), dt));
+		velocityZ = _mm256_add_ps(velocityZ, _mm256_mul_ps(_mm256_mul_ps(k, _mm256_sub_ps(_mm256_add_ps(windZ, turbulenceZ), velocityZ)), dt));
+		px = _mm256_add_ps(px, _mm256_mul_ps(velocityX, dt));
+		py = _mm256_add_ps(py, _mm256_mul_ps(velocityY, dt));
+		pz = _mm256_add_ps(pz, _mm256_mul_ps(velocityZ, dt));
+
+		// Out through the bottom or the top : back on the other side, over an other spot
+		__m256 wraps = _mm256_floor_ps(_mm256_mul_ps(_mm256_sub_ps(py, minY), inverseY));
+		py = _mm256_sub_ps(py, _mm256_mul_ps(wraps, sizeY));
+		__m256 respawned = _mm256_cmp_ps(wraps, zero, _CMP_NEQ_OQ);
+		__m256 h = _mm256_add_ps(_mm256_mul_ps(px, hashX), _mm256_mul_ps(pz, hashZ));
+		px = _mm256_add_ps(px, _mm256_and_ps(respawned, _mm256_mul_ps(fract(h), sizeX)));
+		pz = _mm256_add_ps(pz, _mm256_and_ps(respawned, _mm256_mul_ps(fract(_mm256_add_ps(h, h)), sizeZ)));
+
+		// Around the camera
+		px = _mm256_sub_ps(px, _mm256_mul_ps(_mm256_floor_ps(_mm256_mul_ps(_mm256_sub_ps(px, minX), inverseX)), sizeX));
+		pz = _mm256_sub_ps(pz, _mm256_mul_ps(_mm256_floor_ps(_mm256_mul_ps(_mm256_sub_ps(pz, minZ), inverseZ)), sizeZ));
+
+		_mm256_storeu_ps(x + i, px);
+		_mm256_storeu_ps(y + i, py);
+		_mm256_storeu_ps(z + i, pz);
+		_mm256_storeu_ps(vx + i, velocityX);
+		_mm256_storeu_ps(vy + i, velocityY);
+		_mm256_storeu_ps(vz + i, velocityZ);
+		// Write only, the mapped memory is not read back
+		_mm256_storeu_ps(outX + i, px);
+		_mm256_storeu_ps(outY + i, py);
+		_mm256_storeu_ps(outZ + i, pz);
+	}
+
+	_mm256_zeroupper();
+}
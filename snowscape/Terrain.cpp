@@ -0,0 +1,331 @@
+#include "Terrain.h"
+#include "shader.hpp"
+#include "memorytracker.hpp"
+#include "Profiler.h"
+#include "SeededRandom.h"
+
+#include <stdio.h>
+#include <math.h>
+#include <algorithm>
+#include <chrono>
+
+const float Terrain::SIZE = 2048.0f;
+const float Terrain::LEAF_RANGE = 128.0f;
+
+// Shape of the hills
+static const float HILL_HEIGHT = 120.0f;
+static const int OCTAVES = 6;
+static const int LARGEST_CELL = 256; // Samples between the lattice points of the first octave
+// The village sits in a shallow valley : flattened inside, full height outside
+static const float VALLEY_INNER = 150.0f, VALLEY_OUTER = 450.0f, VALLEY_FLOOR = 0.1f;
+// Fraction of the range of a level over which its vertices slide onto the grid of the next one
+static const float MORPH_FRACTION = 0.3f;
+
+// Value in [0, 1) of a lattice point, the same on every compiler
+static float latticeValue(unsigned int seed, int x, int z) {
+	return (hashCoordinates(seed, x, z) >> 8) * (1.0f / 16777216.0f);
+}
+
+// Smoothly interpolated lattice values, cell samples apart. The lattice wraps with the heightmap
+static float valueNoise(unsigned int seed, int x, int z, int cell) {
+	int period = Terrain::HEIGHTMAP_SIZE / cell;
+	int x0 = x / cell, z0 = z / cell;
+	float tx = (float)(x - x0 * cell) / cell, tz = (float)(z - z0 * cell) / cell;
+	tx = tx * tx * (3.0f - 2.0f * tx);
+	tz = tz * tz * (3.0f - 2.0f * tz);
+	int x1 = (x0 + 1) % period, z1 = (z0 + 1) % period;
+	float a = latticeValue(seed, x0, z0), b = latticeValue(seed, x1, z0);
+	float c = latticeValue(seed, x0, z1), d = latticeValue(seed, x1, z1);
+	return mix(mix(a, b, tx), mix(c, d, tx), tz);
+}
+
+Terrain::Terrain() {
+	heightTexture = gridBuffer = indexBuffer = chunkBuffer = vertexArray = 0;
+	programID = 0;
+	chunkCapacity = 0;
+	indexCount = 0;
+	generateTime = 0.0;
+	maxChunks = 0;
+	for (int level = 0; level < LEVELS; ++level) {
+		ranges[level] = LEAF_RANGE * (1 << level);
+	}
+}
+
+Terrain::~Terrain() {
+	if (!programID) return;
+
+	MemoryTracker::releaseTexture(heightTexture);
+	MemoryTracker::releaseBuffer(gridBuffer);
+	MemoryTracker::releaseBuffer(indexBuffer);
+	MemoryTracker::releaseBuffer(chunkBuffer);
+	MemoryTracker::releaseCpu(&heights);
+	glDeleteTextures(1, &heightTexture);
+	glDeleteBuffers(1, &gridBuffer);
+	glDeleteBuffers(1, &indexBuffer);
+	glDeleteBuffers(1, &chunkBuffer);
+	glDeleteVertexArrays(1, &vertexArray);
+	glDeleteProgram(programID);
+}
+
+float Terrain::generateHeight(unsigned int seed, int x, int z) const {
+	float noise = 0.0f, amplitude = 1.0f, total = 0.0f;
+	for (int octave = 0, cell = LARGEST_CELL; octave < OCTAVES; ++octave, cell /= 2) {
+		noise += amplitude * valueNoise(seed + octave, x, z, cell);
+		total += amplitude;
+		amplitude *= 0.5f;
+	}
+	noise /= total;
+
+	// Distance to the closest copy of the origin
+	float unit = SIZE / HEIGHTMAP_SIZE;
+	float dx = (x < HEIGHTMAP_SIZE / 2 ? x : x - HEIGHTMAP_SIZE) * unit;
+	float dz = (z < HEIGHTMAP_SIZE / 2 ? z : z - HEIGHTMAP_SIZE) * unit;
+	float valley = smoothstep(VALLEY_INNER, VALLEY_OUTER, sqrtf(dx * dx + dz * dz));
+	// Squared, wide valleys and rounded tops
+	return HILL_HEIGHT * noise * noise * (VALLEY_FLOOR + (1.0f - VALLEY_FLOOR) * valley);
+}
+
+void Terrain::buildBounds() {
+	// Leaves from the samples, their last row and column are the first of the next node
+	int nodes = 1 << (LEVELS - 1);
+	int step = HEIGHTMAP_SIZE / nodes;
+	bounds[0].resize(nodes * nodes);
+	for (int z = 0; z < nodes; ++z) {
+		for (int x = 0; x < nodes; ++x) {
+			vec2 bound(sample(x * step, z * step));
+			bound.y = bound.x;
+			for (int sz = 0; sz <= step; ++sz) {
+				for (int sx = 0; sx <= step; ++sx) {
+					float h = sample(x * step + sx, z * step + sz);
+					bound = vec2(std::min(bound.x, h), std::max(bound.y, h));
+				}
+			}
+			bounds[0][z * nodes + x] = bound;
+		}
+	}
+
+	// Every level from its four children
+	for (int level = 1; level < LEVELS; ++level) {
+		nodes /= 2;
+		bounds[level].resize(nodes * nodes);
+		const std::vector<vec2> &children = bounds[level - 1];
+		for (int z = 0; z < nodes; ++z) {
+			for (int x = 0; x < nodes; ++x) {
+				vec2 a = children[(z * 2) * nodes * 2 + x * 2], b = children[(z * 2) * nodes * 2 + x * 2 + 1];
+				vec2 c = children[(z * 2 + 1) * nodes * 2 + x * 2], d = children[(z * 2 + 1) * nodes * 2 + x * 2 + 1];
+				bounds[level][z * nodes + x] = vec2(std::min(std::min(a.x, b.x), std::min(c.x, d.x)), std::max(std::max(a.y, b.y), std::max(c.y, d.y)));
+			}
+		}
+	}
+}
+
+void Terrain::init(JobSystem *jobSystem, unsigned int seed) {
+	PROFILE_SCOPE("Generate terrain");
+	std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+
+	// Heights, a few rows per job
+	heights.resize(HEIGHTMAP_SIZE * HEIGHTMAP_SIZE);
+	jobSystem->parallelFor(HEIGHTMAP_SIZE, 16, [&](size_t begin, size_t end) {
+		for (size_t z = begin; z < end; ++z) {
+			for (int x = 0; x < HEIGHTMAP_SIZE; ++x) {
+				heights[z * HEIGHTMAP_SIZE + x] = generateHeight(seed, x, (int)z);
+			}
+		}
+	});
+	MemoryTracker::trackCpu(&heights, heights.size() * sizeof(float), MEMORY_TEXTURE, "terrain heights");
+	buildBounds();
+	generateTime = millisecondsSince(start);
+
+	// Sampled by the vertex shader, repeats like height()
+	glGenTextures(1, &heightTexture);
+	glBindTexture(GL_TEXTURE_2D, heightTexture);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_R32F, HEIGHTMAP_SIZE, HEIGHTMAP_SIZE, 0, GL_RED, GL_FLOAT, &heights[0]);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+	MemoryTracker::trackTexture(heightTexture, MemoryTracker::textureSize(heightTexture), MEMORY_TEXTURE, "terrain heightmap");
+
+	GLint previousVertexArray;
+	glGetIntegerv(GL_VERTEX_ARRAY_BINDING, &previousVertexArray);
+	glGenVertexArrays(1, &vertexArray);
+	glBindVertexArray(vertexArray);
+
+	// The chunk grid, in quads
+	std::vector<vec2> grid;
+	for (int z = 0; z <= GRID_SIZE; ++z) {
+		for (int x = 0; x <= GRID_SIZE; ++x) {
+			grid.push_back(vec2(x, z));
+		}
+	}
+	glGenBuffers(1, &gridBuffer);
+	glBindBuffer(GL_ARRAY_BUFFER, gridBuffer);
+	glBufferData(GL_ARRAY_BUFFER, grid.size() * sizeof(vec2), &grid[0], GL_STATIC_DRAW);
+	MemoryTracker::trackBuffer(gridBuffer, grid.size() * sizeof(vec2), MEMORY_MESH, "terrain grid");
+	glEnableVertexAttribArray(0);
+	glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, (GLvoid*)0);
+
+	// Counter-clockwise seen from above
+	std::vector<unsigned short> indices;
+	for (int z = 0; z < GRID_SIZE; ++z) {
+		for (int x = 0; x < GRID_SIZE; ++x) {
+			unsigned short a = (unsigned short)(z * (GRID_SIZE + 1) + x), b = a + GRID_SIZE + 1;
+			unsigned short quad[6] = { a, b, (unsigned short)(a + 1), (unsigned short)(a + 1), b, (unsigned short)(b + 1) };
+			indices.insert(indices.end(), quad, quad + 6);
+		}
+	}
+	indexCount = (GLsizei)indices.size();
+	glGenBuffers(1, &indexBuffer);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indexBuffer);
+	glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(unsigned short), &indices[0], GL_STATIC_DRAW);
+	MemoryTracker::trackBuffer(indexBuffer, indices.size() * sizeof(unsigned short), MEMORY_MESH, "terrain grid");
+
+	// One chunk per instance, refilled every frame
+	glGenBuffers(1, &chunkBuffer);
+	glBindBuffer(GL_ARRAY_BUFFER, chunkBuffer);
+	glEnableVertexAttribArray(1);
+	glVertexAttribPointer(1, 4, GL_FLOAT, GL_FALSE, 0, (GLvoid*)0);
+	glVertexAttribDivisor(1, 1);
+	glBindVertexArray(previousVertexArray);
+
+	programID = LoadShaders("terrain.vertexshader", "terrain.fragmentshader");
+	ViewProjectionID = glGetUniformLocation(programID, "VP");
+	ViewID = glGetUniformLocation(programID, "V");
+	EyeID = glGetUniformLocation(programID, "EyePosition_worldspace");
+	LightID = glGetUniformLocation(programID, "LightPosition_worldspace");
+	HeightmapID = glGetUniformLocation(programID, "heightmap");
+	MorphRangesID = glGetUniformLocation(programID, "morphRanges");
+
+	// GLSL has no way to see LEVELS, the shader declares the array with the same size
+	const GLchar *morphRangesName = "morphRanges";
+	GLuint morphRangesIndex = GL_INVALID_INDEX;
+	GLint morphRangesSize = 0;
+	glGetUniformIndices(programID, 1, &morphRangesName, &morphRangesIndex);
+	if (morphRangesIndex != GL_INVALID_INDEX) glGetActiveUniformsiv(programID, 1, &morphRangesIndex, GL_UNIFORM_SIZE, &morphRangesSize);
+	if (morphRangesSize != LEVELS) {
+		fprintf(stderr, "terrain.vertexshader has %d morph ranges, Terrain::LEVELS is %d\n", morphRangesSize, LEVELS);
+	}
+
+	// Constants of the shader
+	glUseProgram(programID);
+	glUniform1f(glGetUniformLocation(programID, "terrainSize"), SIZE);
+	glUniform1f(glGetUniformLocation(programID, "gridSize"), (float)GRID_SIZE);
+	vec2 morphRanges[LEVELS];
+	for (int level = 0; level < LEVELS; ++level) {
+		// Start and end distances of the morph, fully on the next grid at the end of the range
+		morphRanges[level] = vec2(ranges[level] * (1.0f - MORPH_FRACTION), ranges[level]);
+	}
+	glUniform2fv(MorphRangesID, LEVELS, &morphRanges[0][0]);
+	glUseProgram(0);
+}
+
+float Terrain::height(float x, float z) const {
+	float unit = SIZE / HEIGHTMAP_SIZE;
+	float fx = x / unit, fz = z / unit;
+	float x0 = floorf(fx), z0 = floorf(fz);
+	float tx = fx - x0, tz = fz - z0;
+	int ix = (int)x0, iz = (int)z0;
+	return mix(mix(sample(ix, iz), sample(ix + 1, iz), tx), mix(sample(ix, iz + 1), sample(ix + 1, iz + 1), tx), tz);
+}
+
+bool Terrain::select(int level, int x, int z, const vec3 &eye, const vec4 planes[6]) {
+	int nodes = 1 << (LEVELS - 1 - level);
+	float size = SIZE / nodes;
+	vec2 bound = bounds[level][(z & (nodes - 1)) * nodes + (x & (nodes - 1))];
+	vec3 boxMin(x * size, bound.x, z * size);
+	vec3 boxMax(boxMin.x + size, bound.y, boxMin.z + size);
+
+	// Out of view : nothing to draw, at any level
+	for (int p = 0; p < 6; ++p) {
+		// Corner the furthest along the normal of the plane
+		vec3 corner(planes[p].x > 0.0f ? boxMax.x : boxMin.x, planes[p].y > 0.0f ? boxMax.y : boxMin.y, planes[p].z > 0.0f ? boxMax.z : boxMin.z);
+		if (dot(vec3(planes[p]), corner) + planes[p].w < 0.0f) return true;
+	}
+
+	float distance = length(clamp(eye, boxMin, boxMax) - eye);
+	if (distance > ranges[level]) return false;
+
+	if (level == 0 || distance > ranges[level - 1]) {
+		chunks.push_back(Chunk(boxMin.x, boxMin.z, size, (float)level));
+		return true;
+	}
+
+	// The children out of range of the finer level are drawn at it fully morphed, which is the grid of this node
+	for (int c = 0; c < 4; ++c) {
+		int childX = x * 2 + (c & 1), childZ = z * 2 + (c >> 1);
+		if (!select(level - 1, childX, childZ, eye, planes)) {
+			chunks.push_back(Chunk(childX * size * 0.5f, childZ * size * 0.5f, size * 0.5f, (float)(level - 1)));
+		}
+	}
+	return true;
+}
+
+void Terrain::draw(const mat4 &ViewMatrix, const mat4 &ProjectionMatrix, vec3 lightPos) {
+	PROFILE_SCOPE("Terrain");
+	mat4 viewProjection = ProjectionMatrix * ViewMatrix;
+	vec3 eye = vec3(inverse(ViewMatrix)[3]);
+
+	// Frustum planes, rows of the view projection matrix combined
+	vec4 planes[6];
+	for (int i = 0; i < 3; ++i) {
+		vec4 row(viewProjection[0][i], viewProjection[1][i], viewProjection[2][i], viewProjection[3][i]);
+		vec4 w(viewProjection[0][3], viewProjection[1][3], viewProjection[2][3], viewProjection[3][3]);
+		planes[i * 2] = w + row;
+		planes[i * 2 + 1] = w - row;
+	}
+	for (int i = 0; i < 6; ++i) {
+		planes[i] /= length(vec3(planes[i]));
+	}
+
+	// The root under the eye and its neighbours, the far plane is closer than the next ones
+	chunks.clear();
+	int rootX = (int)floorf(eye.x / SIZE), rootZ = (int)floorf(eye.z / SIZE);
+	for (int z = rootZ - 1; z <= rootZ + 1; ++z) {
+		for (int x = rootX - 1; x <= rootX + 1; ++x) {
+			select(LEVELS - 1, x, z, eye, planes);
+		}
+	}
+	maxChunks = std::max(maxChunks, (int)chunks.size());
+	if (chunks.empty()) return;
+
+	GLint previousVertexArray;
+	glGetIntegerv(GL_VERTEX_ARRAY_BINDING, &previousVertexArray);
+	glBindVertexArray(vertexArray);
+
+	// Orphaned every frame, grown when too small
+	glBindBuffer(GL_ARRAY_BUFFER, chunkBuffer);
+	if (chunks.size() > chunkCapacity) {
+		chunkCapacity = std::max(chunks.size(), chunkCapacity * 2);
+		MemoryTracker::trackBuffer(chunkBuffer, chunkCapacity * sizeof(Chunk), MEMORY_DYNAMIC, "terrain chunks");
+	}
+	glBufferData(GL_ARRAY_BUFFER, chunkCapacity * sizeof(Chunk), NULL, GL_STREAM_DRAW);
+	glBufferSubData(GL_ARRAY_BUFFER, 0, chunks.size() * sizeof(Chunk), &chunks[0]);
+
+	glUseProgram(programID);
+	glUniformMatrix4fv(ViewProjectionID, 1, GL_FALSE, &viewProjection[0][0]);
+	glUniformMatrix4fv(ViewID, 1, GL_FALSE, &ViewMatrix[0][0]);
+	glUniform3f(EyeID, eye.x, eye.y, eye.z);
+	glUniform3f(LightID, lightPos.x, lightPos.y, lightPos.z);
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_2D, heightTexture);
+	glUniform1i(HeightmapID, 0);
+
+	glDrawElementsInstanced(GL_TRIANGLES, indexCount, GL_UNSIGNED_SHORT, (void*)0, (GLsizei)chunks.size());
+	glBindVertexArray(previousVertexArray);
+}
+
+long long Terrain::maxTriangles() const {
+	// The roots around the eye, then below each level the children of the parents within its range
+	long long count = 9;
+	for (int level = 0; level < LEVELS - 1; ++level) {
+		float parentSize = SIZE / (1 << (LEVELS - 2 - level));
+		long long parents = (long long)ceilf(2.0f * ranges[level] / parentSize) + 1;
+		count += 4 * parents * parents;
+	}
+	return count * GRID_SIZE * GRID_SIZE * 2;
+}
+
+void Terrain::print() const {
+	printf("Terrain : %.0f x %.0f units, %d levels, %d chunks at most, %lld triangles at most (bound %lld), %f ms generation\n", SIZE, SIZE, LEVELS,
+		maxChunks, (long long)maxChunks * GRID_SIZE * GRID_SIZE * 2, maxTriangles(), generateTime);
+}
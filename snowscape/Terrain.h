@@ -0,0 +1,80 @@
+#ifndef TERRAIN_H
+#define TERRAIN_H
+
+#include <vector>
+#include <GL/glew.h>
+
+#include <glm/glm.hpp>
+using namespace glm;
+
+#include "JobSystem.h"
+
+// Snow covered hills under the scene, a heightfield drawn with CDLOD (continuous
+// distance-dependent level of detail).
+// The heights are generated from the seed at startup on a square of SIZE units that
+// repeats without a seam, the objects and the cameras read them back with height()
+// and the vertex shader from a float texture.
+// Every chunk is the same GRID_SIZE x GRID_SIZE grid, scaled to its node of a quadtree
+// and displaced on the GPU. The further the camera, the bigger the nodes : one level
+// per distance range, twice the previous one. Towards the end of its range the odd
+// vertices of a node slide onto the grid of its parent, the levels meet without cracks
+// and switch without popping. Nodes out of the frustum are skipped with the lowest and
+// highest heights under them.
+// Each level covers about the same number of nodes, the triangle count depends on the
+// number of levels and not on the area.
+class Terrain {
+	public:
+		static const float SIZE;               // Side of the landscape, the heights repeat past it
+		static const int HEIGHTMAP_SIZE = 1024; // Samples on a side, one every SIZE / HEIGHTMAP_SIZE units
+		static const int GRID_SIZE = 16;       // Quads on a side of a chunk
+		static const int LEVELS = 7;           // Roots of SIZE units down to leaves of SIZE / 64, one sample per quad
+		static const float LEAF_RANGE;         // Distance covered by the leaves, doubles every level
+
+		Terrain();
+		~Terrain();
+
+		// Heights on the job threads, then texture, grid and program. Thread that owns the context
+		void init(JobSystem *jobSystem, unsigned int seed);
+		// Ground height at a point, bilinear between the samples like the texture. Any thread once init() returned
+		float height(float x, float z) const;
+
+		// Nodes around the eye, one instanced draw of the chunk grid. The clustered lights are bound to getProgram() beforehand
+		void draw(const mat4 &ViewMatrix, const mat4 &ProjectionMatrix, vec3 lightPos);
+
+		GLuint getProgram() const { return programID; }
+		// Of the last draw()
+		int chunkCount() const { return (int)chunks.size(); }
+		long long triangleCount() const { return (long long)chunks.size() * GRID_SIZE * GRID_SIZE * 2; }
+		// Upper bound of triangleCount() wherever the camera is
+		long long maxTriangles() const;
+		void print() const;
+
+	private:
+		// Instance attributes of a chunk : corner x and z, side and level
+		typedef vec4 Chunk;
+
+		// Height of sample (x, z), wrapped
+		float sample(int x, int z) const { return heights[(z & (HEIGHTMAP_SIZE - 1)) * HEIGHTMAP_SIZE + (x & (HEIGHTMAP_SIZE - 1))]; }
+		// Repeating fractal noise and the shape of the valley around the origin
+		float generateHeight(unsigned int seed, int x, int z) const;
+		// Lowest and highest heights under every node of every level
+		void buildBounds();
+		// Node (x, z) of a level, in node units. False when out of the range of its level, its parent draws it
+		bool select(int level, int x, int z, const vec3 &eye, const vec4 planes[6]);
+
+		std::vector<float> heights;
+		std::vector<vec2> bounds[LEVELS]; // Min and max height of each node, wrapped like the samples
+		float ranges[LEVELS];
+
+		std::vector<Chunk> chunks;
+		GLuint heightTexture, gridBuffer, indexBuffer, chunkBuffer, vertexArray;
+		size_t chunkCapacity;
+		GLsizei indexCount;
+
+		GLuint programID;
+		GLuint ViewProjectionID, ViewID, EyeID, LightID, HeightmapID, MorphRangesID;
+		double generateTime; // Milliseconds
+		int maxChunks;
+};
+
+#endif
@@ -0,0 +1,277 @@
+#include "TextureStreamer.h"
+#include "Profiler.h"
+#include "memorytracker.hpp"
+
+#include <stdio.h>
+#include <limits.h>
+#include <cmath>
+#include <algorithm>
+
+const float TextureStreamer::LOD_FADE_STEP = 0.125f;
+
+static const double MB = 1024.0 * 1024.0;
+
+TextureStreamer::TextureStreamer(JobSystem *jobSystem, size_t budget) : jobSystem(jobSystem), budgetBytes(budget) {
+	synchronous = false;
+	frame = 0;
+	streamedBytes = peakBytes = 0;
+	levelsRead = levelsEvicted = 0;
+}
+
+TextureStreamer::~TextureStreamer() {
+	// The reads in flight end with a GL job that writes to their texture
+	jobSystem->wait(reads);
+	jobSystem->flushGLThread();
+	for (size_t i = 0; i < textures.size(); ++i) {
+		delete textures[i];
+	}
+}
+
+void TextureStreamer::computeLevels(const TextureData &header, StreamedTexture &texture) {
+	unsigned int blockSize = (header.format == GL_COMPRESSED_RGBA_S3TC_DXT1_EXT) ? 8 : 16;
+	unsigned int width = header.width, height = header.height, offset = header.dataOffset;
+
+	texture.format = header.format;
+	texture.levelCount = std::max(header.mipMapCount, 1u);
+	texture.tailLevel = texture.levelCount - 1;
+	texture.widths.clear();
+	texture.heights.clear();
+	texture.offsets.clear();
+	texture.sizes.clear();
+	for (unsigned int level = 0; level < texture.levelCount; ++level) {
+		unsigned int size = ((width + 3) / 4) * ((height + 3) / 4) * blockSize;
+		texture.widths.push_back(width);
+		texture.heights.push_back(height);
+		texture.offsets.push_back(offset);
+		texture.sizes.push_back(size);
+		if (std::max(width, height) <= TAIL_SIZE && level < texture.tailLevel) texture.tailLevel = level;
+
+		offset += size;
+		width = std::max(width / 2, 1u);
+		height = std::max(height / 2, 1u);
+	}
+}
+
+bool TextureStreamer::readTail(const char *path, TextureData &texture) {
+	FILE *file = fopen(path, "rb");
+	if (!file) {
+		printf("%s could not be opened\n", path);
+		return false;
+	}
+
+	unsigned char header[DDS_HEADER_SIZE];
+	size_t headerSize = fread(header, 1, DDS_HEADER_SIZE, file);
+	if (!parseDDSHeader(header, headerSize, texture)) {
+		fclose(file);
+		return false;
+	}
+
+	// A truncated file keeps the levels it has in full
+	fseek(file, 0, SEEK_END);
+	long fileSize = ftell(file);
+	StreamedTexture layout;
+	computeLevels(texture, layout);
+	unsigned int levels = 0;
+	while (levels < layout.levelCount && (long)(layout.offsets[levels] + layout.sizes[levels]) <= fileSize) levels++;
+	if (levels == 0) {
+		fclose(file);
+		return false;
+	}
+	texture.mipMapCount = levels;
+	computeLevels(texture, layout);
+
+	unsigned int begin = layout.offsets[layout.tailLevel];
+	unsigned int end = layout.offsets[levels - 1] + layout.sizes[levels - 1];
+	texture.pixels.resize(end - begin);
+	fseek(file, begin, SEEK_SET);
+	size_t read = fread(&texture.pixels[0], 1, end - begin, file);
+	fclose(file);
+	return read == end - begin;
+}
+
+GLuint TextureStreamer::create(const char *path, const TextureData &tail) {
+	StreamedTexture *texture = new StreamedTexture();
+	texture->path = path;
+	computeLevels(tail, *texture);
+	texture->residentLevel = texture->tailLevel;
+	texture->finestLevel = 0;
+	texture->loading = false;
+	texture->minLod = 0.0f;
+	texture->wanted = INT_MAX;
+	texture->lastUsed.assign(texture->levelCount, 0);
+
+	glGenTextures(1, &texture->texture);
+	glBindTexture(GL_TEXTURE_2D, texture->texture);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	unsigned int offset = 0;
+	for (unsigned int level = texture->tailLevel; level < texture->levelCount; ++level) {
+		glCompressedTexImage2D(GL_TEXTURE_2D, level, texture->format, texture->widths[level], texture->heights[level], 0, texture->sizes[level], &tail.pixels[offset]);
+		offset += texture->sizes[level];
+	}
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+	// The missing levels are outside [base, max], the texture is complete without them
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, texture->tailLevel);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, texture->levelCount - 1);
+
+	textureIndices[texture->texture] = textures.size();
+	textures.push_back(texture);
+	track(*texture);
+	return texture->texture;
+}
+
+void TextureStreamer::request(GLuint texture, float level) {
+	std::map<GLuint, size_t>::const_iterator it = textureIndices.find(texture);
+	if (it == textureIndices.end()) return;
+
+	int wanted = std::max((int)floorf(level), 0);
+	std::atomic<int> &current = textures[it->second]->wanted;
+	int previous = current.load(std::memory_order_relaxed);
+	while (wanted < previous && !current.compare_exchange_weak(previous, wanted, std::memory_order_relaxed));
+}
+
+unsigned int TextureStreamer::textureSize(GLuint texture) const {
+	std::map<GLuint, size_t>::const_iterator it = textureIndices.find(texture);
+	if (it == textureIndices.end()) return 0;
+	return std::max(textures[it->second]->widths[0], textures[it->second]->heights[0]);
+}
+
+size_t TextureStreamer::levelBytes(const StreamedTexture &texture, unsigned int from, unsigned int to) const {
+	size_t bytes = 0;
+	for (unsigned int level = from; level < to; ++level) {
+		bytes += texture.sizes[level];
+	}
+	return bytes;
+}
+
+void TextureStreamer::track(const StreamedTexture &texture) {
+	MemoryTracker::trackTexture(texture.texture, levelBytes(texture, texture.residentLevel, texture.levelCount), MEMORY_TEXTURE, texture.path.c_str());
+}
+
+void TextureStreamer::startRead(StreamedTexture *texture) {
+	unsigned int level = texture->residentLevel - 1;
+	texture->loading = true;
+
+	jobSystem->runBackground([this, texture, level]() {
+		PROFILE_SCOPE("Stream texture level");
+		std::vector<unsigned char> *pixels = new std::vector<unsigned char>(texture->sizes[level]);
+		FILE *file = fopen(texture->path.c_str(), "rb");
+		bool read = file && fseek(file, texture->offsets[level], SEEK_SET) == 0 && fread(&(*pixels)[0], 1, pixels->size(), file) == pixels->size();
+		if (file) fclose(file);
+		if (!read) {
+			delete pixels;
+			pixels = NULL;
+		}
+		jobSystem->runOnGLThread([this, texture, level, pixels]() { finishRead(texture, level, pixels); });
+	}, &reads);
+}
+
+void TextureStreamer::finishRead(StreamedTexture *texture, unsigned int level, std::vector<unsigned char> *pixels) {
+	texture->loading = false;
+	if (!pixels) {
+		// Stays at its level, the tail at least is there
+		printf("Level %u of %s could not be read\n", level, texture->path.c_str());
+		texture->finestLevel = texture->residentLevel;
+		return;
+	}
+
+	GLint previous;
+	glGetIntegerv(GL_TEXTURE_BINDING_2D, &previous);
+	glBindTexture(GL_TEXTURE_2D, texture->texture);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	glCompressedTexImage2D(GL_TEXTURE_2D, level, texture->format, texture->widths[level], texture->heights[level], 0, texture->sizes[level], &(*pixels)[0]);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, level);
+	// The LOD is relative to the base level, one more keeps sampling the previous level and fades from there
+	texture->minLod += 1.0f;
+	glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_LOD, texture->minLod);
+	glBindTexture(GL_TEXTURE_2D, previous);
+	delete pixels;
+
+	texture->residentLevel = level;
+	streamedBytes += texture->sizes[level];
+	peakBytes = std::max(peakBytes, streamedBytes);
+	levelsRead++;
+	track(*texture);
+}
+
+bool TextureStreamer::evictOne() {
+	StreamedTexture *victim = NULL;
+	for (size_t i = 0; i < textures.size(); ++i) {
+		StreamedTexture *texture = textures[i];
+		// A read in flight needs the level below it
+		if (texture->residentLevel >= texture->tailLevel || texture->loading) continue;
+		if (texture->lastUsed[texture->residentLevel] == frame) continue;
+		if (!victim || texture->lastUsed[texture->residentLevel] < victim->lastUsed[victim->residentLevel]) victim = texture;
+	}
+	if (!victim) return false;
+
+	unsigned int level = victim->residentLevel;
+	GLint previous;
+	glGetIntegerv(GL_TEXTURE_BINDING_2D, &previous);
+	glBindTexture(GL_TEXTURE_2D, victim->texture);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, level + 1);
+	victim->minLod = 0.0f;
+	glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_LOD, 0.0f);
+	// An empty image gives the storage of the level back
+	glTexImage2D(GL_TEXTURE_2D, level, victim->format, 0, 0, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+	glBindTexture(GL_TEXTURE_2D, previous);
+
+	victim->residentLevel = level + 1;
+	streamedBytes -= victim->sizes[level];
+	levelsEvicted++;
+	track(*victim);
+	return true;
+}
+
+void TextureStreamer::update() {
+	PROFILE_SCOPE("Texture streaming");
+	frame++;
+
+	for (size_t i = 0; i < textures.size(); ++i) {
+		StreamedTexture *texture = textures[i];
+		int wanted = texture->wanted.exchange(INT_MAX, std::memory_order_relaxed);
+		if (wanted == INT_MAX) continue;
+
+		// Every level coarser than the one wanted is needed too
+		for (unsigned int level = std::min((unsigned int)wanted, texture->levelCount - 1); level < texture->levelCount; ++level) {
+			texture->lastUsed[level] = frame;
+		}
+	}
+
+	for (size_t i = 0; i < textures.size(); ++i) {
+		StreamedTexture *texture = textures[i];
+		if (texture->minLod > 0.0f) {
+			texture->minLod = std::max(texture->minLod - LOD_FADE_STEP, 0.0f);
+			GLint previous;
+			glGetIntegerv(GL_TEXTURE_BINDING_2D, &previous);
+			glBindTexture(GL_TEXTURE_2D, texture->texture);
+			glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_LOD, texture->minLod);
+			glBindTexture(GL_TEXTURE_2D, previous);
+		}
+
+		if (texture->loading || texture->residentLevel <= texture->finestLevel || texture->lastUsed[texture->residentLevel - 1] != frame) continue;
+
+		// Room first, from the levels not needed this frame
+		size_t size = texture->sizes[texture->residentLevel - 1];
+		while (streamedBytes + size > budgetBytes && evictOne());
+		if (streamedBytes + size <= budgetBytes) startRead(texture);
+	}
+
+	// A smaller budget, or levels that arrived since the last frame
+	while (streamedBytes > budgetBytes && evictOne());
+
+	if (synchronous) {
+		jobSystem->wait(reads);
+		jobSystem->flushGLThread();
+	}
+}
+
+void TextureStreamer::print() const {
+	printf("Texture streaming : %d textures, %.2f MB above the tails, %.2f MB peak, %.2f MB budget, %u levels read, %u evicted\n", (int)textures.size(),
+		streamedBytes / MB, peakBytes / MB, budgetBytes / MB, levelsRead, levelsEvicted);
+	for (size_t i = 0; i < textures.size(); ++i) {
+		const StreamedTexture *texture = textures[i];
+		printf("  level %u (%ux%u), tail from %u  %s\n", texture->residentLevel, texture->widths[texture->residentLevel], texture->heights[texture->residentLevel],
+			texture->tailLevel, texture->path.c_str());
+	}
+}
@@ -0,0 +1,93 @@
+#ifndef TEXTURESTREAMER_H
+#define TEXTURESTREAMER_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <atomic>
+#include <GL/glew.h>
+
+#include "texture.hpp"
+#include "JobSystem.h"
+
+// Mipmaps of the DDS textures loaded on demand, under a memory budget.
+// A streamed texture starts with its tail only, the levels of at most TAIL_SIZE
+// texels. Every frame the draw code requests the finest level each object needs for
+// its size on screen. The next finer level of a texture is then read by a job and
+// uploaded on the GL thread with runOnGLThread(), one level at a time since the
+// resident levels must follow each other. GL_TEXTURE_BASE_LEVEL is the finest resident
+// level, GL_TEXTURE_MIN_LOD fades the sampling from the previous one over a few frames
+// so the new level does not pop.
+// Over the budget, the resident level that was needed the longest time ago is
+// dropped, never one needed in the current frame.
+class TextureStreamer {
+	public:
+		static const unsigned int TAIL_SIZE = 128;
+		// MIN_LOD change per frame when a level arrives
+		static const float LOD_FADE_STEP;
+
+		TextureStreamer(JobSystem *jobSystem, size_t budget);
+		// GL thread, waits for the reads in flight
+		~TextureStreamer();
+
+		// CPU side of a streamed texture : header and tail levels. Any thread
+		static bool readTail(const char *path, TextureData &texture);
+		// GL texture of the tail, registered for streaming. GL thread
+		GLuint create(const char *path, const TextureData &tail);
+		bool isStreamed(GLuint texture) const { return textureIndices.count(texture) != 0; }
+
+		// Reads finished before update() returns, for the deterministic headless runs
+		void setSynchronous(bool synchronous) { this->synchronous = synchronous; }
+
+		// Level needed this frame for a texture, 0 is the finest. Any thread, between two update() calls
+		void request(GLuint texture, float level);
+		// Texels across the texture, for the callers computing a level. 0 when not streamed
+		unsigned int textureSize(GLuint texture) const;
+		// GL thread, once per frame after the requests : reads, evictions and LOD fades
+		void update();
+
+		size_t residentBytes() const { return streamedBytes; }
+		size_t budget() const { return budgetBytes; }
+
+		// Levels read and dropped, and where every texture stands
+		void print() const;
+
+	private:
+		struct StreamedTexture {
+			std::string path;
+			GLuint texture;
+			unsigned int format, levelCount;
+			std::vector<unsigned int> widths, heights;
+			std::vector<unsigned int> offsets, sizes; // Of each level in the file
+			unsigned int tailLevel;                    // Always resident from there on
+			unsigned int residentLevel;                // Finest resident level, the base level
+			unsigned int finestLevel;                  // 0, or the level under the one that could not be read
+			bool loading;                              // A read of residentLevel - 1 is in flight
+			float minLod;
+			std::atomic<int> wanted;                   // Finest level requested this frame
+			std::vector<unsigned int> lastUsed;        // Frame each level was last needed
+		};
+
+		// Layout of the levels in the file
+		static void computeLevels(const TextureData &header, StreamedTexture &texture);
+		size_t levelBytes(const StreamedTexture &texture, unsigned int from, unsigned int to) const;
+		void startRead(StreamedTexture *texture);
+		void finishRead(StreamedTexture *texture, unsigned int level, std::vector<unsigned char> *pixels);
+		bool evictOne();
+		void track(const StreamedTexture &texture);
+
+		JobSystem *jobSystem;
+		size_t budgetBytes;
+		bool synchronous;
+
+		std::vector<StreamedTexture*> textures;
+		std::map<GLuint, size_t> textureIndices;
+		JobCounter reads;
+
+		unsigned int frame;
+		size_t streamedBytes; // Levels above the tails
+		size_t peakBytes;
+		unsigned int levelsRead, levelsEvicted;
+};
+
+#endif
@@ -0,0 +1,244 @@
+#include "TileWorld.h"
+#include "Profiler.h"
+#include "SeededRandom.h"
+
+#include <stdio.h>
+#include <math.h>
+#include <algorithm>
+#include <chrono>
+
+#include <glm/gtc/constants.hpp>
+
+const float TileWorld::TILE_SIZE = 64.0f;
+
+// Houses first, the others keep away from them. Sizes and headings of createObjects()
+const TileWorld::Layer TileWorld::layers[LAYER_COUNT] = {
+	{ "models/house2/model.obj", { "models/house2/texture.dds", "models/house2/texture2.dds" }, "models/house2/texture_normals.bmp", 24.0f, 0.6f, 0.0f },
+	{ "models/deer/model.obj", { "models/deer/texture.dds", NULL }, "models/deer/texture_normals.bmp", 10.0f, 0.5f, 8.0f },
+	{ "models/rock/model1.obj", { "models/rock/texture.dds", NULL }, "models/rock/texture_normals.bmp", 8.0f, 0.6f, 8.0f },
+};
+
+enum { LAYER_HOUSES, LAYER_DEER, LAYER_ROCKS };
+
+TileWorld::TileWorld(JobSystem *jobSystem, EntityStore &entities, const Terrain *terrain, unsigned int seed, int radius) : jobSystem(jobSystem), entities(entities), terrain(terrain), seed(seed), radius(radius) {
+	synchronous = false;
+	liveInstances = 0;
+	tilesLoaded = tilesDropped = 0;
+	updateTime = maxUpdateTime = 0.0;
+	updates = 0;
+
+	for (int l = 0; l < LAYER_COUNT; ++l) {
+		Model *model = Obj3D::modelCache[layers[l].model];
+		handles[l].model = model;
+		handles[l].NormalTexture = Obj3D::textureCache[layers[l].normalTexture];
+		handles[l].depthTest = true;
+		boundsMin[l] = model->boundsMin;
+		boundsMax[l] = model->boundsMax;
+		textures[l][0] = Obj3D::textureCache[layers[l].textures[0]];
+		textures[l][1] = layers[l].textures[1] ? Obj3D::textureCache[layers[l].textures[1]] : 0;
+	}
+}
+
+TileWorld::~TileWorld() {
+	for (std::map<std::pair<int, int>, Tile*>::iterator it = tiles.begin(); it != tiles.end(); ++it) {
+		jobSystem->wait(it->second->generated);
+		release(it->second);
+		delete it->second;
+	}
+}
+
+void TileWorld::poissonDisk(std::mt19937 &random, float radius, float margin, std::vector<vec2> &points) {
+	// Bridson's algorithm : new points around the active ones until none of them has room left
+	const int ATTEMPTS = 30;
+	float low = margin, high = TILE_SIZE - margin;
+	float cellSize = radius / sqrtf(2.0f);
+	int gridSize = std::max((int)ceilf((high - low) / cellSize), 1);
+	// One point at most per cell, -1 when empty
+	std::vector<int> grid(gridSize * gridSize, -1);
+	std::vector<int> active;
+	points.clear();
+
+	vec2 first(randomFloat(random, low, high), randomFloat(random, low, high));
+	points.push_back(first);
+	active.push_back(0);
+	grid[std::min((int)((first.y - low) / cellSize), gridSize - 1) * gridSize + std::min((int)((first.x - low) / cellSize), gridSize - 1)] = 0;
+
+	while (!active.empty()) {
+		size_t a = randomInt(random, (unsigned int)active.size());
+		vec2 center = points[active[a]];
+		bool found = false;
+		for (int attempt = 0; attempt < ATTEMPTS && !found; ++attempt) {
+			float angle = randomFloat(random, 0.0f, two_pi<float>());
+			float distance = randomFloat(random, radius, 2.0f * radius);
+			vec2 point = center + distance * vec2(cosf(angle), sinf(angle));
+			if (point.x < low || point.x > high || point.y < low || point.y > high) continue;
+
+			int cellX = std::min((int)((point.x - low) / cellSize), gridSize - 1);
+			int cellY = std::min((int)((point.y - low) / cellSize), gridSize - 1);
+			bool free = true;
+			for (int y = std::max(cellY - 2, 0); y <= std::min(cellY + 2, gridSize - 1) && free; ++y) {
+				for (int x = std::max(cellX - 2, 0); x <= std::min(cellX + 2, gridSize - 1) && free; ++x) {
+					int other = grid[y * gridSize + x];
+					if (other >= 0 && dot(points[other] - point, points[other] - point) < radius * radius) free = false;
+				}
+			}
+			if (!free) continue;
+
+			grid[cellY * gridSize + cellX] = (int)points.size();
+			active.push_back((int)points.size());
+			points.push_back(point);
+			found = true;
+		}
+		if (!found) {
+			active[a] = active.back();
+			active.pop_back();
+		}
+	}
+}
+
+void TileWorld::generate(Tile *tile) {
+	PROFILE_SCOPE("Generate tile");
+	const float pi_over_2 = half_pi<float>();
+	const float pi_over_4 = quarter_pi<float>();
+
+	std::mt19937 random(hashCoordinates(seed, tile->x, tile->z));
+	vec2 origin(tile->x * TILE_SIZE, tile->z * TILE_SIZE);
+	std::vector<vec2> points, houses;
+	for (int l = 0; l < LAYER_COUNT; ++l) {
+		const Layer &layer = layers[l];
+		poissonDisk(random, layer.radius, layer.radius * 0.5f, points);
+
+		for (size_t p = 0; p < points.size(); ++p) {
+			if (randomFloat(random, 0.0f, 1.0f) >= layer.keep) continue;
+			bool clear = true;
+			for (size_t h = 0; h < houses.size() && clear; ++h) {
+				clear = dot(houses[h] - points[p], houses[h] - points[p]) >= layer.clearance * layer.clearance;
+			}
+			if (!clear) continue;
+
+			Instance instance;
+			instance.kind = l;
+			instance.texture = textures[l][textures[l][1] ? randomInt(random, 2) : 0];
+			instance.position = vec3(origin.x + points[p].x, 0.0f, origin.y + points[p].y);
+			vec3 rotation(0.0f);
+			switch (l) {
+				case LAYER_HOUSES:
+					instance.scale = vec3(0.2f);
+					instance.position.y = -1.0f;
+					rotation = vec3(randomInt(random, 4) * pi_over_2, pi_over_2, 0.0f);
+					houses.push_back(points[p]);
+					break;
+				case LAYER_DEER:
+					instance.scale = vec3(0.1f);
+					rotation.x = randomInt(random, 8) * pi_over_4;
+					break;
+				default:
+					instance.scale = vec3(1.0f / (randomInt(random, 10) + 1));
+					instance.position.y = -1.0f / (0.001f + randomInt(random, 5));
+					rotation.x = randomInt(random, 8) * pi_over_4;
+					break;
+			}
+			if (terrain) instance.position.y += terrain->height(instance.position.x, instance.position.z);
+			// Same rotations as Obj3D::getModelMatrix
+			instance.orientation = angleAxis(rotation.x, vec3(0.0f, 1.0f, 0.0f)) * angleAxis(rotation.y, vec3(-1.0f, 0.0f, 0.0f));
+			tile->instances.push_back(instance);
+		}
+	}
+}
+
+void TileWorld::commit(Tile *tile) {
+	tile->entities.reserve(tile->instances.size());
+	for (size_t i = 0; i < tile->instances.size(); ++i) {
+		const Instance &instance = tile->instances[i];
+		RenderHandles instanceHandles = handles[instance.kind];
+		instanceHandles.Texture = instance.texture;
+
+		EntityID id = entities.create(instanceHandles, boundsMin[instance.kind], boundsMax[instance.kind]);
+		entities.setPosition(id, instance.position);
+		entities.setOrientation(id, instance.orientation);
+		entities.setScale(id, instance.scale);
+		if (instance.kind == LAYER_HOUSES) entities.occluderScales[entities.indexOf(id)] = 1.0f;
+		tile->entities.push_back(id);
+	}
+
+	liveInstances += tile->entities.size();
+	std::vector<Instance>().swap(tile->instances);
+	tile->committed = true;
+	tilesLoaded++;
+}
+
+void TileWorld::release(Tile *tile) {
+	for (size_t i = 0; i < tile->entities.size(); ++i) {
+		entities.destroy(tile->entities[i]);
+	}
+	liveInstances -= tile->entities.size();
+	tile->entities.clear();
+}
+
+void TileWorld::update(const vec3 &camera) {
+	PROFILE_SCOPE("Tile streaming");
+	std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+	int cameraX = (int)floorf(camera.x / TILE_SIZE);
+	int cameraZ = (int)floorf(camera.z / TILE_SIZE);
+
+	// One tile of slack before dropping, walking along an edge does not reload the same row every step
+	for (std::map<std::pair<int, int>, Tile*>::iterator it = tiles.begin(); it != tiles.end();) {
+		Tile *tile = it->second;
+		if (std::max(abs(tile->x - cameraX), abs(tile->z - cameraZ)) > radius + 1 && tile->generated.done()) {
+			release(tile);
+			delete tile;
+			it = tiles.erase(it);
+			tilesDropped++;
+		}
+		else {
+			++it;
+		}
+	}
+
+	// Missing tiles of the ring, the closest rings first
+	for (int ring = 0; ring <= radius; ++ring) {
+		for (int z = cameraZ - ring; z <= cameraZ + ring; ++z) {
+			for (int x = cameraX - ring; x <= cameraX + ring; ++x) {
+				if (std::max(abs(x - cameraX), abs(z - cameraZ)) != ring || tiles.count(std::make_pair(x, z))) continue;
+
+				Tile *tile = new Tile();
+				tile->x = x;
+				tile->z = z;
+				tile->committed = false;
+				tiles[std::make_pair(x, z)] = tile;
+				jobSystem->runBackground([this, tile]() { generate(tile); }, &tile->generated);
+			}
+		}
+	}
+
+	if (synchronous) {
+		for (std::map<std::pair<int, int>, Tile*>::iterator it = tiles.begin(); it != tiles.end(); ++it) {
+			jobSystem->wait(it->second->generated);
+		}
+	}
+
+	// Entities of the closest generated tiles, a few per frame so a new row does not make a spike
+	int commits = 0;
+	for (int ring = 0; ring <= radius && (synchronous || commits < COMMITS_PER_UPDATE); ++ring) {
+		for (int z = cameraZ - ring; z <= cameraZ + ring; ++z) {
+			for (int x = cameraX - ring; x <= cameraX + ring; ++x) {
+				if (std::max(abs(x - cameraX), abs(z - cameraZ)) != ring) continue;
+				Tile *tile = tiles[std::make_pair(x, z)];
+				if (tile->committed || !tile->generated.done()) continue;
+				if (!synchronous && commits == COMMITS_PER_UPDATE) continue;
+				commit(tile);
+				commits++;
+			}
+		}
+	}
+
+	double time = millisecondsSince(start);
+	updateTime += time;
+	maxUpdateTime = std::max(maxUpdateTime, time);
+	updates++;
+}
+
+void TileWorld::print() const {
+	printf("Tiles : %d of %.0f units around the camera, %d instances, %u tiles loaded, %u dropped, %f ms average update, %f ms max\n", (int)tiles.size(),
+		TILE_SIZE, (int)liveInstances, tilesLoaded, tilesDropped, updates ? updateTime / updates : 0.0, maxUpdateTime);
+}
@@ -0,0 +1,98 @@
+#ifndef TILEWORLD_H
+#define TILEWORLD_H
+
+#include <vector>
+#include <map>
+#include <random>
+
+#include <glm/glm.hpp>
+#include <glm/gtc/quaternion.hpp>
+using namespace glm;
+
+#include "EntityStore.h"
+#include "JobSystem.h"
+#include "Terrain.h"
+
+// Endless world of square tiles paged in and out around the camera.
+// Every tile is populated from its own seed, a hash of the world seed and its
+// coordinates, so it comes back the same each time the camera returns. Houses, deer
+// and rocks are placed with Poisson disk sampling by a job, then the main thread
+// creates their entities a few tiles per frame. Tiles further than RADIUS + 1 from
+// the camera tile destroy theirs : the entity count, and with it the memory and the
+// frame time, only depend on the radius.
+// The points keep half their distance away from the tile edges, the spacing holds
+// across the tiles without looking at the neighbours.
+class TileWorld {
+	public:
+		static const float TILE_SIZE;
+		// Tiles whose entities are created in one update(), the others wait for the next frames
+		static const int COMMITS_PER_UPDATE = 2;
+
+		// The models and textures of the village must be in the Obj3D caches. radius in tiles around the camera one,
+		// the objects stand on the terrain when there is one
+		TileWorld(JobSystem *jobSystem, EntityStore &entities, const Terrain *terrain, unsigned int seed, int radius);
+		// Waits for the jobs in flight, the entities of the tiles are destroyed
+		~TileWorld();
+
+		// Every tile of the ring created before update() returns, for the deterministic headless runs
+		void setSynchronous(bool synchronous) { this->synchronous = synchronous; }
+
+		// Main thread, once per frame with the camera position
+		void update(const vec3 &camera);
+
+		size_t tileCount() const { return tiles.size(); }
+		size_t instanceCount() const { return liveInstances; }
+		// Tiles loaded and dropped, and how long the updates took
+		void print() const;
+
+	private:
+		struct Instance {
+			int kind;
+			GLuint texture;
+			vec3 position, scale;
+			quat orientation;
+		};
+		struct Tile {
+			int x, z;
+			std::vector<Instance> instances; // Written by the job, released once the entities exist
+			std::vector<EntityID> entities;
+			JobCounter generated;
+			bool committed;
+		};
+		// One kind of object and how it is spaced
+		struct Layer {
+			const char *model, *textures[2], *normalTexture;
+			float radius;    // Minimum distance between two of them
+			float keep;      // Fraction of the Poisson points kept, thins the maximal packing
+			float clearance; // Minimum distance to a house
+		};
+
+		static const int LAYER_COUNT = 3;
+		static const Layer layers[LAYER_COUNT];
+
+		// Points at least radius apart in [margin, TILE_SIZE - margin]^2, tile space
+		static void poissonDisk(std::mt19937 &random, float radius, float margin, std::vector<vec2> &points);
+		// Job : the instances of a tile
+		void generate(Tile *tile);
+		void commit(Tile *tile);
+		void release(Tile *tile);
+
+		JobSystem *jobSystem;
+		EntityStore &entities;
+		const Terrain *terrain;
+		unsigned int seed;
+		int radius;
+		bool synchronous;
+
+		RenderHandles handles[LAYER_COUNT];
+		vec3 boundsMin[LAYER_COUNT], boundsMax[LAYER_COUNT];
+		GLuint textures[LAYER_COUNT][2];
+
+		std::map<std::pair<int, int>, Tile*> tiles;
+		size_t liveInstances;
+		unsigned int tilesLoaded, tilesDropped;
+		double updateTime, maxUpdateTime; // Milliseconds
+		unsigned int updates;
+};
+
+#endif
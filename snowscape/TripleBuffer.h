@@ -0,0 +1,42 @@
+#ifndef TRIPLEBUFFER_H
+#define TRIPLEBUFFER_H
+
+#include <atomic>
+
+// Lock-free single producer, single consumer triple buffer.
+// The producer fills its own slot and publishes it by swapping it with the
+// shared one. The consumer takes the shared slot only when something new was
+// published, and keeps reading it until the next one. Neither side ever waits :
+// a producer faster than the consumer overwrites the unread snapshots, a consumer
+// faster than the producer reads the same snapshot again.
+template <typename T>
+class TripleBuffer {
+	public:
+		TripleBuffer() : shared(1), writeIndex(0), readIndex(2) {}
+
+		// Producer only, the slot to fill
+		T &writeBuffer() { return buffers[writeIndex]; }
+		// Producer only, hand the filled slot to the consumer and get a free one back
+		void publish() {
+			writeIndex = shared.exchange(writeIndex | FRESH, std::memory_order_acq_rel) & INDEX_MASK;
+		}
+
+		// Consumer only, take the last published slot. False if nothing new was published since the last call
+		bool acquire() {
+			if (!(shared.load(std::memory_order_relaxed) & FRESH)) return false;
+			readIndex = shared.exchange(readIndex, std::memory_order_acq_rel) & INDEX_MASK;
+			return true;
+		}
+		// Consumer only, the slot taken by the last acquire(). The consumer owns it until the next acquire()
+		const T &readBuffer() const { return buffers[readIndex]; }
+
+	private:
+		static const unsigned int INDEX_MASK = 3;
+		static const unsigned int FRESH = 4; // The shared slot holds a snapshot the consumer has not taken
+
+		T buffers[3];
+		std::atomic<unsigned int> shared;
+		unsigned int writeIndex, readIndex;
+};
+
+#endif
@@ -1,8 +1,16 @@
 // Include standard headers
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <math.h>
 #include <vector>
+#include <map>
+#include <deque>
+#include <algorithm>
 #include <ctime>
+#include <thread>
+#include <atomic>
+#include <chrono>
 
 // Include GLEW
 #include <GL/glew.h>
@@ -16,6 +24,7 @@ GLFWwindow* window;
 #include<glm/mat4x4.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 #include <glm/gtx/transform.hpp>
+#include <glm/gtc/quaternion.hpp>
 using namespace glm;
 
 // Our premade functions
@@ -23,124 +32,716 @@ using namespace glm;
 #include "texture.hpp"
 #include "controls.hpp"
 #include "objloader.hpp"
+#include "text2D.hpp"
+#include "processmemory.hpp"
+#include "memorytracker.hpp"
+#include "errorpause.hpp"
 
 // High level, helper functions
 #include "Obj3D.h"
+#include "JobSystem.h"
+#include "EntityStore.h"
+#include "MatrixBatch.h"
+#include "RenderQueue.h"
+#include "OcclusionCuller.h"
+#include "OcclusionQueries.h"
+#include "GpuCulling.h"
+#include "ClusteredLights.h"
+#include "TripleBuffer.h"
+#include "CameraPath.h"
+#include "HeadlessContext.h"
+#include "Profiler.h"
+#include "GpuTimers.h"
+#include "FrameStats.h"
+#include "AssetLoader.h"
+#include "TextureStreamer.h"
+#include "SceneGenerator.h"
+#include "TileWorld.h"
+#include "Terrain.h"
+#include "Snowfall.h"
+#include "SnowVolume.h"
 
 #define WINDOW_WIDTH 1024
 #define WINDOW_HEIGHT 768
+// Times the grass texture repeats across the first skybox
+#define GROUND_TEXTURE_REPEAT 60
 
 int nbFrames;
 double lastTime;
 
-std::vector<Obj3D> objects;
+// Seconds since the program started, works without GLFW
+double getTime() {
+	static std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// --headless : offscreen benchmark run of --frames frames along a scripted camera path, timings written to --csv
+bool headless = false;
+HeadlessContext *headlessContext;
+int headlessFrames = 1000;
+const char *csvPath = "frames.csv";
+const char *cameraPathFile = NULL;
+// createObjects() and the scene generator draw their random numbers from this seed
+unsigned int seed = 1;
+// --scene N : N generated objects instead of the village, with --scene-models meshes over --scene-extent units
+SceneParameters sceneParameters = { 0, 4, 0.0f, 0 };
+// --tiles : endless world paged in around the camera instead of the village, --tile-radius tiles on each side
+TileWorld *tileWorld;
+bool tileStreaming = false;
+int tileRadius = 4;
+// Snow covered hills under everything, --no-terrain leaves the flat grass of the first skybox
+Terrain *terrain;
+bool terrainEnabled = true;
+// Flakes falling around the camera, none unless --snow N. --snow-mode gpu animates them
+// in the vertex shader instead of simulating them on the job threads
+enum SnowMode { SNOW_CPU, SNOW_GPU, SNOW_MODE_COUNT };
+const char *snowModeNames[] = { "cpu", "gpu" };
+SnowMode snowMode = SNOW_CPU;
+Snowfall *snowfall;
+SnowVolume *snowVolume;
+unsigned int snowfallCount = 0;
+double lastSnowfallTime, snowTime;
+bool vsync = true;
+// --profile : scoped CPU markers and GPU pass times written there as a Chrome trace at exit
+const char *tracePath = NULL;
+GpuTimers *gpuTimers;
+// Frame time distribution, fed by the thread that draws
+FrameStats *frameStats;
+int framebufferWidth = WINDOW_WIDTH, framebufferHeight = WINDOW_HEIGHT;
+
+// Worker threads for the CPU side of the frame
+JobSystem *jobSystem;
+
+// Lit objects
+EntityStore entities;
+// Skyboxes, drawn with the texture only shader
 std::vector<Obj3D> objects_shader1;
 
-void createObjects() {
+// Occlusion culling, O cycles through the modes
+enum CullingMode { CULLING_SOFTWARE, CULLING_QUERIES, CULLING_GPU, CULLING_NONE, CULLING_MODE_COUNT };
+const char *cullingModeNames[] = { "software", "queries", "gpu", "none" };
+CullingMode cullingMode = CULLING_SOFTWARE;
+OcclusionCuller *occlusionCuller;
+OcclusionQueries *occlusionQueries;
+GpuCulling *gpuCulling;
+int culledObjects;
+
+// Lit windows and lanterns
+ClusteredLights *clusteredLights;
+
+// Depth pre-pass toggled with P, objects are sorted front to back without it
+bool depthPrepass = true;
+// Overdraw visualization toggled with V
+bool overdrawView = false;
+// B cycles through the supported paths
+MatrixBatchPath matrixBatchPath;
+// Performance overlay toggled with H, --no-hud hides it from the start. Never shown headless
+bool hudVisible = true;
+// --gpu-budget and --cpu-budget, in MB : a warning is printed when the tracked memory goes over
+double gpuBudget = 512.0, cpuBudget = 256.0;
+// Mip levels of the object textures loaded as they get close, --texture-budget MB above the tails. Off with --no-streaming
+TextureStreamer *textureStreamer;
+bool textureStreaming = true;
+double textureBudget = 16.0;
+
+// Everything the render thread needs from one simulated frame, never modified once published
+struct FrameSnapshot {
+	EntityStore entities;              // Render state only, worldMatrices are those after the last tick
+	unsigned int serial;               // Publish that last wrote this slot
+	std::vector<unsigned int> changedEntities; // World matrices changed since the snapshot the render thread had
+	bool resync;                       // The render thread copies all of them instead
+	std::vector<unsigned int> movedEntities; // Entities the last tick moved
+	std::vector<mat4> movedMatrices;   // and their world matrices after the tick before
+	bool interpolate;                  // False when the entities changed between the two ticks
+	double updateTime;                 // Milliseconds of ticks since the previous snapshot
+	double publishTime;                // getTime() when published
+	double accumulator;                // Simulation time not ticked yet when published
+	mat4 ViewMatrix, ProjectionMatrix;
+	vec3 previousLightPos, currentLightPos;
+	int framebufferWidth, framebufferHeight;
+	CullingMode cullingMode;
+	bool depthPrepass, overdrawView, hudVisible;
+	MatrixBatchPath matrixBatchPath;
+};
+
+// The simulation (main thread) fills a snapshot and publishes it, the render thread owns the GL context
+// and draws the newest one. Neither waits for the other.
+TripleBuffer<FrameSnapshot> snapshots;
+// Snapshot being drawn, render thread only
+const FrameSnapshot *frame;
+// Render thread only, the world matrices and the light at the time of the frame : those of the snapshot, with the
+// entities its last tick moved blended between the last two ticks. Kept across frames, only the changes are copied
+std::vector<mat4> interpolatedMatrices;
+// Entities blended in interpolatedMatrices, set back to the snapshot ones on the next acquire
+std::vector<unsigned int> blendedEntities;
+const mat4 *frameMatrices;
+vec3 frameLightPos;
+// Serial of the last snapshot the render thread acquired, the simulation lists the changes since that one
+std::atomic<unsigned int> acquiredSerial;
+std::atomic<bool> quitRenderThread;
+
+// Fixed simulation step, --tick-rate changes it. Rendering interpolates between the last two ticks
+double tickRate = 60.0;
+// More ticks than that in one frame and the simulation slows down instead of falling further behind
+#define MAX_TICKS_PER_FRAME 8
+// Entities the last tick moved with their world matrices before it, and the light before it
+std::vector<unsigned int> movedEntities;
+std::vector<mat4> movedMatrices;
+unsigned int previousLayoutVersion;
+vec3 previousLightPos;
+// Milliseconds of ticks not published yet
+double pendingUpdateTime = 0.0;
+
+// Simulation thread : the entities whose world matrix changed in each of the last publishes, oldest first.
+// A snapshot slot written again copies only what changed since it was last written
+struct PublishedChanges {
+	unsigned int serial;
+	bool all;                           // Layout change or more changes than entities : everything is copied
+	std::vector<unsigned int> entities; // Repeats possible
+};
+#define PUBLISHED_CHANGES_KEPT 8
+std::deque<PublishedChanges> publishedChanges;
+unsigned int publishSerial = 0;
+unsigned int publishedLayoutVersion;
+// World matrices changed since the last publish, and the changes a slot catches up with
+std::vector<unsigned int> unpublishedChanges, slotChanges;
+
+// The moving light, it bounces inside a box
+vec3 lightPos(-25, 50, 25);
+vec3 lightDirection(1);
+
+// True once per press of the key
+bool keyPressed(int key) {
+	static std::map<int, int> lastStates;
+	int state = glfwGetKey(window, key);
+	bool pressed = state == GLFW_PRESS && lastStates[key] != GLFW_PRESS;
+	lastStates[key] = state;
+	return pressed;
+}
+
+// Files of the objects createSkyboxes() and createObjects() create, loaded across the job threads before they run
+struct SceneObject {
+	const char *model, *textures[2], *normalTexture;
+	bool streamed; // The skyboxes always fill the screen, only the textures of the objects are streamed
+};
+
+enum { SCENE_SKYBOX, SCENE_CLOUD, SCENE_ROCK, SCENE_DEER, SCENE_HOUSE, SCENE_OBJECT_COUNT };
+
+const SceneObject sceneObjects[SCENE_OBJECT_COUNT] = {
+	{ "models/skybox/model.obj", { "models/skybox/texture2.dds", "models/skybox/texture.dds" }, "models/default_normal.bmp", false },
+	{ "models/rock/model1.obj", { "models/rock/cloud.dds", NULL }, "models/default_normal.bmp", true },
+	{ "models/rock/model1.obj", { "models/rock/texture.dds", NULL }, "models/rock/texture_normals.bmp", true },
+	{ "models/deer/model.obj", { "models/deer/texture.dds", NULL }, "models/deer/texture_normals.bmp", true },
+	{ "models/house2/model.obj", { "models/house2/texture2.dds", "models/house2/texture.dds" }, "models/house2/texture_normals.bmp", true },
+};
+
+void loadSceneAssets() {
+	AssetLoader loader(jobSystem, textureStreamer);
+	for (int i = 0; i < SCENE_OBJECT_COUNT; ++i) {
+		const SceneObject &object = sceneObjects[i];
+		loader.addModel(object.model);
+		for (int t = 0; t < 2; ++t) {
+			if (object.textures[t]) loader.addTexture(object.textures[t], object.streamed);
+		}
+		loader.addTexture(object.normalTexture);
+	}
+	loader.load();
+	loader.print();
+}
+
+// Height of the ground under a point, what the objects and the cameras stand on
+float groundHeight(float x, float z) {
+	return terrain ? terrain->height(x, z) : 0.0f;
+}
+
+void createSkyboxes() {
 	const float pi_over_2 = half_pi<float>();
-	const float pi_over_4 = quarter_pi<float>();
 
-	// Skybox
-	objects_shader1.push_back(Obj3D("models/skybox/model.obj", "models/skybox/texture2.dds"));
+	const SceneObject &skybox = sceneObjects[SCENE_SKYBOX];
+	objects_shader1.push_back(Obj3D(skybox.model, skybox.textures[0], skybox.normalTexture));
 	objects_shader1.rbegin()->rotation.y = three_over_two_pi<float>();
 	objects_shader1.rbegin()->scale = vec3(12.0f);
 	objects_shader1.rbegin()->position.y = 241.0f;
 	objects_shader1.rbegin()->init();
 
-	objects_shader1.push_back(Obj3D("models/skybox/model.obj", "models/skybox/texture.dds"));
+	objects_shader1.push_back(Obj3D(skybox.model, skybox.textures[1], skybox.normalTexture));
 	objects_shader1.rbegin()->rotation.y = pi_over_2;
 	objects_shader1.rbegin()->scale = vec3(11.9f);
 	objects_shader1.rbegin()->depthTest = false;
 	objects_shader1.rbegin()->init();
-	
+}
+
+void createObjects() {
+	const float pi_over_2 = half_pi<float>();
+	const float pi_over_4 = quarter_pi<float>();
+
 	// Clouds
 	for (int i = 0; i <= 25; ++i) {
-		objects.push_back(Obj3D("models/rock/model1.obj", "models/rock/cloud.dds"));
-		objects.rbegin()->init();
+		const SceneObject &files = sceneObjects[SCENE_CLOUD];
+		Obj3D cloud(files.model, files.textures[0], files.normalTexture);
+		cloud.init();
 
 		float size = 7.0f / ((rand() % 10) + 1);
-		objects.rbegin()->scale = vec3(size / (1 + rand()%2), 3.0f / ((rand() % 10) + 1), size / (1 + rand() % 2));
-		objects.rbegin()->position = vec3(-75 + rand() % 150, 75 - (rand() % 10), -75 + rand() % 150);
-		objects.rbegin()->speed = vec3(-4 + rand() % 8, 0, -4 + rand() % 8);
-		objects.rbegin()->speed.x /= 126;
-		objects.rbegin()->speed.z /= 126;
+		cloud.scale = vec3(size / (1 + rand()%2), 3.0f / ((rand() % 10) + 1), size / (1 + rand() % 2));
+		cloud.position = vec3(-75 + rand() % 150, 75 - (rand() % 10), -75 + rand() % 150);
+		cloud.speed = vec3(-4 + rand() % 8, 0, -4 + rand() % 8);
+		// Units per second, they used to move this much per frame at 60 frames per second
+		cloud.speed.x *= 60.0f / 126;
+		cloud.speed.z *= 60.0f / 126;
+		cloud.position.y += groundHeight(cloud.position.x, cloud.position.z);
+		entities.create(cloud);
 	}
 	
 	// Rocks
 	for (int i = 0; i <= 50; ++i) {
-		objects.push_back(Obj3D("models/rock/model1.obj", "models/rock/texture.dds", "models/rock/texture_normals.bmp"));
-		objects.rbegin()->scale = vec3(1.0f / ((rand() % 10) + 1));
-		objects.rbegin()->position = vec3(-50 + rand() % 100, 0 - (1/ (0.001 + rand() % 5)), -50 + rand() % 100);
-		objects.rbegin()->rotation = vec3((rand() % 8)* pi_over_4, 0, 0);
-		objects.rbegin()->init();
+		const SceneObject &files = sceneObjects[SCENE_ROCK];
+		Obj3D rock(files.model, files.textures[0], files.normalTexture);
+		rock.scale = vec3(1.0f / ((rand() % 10) + 1));
+		rock.position = vec3(-50 + rand() % 100, 0 - (1/ (0.001 + rand() % 5)), -50 + rand() % 100);
+		rock.position.y += groundHeight(rock.position.x, rock.position.z);
+		rock.rotation = vec3((rand() % 8)* pi_over_4, 0, 0);
+		rock.init();
+		entities.create(rock);
 	}
 
 	// Deers
 	for (int i = 0; i <= 30; ++i) {
-		objects.push_back(Obj3D("models/deer/model.obj", "models/deer/texture.dds", "models/deer/texture_normals.bmp"));
-		objects.rbegin()->scale = vec3(0.1f);
-		objects.rbegin()->position = vec3(-50 + rand() % 100, 0, -50 + rand() % 100);
-		objects.rbegin()->rotation = vec3((rand() % 8)* pi_over_4, 0, 0);
-		objects.rbegin()->init();
+		const SceneObject &files = sceneObjects[SCENE_DEER];
+		Obj3D deer(files.model, files.textures[0], files.normalTexture);
+		deer.scale = vec3(0.1f);
+		deer.position = vec3(-50 + rand() % 100, 0, -50 + rand() % 100);
+		deer.position.y += groundHeight(deer.position.x, deer.position.z);
+		deer.rotation = vec3((rand() % 8)* pi_over_4, 0, 0);
+		deer.init();
+		entities.create(deer);
 	}
 
 	// Houses
 	for (int i = 0; i <= 30; ++i) {
+		const SceneObject &files = sceneObjects[SCENE_HOUSE];
+		const char *texturePath = files.textures[0];
 		if (rand() % 2) {
-			objects.push_back(Obj3D("models/house2/model.obj", "models/house2/texture.dds", "models/house2/texture_normals.bmp"));
-		}
-		else {
-			objects.push_back(Obj3D("models/house2/model.obj", "models/house2/texture2.dds", "models/house2/texture_normals.bmp"));
+			texturePath = files.textures[1];
 		}
 
-		objects.rbegin()->scale = vec3(0.2f);
-		objects.rbegin()->position = vec3(-152 + rand() % 313, -1, -151 + rand() % 317);
-		objects.rbegin()->rotation = vec3((rand() % 4)* pi_over_2, pi_over_2, 0);
-		objects.rbegin()->init();
+		Obj3D house(files.model, texturePath, files.normalTexture);
+		house.scale = vec3(0.2f);
+		house.position = vec3(-152 + rand() % 313, -1, -151 + rand() % 317);
+		house.position.y += groundHeight(house.position.x, house.position.z);
+		house.rotation = vec3((rand() % 4)* pi_over_2, pi_over_2, 0);
+		house.occluderScale = 1.0f;
+		house.init();
+		entities.create(house);
 	}
 	
 	/*
-	objects.push_back(Obj3D("models/house1/model1.obj", "models/house1/texture.dds", "models/house1/texture_normals.bmp"));
-	objects.rbegin()->init();*/
+	Obj3D house1("models/house1/model1.obj", "models/house1/texture.dds", "models/house1/texture_normals.bmp");
+	house1.init();
+	entities.create(house1);*/
 }
 
-void updateLoop() {
-	for (std::vector<Obj3D>::iterator obj = objects.begin(); obj != objects.end(); ++obj) {
-		obj->update();
+void createLights() {
+	// A lit window in every house
+	for (size_t i = 0; i < entities.size(); ++i) {
+		if (entities.occluderScales[i] > 0.0f) {
+			clusteredLights->addLight(entities.positions[i] + vec3(0.0f, 2.0f, 0.0f), 10.0f, vec3(1.0f, 0.7f, 0.4f), 15.0f);
+		}
 	}
+
+	// Lanterns along the two main paths
+	for (int i = -150; i <= 150; i += 5) {
+		clusteredLights->addLight(vec3(i, 2.5f + groundHeight((float)i, 3.0f), 3.0f), 7.0f, vec3(1.0f, 0.85f, 0.5f), 8.0f);
+		clusteredLights->addLight(vec3(3.0f, 2.5f + groundHeight(3.0f, (float)i), i), 7.0f, vec3(1.0f, 0.85f, 0.5f), 8.0f);
+	}
+}
+
+// World matrices of the dirty entities, the changed ones are copied into the next snapshots
+void updateWorldMatrices() {
+	entities.updateTransforms(jobSystem);
+	// Past the entity count the next publish copies them all anyway
+	if (unpublishedChanges.size() > entities.size()) return;
+	unpublishedChanges.insert(unpublishedChanges.end(), entities.updatedEntities.begin(), entities.updatedEntities.end());
+}
+
+// One simulation tick of dt seconds
+void updateLoop(float dt) {
+	PROFILE_SCOPE("Update");
+	double start = getTime();
+
+	previousLayoutVersion = entities.layoutVersion;
+	previousLightPos = lightPos;
+
+	entities.update(dt);
+	// Only the moved entities and their children get a new world matrix, the frames blend those alone
+	updateWorldMatrices();
+	movedEntities = entities.updatedEntities;
+	movedMatrices = entities.previousMatrices;
+
+	lightPos.y += 6.0f * dt * lightDirection.y;
+	if (lightPos.y > 50.0f) lightPos.y = 50.0f, lightDirection.y = -1;
+	if (lightPos.y < 30.0f) lightPos.y = 30.0f, lightDirection.y = 1;
+
+	lightPos.x += 9.0f * dt * lightDirection.x;
+	if (lightPos.x > 40.0f) lightPos.x = 40.0f, lightDirection.x = -1;
+	if (lightPos.x < -40.0f) lightPos.x = -40.0f, lightDirection.x = 1;
+
+	lightPos.z += 3.0f * dt * lightDirection.z;
+	if (lightPos.z > 40.0f) lightPos.z = 40.0f, lightDirection.z = -1;
+	if (lightPos.z < -40.0f) lightPos.z = -40.0f, lightDirection.z = 1;
+
+	pendingUpdateTime += (getTime() - start) * 1000.0;
+}
+
+// Page the tiles in and out around the camera, once per frame on the simulation thread
+void updateTiles(const vec3 &camera) {
+	if (!tileWorld) return;
+	double start = getTime();
+	tileWorld->update(camera);
+	// The entities of the tiles committed now have no world matrix yet, the tick already ran
+	updateWorldMatrices();
+	pendingUpdateTime += (getTime() - start) * 1000.0;
 }
 
 // Shader uniform identifiers
-GLuint MatrixID, ViewMatrixID, ModelMatrixID, LightID, TextureID, NormalTextureID, ModelView3x3MatrixID;
+GLuint ViewMatrixID, LightID, TextureID, NormalTextureID;
 GLuint programID, textureShaderID;
 GLuint MatrixID_2, TextureID_2, BoolID;
+GLuint depthProgramID, overdrawProgramID;
+
+// Per object matrices of the frame, the lit, depth and overdraw passes bind one block of it per draw
+#define OBJECT_BLOCK_BINDING 0
+GLuint objectBuffer;
+size_t objectStride, objectCapacity;
+// Block after the listed entities : identity world matrix, the view and projection for draws in world space
+size_t sceneBlock;
+double matrixBatchTime;
+
+// Compute the matrices of the listed entities straight into the object buffer, block i is for list[i]
+void uploadObjectMatrices(const std::vector<unsigned int> &list, const mat4 &ViewMatrix, const mat4 &ProjectionMatrix) {
+	PROFILE_SCOPE("Object matrices");
+
+	glBindBuffer(GL_UNIFORM_BUFFER, objectBuffer);
+	if (list.size() + 1 > objectCapacity) {
+		objectCapacity = (list.size() + 1) * 2;
+		glBufferData(GL_UNIFORM_BUFFER, objectCapacity * objectStride, NULL, GL_STREAM_DRAW);
+		MemoryTracker::trackBuffer(objectBuffer, objectCapacity * objectStride, MEMORY_DYNAMIC, "object matrices");
+	}
+
+	// The previous content is not needed anymore, the driver can hand out fresh memory instead of waiting
+	unsigned char *output = (unsigned char*)glMapBufferRange(GL_UNIFORM_BUFFER, 0, (list.size() + 1) * objectStride, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+	double start = getTime();
+	jobSystem->parallelFor(list.size(), 1024, [&](size_t begin, size_t end) {
+		computeObjectMatrices(frame->matrixBatchPath, frameMatrices, &list[begin], end - begin, ViewMatrix, ProjectionMatrix, output + begin * objectStride, objectStride);
+	});
+	matrixBatchTime = (getTime() - start) * 1000.0;
+	static const mat4 identity(1.0f);
+	static const unsigned int first = 0;
+	sceneBlock = list.size();
+	computeObjectMatrices(frame->matrixBatchPath, &identity, &first, 1, ViewMatrix, ProjectionMatrix, output + sceneBlock * objectStride, objectStride);
+	glUnmapBuffer(GL_UNIFORM_BUFFER);
+}
+
+void bindObjectMatrices(size_t block) {
+	glBindBufferRange(GL_UNIFORM_BUFFER, OBJECT_BLOCK_BINDING, objectBuffer, block * objectStride, sizeof(ObjectMatrices));
+}
+
+// Draws of the software and no culling modes, recorded on the job threads
+RenderQueue *renderQueue;
+
+// Record the draws of one visible entity, its matrices are in the given block of the object buffer
+void recordObject(std::vector<DrawPacket> &commands, unsigned int entity, size_t block, const mat4 &ViewMatrix) {
+	const RenderHandles &obj = frame->entities.render[entity];
+
+	DrawPacket packet;
+	packet.vertexBuffer = obj.model->VBO;
+	packet.uvBuffer = obj.model->UVBO;
+	packet.normalBuffer = obj.model->NBO;
+	packet.tangentBuffer = obj.model->tangentbuffer;
+	packet.bitangentBuffer = obj.model->bitangentbuffer;
+	packet.elementBuffer = obj.model->elementbuffer;
+	packet.texture = obj.Texture;
+	packet.normalTexture = obj.NormalTexture;
+	packet.uniformOffset = (GLuint)(block * objectStride);
+	packet.indexCount = (GLsizei)obj.model->indices.size();
+	packet.depthWrite = obj.depthTest;
+
+	// Coarse front to back order, objects of the same 8 units slice stay grouped by model and texture
+	float distance = -(ViewMatrix * frameMatrices[entity][3]).z;
+	unsigned int depthBucket = (unsigned int)(std::max(distance, 0.0f) / 8.0f);
+
+	if (frame->depthPrepass) {
+		// Depth only from the position stream, the lit pass then shades each pixel once in any order
+		DrawPacket depth = packet;
+		depth.pass = PASS_DEPTH;
+		depth.depthWrite = 1;
+		depth.sortKey = RenderQueue::makeKey(PASS_DEPTH, depthBucket, packet.vertexBuffer, 0, 0);
+		commands.push_back(depth);
+		depthBucket = 0;
+	}
+
+	RenderPass pass = frame->overdrawView ? PASS_OVERDRAW : PASS_LIT;
+	packet.pass = pass;
+	packet.sortKey = RenderQueue::makeKey(pass, depthBucket, packet.vertexBuffer, packet.texture, packet.normalTexture);
+	commands.push_back(packet);
+}
+
+// Scene draws of the frame outside the render queue and the GPU culling, the overlay is not counted
+int drawCalls;
+long long drawnTriangles;
+
+// Draw one entity with the normal light shader, programID must be in use and its matrices in the given block
+void drawLitObject(size_t entity, size_t block) {
+	const RenderHandles &obj = frame->entities.render[entity];
+
+	if (obj.depthTest) {
+		glDepthMask(GL_TRUE);
+	}
+	else {
+		glDepthMask(GL_FALSE);
+	}
+
+	// Set the position of our model
+	bindObjectMatrices(block);
+
+	// Bind our texture
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_2D, obj.Texture);
+	glUniform1i(TextureID, 0);
+
+	// Texture normals
+	glActiveTexture(GL_TEXTURE1);
+	glBindTexture(GL_TEXTURE_2D, obj.NormalTexture);
+	glUniform1i(NormalTextureID, 1);
+	
+	// Vertices
+	glEnableVertexAttribArray(0);
+	glBindBuffer(GL_ARRAY_BUFFER, obj.model->VBO);
+	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, (GLvoid*)0);
+
+	// UVs
+	glEnableVertexAttribArray(1);
+	glBindBuffer(GL_ARRAY_BUFFER, obj.model->UVBO);
+	glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 0, (GLvoid*)0);
+
+	// Normals
+	glEnableVertexAttribArray(2);
+	glBindBuffer(GL_ARRAY_BUFFER, obj.model->NBO);
+	glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, 0, (GLvoid*)0);
+
+	// Tangents
+	glEnableVertexAttribArray(3);
+	glBindBuffer(GL_ARRAY_BUFFER, obj.model->tangentbuffer);
+	glVertexAttribPointer(3, 3, GL_FLOAT, GL_FALSE, 0, (GLvoid*)0);
+
+	// Bitangents
+	glEnableVertexAttribArray(4);
+	glBindBuffer(GL_ARRAY_BUFFER, obj.model->bitangentbuffer);
+	glVertexAttribPointer(4, 3, GL_FLOAT, GL_FALSE, 0, (GLvoid*)0);
+
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, obj.model->elementbuffer);
+
+	glDrawElements(GL_TRIANGLES, obj.model->indices.size(), GL_UNSIGNED_SHORT, (void*)0);
+	drawCalls++;
+	drawnTriangles += obj.model->indices.size() / 3;
+
+	glDisableVertexAttribArray(0);
+	glDisableVertexAttribArray(1);
+	glDisableVertexAttribArray(3);
+}
+
+// Overlay text, rebuilt a few times per second so formatting it costs next to nothing
+#define HUD_REFRESH 0.25
+#define HUD_LINES 5
+#define HUD_TEXT_SIZE 16
+char hudLines[HUD_LINES][128];
+unsigned int hudColors[HUD_LINES] = { 0xffffff, 0xffffff, 0xffffff, 0xffffff, 0xffffff };
+double hudLastRefresh, hudTime;
+int hudFrames;
+
+// Frame figures on screen. They are taken before the overlay is drawn and it is not counted in them,
+// its own cost is shown apart.
+void drawHud(int sceneDraws, long long sceneTriangles) {
+	PROFILE_SCOPE("HUD");
+	double start = getTime();
+	hudFrames++;
+
+	if (start - hudLastRefresh >= HUD_REFRESH) {
+		FrameStats::Summary stats = frameStats->summary();
+		double frameTime = (start - hudLastRefresh) * 1000.0 / hudFrames;
+		snprintf(hudLines[0], sizeof(hudLines[0]), "%.2f ms/frame (%.0f fps)  p50 %.2f  p99 %.2f  max %.2f ms", frameTime, 1000.0 / frameTime, stats.p50, stats.p99, stats.max);
+		if (sceneTriangles >= 0) {
+			snprintf(hudLines[1], sizeof(hudLines[1]), "%d draw calls  %.2fK triangles", sceneDraws, sceneTriangles / 1000.0);
+		}
+		else {
+			snprintf(hudLines[1], sizeof(hudLines[1]), "%d draw calls  triangles on the GPU", sceneDraws);
+		}
+		snprintf(hudLines[2], sizeof(hudLines[2]), "%.1f MB memory, %.1f MB meshes  %u stutters", processMemoryUsage() / (1024.0 * 1024.0),
+			MemoryTracker::total(MEMORY_CPU) / (1024.0 * 1024.0), frameStats->stutterCount());
+		snprintf(hudLines[3], sizeof(hudLines[3]), "GPU %.1f MB peak %.1f  mesh %.1f tex %.1f rt %.1f dyn %.1f",
+			MemoryTracker::total(MEMORY_GPU) / (1024.0 * 1024.0), MemoryTracker::peak(MEMORY_GPU) / (1024.0 * 1024.0),
+			MemoryTracker::categoryTotal(MEMORY_GPU, MEMORY_MESH) / (1024.0 * 1024.0), MemoryTracker::categoryTotal(MEMORY_GPU, MEMORY_TEXTURE) / (1024.0 * 1024.0),
+			MemoryTracker::categoryTotal(MEMORY_GPU, MEMORY_RENDER_TARGET) / (1024.0 * 1024.0), MemoryTracker::categoryTotal(MEMORY_GPU, MEMORY_DYNAMIC) / (1024.0 * 1024.0));
+		snprintf(hudLines[4], sizeof(hudLines[4]), "HUD %.3f ms", hudTime);
+		// Frame time line in yellow when the tail is far from the median
+		hudColors[0] = stats.p99 > 2.0f * stats.p50 ? 0xffff40 : 0xffffff;
+		// Memory lines in red over their budget
+		hudColors[2] = MemoryTracker::overBudget(MEMORY_CPU) ? 0xff4040 : 0xffffff;
+		hudColors[3] = MemoryTracker::overBudget(MEMORY_GPU) ? 0xff4040 : 0xffffff;
+		hudLastRefresh = start;
+		hudFrames = 0;
+	}
+
+	// Top left
+	for (int l = 0; l < HUD_LINES; ++l) {
+		printText2D(hudLines[l], 8, frame->framebufferHeight - (l + 1) * (HUD_TEXT_SIZE + 4), HUD_TEXT_SIZE, hudColors[l]);
+	}
+	drawText2D(frame->framebufferWidth, frame->framebufferHeight);
+
+	hudTime = (getTime() - start) * 1000.0;
+}
+
+// Finest mip level each entity needs : the texels across its texture over the pixels it covers.
+// The texture is assumed to be mapped once over the bounds.
+void requestTextureLevels(const mat4 &ViewMatrix, const mat4 &ProjectionMatrix) {
+	PROFILE_SCOPE("Texture requests");
+	// Pixels covered by one unit at a distance of one
+	float pixelScale = ProjectionMatrix[1][1] * frame->framebufferHeight * 0.5f;
+	vec3 eye = vec3(inverse(ViewMatrix)[3]);
+
+	jobSystem->parallelFor(frame->entities.size(), 1024, [&](size_t begin, size_t end) {
+		for (size_t i = begin; i < end; ++i) {
+			GLuint texture = frame->entities.render[i].Texture;
+			unsigned int size = textureStreamer->textureSize(texture);
+			if (!size) continue;
+
+			const mat4 &M = frameMatrices[i];
+			float scale = std::max(length(vec3(M[0])), std::max(length(vec3(M[1])), length(vec3(M[2]))));
+			float diameter = length(frame->entities.boundsMax[i] - frame->entities.boundsMin[i]) * scale;
+			float distance = std::max(length(vec3(M[3]) - eye) - diameter * 0.5f, 0.1f);
+			float pixels = std::max(diameter * pixelScale / distance, 1.0f);
+			textureStreamer->request(texture, log2f(size / pixels));
+		}
+	});
+}
+
+void drawLoop() {
+	PROFILE_SCOPE("Frame");
+	gpuTimers->beginFrame();
+	GPU_PROFILE_SCOPE(gpuTimers, "Frame");
 
-void drawLoop(vec3 lightPos) {
 	// Measure speed
-	double currentTime = glfwGetTime();
+	double currentTime = getTime();
 	nbFrames++;
 	if (currentTime - lastTime >= 1.0) {
-		printf("%f ms/frame\n", 1000.0 / double(nbFrames));
+		printf("%f ms/frame, %s culling : %d objects culled, %f ms rasterization, %d queries, depth pre-pass %s\n", 1000.0 / double(nbFrames),
+			cullingModeNames[frame->cullingMode], culledObjects, occlusionCuller->rasterTime, occlusionQueries->queriesIssued, frame->depthPrepass ? "on" : "off");
+		printf("%d point lights, %d cluster references, %f ms binning\n", clusteredLights->lightCount(), clusteredLights->lightReferences, clusteredLights->buildTime);
+		printf("%s object matrices : %f ms\n", matrixBatchPathName(frame->matrixBatchPath), matrixBatchTime);
+		printf("%d draw packets, %f ms sort, %d state changes\n", (int)renderQueue->packetCount(), renderQueue->sortTime, renderQueue->stateChanges);
+		if (terrain) printf("%d terrain chunks, %lld triangles\n", terrain->chunkCount(), terrain->triangleCount());
+		if (snowfall) printf("%u snowflakes : %f ms CPU, %f ms on the job threads\n", (unsigned int)snowfall->count(), snowfall->cpuTime, snowfall->wallTime);
+		printf("GPU");
+		for (int p = 0; p < gpuTimers->passCount; ++p) {
+			printf("%s %s %f ms", p ? "," : " :", gpuTimers->passNames[p], gpuTimers->passTimes[p]);
+		}
+		printf("\n");
+		FrameStats::Summary stats = frameStats->summary();
+		printf("Last %u frames : p50 %f ms, p95 %f ms, p99 %f ms, max %f ms, %u stutters\n", stats.frames, stats.p50, stats.p95, stats.p99, stats.max, frameStats->stutterCount());
 		nbFrames = 0;
 		lastTime += 1.0;
 	}
 
 	// Clear the screen. It's not mentioned before Tutorial 02, but it can cause flickering, so it's there nonetheless.
+	if (frame->overdrawView) {
+		glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
+	}
+	else {
+		glClearColor(0.0f, 0.05f, 0.0f, 0.0f);
+	}
 	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+	drawCalls = 0;
+	drawnTriangles = 0;
+
+	const mat4 &ProjectionMatrix = frame->ProjectionMatrix;
+	const mat4 &ViewMatrix = frame->ViewMatrix;
+	vec3 lightPos = frameLightPos;
+
+	// Reads of the mip levels this view needs, they arrive in a later frame
+	if (textureStreamer) {
+		double streamingStart = getTime();
+		requestTextureLevels(ViewMatrix, ProjectionMatrix);
+		textureStreamer->update();
+		frameStats->addPhase(PHASE_UPLOAD, (getTime() - streamingStart) * 1000.0);
+	}
 
-	// Compute the MVP matrix from keyboard and mouse input
-	computeMatricesFromInputs();
+	// The flakes move on the job threads while this frame is culled and drawn, the time this thread waits
+	// for them in the submission counts as update too. Headless frames are one tick apart
+	if ((snowfall || snowVolume) && !frame->overdrawView) {
+		double snowfallStart = getTime();
+		float dt = headless ? (float)(1.0 / tickRate) : (float)std::min(snowfallStart - lastSnowfallTime, 0.1);
+		lastSnowfallTime = snowfallStart;
+		snowTime = fmod(snowTime + dt, (double)SnowVolume::PERIOD);
+		if (snowfall) snowfall->update(dt, vec3(inverse(ViewMatrix)[3]));
+		frameStats->addPhase(PHASE_UPDATE, (getTime() - snowfallStart) * 1000.0);
+	}
 
-	glm::mat4 ProjectionMatrix = getProjectionMatrix();
-	glm::mat4 ViewMatrix = getViewMatrix();
+	// Bin the point lights in the clusters of this view
+	double cullStart = getTime();
+	clusteredLights->update(ViewMatrix, ProjectionMatrix, frame->framebufferWidth, frame->framebufferHeight);
+
+	// Rasterize the occluders in the software depth buffer
+	culledObjects = 0;
+	if (frame->cullingMode == CULLING_SOFTWARE) {
+		PROFILE_SCOPE("Occluders");
+		occlusionCuller->beginFrame(ProjectionMatrix * ViewMatrix);
+		for (size_t i = 0; i < frame->entities.size(); ++i) {
+			if (frame->entities.occluderScales[i] > 0.0f) {
+				vec3 boxMin, boxMax;
+				if (frame->entities.getOccluderBox(i, boxMin, boxMax)) occlusionCuller->addOccluder(frameMatrices[i], boxMin, boxMax);
+			}
+		}
+		occlusionCuller->rasterize();
+	}
+	else if (frame->cullingMode == CULLING_QUERIES) {
+		occlusionQueries->beginFrame(frame->entities, frameMatrices);
+	}
+	else if (frame->cullingMode == CULLING_GPU) {
+		// Nothing comes back to the CPU, the culled count is unknown
+		GPU_PROFILE_SCOPE(gpuTimers, "GPU culling");
+		gpuCulling->cull(frame->entities, frameMatrices, ProjectionMatrix * ViewMatrix);
+	}
+	// The pyramid of the last GPU culling frame would be stale when the mode comes back
+	if (frame->cullingMode != CULLING_GPU) gpuCulling->invalidateHiZ();
+	double submitStart = getTime();
+	frameStats->addPhase(PHASE_CULL, (submitStart - cullStart) * 1000.0);
+	// The per object visibility runs in the middle of the submission, it counts as culling
+	double visibilityTime = 0.0;
+	double snowfallWaitTime = 0.0;
 
 	// Texture only shader
+	gpuTimers->begin("Skyboxes");
 	glUseProgram(textureShaderID);
+	vec3 eye = vec3(inverse(ViewMatrix)[3]);
 
-	for (std::vector<Obj3D>::iterator obj = objects_shader1.begin(); obj != objects_shader1.end(); ++obj) {
+	for (std::vector<Obj3D>::iterator obj = objects_shader1.begin(); obj != objects_shader1.end() && !frame->overdrawView; ++obj) {
+		// The terrain is the ground, the walls of the grass box would hide it past a few hundred units
+		if (terrain && obj == objects_shader1.begin()) continue;
 
-		// Set the position of our model
-		mat4 ModelViewMatrix = ViewMatrix * obj->getModelMatrix();
+		// Set the position of our model. In the tile world and on the terrain the skyboxes follow the camera,
+		// the ground by whole repeats of its texture so the grass stays in place. It is widened to keep its
+		// walls behind the mountains when it lags behind the camera
+		mat4 ModelMatrix = obj->getModelMatrix();
+		if (tileStreaming || terrain) {
+			vec3 offset(eye.x, 0.0f, eye.z);
+			if (obj == objects_shader1.begin()) {
+				const float GROUND_WIDENING = 1.1f;
+				float repeat = (obj->model->boundsMax.x - obj->model->boundsMin.x) * obj->scale.x * GROUND_WIDENING / GROUND_TEXTURE_REPEAT;
+				offset = floor(offset / repeat) * repeat;
+				ModelMatrix = scale(vec3(GROUND_WIDENING, 1.0f, GROUND_WIDENING)) * ModelMatrix;
+			}
+			ModelMatrix = translate(offset) * ModelMatrix;
+		}
+		mat4 ModelViewMatrix = ViewMatrix * ModelMatrix;
 		mat4 MVP = ProjectionMatrix * ModelViewMatrix;
 
 		if (obj->depthTest) {
@@ -151,7 +752,7 @@ void drawLoop(vec3 lightPos) {
 		}
 
 		glUniformMatrix4fv(MatrixID_2, 1, GL_FALSE, &MVP[0][0]);
-		glUniform1i(BoolID, (obj == objects_shader1.begin()) * 60);
+		glUniform1i(BoolID, (obj == objects_shader1.begin()) * GROUND_TEXTURE_REPEAT);
 
 		// Bind our texture
 		glActiveTexture(GL_TEXTURE0);
@@ -171,136 +772,685 @@ void drawLoop(vec3 lightPos) {
 		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, obj->model->elementbuffer);
 
 		glDrawElements(GL_TRIANGLES, obj->model->indices.size(), GL_UNSIGNED_SHORT, (void*)0);
+		drawCalls++;
+		drawnTriangles += obj->model->indices.size() / 3;
 
 		glDisableVertexAttribArray(0);
 		glDisableVertexAttribArray(1);
 	}
+	gpuTimers->end();
+
+	// Terrain before the objects, the hills hide part of them from the depth test
+	if (terrain && !frame->overdrawView) {
+		GPU_PROFILE_SCOPE(gpuTimers, "Terrain");
+		glDepthMask(GL_TRUE);
+		clusteredLights->bind(terrain->getProgram());
+		terrain->draw(ViewMatrix, ProjectionMatrix, lightPos);
+		drawCalls++;
+		drawnTriangles += terrain->triangleCount();
+	}
 
 	// Normal light shader
-	glUseProgram(programID);
+	clusteredLights->bind(programID);
 
 	glUniformMatrix4fv(ViewMatrixID, 1, GL_FALSE, &ViewMatrix[0][0]);
 	glUniform3f(LightID, lightPos.x, lightPos.y, lightPos.z);
 
-	for (std::vector<Obj3D>::iterator obj  = objects.begin(); obj != objects.end(); ++obj) {
-		
-		// Set the position of our model
-		mat4 ModelMatrix = obj->getModelMatrix();
-		mat4 ModelViewMatrix = ViewMatrix * ModelMatrix;
-		mat3 ModelView3x3Matrix = mat3(ModelViewMatrix);
-		mat4 MVP = ProjectionMatrix * ModelViewMatrix;
+	if (frame->cullingMode == CULLING_QUERIES) {
+		PROFILE_SCOPE("Occlusion query draws");
+		GPU_PROFILE_SCOPE(gpuTimers, "Occlusion query draws");
 
-		if (obj->depthTest) {
-			glDepthMask(GL_TRUE);
+		// Block i is entity i
+		std::vector<unsigned int> allEntities(frame->entities.size());
+		for (size_t i = 0; i < allEntities.size(); ++i) {
+			allEntities[i] = (unsigned int)i;
+		}
+		uploadObjectMatrices(allEntities, ViewMatrix, ProjectionMatrix);
+
+		std::vector<int> hiddenNodes;
+
+		// Nodes visible last frame fill the depth buffer first, their own draw is the query when they are due for a check
+		for (size_t n = 0; n < occlusionQueries->nodes.size(); ++n) {
+			OcclusionQueries::Node &node = occlusionQueries->nodes[n];
+			if (!node.visible) {
+				hiddenNodes.push_back((int)n);
+				culledObjects += (int)node.entities.size();
+				continue;
+			}
+
+			bool query = occlusionQueries->wantsQuery((int)n);
+			if (query) occlusionQueries->beginQuery((int)n);
+			for (size_t i = 0; i < node.entities.size(); ++i) {
+				size_t entity = frame->entities.indexOf(node.entities[i]);
+				drawLitObject(entity, entity);
+			}
+			if (query) occlusionQueries->endQuery();
+		}
+
+		// Hidden nodes test their bounds against that depth, the GPU skips their draw if no sample passed
+		occlusionQueries->queryHiddenBounds(ProjectionMatrix * ViewMatrix, vec3(inverse(ViewMatrix)[3]));
+		glUseProgram(programID);
+
+		for (size_t h = 0; h < hiddenNodes.size(); ++h) {
+			OcclusionQueries::Node &node = occlusionQueries->nodes[hiddenNodes[h]];
+			if (node.pending) glBeginConditionalRender(node.query, GL_QUERY_NO_WAIT);
+			for (size_t i = 0; i < node.entities.size(); ++i) {
+				size_t entity = frame->entities.indexOf(node.entities[i]);
+				drawLitObject(entity, entity);
+			}
+			if (node.pending) glEndConditionalRender();
+		}
+	}
+	else if (frame->cullingMode == CULLING_GPU) {
+		clusteredLights->bind(gpuCulling->getDrawProgram());
+		{
+			GPU_PROFILE_SCOPE(gpuTimers, "Indirect draws");
+			gpuCulling->draw(ViewMatrix, ProjectionMatrix, lightPos);
+		}
+		GPU_PROFILE_SCOPE(gpuTimers, "Hi-Z");
+		gpuCulling->buildHiZ(ProjectionMatrix * ViewMatrix);
+	}
+	else {
+		// Skip objects hidden behind the occluders, tested in parallel
+		std::vector<unsigned char> visible(frame->entities.size(), 1);
+		double visibilityStart = getTime();
+		if (frame->cullingMode == CULLING_SOFTWARE) {
+			PROFILE_SCOPE("Visibility");
+			jobSystem->parallelFor(frame->entities.size(), 256, [&](size_t begin, size_t end) {
+				for (size_t i = begin; i < end; ++i) {
+					visible[i] = occlusionCuller->isVisible(frameMatrices[i], frame->entities.boundsMin[i], frame->entities.boundsMax[i]);
+				}
+			});
+		}
+
+		std::vector<unsigned int> visibleObjects;
+		for (size_t i = 0; i < frame->entities.size(); ++i) {
+			if (!visible[i]) {
+				culledObjects++;
+				continue;
+			}
+
+			visibleObjects.push_back((unsigned int)i);
+		}
+		visibilityTime = (getTime() - visibilityStart) * 1000.0;
+		frameStats->addPhase(PHASE_CULL, visibilityTime);
+
+		// Block i is visibleObjects[i], shared by all the passes so the depths match exactly
+		uploadObjectMatrices(visibleObjects, ViewMatrix, ProjectionMatrix);
+
+		// Record the packets on the job threads, then merge and sort them on this one
+		renderQueue->reset();
+		jobSystem->parallelFor(visibleObjects.size(), 256, [&](size_t begin, size_t end) {
+			PROFILE_SCOPE("Record draws");
+			std::vector<DrawPacket> &commands = renderQueue->threadBuffer();
+			for (size_t i = begin; i < end; ++i) {
+				recordObject(commands, visibleObjects[i], i, ViewMatrix);
+			}
+		});
+		renderQueue->sort();
+
+		if (frame->depthPrepass) {
+			PROFILE_SCOPE("Depth pre-pass");
+			GPU_PROFILE_SCOPE(gpuTimers, "Depth pre-pass");
+			glUseProgram(depthProgramID);
+			glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+			renderQueue->replay(PASS_DEPTH, objectBuffer, OBJECT_BLOCK_BINDING, sizeof(ObjectMatrices));
+			glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+			glDepthFunc(GL_EQUAL);
+		}
+
+		if (frame->overdrawView) {
+			// Count the shaded fragments of each pixel
+			PROFILE_SCOPE("Overdraw pass");
+			GPU_PROFILE_SCOPE(gpuTimers, "Overdraw pass");
+			glUseProgram(overdrawProgramID);
+			glEnable(GL_BLEND);
+			glBlendFunc(GL_ONE, GL_ONE);
+			renderQueue->replay(PASS_OVERDRAW, objectBuffer, OBJECT_BLOCK_BINDING, sizeof(ObjectMatrices));
+			glDisable(GL_BLEND);
 		}
 		else {
-			glDepthMask(GL_FALSE);
+			PROFILE_SCOPE("Lit pass");
+			GPU_PROFILE_SCOPE(gpuTimers, "Lit pass");
+			glUseProgram(programID);
+			glUniform1i(TextureID, 0);
+			glUniform1i(NormalTextureID, 1);
+			renderQueue->replay(PASS_LIT, objectBuffer, OBJECT_BLOCK_BINDING, sizeof(ObjectMatrices));
 		}
 
-		glUniformMatrix4fv(MatrixID, 1, GL_FALSE, &MVP[0][0]);
-		glUniformMatrix4fv(ModelMatrixID, 1, GL_FALSE, &ModelMatrix[0][0]);
-		glUniformMatrix3fv(ModelView3x3MatrixID, 1, GL_FALSE, &ModelView3x3Matrix[0][0]);
+		glDepthFunc(GL_LESS);
+		glDepthMask(GL_TRUE);
+	}
 
-		// Bind our texture
-		glActiveTexture(GL_TEXTURE0);
-		glBindTexture(GL_TEXTURE_2D, obj->Texture);
-		glUniform1i(TextureID, 0);
-
-		// Texture normals
-		glActiveTexture(GL_TEXTURE1);
-		glBindTexture(GL_TEXTURE_2D, obj->NormalTexture);
-		glUniform1i(NormalTextureID, 1);
-		
-		// Vertices
-		glEnableVertexAttribArray(0);
-		glBindBuffer(GL_ARRAY_BUFFER, obj->model->VBO);
-		glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, (GLvoid*)0);
+	// Snow over everything opaque, under the HUD
+	if (snowfall && !frame->overdrawView) {
+		GPU_PROFILE_SCOPE(gpuTimers, "Snowfall");
+		snowfall->draw(ViewMatrix, ProjectionMatrix, frame->framebufferHeight);
+		drawCalls++;
+		snowfallWaitTime = snowfall->waitTime;
+		frameStats->addPhase(PHASE_UPDATE, snowfallWaitTime);
+	}
+	else if (snowVolume && !frame->overdrawView) {
+		GPU_PROFILE_SCOPE(gpuTimers, "Snow volume");
+		// The GPU culling draws without the object buffer, it only holds the scene block then
+		if (frame->cullingMode == CULLING_GPU) uploadObjectMatrices(std::vector<unsigned int>(), ViewMatrix, ProjectionMatrix);
+		bindObjectMatrices(sceneBlock);
+		snowVolume->draw((float)snowTime, vec3(inverse(ViewMatrix)[3]), ProjectionMatrix, frame->framebufferHeight);
+		drawCalls++;
+	}
 
-		// UVs
-		glEnableVertexAttribArray(1);
-		glBindBuffer(GL_ARRAY_BUFFER, obj->model->UVBO);
-		glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 0, (GLvoid*)0);
+	if (frame->hudVisible) {
+		int sceneDraws = drawCalls;
+		long long sceneTriangles = drawnTriangles;
+		if (frame->cullingMode == CULLING_GPU) {
+			sceneDraws += gpuCulling->drawCount();
+			sceneTriangles = -1;
+		}
+		else if (frame->cullingMode != CULLING_QUERIES) {
+			sceneDraws += renderQueue->drawCalls;
+			sceneTriangles += renderQueue->triangles;
+		}
+		GPU_PROFILE_SCOPE(gpuTimers, "HUD");
+		drawHud(sceneDraws, sceneTriangles);
+	}
 
-		// Normals
-		glEnableVertexAttribArray(2);
-		glBindBuffer(GL_ARRAY_BUFFER, obj->model->NBO);
-		glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, 0, (GLvoid*)0);
+	double swapStart = getTime();
+	frameStats->addPhase(PHASE_SUBMIT, (swapStart - submitStart) * 1000.0 - visibilityTime - snowfallWaitTime);
 
-		// Tangents
-		glEnableVertexAttribArray(3);
-		glBindBuffer(GL_ARRAY_BUFFER, obj->model->tangentbuffer);
-		glVertexAttribPointer(3, 3, GL_FLOAT, GL_FALSE, 0, (GLvoid*)0);
+	// Swap buffers, nothing to present offscreen
+	PROFILE_SCOPE("Swap");
+	if (headless) {
+		glFlush();
+	}
+	else {
+		glfwSwapBuffers(window);
+	}
+	frameStats->addPhase(PHASE_SWAP, (getTime() - swapStart) * 1000.0);
+}
 
-		// Bitangents
-		glEnableVertexAttribArray(4);
-		glBindBuffer(GL_ARRAY_BUFFER, obj->model->bitangentbuffer);
-		glVertexAttribPointer(4, 3, GL_FLOAT, GL_FALSE, 0, (GLvoid*)0);
+// Entities whose world matrix changed in the publishes after serial. False when everything has to be copied :
+// a layout change, more changes than entities or publishes too old to be kept
+static bool changesSince(unsigned int serial, std::vector<unsigned int> &changed) {
+	changed.clear();
+	if (publishedChanges.empty() || publishedChanges.front().serial > serial + 1) return false;
+	for (std::deque<PublishedChanges>::const_iterator changes = publishedChanges.begin(); changes != publishedChanges.end(); ++changes) {
+		if (changes->serial <= serial) continue;
+		if (changes->all || changed.size() + changes->entities.size() > entities.size()) return false;
+		changed.insert(changed.end(), changes->entities.begin(), changes->entities.end());
+	}
+	return true;
+}
 
-		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, obj->model->elementbuffer);
+// Copy the state of the simulation for the render thread
+void publishSnapshot(double accumulator, const mat4 &ViewMatrix, const mat4 &ProjectionMatrix) {
+	PROFILE_SCOPE("Publish snapshot");
+	publishedChanges.push_back(PublishedChanges());
+	PublishedChanges &changes = publishedChanges.back();
+	changes.serial = ++publishSerial;
+	changes.all = entities.layoutVersion != publishedLayoutVersion || unpublishedChanges.size() > entities.size();
+	changes.entities.swap(unpublishedChanges);
+	publishedLayoutVersion = entities.layoutVersion;
+	if (publishedChanges.size() > PUBLISHED_CHANGES_KEPT) {
+		// Its storage holds the next changes
+		unpublishedChanges.swap(publishedChanges.front().entities);
+		publishedChanges.pop_front();
+	}
+	unpublishedChanges.clear();
 
-		glDrawElements(GL_TRIANGLES, obj->model->indices.size(), GL_UNSIGNED_SHORT, (void*)0);
+	// The slot catches up with the world matrices changed since it was last written, static scenes copy nothing.
+	// The vectors of a reused slot keep their capacity, no allocation once the scene stops growing
+	FrameSnapshot &snapshot = snapshots.writeBuffer();
+	if (snapshot.entities.layoutVersion == entities.layoutVersion && changesSince(snapshot.serial, slotChanges)) {
+		if (!slotChanges.empty()) snapshot.entities.copyWorldMatrices(entities, &slotChanges[0], slotChanges.size());
+	}
+	else {
+		snapshot.entities.copyRenderState(entities);
+	}
+	snapshot.serial = publishSerial;
+	// The render thread catches up the same way from the snapshot it has
+	snapshot.resync = !changesSince(acquiredSerial.load(std::memory_order_acquire), snapshot.changedEntities);
+	snapshot.movedEntities = movedEntities;
+	snapshot.movedMatrices = movedMatrices;
+	snapshot.interpolate = previousLayoutVersion == entities.layoutVersion;
+	snapshot.updateTime = pendingUpdateTime;
+	pendingUpdateTime = 0.0;
+	snapshot.publishTime = getTime();
+	snapshot.accumulator = accumulator;
+	snapshot.ViewMatrix = ViewMatrix;
+	snapshot.ProjectionMatrix = ProjectionMatrix;
+	snapshot.previousLightPos = previousLightPos;
+	snapshot.currentLightPos = lightPos;
+	snapshot.framebufferWidth = framebufferWidth;
+	snapshot.framebufferHeight = framebufferHeight;
+	snapshot.cullingMode = cullingMode;
+	snapshot.depthPrepass = depthPrepass;
+	snapshot.overdrawView = overdrawView;
+	snapshot.hudVisible = hudVisible;
+	snapshot.matrixBatchPath = matrixBatchPath;
+	snapshots.publish();
+}
 
-		glDisableVertexAttribArray(0);
-		glDisableVertexAttribArray(1);
-		glDisableVertexAttribArray(3);
+// Blend of two world matrices made of a rotation, a scale and a translation : the orientation is
+// slerped so a turning object keeps its shape, a linear blend of the matrices would shrink it
+static mat4 interpolateMatrix(const mat4 &previous, const mat4 &current, float alpha) {
+	vec3 previousScale(length(vec3(previous[0])), length(vec3(previous[1])), length(vec3(previous[2])));
+	vec3 currentScale(length(vec3(current[0])), length(vec3(current[1])), length(vec3(current[2])));
+	if (determinant(mat3(previous)) < 0.0f) previousScale.x = -previousScale.x;
+	if (determinant(mat3(current)) < 0.0f) currentScale.x = -currentScale.x;
+	vec3 previousInverse = 1.0f / max(abs(previousScale), vec3(1e-20f)) * sign(previousScale);
+	vec3 currentInverse = 1.0f / max(abs(currentScale), vec3(1e-20f)) * sign(currentScale);
+	quat previousOrientation = quat_cast(mat3(vec3(previous[0]) * previousInverse.x, vec3(previous[1]) * previousInverse.y, vec3(previous[2]) * previousInverse.z));
+	quat currentOrientation = quat_cast(mat3(vec3(current[0]) * currentInverse.x, vec3(current[1]) * currentInverse.y, vec3(current[2]) * currentInverse.z));
+
+	// Same composition as EntityStore
+	vec3 scale = mix(previousScale, currentScale, alpha);
+	mat4 m = mat4_cast(normalize(slerp(previousOrientation, currentOrientation, alpha)));
+	m[0] *= scale.x;
+	m[1] *= scale.y;
+	m[2] *= scale.z;
+	m[3] = vec4(mix(vec3(previous[3]), vec3(current[3]), alpha), 1.0f);
+	return m;
+}
+
+// State of the snapshot at the time of this frame, between its last two ticks, into frameMatrices and frameLightPos.
+// The frame shows the simulation one tick late so it never has to extrapolate. acquired is true for the first frame
+// of a snapshot.
+void interpolateSnapshot(const FrameSnapshot &snapshot, bool acquired) {
+	double tickDuration = 1.0 / tickRate;
+	float alpha = (float)std::min((snapshot.accumulator + getTime() - snapshot.publishTime) / tickDuration, 1.0);
+	PROFILE_SCOPE("Interpolate");
+
+	frameLightPos = mix(snapshot.previousLightPos, snapshot.currentLightPos, alpha);
+	const std::vector<mat4> &current = snapshot.entities.worldMatrices;
+	if (acquired) {
+		// Catch up with the new snapshot : the changed matrices and those blended for the previous one
+		if (snapshot.resync || interpolatedMatrices.size() != current.size()) {
+			interpolatedMatrices = current;
+		}
+		else {
+			for (size_t n = 0; n < snapshot.changedEntities.size(); ++n) {
+				interpolatedMatrices[snapshot.changedEntities[n]] = current[snapshot.changedEntities[n]];
+			}
+			for (size_t n = 0; n < blendedEntities.size(); ++n) {
+				interpolatedMatrices[blendedEntities[n]] = current[blendedEntities[n]];
+			}
+		}
+		blendedEntities.clear();
+		if (snapshot.interpolate) blendedEntities = snapshot.movedEntities;
+		acquiredSerial.store(snapshot.serial, std::memory_order_release);
 	}
+	frameMatrices = interpolatedMatrices.empty() ? NULL : &interpolatedMatrices[0];
+	if (!snapshot.interpolate || snapshot.movedEntities.empty()) return;
+
+	// Only the entities of the last tick, static ones cost nothing
+	const unsigned int *moved = &snapshot.movedEntities[0];
+	const mat4 *previous = &snapshot.movedMatrices[0];
+	mat4 *output = &interpolatedMatrices[0];
+	jobSystem->parallelFor(snapshot.movedEntities.size(), 4096, [&](size_t begin, size_t end) {
+		for (size_t n = begin; n < end; ++n) {
+			unsigned int i = moved[n];
+			output[i] = previous[n] == current[i] ? current[i] : interpolateMatrix(previous[n], current[i], alpha);
+		}
+	});
+}
 
-	
-	// Swap buffers
-	glfwSwapBuffers(window);
-	glfwPollEvents();
+// One frame on the GL thread : the newest snapshot, interpolated and drawn.
+// frameStart is when the frame began, before the work that led to it.
+void renderFrame(double frameStart) {
+	// The ticks count once, with the first frame that shows them. Headless they ran on this thread at the start of
+	// the frame, windowed they ran on the main thread while the previous frames were drawn and delayed none of them
+	double interpolateStart = getTime();
+	bool acquired = snapshots.acquire();
+	if (acquired) {
+		if (headless) frameStats->addPhase(PHASE_UPDATE, snapshots.readBuffer().updateTime);
+		else frameStats->addSimulation(snapshots.readBuffer().updateTime);
+	}
+	interpolateSnapshot(snapshots.readBuffer(), acquired);
+	frameStats->addPhase(PHASE_UPDATE, (getTime() - interpolateStart) * 1000.0);
 
+	frame = &snapshots.readBuffer();
+	drawLoop();
+	frameStats->endFrame((getTime() - frameStart) * 1000.0);
 }
 
-std::map<std::string, Model*> Obj3D::modelCache;
-std::map<std::string, GLuint> Obj3D::textureCache;
+void renderLoop() {
+	glfwMakeContextCurrent(window);
+	// Vsync on unless --no-vsync, it only paces this thread
+	glfwSwapInterval(vsync ? 1 : 0);
+	jobSystem->attachThread();
+	Profiler::setThreadName("Render");
+
+	while (!quitRenderThread) {
+		// GL work queued by the jobs
+		double frameStart = getTime();
+		jobSystem->flushGLThread();
+		frameStats->addPhase(PHASE_UPLOAD, (getTime() - frameStart) * 1000.0);
+
+		// The newest snapshot, or the last one again if the simulation did not publish since
+		renderFrame(frameStart);
+	}
 
-int main(void)
-{
+	glfwMakeContextCurrent(NULL);
+}
+
+// Window with a 4.5 context, or 3.3 if that fails
+bool createWindow() {
 	// Initialise GLFW
 	if (!glfwInit())
 	{
 		fprintf(stderr, "Failed to initialize GLFW\n");
-		getchar();
-		return -1;
+		pauseOnError();
+		return false;
 	}
 
 	glfwWindowHint(GLFW_SAMPLES, 4);
-	glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
-	glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
+	// The depth format the GPU culling copies for its Hi-Z pyramid, see GpuCulling::init()
+	glfwWindowHint(GLFW_DEPTH_BITS, 24);
+	glfwWindowHint(GLFW_STENCIL_BITS, 8);
+	glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
+	glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 5);
 	glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE); // To make MacOS happy; should not be needed
 	glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
 
 	// Open a window and create its OpenGL context
+	// 4.5 for the GPU culling, everything else runs on 3.3
 	window = glfwCreateWindow(WINDOW_WIDTH, WINDOW_HEIGHT, "Snowscape", NULL, NULL);
+	if (window == NULL) {
+		glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
+		glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
+		window = glfwCreateWindow(WINDOW_WIDTH, WINDOW_HEIGHT, "Snowscape", NULL, NULL);
+	}
 	if (window == NULL) {
 		fprintf(stderr, "Failed to open GLFW window. If you have an Intel GPU, they are not 3.3 compatible. Try the 2.1 version of the tutorials.\n");
-		getchar();
+		pauseOnError();
 		glfwTerminate();
-		return -1;
+		return false;
 	}
 	glfwMakeContextCurrent(window);
+	return true;
+}
+
+// Interactive loop : this thread reads the input and simulates, the render thread draws
+void runWindowed() {
+	// The render thread takes the context once the first snapshot is published
+	glfwMakeContextCurrent(NULL);
+	quitRenderThread = false;
+	std::thread renderThread;
+
+	// The input is read at the pace of the display, the simulation ticks at its own rate
+	const GLFWvidmode *videoMode = glfwGetVideoMode(glfwGetPrimaryMonitor());
+	double refreshRate = videoMode && videoMode->refreshRate > 0 ? videoMode->refreshRate : 60.0;
+	std::chrono::steady_clock::duration framePeriod = std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(1.0 / refreshRate));
+	std::chrono::steady_clock::time_point nextFrame = std::chrono::steady_clock::now();
+
+	double tickDuration = 1.0 / tickRate;
+	double accumulator = 0.0;
+	double lastFrameTime = getTime();
+
+	do {
+		glfwPollEvents();
+
+		// Compute the MVP matrix from keyboard and mouse input
+		computeMatricesFromInputs();
+
+		// Switch occlusion culling mode
+		if (keyPressed(GLFW_KEY_O)) {
+			cullingMode = CullingMode((cullingMode + 1) % CULLING_MODE_COUNT);
+			if (cullingMode == CULLING_GPU && !gpuCulling->supported) cullingMode = CullingMode(cullingMode + 1);
+		}
+
+		// Depth pre-pass and overdraw visualization, software and no culling modes only
+		if (keyPressed(GLFW_KEY_P)) depthPrepass = !depthPrepass;
+		if (keyPressed(GLFW_KEY_V)) overdrawView = !overdrawView;
+		if (keyPressed(GLFW_KEY_H)) hudVisible = !hudVisible;
+
+		// Compare the object matrix paths
+		if (keyPressed(GLFW_KEY_B)) {
+			matrixBatchPath = MatrixBatchPath((matrixBatchPath + 1) % MATRIX_BATCH_PATH_COUNT);
+			if (matrixBatchPath > bestMatrixBatchPath()) matrixBatchPath = MATRIX_BATCH_SCALAR;
+		}
+
+		// As many fixed ticks as the time elapsed since the last frame, none or several
+		double currentTime = getTime();
+		accumulator += currentTime - lastFrameTime;
+		lastFrameTime = currentTime;
+		int ticks = 0;
+		while (accumulator >= tickDuration && ticks < MAX_TICKS_PER_FRAME) {
+			updateLoop((float)tickDuration);
+			accumulator -= tickDuration;
+			ticks++;
+		}
+		if (accumulator >= tickDuration) accumulator = fmod(accumulator, tickDuration);
+
+		updateTiles(getCameraPosition());
+
+		glfwGetFramebufferSize(window, &framebufferWidth, &framebufferHeight);
+		publishSnapshot(accumulator, getViewMatrix(), getProjectionMatrix());
+		if (!renderThread.joinable()) renderThread = std::thread(renderLoop);
+
+		nextFrame += framePeriod;
+		std::this_thread::sleep_until(nextFrame);
+	}
+	while (glfwGetKey(window, GLFW_KEY_ESCAPE) != GLFW_PRESS &&
+		glfwWindowShouldClose(window) == 0);
+
+	quitRenderThread = true;
+	renderThread.join();
+	glfwMakeContextCurrent(window);
+}
+
+// Offscreen run of headlessFrames frames, exactly one tick per frame and the camera on its path.
+// Nothing depends on the wall clock so two runs draw the same frames.
+void runHeadless() {
+	CameraPath cameraPath;
+	if (!cameraPathFile || !cameraPath.load(cameraPathFile)) cameraPath.createDefault();
+	if (terrain) cameraPath.groundHeight = groundHeight;
+
+	FILE *csv = fopen(csvPath, "w");
+	if (!csv) {
+		fprintf(stderr, "%s could not be opened for writing\n", csvPath);
+		return;
+	}
+	fprintf(csv, "frame,update_ms,render_ms,frame_ms,gpu_ms\n");
+
+	// GPU time of the frame, read back a few frames late so the CPU does not wait
+	const int QUERY_LATENCY = 4;
+	GLuint timerQueries[QUERY_LATENCY];
+	glGenQueries(QUERY_LATENCY, timerQueries);
+
+	struct FrameTiming {
+		double update, render, frame, gpu;
+	};
+	std::vector<FrameTiming> timings(headlessFrames);
+
+	double tickDuration = 1.0 / tickRate;
+	double runStart = getTime();
+	for (int f = 0; f < headlessFrames + QUERY_LATENCY; ++f) {
+		// Result of an older frame
+		int readFrame = f - QUERY_LATENCY + 1;
+		if (readFrame >= 0 && readFrame < headlessFrames) {
+			GLuint64 elapsed = 0;
+			glGetQueryObjectui64v(timerQueries[readFrame % QUERY_LATENCY], GL_QUERY_RESULT, &elapsed);
+			timings[readFrame].gpu = elapsed / 1000000.0;
+		}
+		if (f >= headlessFrames) continue;
+
+		double frameStart = getTime();
+		updateLoop((float)tickDuration);
+		float time = (float)(f * tickDuration);
+		mat4 ViewMatrix = cameraPath.getViewMatrix(time);
+		updateTiles(vec3(inverse(ViewMatrix)[3]));
+		// A full tick in the accumulator, the frame shows the state of its own tick
+		publishSnapshot(tickDuration, ViewMatrix, cameraPath.getProjectionMatrix());
+		double updateEnd = getTime();
+
+		glBeginQuery(GL_TIME_ELAPSED, timerQueries[f % QUERY_LATENCY]);
+		renderFrame(frameStart);
+		glEndQuery(GL_TIME_ELAPSED);
+		double frameEnd = getTime();
+
+		timings[f].update = (updateEnd - frameStart) * 1000.0;
+		timings[f].render = (frameEnd - updateEnd) * 1000.0;
+		timings[f].frame = (frameEnd - frameStart) * 1000.0;
+	}
+	double runTime = getTime() - runStart;
+
+	for (int f = 0; f < headlessFrames; ++f) {
+		fprintf(csv, "%d,%f,%f,%f,%f\n", f, timings[f].update, timings[f].render, timings[f].frame, timings[f].gpu);
+	}
+	fclose(csv);
+	glDeleteQueries(QUERY_LATENCY, timerQueries);
+
+	printf("%d frames in %f s, %f ms/frame, timings written to %s\n", headlessFrames, runTime, runTime * 1000.0 / headlessFrames, csvPath);
+}
+
+std::map<std::string, Model*> Obj3D::modelCache;
+std::map<std::string, GLuint> Obj3D::textureCache;
+
+int main(int argc, char *argv[])
+{
+	// Time 0 of the startup breakdown
+	double startupStart = getTime();
+	for (int i = 1; i < argc; ++i) {
+		if (!strcmp(argv[i], "--tick-rate") && i + 1 < argc) {
+			tickRate = std::max(atof(argv[++i]), 1.0);
+		}
+		else if (!strcmp(argv[i], "--headless")) {
+			headless = true;
+		}
+		else if (!strcmp(argv[i], "--frames") && i + 1 < argc) {
+			headlessFrames = std::max(atoi(argv[++i]), 1);
+		}
+		else if (!strcmp(argv[i], "--csv") && i + 1 < argc) {
+			csvPath = argv[++i];
+		}
+		else if (!strcmp(argv[i], "--camera-path") && i + 1 < argc) {
+			cameraPathFile = argv[++i];
+		}
+		else if (!strcmp(argv[i], "--seed") && i + 1 < argc) {
+			seed = (unsigned int)strtoul(argv[++i], NULL, 10);
+		}
+		else if (!strcmp(argv[i], "--scene") && i + 1 < argc) {
+			sceneParameters.instances = (unsigned int)strtoul(argv[++i], NULL, 10);
+		}
+		else if (!strcmp(argv[i], "--scene-models") && i + 1 < argc) {
+			sceneParameters.uniqueModels = (unsigned int)strtoul(argv[++i], NULL, 10);
+		}
+		else if (!strcmp(argv[i], "--scene-extent") && i + 1 < argc) {
+			sceneParameters.extent = (float)atof(argv[++i]);
+		}
+		else if (!strcmp(argv[i], "--tiles")) {
+			tileStreaming = true;
+		}
+		else if (!strcmp(argv[i], "--tile-radius") && i + 1 < argc) {
+			tileRadius = std::max(atoi(argv[++i]), 0);
+		}
+		else if (!strcmp(argv[i], "--profile") && i + 1 < argc) {
+			tracePath = argv[++i];
+		}
+		else if (!strcmp(argv[i], "--no-hud")) {
+			hudVisible = false;
+		}
+		else if (!strcmp(argv[i], "--gpu-budget") && i + 1 < argc) {
+			gpuBudget = atof(argv[++i]);
+		}
+		else if (!strcmp(argv[i], "--cpu-budget") && i + 1 < argc) {
+			cpuBudget = atof(argv[++i]);
+		}
+		else if (!strcmp(argv[i], "--texture-budget") && i + 1 < argc) {
+			textureBudget = atof(argv[++i]);
+		}
+		else if (!strcmp(argv[i], "--no-streaming")) {
+			textureStreaming = false;
+		}
+		else if (!strcmp(argv[i], "--no-terrain")) {
+			terrainEnabled = false;
+		}
+		else if (!strcmp(argv[i], "--snow") && i + 1 < argc) {
+			snowfallCount = (unsigned int)strtoul(argv[++i], NULL, 10);
+		}
+		else if (!strcmp(argv[i], "--snow-mode") && i + 1 < argc) {
+			i++;
+			bool known = false;
+			for (int mode = 0; mode < SNOW_MODE_COUNT; ++mode) {
+				if (!strcmp(argv[i], snowModeNames[mode])) {
+					snowMode = SnowMode(mode);
+					known = true;
+				}
+			}
+			if (!known) fprintf(stderr, "Unknown snow mode %s, cpu or gpu, using %s\n", argv[i], snowModeNames[snowMode]);
+		}
+		else if (!strcmp(argv[i], "--no-vsync")) {
+			vsync = false;
+		}
+		else if (!strcmp(argv[i], "--culling") && i + 1 < argc) {
+			i++;
+			bool known = false;
+			for (int mode = 0; mode < CULLING_MODE_COUNT; ++mode) {
+				if (!strcmp(argv[i], cullingModeNames[mode])) {
+					cullingMode = CullingMode(mode);
+					known = true;
+				}
+			}
+			if (!known) fprintf(stderr, "Unknown culling mode %s, software, queries, gpu or none, using %s\n", argv[i], cullingModeNames[cullingMode]);
+		}
+	}
+
+	// Nobody is there to press a key
+	if (headless) setPauseOnError(false);
+	// Nobody looks at it either, and its refresh follows the wall clock : the frames would not be reproducible
+	if (headless) hudVisible = false;
+
+	Profiler::setEnabled(tracePath != NULL);
+	Profiler::setThreadName("Main");
+	MemoryTracker::setBudget(MEMORY_GPU, (size_t)(gpuBudget * 1024.0 * 1024.0));
+	MemoryTracker::setBudget(MEMORY_CPU, (size_t)(cpuBudget * 1024.0 * 1024.0));
+
+	if (headless) {
+		headlessContext = new HeadlessContext();
+		if (!headlessContext->create(WINDOW_WIDTH, WINDOW_HEIGHT)) {
+			delete headlessContext;
+			return -1;
+		}
+		printf("Headless context : %s\n", headlessContext->api);
+	}
+	else if (!createWindow()) {
+		return -1;
+	}
 
 	// Initialize GLEW
 	glewExperimental = GL_TRUE;
-	if (glewInit() != GLEW_OK) {
-		fprintf(stderr, "Failed to initialize GLEW\n");
-		getchar();
+	GLenum glewError = glewInit();
+	// GLEW 2.1 and later load the GL functions before they look for GLX, that part alone fails with an EGL context
+	if (glewError == GLEW_ERROR_NO_GLX_DISPLAY && headless && headlessContext->usesEGL() && glGenFramebuffers != NULL) {
+		glewError = GLEW_OK;
+	}
+	if (glewError != GLEW_OK) {
+		fprintf(stderr, "Failed to initialize GLEW : %s\n", glewGetErrorString(glewError));
+		pauseOnError();
 		glfwTerminate();
 		return -1;
 	}
 
-	// Ensure we can capture the escape key being pressed below
-	glfwSetInputMode(window, GLFW_STICKY_KEYS, GL_TRUE);
-	// Hide the mouse and enable unlimited mouvement
-	glfwSetInputMode(window, GLFW_CURSOR, GLFW_CURSOR_DISABLED);
+	if (headless) {
+		if (!headlessContext->createFramebuffer()) {
+			delete headlessContext;
+			return -1;
+		}
+	}
+	else {
+		// Ensure we can capture the escape key being pressed below
+		glfwSetInputMode(window, GLFW_STICKY_KEYS, GL_TRUE);
+		// Hide the mouse and enable unlimited mouvement
+		glfwSetInputMode(window, GLFW_CURSOR, GLFW_CURSOR_DISABLED);
 
-	// Vsync on
-	glfwSwapInterval(1);
+		// Set the mouse at the center of the screen
+		glfwPollEvents();
+		glfwSetCursorPos(window, WINDOW_WIDTH / 2, WINDOW_HEIGHT/ 2);
+
+		glfwGetFramebufferSize(window, &framebufferWidth, &framebufferHeight);
+	}
 
-	// Set the mouse at the center of the screen
-	glfwPollEvents();
-	glfwSetCursorPos(window, WINDOW_WIDTH / 2, WINDOW_HEIGHT/ 2);
 
 	// Dark blue background
 	glClearColor(0.0f, 0.05f, 0.0f, 0.0f);
@@ -316,55 +1466,154 @@ int main(void)
 	programID = LoadShaders("light.vertexshader", "light.fragmentshader");
 	textureShaderID = LoadShaders("TransformVertexShader.vertexshader", "TextureFragmentShader.fragmentshader");
 
-	MatrixID = glGetUniformLocation(programID, "MVP");
 	ViewMatrixID = glGetUniformLocation(programID, "V");
-	ModelMatrixID = glGetUniformLocation(programID, "M");
 	LightID = glGetUniformLocation(programID, "LightPosition_worldspace");
 	TextureID = glGetUniformLocation(programID, "myTextureSampler");
 	NormalTextureID = glGetUniformLocation(programID, "normalTextureSampler");
-	ModelView3x3MatrixID = glGetUniformLocation(programID, "MV3x3");
 
 	MatrixID_2 = glGetUniformLocation(textureShaderID, "MVP");
 	TextureID_2 = glGetUniformLocation(textureShaderID, "myTextureSampler");
 	BoolID = glGetUniformLocation(textureShaderID, "scaleTexture");
 
+	depthProgramID = LoadShaders("depth.vertexshader", "default.fragmentshader");
+	overdrawProgramID = LoadShaders("depth.vertexshader", "overdraw.fragmentshader");
+
+	// Per object matrices, ranges of one uniform buffer
+	glUniformBlockBinding(programID, glGetUniformBlockIndex(programID, "ObjectMatrices"), OBJECT_BLOCK_BINDING);
+	glUniformBlockBinding(depthProgramID, glGetUniformBlockIndex(depthProgramID, "ObjectMatrices"), OBJECT_BLOCK_BINDING);
+	glUniformBlockBinding(overdrawProgramID, glGetUniformBlockIndex(overdrawProgramID, "ObjectMatrices"), OBJECT_BLOCK_BINDING);
+
+	GLint blockAlignment;
+	glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &blockAlignment);
+	objectStride = (sizeof(ObjectMatrices) + blockAlignment - 1) / blockAlignment * blockAlignment;
+	objectCapacity = 0;
+	glGenBuffers(1, &objectBuffer);
+	matrixBatchPath = bestMatrixBatchPath();
+
+	gpuTimers = new GpuTimers();
+	gpuTimers->init();
+	frameStats = new FrameStats();
+	initText2D(NULL);
+	hudLastRefresh = getTime();
+
+	// One more queue for the render thread
+	jobSystem = new JobSystem(0, 1);
+	printf("%u job threads\n", jobSystem->threadCount());
+
+	if (textureStreaming) {
+		textureStreamer = new TextureStreamer(jobSystem, (size_t)(textureBudget * 1024.0 * 1024.0));
+		// Same frames on every headless run
+		textureStreamer->setSynchronous(headless);
+	}
+	double assetsStart = getTime();
+	loadSceneAssets();
 
-	vec3 lightPos(-25, 50, 25);
+	// Same scene for the same seed
+	srand(seed);
+	double objectsStart = getTime();
+	{
+		PROFILE_SCOPE("Create objects");
+		if (terrainEnabled) {
+			// Before anything is placed on it
+			terrain = new Terrain();
+			terrain->init(jobSystem, seed);
+			setGroundHeightFunction(groundHeight);
+		}
+		createSkyboxes();
+		if (tileStreaming) {
+			// The tiles around the camera are created by the first frame
+			tileWorld = new TileWorld(jobSystem, entities, terrain, seed, tileRadius);
+			tileWorld->setSynchronous(headless);
+		}
+		else if (sceneParameters.instances > 0) {
+			sceneParameters.seed = seed;
+			SceneGenerator generator(jobSystem, terrain);
+			generator.generate(sceneParameters, entities);
+			generator.print();
+		}
+		else {
+			createObjects();
+		}
+	}
+	double renderersStart = getTime();
+	occlusionCuller = new OcclusionCuller(jobSystem);
+	renderQueue = new RenderQueue(jobSystem);
+	occlusionQueries = new OcclusionQueries();
+	occlusionQueries->init(entities);
+	gpuCulling = new GpuCulling();
+	gpuCulling->init(framebufferWidth, framebufferHeight);
+	if (cullingMode == CULLING_GPU && !gpuCulling->supported) cullingMode = CULLING_SOFTWARE;
+	clusteredLights = new ClusteredLights();
+	clusteredLights->init();
+	createLights();
+	if (snowfallCount > 0 && snowMode == SNOW_GPU) {
+		snowVolume = new SnowVolume(snowfallCount, seed);
+		snowVolume->init(OBJECT_BLOCK_BINDING);
+	}
+	else if (snowfallCount > 0) {
+		snowfall = new Snowfall(jobSystem, snowfallCount, seed);
+		snowfall->init();
+	}
 
-	createObjects();
-	
-	lastTime = glfwGetTime();
+	lastTime = getTime();
+	printf("Startup : %f ms, %f ms context and shaders, %f ms assets, %f ms objects, %f ms culling and lights\n", (lastTime - startupStart) * 1000.0,
+		(assetsStart - startupStart) * 1000.0, (objectsStart - assetsStart) * 1000.0, (renderersStart - objectsStart) * 1000.0, (lastTime - renderersStart) * 1000.0);
 
 	srand((unsigned int)time(NULL));
 
-	vec3 dir(1);
-	do {
-		updateLoop();
-		
-		lightPos.y += 0.1f * dir.y;
-		if (lightPos.y > 50.0f) lightPos.y = 50.0f, dir.y = -1;
-		if (lightPos.y < 30.0f) lightPos.y = 30.0f, dir.y = 1;
-
-		lightPos.x += 0.15f * dir.x;
-		if (lightPos.x > 40.0f) lightPos.x = 40.0f, dir.x = -1;
-		if (lightPos.x < -40.0f) lightPos.x = -40.0f, dir.x = 1;
-		
-		lightPos.z += 0.05f * dir.z;
-		if (lightPos.z > 40.0f) lightPos.z = 40.0f, dir.z = -1;
-		if (lightPos.z < -40.0f) lightPos.z = -40.0f, dir.z = 1;
-
-		drawLoop(lightPos);
+	// Both modes start from the state after creation
+	previousLayoutVersion = entities.layoutVersion;
+	previousLightPos = lightPos;
+	printf("%f simulation ticks per second\n", tickRate);
+
+	if (headless) {
+		runHeadless();
 	}
-	while (glfwGetKey(window, GLFW_KEY_ESCAPE) != GLFW_PRESS &&
-		glfwWindowShouldClose(window) == 0);
+	else {
+		runWindowed();
+	}
+
+	// What the scene held, before it is released
+	MemoryTracker::print();
+	if (textureStreamer) textureStreamer->print();
+	if (tileWorld) tileWorld->print();
+	if (terrain) terrain->print();
+	if (snowfall) snowfall->print();
+	if (snowVolume) snowVolume->print();
 
 	glDeleteProgram(programID);
 	glDeleteProgram(textureShaderID);
+	glDeleteProgram(depthProgramID);
+	glDeleteProgram(overdrawProgramID);
+	MemoryTracker::releaseBuffer(objectBuffer);
+	glDeleteBuffers(1, &objectBuffer);
 	glDeleteTextures(1, &TextureID);
 	glDeleteTextures(1, &NormalTextureID);
 	
 	// Delete all objects
-	objects.clear();
+	delete tileWorld;
+	entities.clear();
+	delete terrain;
+	delete snowfall;
+	delete snowVolume;
+	delete occlusionCuller;
+	delete occlusionQueries;
+	delete gpuCulling;
+	delete clusteredLights;
+	delete renderQueue;
+	delete textureStreamer;
+	delete jobSystem;
+	delete gpuTimers;
+	cleanupText2D();
+
+	// Tail latency of the run, not only its average
+	frameStats->print();
+	delete frameStats;
+
+	delete headlessContext;
+
+	// Every thread that recorded events is gone
+	if (tracePath) Profiler::writeChromeTrace(tracePath);
 
 	// Close OpenGL window and terminate GLFW
 	glfwTerminate();